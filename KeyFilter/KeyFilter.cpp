@@ -16,6 +16,9 @@ KeyInterceptionCallback InterceptedVirtualKeyBreak;
 KeyInterceptionCallback InterceptedScancodeMake;
 KeyInterceptionCallback InterceptedScancodeBreak;
 
+SelfInjectionFilter* pSelfInjection;
+DebounceFilter* pDebounce;
+
 ///////////////////////////////////////////////
 // Bit flag array template functions:
 
@@ -79,10 +82,75 @@ inline void ClearScancodeBreakFilter() { Clear(*pScancodeBreaks); }
 
 ///////////////////////////////////////////////
 
+// Returns true when the key event is switch chatter, and should be filtered out. Runs in constant time.
+inline bool IsChatter(const uint_fast16_t virtualKey, const bool isBreak, const uint32_t time)
+{
+    auto& debounce = *pDebounce;
+    const auto key = 0xffu & virtualKey;
+
+    const uint32_t window = debounce.windows[key];
+    if (0u == window)
+    {
+        return false;
+    }
+
+    const auto sinceAccepted = time - debounce.lastAcceptedTimes[key]; // NOTE: unsigned; survives the tick count wrapping
+    const auto sinceSeen = time - debounce.lastSeenTimes[key];
+    const auto isQuiet = (DeferredDebounce == debounce.modes[key]) ? sinceSeen >= window : sinceAccepted >= window;
+
+    // Only a change of direction restarts the deferred window; a held key's autorepeats don't.
+    if (isBreak == IsSet(debounce.seenMadeKeys, key))
+    {
+        debounce.lastSeenTimes[key] = time;
+        if (isBreak)
+        {
+            Clear(debounce.seenMadeKeys, key);
+        }
+        else
+        {
+            Set(debounce.seenMadeKeys, key);
+        }
+    }
+
+    if (isBreak == !IsSet(debounce.madeKeys, key)) // if (no transition)
+    {
+        if (isBreak && !isQuiet) // if (the break of a bounce whose make was suppressed)
+        {
+            debounce.suppressedCounts[key]++;
+            return true;
+        }
+
+        return false; // e.g. autorepeat
+    }
+
+    // NOTE: The break of a make that was let through always goes through; the key would be stuck down otherwise.
+    if (!isBreak && !isQuiet)
+    {
+        debounce.suppressedCounts[key]++;
+        return true;
+    }
+
+    if (isBreak)
+    {
+        Clear(debounce.madeKeys, key);
+    }
+    else
+    {
+        Set(debounce.madeKeys, key);
+    }
+    debounce.lastAcceptedTimes[key] = time;
+    debounce.lastSeenTimes[key] = time;
+
+    return false;
+}
+
+///////////////////////////////////////////////
+
 KEYFILTER_API HRESULT Initialize(KeyMap* pInterceptedScancodeMakes, KeyMap* pInterceptedScancodeBreaks,
     KeyMap* pInterceptedVirtualKeyMakes, KeyMap* pInterceptedVirtualKeyBreaks,
     KeyInterceptionCallback interceptedScancodeMake, KeyInterceptionCallback interceptedScancodeBreak,
-    KeyInterceptionCallback interceptedVirtualKeyMake, KeyInterceptionCallback interceptedVirtualKeyBreak
+    KeyInterceptionCallback interceptedVirtualKeyMake, KeyInterceptionCallback interceptedVirtualKeyBreak,
+    SelfInjectionFilter* pSelfInjectionFilter, DebounceFilter* pDebounceFilter
     )
 {
     if (nullptr == pInterceptedScancodeMakes || nullptr == pInterceptedScancodeBreaks ||
@@ -97,6 +165,11 @@ KEYFILTER_API HRESULT Initialize(KeyMap* pInterceptedScancodeMakes, KeyMap* pInt
         return E_POINTER;
     }
 
+    if (nullptr == pSelfInjectionFilter || nullptr == pDebounceFilter)
+    {
+        return E_POINTER;
+    }
+
     pScancodeMakes = pInterceptedScancodeMakes;
     pScancodeBreaks = pInterceptedScancodeBreaks;
     pVirtualKeyMakes = pInterceptedVirtualKeyMakes;
@@ -107,6 +180,9 @@ KEYFILTER_API HRESULT Initialize(KeyMap* pInterceptedScancodeMakes, KeyMap* pInt
     InterceptedVirtualKeyMake = interceptedVirtualKeyMake;
     InterceptedVirtualKeyBreak = interceptedVirtualKeyBreak;
 
+    pSelfInjection = pSelfInjectionFilter;
+    pDebounce = pDebounceFilter;
+
     // TODO: Add memory barrier here; make sure all of those pointers are written.
 
     isInitialized = true;
@@ -152,38 +228,51 @@ extern "C" KEYFILTER_API LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM
     const auto scancode = kbDllHookStruct.scanCode;
     const auto flags = kbDllHookStruct.flags;
     const auto dwExtraInfo = kbDllHookStruct.dwExtraInfo;
+    const auto time = kbDllHookStruct.time;
 
     const auto extendedKey = 0 != (LLKHF_EXTENDED & flags);
     //const auto lowIntegrityInjection = 0 != (LLKHF_LOWER_IL_INJECTED & flags);
-    //const auto injection = 0 != (LLKHF_INJECTED & flags);
+    const auto injection = 0 != (LLKHF_INJECTED & flags);
     //const auto altDown = 0 != (LLKHF_ALTDOWN & flags);
-    //const auto keyBreaking = 0 != (LLKHF_UP & flags);
+    const auto keyBreaking = 0 != (LLKHF_UP & flags);
+
+    // LLKHF_INJECTED is also set for LLKHF_LOWER_IL_INJECTED events.
+    if (injection && pSelfInjection->signature == dwExtraInfo && !pSelfInjection->isVisible) // if (this process sent the key event)
+    {
+        pSelfInjection->skippedHookEvents++;
+        return ::CallNextHookEx(nullptr, nCode, wParam, lParam);
+    }
+
+    if (!injection && IsChatter(vkCode, keyBreaking, time)) // if (a worn switch bounced)
+    {
+        return 1;
+    }
 
     switch (wParam)
     {
     case WM_KEYDOWN:
     case WM_SYSKEYDOWN:
-        if (IsVirtualKeyMakeFiltered(vkCode))
+        if (IsVirtualKeyMakeFiltered(vkCode) &&
+            InterceptedVirtualKeyMake(vkCode, scancode, extendedKey, injection, static_cast<DWORD>(dwExtraInfo), time))
         {
-            InterceptedVirtualKeyMake(vkCode, scancode, extendedKey, static_cast<DWORD>(dwExtraInfo));
             return 1;
         }
-        if (IsScancodeMakeFiltered(scancode))
+        if (IsScancodeMakeFiltered(scancode) &&
+            InterceptedScancodeMake(vkCode, scancode, extendedKey, injection, static_cast<DWORD>(dwExtraInfo), time))
         {
-            InterceptedScancodeMake(vkCode, scancode, extendedKey, static_cast<DWORD>(dwExtraInfo));
             return 1;
         }
         break;
     case WM_KEYUP:
     case WM_SYSKEYUP:
-        if (IsVirtualKeyBreakFiltered(vkCode))
+        if (IsVirtualKeyBreakFiltered(vkCode) &&
+            InterceptedVirtualKeyBreak(vkCode, scancode, extendedKey, injection, static_cast<DWORD>(dwExtraInfo), time))
         {
-            InterceptedVirtualKeyBreak(vkCode, scancode, extendedKey, static_cast<DWORD>(dwExtraInfo));
             return 1;
         }
-        if (IsScancodeBreakFiltered(scancode))
+        if (IsScancodeBreakFiltered(scancode) &&
+            InterceptedScancodeBreak(vkCode, scancode, extendedKey, injection, static_cast<DWORD>(dwExtraInfo), time))
         {
-            InterceptedScancodeBreak(vkCode, scancode, extendedKey, static_cast<DWORD>(dwExtraInfo));
             return 1;
         }
         break;
@@ -15,14 +15,44 @@
 
 // Bit maps of 256 scancodes and virtual keys.
 using KeyMap = uint32_t[256u / (sizeof(uint32_t) * 8u)];
-using KeyInterceptionCallback = void(*)(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation);
+// Returns true when the key event was consumed, and should be filtered out of the system's input queue.
+using KeyInterceptionCallback = bool(*)(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time);
+
+// Identifies the key events this process injected with SendInput(), so they can be passed straight on.
+struct SelfInjectionFilter
+{
+    ULONG_PTR   signature;                  // the dwExtraInfo value this process tags its injected input with
+    bool        isVisible;                  // when set, self-injected key events are handed to the callbacks anyway
+    uint64_t    skippedHookEvents;          // self-injected key events the hook passed on without a callback
+    uint64_t    skippedRawInputEvents;      // self-injected raw input that wasn't dispatched to the callbacks
+};
+
+// Per virtual key debounce state, for keyboards with chattering switches. Windows are in milliseconds,
+//  measured with KBDLLHOOKSTRUCT::time; a zero window turns debouncing off for the key.
+enum DebounceMode : uint8_t
+{
+    EagerDebounce       = 0u,   // pass the first transition, then suppress the key for the window
+    DeferredDebounce    = 1u,   // only pass a transition once the key has been quiet for the window
+};
+
+struct DebounceFilter
+{
+    uint16_t    windows[256];
+    uint8_t     modes[256];
+    uint32_t    madeKeys[8];            // bit map of the key state the hook has let through
+    uint32_t    seenMadeKeys[8];        // bit map of the direction of each key's last event, let through or not
+    uint32_t    lastAcceptedTimes[256];
+    uint32_t    lastSeenTimes[256];     // the key's last change of direction; autorepeats don't count
+    uint32_t    suppressedCounts[256];
+};
 
 extern "C"
 {
     KEYFILTER_API HRESULT Initialize(KeyMap* pInterceptedScancodeMakes, KeyMap* pInterceptedScancodeBreaks,
         KeyMap* pInterceptedVirtualKeyMakes, KeyMap* pInterceptedVirtualKeyBreaks,
         KeyInterceptionCallback interceptedScancodeMake, KeyInterceptionCallback interceptedScancodeBreak,
-        KeyInterceptionCallback interceptedVirtualKeyMake, KeyInterceptionCallback interceptedVirtualKeyBreak);
+        KeyInterceptionCallback interceptedVirtualKeyMake, KeyInterceptionCallback interceptedVirtualKeyBreak,
+        SelfInjectionFilter* pSelfInjectionFilter, DebounceFilter* pDebounceFilter);
 
     KEYFILTER_API LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM wParam, LPARAM lParam);
 } // extern "C"
@@ -0,0 +1,111 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// Reads the key state UberKey publishes to shared memory.
+//
+//  KeyStateReader                      prints the made keys whenever a key event changes them
+//  KeyStateReader -benchmark [count]   times count snapshot reads (default 10000000)
+
+#include <windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include <iostream>
+
+#include "UberKeyShared.h"
+
+namespace
+{
+    void PrintKeyMap(const wchar_t* const name, const uint32_t (&keyMap)[8])
+    {
+        std::wcout << name;
+        for (auto code = 0u; code < 256u; code++)
+        {
+            if (uberkey_is_set(keyMap, code))
+            {
+                wchar_t hex[8];
+                ::swprintf_s(hex, L" 0x%02x", code);
+                std::wcout << hex;
+            }
+        }
+        std::wcout << std::endl;
+    }
+
+    int Watch(UberKeySharedReader& reader)
+    {
+        uberkey_key_state state;
+        auto lastSequence = 0u;
+        auto lastTimestamp = int64_t(0);
+
+        for (;;)
+        {
+            if (!reader.Read(state))
+            {
+                std::wcout << L"The writer kept the key state busy." << std::endl;
+                continue;
+            }
+
+            if (state.event_sequence != lastSequence || state.event_timestamp != lastTimestamp) // if (there was a key event)
+            {
+                lastSequence = state.event_sequence;
+                lastTimestamp = state.event_timestamp;
+
+                std::wcout << L"event " << state.event_sequence << std::endl;
+                PrintKeyMap(L"  scancodes:   ", state.made_scancodes);
+                PrintKeyMap(L"  virtual keys:", state.made_virtual_keys);
+            }
+
+            ::Sleep(10);
+        }
+    }
+
+    int Benchmark(UberKeySharedReader& reader, const uint64_t count)
+    {
+        LARGE_INTEGER frequency;
+        LARGE_INTEGER start;
+        LARGE_INTEGER stop;
+        ::QueryPerformanceFrequency(&frequency);
+
+        uberkey_key_state state;
+        auto failureCount = uint64_t(0);
+
+        ::QueryPerformanceCounter(&start);
+        for (auto i = uint64_t(0); i < count; i++)
+        {
+            if (!reader.Read(state))
+            {
+                failureCount++;
+            }
+        }
+        ::QueryPerformanceCounter(&stop);
+
+        const auto seconds = double(stop.QuadPart - start.QuadPart) / double(frequency.QuadPart);
+        std::wcout << count << L" reads in " << seconds << L" s; "
+            << (seconds * 1e9 / double(count)) << L" ns per read, "
+            << reader.retryCount() << L" retries, "
+            << failureCount << L" failures" << std::endl;
+
+        return 0 == failureCount ? 0 : 1;
+    }
+} // namespace
+
+int wmain(int argc, wchar_t* argv[])
+{
+    UberKeySharedReader reader;
+    if (!reader.Open())
+    {
+        std::wcout << L"UberKey isn't publishing its key state." << std::endl;
+        return 1;
+    }
+
+    std::wcout << L"Reading the key state of process " << reader.writerProcessId() << L"." << std::endl;
+
+    if (argc > 1 && 0 == ::_wcsicmp(argv[1], L"-benchmark"))
+    {
+        const auto count = argc > 2 ? ::_wcstoui64(argv[2], nullptr, 10) : uint64_t(10000000);
+        return Benchmark(reader, 0 != count ? count : 1);
+    }
+
+    return Watch(reader);
+}
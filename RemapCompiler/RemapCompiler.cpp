@@ -0,0 +1,627 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// Compiles a binding file into a remap image (see RemapImage.h).
+//
+//  RemapCompiler <binding file> <image file>
+//
+// A binding file is JSON; a list of layers, the first of which is the base layer. Each layer maps key
+//  names, as in the Lua vk table, to actions:
+//
+//  {
+//      "layers": [
+//          { "name": "base", "keys": {
+//              "capital": "escape",                        remaps caps lock to escape
+//              "apps": { "block": true },                  swallows the key
+//              "f13": { "macro": ["lcontrol+c", "tab"] },  taps the chords, in order
+//              "rmenu": { "hold": "nav" },                 activates the layer while held
+//              "scroll": { "toggle": "nav" } } },          activates, or deactivates, the layer
+//          { "name": "nav", "keys": { "h": "left", "l": "right" } }
+//      ]
+//  }
+//
+// Keys with no action in a layer fall through to the next active layer down.
+// NOTE: Only uses the standard library; keep it free of Win32, like RemapImage.
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "RemapImage.h"
+#include "VirtualKeys.h"
+
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+namespace
+{
+    struct JsonValue
+    {
+        enum class Type { Null, Boolean, Number, String, Array, Object };
+
+        Type                                    type;
+        bool                                    boolean;
+        double                                  number;
+        string                                  text;
+        vector<JsonValue>                       items;
+        vector<std::pair<string, JsonValue>>    members; // in file order
+
+        JsonValue() : type(Type::Null), boolean(false), number(0.0) {}
+    };
+
+    // Just enough JSON for binding files. Errors are thrown with the line they were found on.
+    class JsonReader final
+    {
+    public:
+        JsonReader(const char* begin, const char* end)
+            : _pos(begin)
+            , _end(end)
+            , _line(1u)
+        {
+        }
+
+        JsonValue ReadDocument()
+        {
+            auto value = ReadValue();
+            SkipWhitespace();
+            if (_pos != _end)
+            {
+                Fail("unexpected text after the document");
+            }
+            return value;
+        }
+
+    private:
+        const char* _pos;
+        const char* _end;
+        unsigned int _line;
+
+        [[noreturn]] void Fail(const string& message) const
+        {
+            throw runtime_error("line " + std::to_string(_line) + ": " + message);
+        }
+
+        void SkipWhitespace()
+        {
+            while (_pos != _end && (' ' == *_pos || '\t' == *_pos || '\r' == *_pos || '\n' == *_pos))
+            {
+                if ('\n' == *_pos)
+                {
+                    _line++;
+                }
+                _pos++;
+            }
+        }
+
+        bool Accept(const char ch)
+        {
+            SkipWhitespace();
+            if (_pos != _end && ch == *_pos)
+            {
+                _pos++;
+                return true;
+            }
+            return false;
+        }
+
+        void Expect(const char ch)
+        {
+            if (!Accept(ch))
+            {
+                Fail(string("expected '") + ch + "'");
+            }
+        }
+
+        bool AcceptWord(const char* const word)
+        {
+            const auto length = ::strlen(word);
+            if (static_cast<size_t>(_end - _pos) >= length && 0 == ::strncmp(_pos, word, length))
+            {
+                _pos += length;
+                return true;
+            }
+            return false;
+        }
+
+        static void AppendUtf8(string& text, const uint32_t codePoint)
+        {
+            if (codePoint < 0x80u)
+            {
+                text += static_cast<char>(codePoint);
+            }
+            else if (codePoint < 0x800u)
+            {
+                text += static_cast<char>(0xc0u | (codePoint >> 6));
+                text += static_cast<char>(0x80u | (codePoint & 0x3fu));
+            }
+            else
+            {
+                text += static_cast<char>(0xe0u | (codePoint >> 12));
+                text += static_cast<char>(0x80u | ((codePoint >> 6) & 0x3fu));
+                text += static_cast<char>(0x80u | (codePoint & 0x3fu));
+            }
+        }
+
+        string ReadString()
+        {
+            Expect('"');
+
+            string text;
+            for (;;)
+            {
+                if (_pos == _end || '\n' == *_pos)
+                {
+                    Fail("unterminated string");
+                }
+
+                const auto ch = *_pos++;
+                if ('"' == ch)
+                {
+                    return text;
+                }
+                if ('\\' != ch)
+                {
+                    text += ch;
+                    continue;
+                }
+
+                if (_pos == _end)
+                {
+                    Fail("unterminated string");
+                }
+                const auto escaped = *_pos++;
+                switch (escaped)
+                {
+                case '"': case '\\': case '/': text += escaped; break;
+                case 'b': text += '\b'; break;
+                case 'f': text += '\f'; break;
+                case 'n': text += '\n'; break;
+                case 'r': text += '\r'; break;
+                case 't': text += '\t'; break;
+                case 'u':
+                    {
+                        if (_end - _pos < 4)
+                        {
+                            Fail("malformed \\u escape");
+                        }
+                        const string hex(_pos, _pos + 4);
+                        char* pHexEnd = nullptr;
+                        const auto codePoint = ::strtoul(hex.c_str(), &pHexEnd, 16);
+                        if (pHexEnd != hex.c_str() + 4)
+                        {
+                            Fail("malformed \\u escape");
+                        }
+                        AppendUtf8(text, static_cast<uint32_t>(codePoint));
+                        _pos += 4;
+                    }
+                    break;
+                default:
+                    Fail("unknown escape in string");
+                }
+            }
+        }
+
+        JsonValue ReadValue()
+        {
+            SkipWhitespace();
+            if (_pos == _end)
+            {
+                Fail("unexpected end of file");
+            }
+
+            JsonValue value;
+            if ('{' == *_pos)
+            {
+                _pos++;
+                value.type = JsonValue::Type::Object;
+                if (!Accept('}'))
+                {
+                    do
+                    {
+                        SkipWhitespace();
+                        auto name = ReadString();
+                        Expect(':');
+                        value.members.emplace_back(std::move(name), ReadValue());
+                    } while (Accept(','));
+                    Expect('}');
+                }
+            }
+            else if ('[' == *_pos)
+            {
+                _pos++;
+                value.type = JsonValue::Type::Array;
+                if (!Accept(']'))
+                {
+                    do
+                    {
+                        value.items.push_back(ReadValue());
+                    } while (Accept(','));
+                    Expect(']');
+                }
+            }
+            else if ('"' == *_pos)
+            {
+                value.type = JsonValue::Type::String;
+                value.text = ReadString();
+            }
+            else if (AcceptWord("true"))
+            {
+                value.type = JsonValue::Type::Boolean;
+                value.boolean = true;
+            }
+            else if (AcceptWord("false"))
+            {
+                value.type = JsonValue::Type::Boolean;
+            }
+            else if (AcceptWord("null"))
+            {
+                value.type = JsonValue::Type::Null;
+            }
+            else
+            {
+                const string number(_pos, std::min(_end, _pos + 64));
+                char* pNumberEnd = nullptr;
+                errno = 0;
+                value.number = ::strtod(number.c_str(), &pNumberEnd);
+                if (pNumberEnd == number.c_str() || 0 != errno)
+                {
+                    Fail("expected a value");
+                }
+                value.type = JsonValue::Type::Number;
+                _pos += pNumberEnd - number.c_str();
+            }
+
+            return value;
+        }
+    };
+
+    const JsonValue* FindMember(const JsonValue& object, const char* const name)
+    {
+        for (const auto& member : object.members)
+        {
+            if (member.first == name)
+            {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+
+    // A key name from the Lua vk table, or a code; e.g. "capital", "kana", "0x14", or "20".
+    uint16_t ParseVirtualKey(const string& name)
+    {
+        for (auto i = 0u; i < virtualKeyCount; i++)
+        {
+            const auto& vk = virtualKeys[i];
+            if ('\0' != vk.name[0] && name == vk.name)
+            {
+                return static_cast<uint16_t>(i);
+            }
+            for (auto pAlt = vk.altNames; nullptr != pAlt && nullptr != *pAlt; pAlt++)
+            {
+                if (name == *pAlt)
+                {
+                    return static_cast<uint16_t>(i);
+                }
+            }
+        }
+
+        if (!name.empty() && 0 != ::isdigit(static_cast<unsigned char>(name[0])))
+        {
+            char* pEnd = nullptr;
+            const auto code = ::strtoul(name.c_str(), &pEnd, 0);
+            if ('\0' == *pEnd && code > 0u && code < 0xffu)
+            {
+                return static_cast<uint16_t>(code);
+            }
+        }
+
+        throw runtime_error("unknown key \"" + name + "\"");
+    }
+
+    class ImageBuilder final
+    {
+    public:
+        explicit ImageBuilder(const JsonValue& document)
+        {
+            const auto pLayers = (JsonValue::Type::Object == document.type) ? FindMember(document, "layers") : nullptr;
+            if (nullptr == pLayers || JsonValue::Type::Array != pLayers->type || pLayers->items.empty())
+            {
+                throw runtime_error("the binding file needs a list of layers");
+            }
+            if (pLayers->items.size() > RemapMaxLayers)
+            {
+                throw runtime_error("too many layers; the most is " + std::to_string(RemapMaxLayers));
+            }
+
+            _actions.push_back(RemapAction()); // action 0 is no action
+
+            // Name every layer first, so layers may refer to ones further down the file.
+            for (const auto& layer : pLayers->items)
+            {
+                const auto pName = (JsonValue::Type::Object == layer.type) ? FindMember(layer, "name") : nullptr;
+                if (nullptr == pName || JsonValue::Type::String != pName->type || pName->text.empty())
+                {
+                    throw runtime_error("every layer needs a name");
+                }
+                if (_layerIndices.count(pName->text))
+                {
+                    throw runtime_error("there's more than one layer named \"" + pName->text + "\"");
+                }
+
+                _layerIndices[pName->text] = static_cast<uint8_t>(_layers.size());
+
+                RemapLayer remapLayer = {};
+                remapLayer.nameOffset = AddString(pName->text);
+                _layers.push_back(remapLayer);
+            }
+
+            for (size_t i = 0u; i < pLayers->items.size(); i++)
+            {
+                const auto pKeys = FindMember(pLayers->items[i], "keys");
+                if (nullptr == pKeys)
+                {
+                    continue;
+                }
+                if (JsonValue::Type::Object != pKeys->type)
+                {
+                    throw runtime_error("layer \"" + LayerName(i) + "\": keys must be an object");
+                }
+
+                for (const auto& binding : pKeys->members)
+                {
+                    try
+                    {
+                        auto& actionIndex = _layers[i].actions[ParseVirtualKey(binding.first)];
+                        if (0u != actionIndex)
+                        {
+                            throw runtime_error("bound more than once");
+                        }
+                        actionIndex = AddAction(binding.second);
+                        _bindingCount++;
+                    }
+                    catch (const runtime_error& e)
+                    {
+                        throw runtime_error("layer \"" + LayerName(i) + "\", key \"" + binding.first + "\": " + e.what());
+                    }
+                }
+            }
+        }
+
+        vector<uint8_t> Build() const
+        {
+            RemapImageHeader header = {};
+            header.magic = RemapImageMagic;
+            header.version = RemapImageVersion;
+            header.headerSize = sizeof(header);
+            header.layerCount = static_cast<uint32_t>(_layers.size());
+            header.layerOffset = sizeof(header);
+            header.actionCount = static_cast<uint32_t>(_actions.size());
+            header.actionOffset = header.layerOffset + header.layerCount * sizeof(RemapLayer);
+            header.stepCount = static_cast<uint32_t>(_steps.size());
+            header.stepOffset = header.actionOffset + header.actionCount * sizeof(RemapAction);
+            header.stringsSize = static_cast<uint32_t>(_strings.size());
+            header.stringsOffset = header.stepOffset + header.stepCount * sizeof(RemapKeyStep);
+            header.imageSize = header.stringsOffset + header.stringsSize;
+
+            vector<uint8_t> image(header.imageSize);
+            auto Copy = [&image](const uint32_t offset, const void* data, const size_t size)
+            {
+                if (0u != size)
+                {
+                    ::memcpy(&image[offset], data, size);
+                }
+            };
+            Copy(header.layerOffset, _layers.data(), _layers.size() * sizeof(RemapLayer));
+            Copy(header.actionOffset, _actions.data(), _actions.size() * sizeof(RemapAction));
+            Copy(header.stepOffset, _steps.data(), _steps.size() * sizeof(RemapKeyStep));
+            Copy(header.stringsOffset, _strings.data(), _strings.size());
+
+            header.checksum = RemapImageChecksum(&image[sizeof(header)], image.size() - sizeof(header));
+            Copy(0u, &header, sizeof(header));
+
+            return image;
+        }
+
+        size_t layerCount() const { return _layers.size(); }
+        size_t actionCount() const { return _actions.size(); }
+        size_t stepCount() const { return _steps.size(); }
+        size_t bindingCount() const { return _bindingCount; }
+
+    private:
+        vector<RemapLayer>                                  _layers;
+        vector<RemapAction>                                 _actions;
+        vector<RemapKeyStep>                                _steps;
+        string                                              _strings;
+        std::map<string, uint8_t>                           _layerIndices;
+        std::map<std::tuple<int, int, int>, uint16_t>       _sharedActions; // identical actions, other than macros, are shared
+        size_t                                              _bindingCount = 0u;
+
+        string LayerName(const size_t layer) const
+        {
+            return string(&_strings[_layers[layer].nameOffset]);
+        }
+
+        uint32_t AddString(const string& text)
+        {
+            const auto offset = static_cast<uint32_t>(_strings.size());
+            _strings += text;
+            _strings += '\0';
+            return offset;
+        }
+
+        uint8_t FindLayer(const JsonValue& name) const
+        {
+            const auto found = (JsonValue::Type::String == name.type) ? _layerIndices.find(name.text) : _layerIndices.end();
+            if (_layerIndices.end() == found)
+            {
+                throw runtime_error("no such layer");
+            }
+            return found->second;
+        }
+
+        void AddChord(const string& chord)
+        {
+            // "lcontrol+shift+c" makes each key in order, then breaks them in reverse.
+            vector<uint16_t> keys;
+            size_t start = 0u;
+            for (;;)
+            {
+                const auto plus = chord.find('+', start);
+                keys.push_back(ParseVirtualKey(chord.substr(start, (string::npos == plus) ? string::npos : plus - start)));
+                if (string::npos == plus)
+                {
+                    break;
+                }
+                start = plus + 1u;
+            }
+
+            for (const auto key : keys)
+            {
+                _steps.push_back({ key, 0u, 0u });
+            }
+            for (auto it = keys.rbegin(); it != keys.rend(); ++it)
+            {
+                _steps.push_back({ *it, 1u, 0u });
+            }
+        }
+
+        uint16_t AddAction(const JsonValue& spec)
+        {
+            RemapAction action = {};
+
+            if (JsonValue::Type::String == spec.type)
+            {
+                action.type = static_cast<uint8_t>(RemapActionType::Remap);
+                action.virtualKey = ParseVirtualKey(spec.text);
+            }
+            else if (JsonValue::Type::Object == spec.type && 1u == spec.members.size())
+            {
+                const auto& kind = spec.members[0].first;
+                const auto& value = spec.members[0].second;
+
+                if ("remap" == kind && JsonValue::Type::String == value.type)
+                {
+                    action.type = static_cast<uint8_t>(RemapActionType::Remap);
+                    action.virtualKey = ParseVirtualKey(value.text);
+                }
+                else if ("block" == kind && JsonValue::Type::Boolean == value.type && value.boolean)
+                {
+                    action.type = static_cast<uint8_t>(RemapActionType::Block);
+                }
+                else if ("hold" == kind)
+                {
+                    action.type = static_cast<uint8_t>(RemapActionType::HoldLayer);
+                    action.layer = FindLayer(value);
+                }
+                else if ("toggle" == kind)
+                {
+                    action.type = static_cast<uint8_t>(RemapActionType::ToggleLayer);
+                    action.layer = FindLayer(value);
+                }
+                else if ("macro" == kind && JsonValue::Type::Array == value.type && !value.items.empty())
+                {
+                    action.type = static_cast<uint8_t>(RemapActionType::Macro);
+                    action.firstStep = static_cast<uint32_t>(_steps.size());
+                    for (const auto& chord : value.items)
+                    {
+                        if (JsonValue::Type::String != chord.type)
+                        {
+                            throw runtime_error("a macro is a list of key chords");
+                        }
+                        AddChord(chord.text);
+                    }
+                    action.stepCount = static_cast<uint32_t>(_steps.size()) - action.firstStep;
+                }
+                else
+                {
+                    throw runtime_error("unknown action \"" + kind + "\"");
+                }
+            }
+            else
+            {
+                throw runtime_error("an action is a key name, or an object with one of: remap, block, macro, hold, toggle");
+            }
+
+            if (static_cast<uint8_t>(RemapActionType::Macro) != action.type)
+            {
+                const auto key = std::make_tuple(static_cast<int>(action.type), static_cast<int>(action.layer), static_cast<int>(action.virtualKey));
+                const auto found = _sharedActions.find(key);
+                if (_sharedActions.end() != found)
+                {
+                    return found->second;
+                }
+                _sharedActions[key] = static_cast<uint16_t>(_actions.size());
+            }
+
+            if (_actions.size() > 0xffffu)
+            {
+                throw runtime_error("too many actions");
+            }
+            _actions.push_back(action);
+            return static_cast<uint16_t>(_actions.size() - 1u);
+        }
+    };
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    if (3 != argc)
+    {
+        std::cerr << "usage: RemapCompiler <binding file> <image file>" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        std::ifstream inFile(argv[1], std::ios_base::in | std::ios_base::binary);
+        if (!inFile.good())
+        {
+            throw runtime_error(string("failed to read ") + argv[1]);
+        }
+        const string source((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+
+        JsonReader reader(source.data(), source.data() + source.size());
+        const ImageBuilder builder(reader.ReadDocument());
+        const auto image = builder.Build();
+
+        // Check the image the same way UberKey will.
+        RemapImage check;
+        const auto pError = check.Open(image.data(), image.size());
+        if (nullptr != pError)
+        {
+            throw runtime_error(string("internal error; ") + pError);
+        }
+
+        std::ofstream outFile(argv[2], std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        outFile.write(reinterpret_cast<const char*>(image.data()), image.size());
+        if (!outFile.good())
+        {
+            throw runtime_error(string("failed to write ") + argv[2]);
+        }
+
+        std::cout << builder.bindingCount() << " bindings in " << builder.layerCount() << " layers; "
+            << builder.actionCount() << " actions, " << builder.stepCount() << " key steps, "
+            << image.size() << " bytes" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << argv[1] << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
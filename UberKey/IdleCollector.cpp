@@ -0,0 +1,78 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "IdleCollector.h"
+
+#include <chrono>
+
+namespace
+{
+    inline int64_t Nanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+} // namespace
+
+IdleCollector::IdleCollector()
+    : _mode(Mode::Automatic)
+    , _settings{ 0.001, 0, 64, 4096 }
+    , _stats()
+    , _baseline(0)
+    , _isCycleRunning(false)
+{
+}
+
+void IdleCollector::SetMode(lua_State* L, const Mode mode)
+{
+    _mode = mode;
+
+    if (Mode::Idle == _mode)
+    {
+        lua_gc(L, LUA_GCSTOP, 0);
+    }
+    else
+    {
+        lua_gc(L, LUA_GCRESTART, 0);
+    }
+    _baseline = lua_gc(L, LUA_GCCOUNT, 0);
+    _isCycleRunning = false;
+}
+
+bool IdleCollector::RunSlice(lua_State* L, const bool isBusy)
+{
+    const auto start = Nanoseconds();
+    const auto deadline = start + static_cast<int64_t>(_settings.sliceSeconds * 1e9);
+
+    auto isCycleComplete = false;
+    auto now = start;
+    do
+    {
+        isCycleComplete = (0 != lua_gc(L, LUA_GCSTEP, _settings.stepSize));
+        _stats.stepCount++;
+        now = Nanoseconds();
+    } while (!isCycleComplete && now < deadline);
+
+    lua_gc(L, LUA_GCSTOP, 0); // NOTE: stepping re-arms the automatic collector
+
+    const auto pause = now - start;
+    _stats.sliceCount++;
+    if (isBusy)
+    {
+        _stats.busySliceCount++;
+    }
+    _stats.totalPause += pause;
+    _stats.lastPause = pause;
+    if (pause > _stats.maxPause)
+    {
+        _stats.maxPause = pause;
+    }
+
+    if (isCycleComplete)
+    {
+        _stats.cycleCount++;
+        _baseline = lua_gc(L, LUA_GCCOUNT, 0);
+    }
+    _isCycleRunning = !isCycleComplete;
+
+    return isCycleComplete;
+}
@@ -0,0 +1,79 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include <lua.hpp>
+
+// Runs a Lua state's garbage collector in slices, in a host's idle time, rather than whenever an
+//  allocation inside a key callback tips it over. The host asks HasIdleWork() when it has nothing else
+//  to do, and IsOverDebt() when it's too busy to wait for that, and runs a slice when either says so.
+// NOTE: Only uses the Lua C API and the standard library; keep it free of Win32. UberKey and UberKeyLoad
+//  both collect with it.
+class IdleCollector final
+{
+public:
+    enum class Mode { Automatic, Idle };
+
+    struct Settings
+    {
+        double  sliceSeconds;   // the longest the collector runs before checking for messages again
+        int     stepSize;       // LUA_GCSTEP's argument, in KB
+        int     idleThreshold;  // KB allocated since the last cycle before an idle cycle starts
+        int     maxDebt;        // KB allocated since the last cycle before the collector runs while busy
+    };
+
+    struct Stats
+    {
+        uint64_t    sliceCount;
+        uint64_t    busySliceCount; // slices run because maxDebt was reached
+        uint64_t    stepCount;
+        uint64_t    cycleCount;
+        int64_t     totalPause;     // nanoseconds
+        int64_t     maxPause;
+        int64_t     lastPause;
+    };
+
+    IdleCollector();
+
+    // Idle mode stops Lua's collector; the host then runs it with RunSlice(). Starts a new debt.
+    void SetMode(lua_State* L, Mode mode);
+    void SetSettings(const Settings& settings) { _settings = settings; }
+
+    bool HasIdleWork(lua_State* L) const
+    {
+        return Mode::Idle == _mode && (_isCycleRunning || Debt(L) >= _settings.idleThreshold);
+    }
+
+    bool IsOverDebt(lua_State* L) const
+    {
+        return Mode::Idle == _mode && Debt(L) >= _settings.maxDebt;
+    }
+
+    // Steps the collector until a cycle completes or the slice runs out. Returns true if a cycle completed.
+    //  A busy slice is one run because IsOverDebt() said so.
+    bool RunSlice(lua_State* L, bool isBusy = false);
+
+    Mode mode() const { return _mode; }
+    const Settings& settings() const { return _settings; }
+    const Stats& stats() const { return _stats; }
+
+    static double NanosecondsToSeconds(const int64_t nanoseconds) { return static_cast<double>(nanoseconds) / 1e9; }
+
+private:
+    Mode        _mode;
+    Settings    _settings;
+    Stats       _stats;
+    int         _baseline;  // KB in use after the last complete cycle
+    bool        _isCycleRunning;
+
+    int Debt(lua_State* L) const
+    {
+        return lua_gc(L, LUA_GCCOUNT, 0) - _baseline;
+    }
+
+    IdleCollector(const IdleCollector&) = delete;
+    IdleCollector& operator =(const IdleCollector&) = delete;
+};
@@ -0,0 +1,254 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "KeyDispatch.h"
+
+#include <cassert>
+#include <new>
+#include <stdexcept>
+
+namespace dispatch
+{
+    namespace sc
+    {
+        extern const char Typename[] = "scancode";
+        extern const char MakeLatches[] = "UberKey.ScancodeMakeLatches";
+        extern const char BreakLatches[] = "UberKey.ScancodeBreakLatches";
+        extern const char MakeInterceptions[] = "UberKey.ScancodeMakeInterceptions";
+        extern const char BreakInterceptions[] = "UberKey.ScancodeBreakInterceptions";
+    } // namespace sc
+
+    namespace vk
+    {
+        extern const char Typename[] = "virtual key";
+        extern const char MakeLatches[] = "UberKey.VirtualKeyMakeLatches";
+        extern const char BreakLatches[] = "UberKey.VirtualKeyBreakLatches";
+        extern const char MakeInterceptions[] = "UberKey.VirtualKeyMakeInterceptions";
+        extern const char BreakInterceptions[] = "UberKey.VirtualKeyBreakInterceptions";
+    } // namespace vk
+
+    const char* const CallbackTableNames[BindingKindCount] =
+    {
+        sc::MakeLatches, sc::BreakLatches, vk::MakeLatches, vk::BreakLatches,
+        sc::MakeInterceptions, sc::BreakInterceptions, vk::MakeInterceptions, vk::BreakInterceptions
+    };
+
+    uint32_t BindingKindOf(const char* const callbackTablename)
+    {
+        for (auto kind = 0u; kind < BindingKindCount; kind++)
+        {
+            if (callbackTablename == CallbackTableNames[kind])
+            {
+                return kind;
+            }
+        }
+
+        assert(false);
+        return 0u;
+    }
+
+    void CreateCallbackTables(lua_State* L)
+    {
+        for (const auto CallbackTablename : CallbackTableNames)
+        {
+            lua_pushstring(L, CallbackTablename); // push callback table name
+            lua_createtable(L, 256, 0); // push callback table
+            lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+        }
+    }
+
+    void StoreKeyCallback(lua_State* L, const char* const callbackTablename, lua_Integer callbackIndex)
+    {
+        lua_pushstring(L, callbackTablename); // push the name of the callback table
+        lua_rawget(L, LUA_REGISTRYINDEX); // pop table name; push callback table
+        lua_insert(L, -2); // move the callback table under the callback
+        lua_rawseti(L, -2, static_cast<int>(callbackIndex)); // callbacks[index] = callback; pop callback
+        lua_pop(L, 1); // pop callback table
+    }
+
+    bool IsKeyCallbackBound(lua_State* L, const char* const callbackTablename, lua_Integer callbackIndex)
+    {
+        lua_getfield(L, LUA_REGISTRYINDEX, callbackTablename); // push the callback table
+        lua_rawgeti(L, -1, static_cast<int>(callbackIndex)); // push the callback
+        const auto isBound = !lua_isnil(L, -1);
+        lua_pop(L, 2);
+
+        return isBound;
+    }
+
+    bool PushKeyCallback(lua_State* L, const char* const callbackTablename, lua_Integer callbackIndex)
+    {
+        lua_pushstring(L, callbackTablename); // push the callback table's name
+        lua_rawget(L, LUA_REGISTRYINDEX); // pop table name; push callback table
+
+        assert(lua_istable(L, lua_gettop(L)));
+
+        lua_rawgeti(L, -1, static_cast<int>(callbackIndex)); // push callback function
+
+        if (lua_isnil(L, -1)) // if (only native handlers are bound to the key)
+        {
+            lua_pop(L, 2);
+            return false;
+        }
+
+        assert(lua_isfunction(L, -1));
+
+        lua_replace(L, -2); // overwrite the callback table with the callback function
+        return true;
+    }
+
+    int PushKeyCallbackArguments(lua_State* L, const uberkey_key_event& event, const int eventObjectReference)
+    {
+        if (LUA_NOREF != eventObjectReference) // if (the callback takes the reusable event object)
+        {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, eventObjectReference);
+            return 1;
+        }
+
+        // push the callback function default parameters, starting with the virtual key code
+        lua_pushinteger(L, event.virtual_key);
+        lua_pushinteger(L, event.scancode);
+        lua_pushboolean(L, event.e0);
+        lua_pushboolean(L, event.e1);
+        lua_pushinteger(L, event.extra_information);
+        lua_pushinteger(L, event.device);
+        return 6;
+    }
+
+    const char* CallbackErrorDescription(const int result)
+    {
+        switch (result)
+        {
+        case LUA_ERRRUN:
+            return "Lua runtime error.";
+        case LUA_ERRMEM:
+            return "Lua memory allocation error.";
+        case LUA_ERRERR:
+            return "Lua error while running the error handler function.";
+        default:
+            return "Lua unknown error.";
+        }
+    }
+
+    const char DispatcherName[] = "UberKey.Dispatcher";
+    const char DispatcherThreadName[] = "UberKey.DispatcherThread";
+
+    // NOTE: uberkey_key_event is only declared when keyboard.ffi hasn't already.
+    const char LuaDispatcherSource[] = R"(
+        local ring, current_event, callback_tables = ...
+        local ffi = require("ffi")
+        local band = require("bit").band
+
+        if not pcall(ffi.typeof, "uberkey_key_event") then
+            ffi.cdef[[
+                typedef struct {
+                    int64_t  timestamp;
+                    uint64_t device_handle;
+                    uint32_t sequence;
+                    uint32_t extra_information;
+                    uint16_t virtual_key;
+                    uint16_t scancode;
+                    uint16_t repeat_count;
+                    uint8_t  e0;
+                    uint8_t  e1;
+                    uint8_t  device;
+                    uint8_t  injected;
+                    uint8_t  is_break;
+                    uint8_t  sources;
+                    uint8_t  is_consumed;
+                    uint8_t  reserved[3];
+                } uberkey_key_event;
+            ]]
+        end
+
+        ffi.cdef[[
+            typedef struct {
+                uberkey_key_event event;
+                uint8_t  table;
+                uint8_t  reserved[3];
+                int32_t  callback_index;
+            } uberkey_ring_key_event;
+            typedef struct {
+                uint32_t head;
+                uint32_t tail;
+                uint32_t is_event_callback_style;
+                uint32_t reserved;
+                uberkey_ring_key_event entries[256];
+            } uberkey_key_event_ring;
+        ]]
+
+        ring = ffi.cast("uberkey_key_event_ring*", ring)
+        current_event = ffi.cast("uberkey_key_event*", current_event)
+        local event_object = ffi.cast("const uberkey_key_event*", current_event)
+        local copy, event_size, yield = ffi.copy, ffi.sizeof("uberkey_key_event"), coroutine.yield
+
+        return function()
+            while true do
+                local head = ring.head
+                while head ~= ring.tail do
+                    local entry = ring.entries[head]
+                    head = band(head + 1, 255)
+                    ring.head = head -- consumed before the call; an erroring callback isn't run twice
+
+                    local callback = callback_tables[entry.table][entry.callback_index]
+                    if callback ~= nil then
+                        local e = entry.event
+                        copy(current_event, e, event_size)
+                        if ring.is_event_callback_style ~= 0 then
+                            callback(event_object)
+                        else
+                            callback(e.virtual_key, e.scancode, e.e0 ~= 0, e.e1 ~= 0, e.extra_information, e.device)
+                        end
+                    end
+                end
+                yield()
+            end
+        end
+    )";
+
+    void LuaDispatcher::Create(lua_State* L, uberkey_key_event* pCurrentEvent)
+    {
+        {
+            const auto result = luaL_loadbuffer(L, LuaDispatcherSource, sizeof(LuaDispatcherSource) - 1u, "UberKey_Dispatcher"); // push the chunk
+            if (LUA_ERRMEM == result)
+            {
+                throw std::bad_alloc();
+            }
+            else if (0 != result)
+            {
+                throw std::logic_error("failed to compile the Lua dispatcher");
+            }
+        }
+
+        lua_pushlightuserdata(L, &_ring);
+        lua_pushlightuserdata(L, pCurrentEvent);
+
+        lua_createtable(L, static_cast<int>(BindingKindCount), 0); // push the callback table list
+        for (auto kind = 0u; kind < BindingKindCount; kind++)
+        {
+            lua_getfield(L, LUA_REGISTRYINDEX, CallbackTableNames[kind]); // push the callback table
+            lua_rawseti(L, -2, static_cast<int>(kind + 1u)); // pop the callback table into the list
+        }
+
+        if (0 != lua_pcall(L, 3, 1, 0)) // pop the chunk and arguments; push the dispatcher function
+        {
+            const std::string message = lua_tostring(L, -1);
+            lua_pop(L, 1);
+            throw std::runtime_error("failed to create the Lua dispatcher: " + message);
+        }
+
+        lua_setfield(L, LUA_REGISTRYINDEX, DispatcherName); // pop the dispatcher function
+
+        _L = L;
+        CreateThread();
+    }
+
+    void LuaDispatcher::CreateThread()
+    {
+        _thread = lua_newthread(_L); // push the thread
+        lua_setfield(_L, LUA_REGISTRYINDEX, DispatcherThreadName); // pop the thread; keeps it from being collected
+
+        lua_getfield(_L, LUA_REGISTRYINDEX, DispatcherName); // push the dispatcher function
+        lua_xmove(_L, _thread, 1); // pop the function; push it onto the thread's stack
+    }
+} // namespace dispatch
@@ -0,0 +1,281 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <lua.hpp>
+
+#include "UberKeyPlugin.h"
+
+// The key dispatch core; how key events find their Lua callbacks, and how the callbacks are called.
+//
+// A binding is a Lua function in one of eight callback tables in the registry, one for each
+//  uberkey_binding_kind, at the callback index of its device and code. Each kind has a key map of the
+//  codes bound on any device, as a quick reject test, and a key map per device slot; an event only
+//  enters Lua when a key map says something's bound. UberKey dispatches through these functions, and so
+//  does UberKeyLoad, so a load test runs the same dispatch as the real thing.
+// NOTE: Only uses the Lua C API and the standard library; keep it free of Win32.
+
+// Bit maps of 256 scancodes and virtual keys.
+using KeyMap = uint32_t[256u / (sizeof(uint32_t) * 8u)];
+
+// Bit flag array template functions:
+
+template< typename T, size_t S >
+inline void Set(T (&array)[S], const unsigned int index)
+{
+    const auto WordBitCount = sizeof(T) * 8u;
+    const auto BitCountMask = WordBitCount - 1;
+    const auto ArraySizeMask = WordBitCount * S - 1;
+    const unsigned int clamped = ArraySizeMask & index;
+    array[clamped / WordBitCount] |= 0x1 << (BitCountMask & clamped);
+}
+
+template< typename T, size_t S >
+inline void Clear(T (&array)[S], const unsigned int index)
+{
+    const auto WordBitCount = sizeof(T) * 8u;
+    const auto BitCountMask = WordBitCount - 1;
+    const auto ArraySizeMask = WordBitCount * S - 1;
+    const unsigned int clamped = ArraySizeMask & index;
+    array[clamped / WordBitCount] &= ~(0x1 << (BitCountMask & clamped));
+}
+
+template< typename T, size_t S >
+inline bool IsSet(T(&array)[S], const unsigned int index)
+{
+    const auto WordBitCount = sizeof(T) * 8u;
+    const auto BitCountMask = WordBitCount - 1;
+    const auto ArraySizeMask = WordBitCount * S - 1;
+    const unsigned int clamped = ArraySizeMask & index;
+    return 0u != (array[clamped / WordBitCount] & (0x1 << (BitCountMask & clamped)));
+}
+
+template< typename T, size_t S >
+inline void Clear(T(&array)[S])
+{
+    ::memset(array, 0u, sizeof(array));
+}
+
+namespace dispatch
+{
+    namespace sc
+    {
+        extern const char Typename[];
+        extern const char MakeLatches[];
+        extern const char BreakLatches[];
+        extern const char MakeInterceptions[];
+        extern const char BreakInterceptions[];
+    } // namespace sc
+
+    namespace vk
+    {
+        extern const char Typename[];
+        extern const char MakeLatches[];
+        extern const char BreakLatches[];
+        extern const char MakeInterceptions[];
+        extern const char BreakInterceptions[];
+    } // namespace vk
+
+    const uint32_t BindingKindCount = 8u;
+
+    // The callback tables' registry names, by uberkey_binding_kind.
+    extern const char* const CallbackTableNames[BindingKindCount];
+
+    // The uberkey_binding_kind of a callback table; one of the names above, not just an equal string.
+    uint32_t BindingKindOf(const char* callbackTablename);
+
+    inline bool IsVirtualKeyKind(const uint32_t kind)
+    {
+        return 0u != (2u & kind);
+    }
+
+    inline bool IsInterceptionKind(const uint32_t kind)
+    {
+        return kind >= UBERKEY_INTERCEPT_SCANCODE_MAKE;
+    }
+
+    // Callbacks bound to any device are at device slot zero.
+    const uint_fast8_t AnyDevice = 0u;
+
+    // Callbacks scoped to a device are stored above the 16-bit range of codes in the same callback table.
+    inline lua_Integer CallbackIndex(const uint_fast8_t deviceSlot, const uint_fast16_t code)
+    {
+        return (static_cast<lua_Integer>(deviceSlot) << 16) | code;
+    }
+
+    // The kinds a key event is dispatched to, in order; the interceptions, which the hook sees first,
+    //  then the listeners, each by virtual key, then by scancode.
+    inline const uint32_t (&DispatchOrder(const bool isBreak))[4]
+    {
+        static const uint32_t Orders[2][4] =
+        {
+            { UBERKEY_INTERCEPT_VIRTUAL_KEY_MAKE, UBERKEY_INTERCEPT_SCANCODE_MAKE, UBERKEY_LISTEN_FOR_VIRTUAL_KEY_MAKE, UBERKEY_LISTEN_FOR_SCANCODE_MAKE },
+            { UBERKEY_INTERCEPT_VIRTUAL_KEY_BREAK, UBERKEY_INTERCEPT_SCANCODE_BREAK, UBERKEY_LISTEN_FOR_VIRTUAL_KEY_BREAK, UBERKEY_LISTEN_FOR_SCANCODE_BREAK },
+        };
+        return Orders[isBreak ? 1 : 0];
+    }
+
+    // Creates the empty callback tables in the registry.
+    void CreateCallbackTables(lua_State* L);
+
+    // Stores the value at the top of the stack as the callback; nil unbinds it. Pops the value.
+    void StoreKeyCallback(lua_State* L, const char* callbackTablename, lua_Integer callbackIndex);
+
+    bool IsKeyCallbackBound(lua_State* L, const char* callbackTablename, lua_Integer callbackIndex);
+
+    // Pushes the bound callback, and returns true; or pushes nothing, and returns false.
+    bool PushKeyCallback(lua_State* L, const char* callbackTablename, lua_Integer callbackIndex);
+
+    // Pushes a callback's arguments: the event object, given its registry reference, for the "event"
+    //  callback style; or, with LUA_NOREF, the six arguments of the "arguments" style. Returns the count.
+    int PushKeyCallbackArguments(lua_State* L, const uberkey_key_event& event, int eventObjectReference);
+
+    // What a failed lua_pcall() of a callback is reported as.
+    const char* CallbackErrorDescription(int result);
+
+    // Runs the callbacks bound to the code on any device, then those bound to the event's own device;
+    //  each only when its key map is set. The run function is called with the device slot and the
+    //  callback index. Returns true if any callback was run.
+    template<typename RunCallback>
+    inline bool DispatchKeyCallbacks(const KeyMap& anyDeviceKeyMap, const KeyMap& deviceKeyMap, const uint_fast8_t device, const uint_fast16_t code, RunCallback run)
+    {
+        auto isDispatched = false;
+
+        if (IsSet(anyDeviceKeyMap, code))
+        {
+            run(AnyDevice, CallbackIndex(AnyDevice, code));
+            isDispatched = true;
+        }
+
+        if (AnyDevice != device && IsSet(deviceKeyMap, code))
+        {
+            run(device, CallbackIndex(device, code));
+            isDispatched = true;
+        }
+
+        return isDispatched;
+    }
+
+    // Lua Dispatch Mode
+    //
+    // Instead of entering Lua for every key event, a script may have its callbacks run by a dispatcher
+    //  loop written in Lua. Key events are queued into a ring the dispatcher reads through LuaJIT's FFI,
+    //  and the dispatcher coroutine is resumed once per batch. LuaJIT can then compile the dispatch loop
+    //  together with the callbacks.
+
+    // Keep in sync with LuaDispatcherSource.
+    struct RingKeyEvent
+    {
+        uberkey_key_event   event;
+        uint8_t             table;  // the binding kind, plus one; Lua indexes from 1
+        uint8_t             reserved[3];
+        int32_t             callbackIndex;
+    };
+
+    struct KeyEventRing
+    {
+        uint32_t        head; // written by the dispatcher
+        uint32_t        tail; // written by Queue()
+        uint32_t        isEventCallbackStyle;
+        uint32_t        reserved;
+        RingKeyEvent    entries[256];
+    };
+
+    static_assert(sizeof(RingKeyEvent) == 48u, "RingKeyEvent no longer matches its FFI declaration");
+
+    class LuaDispatcher final
+    {
+    public:
+        LuaDispatcher()
+            : _ring()
+            , _L(nullptr)
+            , _thread(nullptr)
+            , _isDispatching(false)
+        {
+        }
+
+        // Compiles the dispatcher in the Lua state, after its callback tables are made. Each key event is
+        //  copied to the current event before its callback runs. Throws on failure.
+        void Create(lua_State* L, uberkey_key_event* pCurrentEvent);
+
+        // Forgets the dispatcher; its Lua state is being closed.
+        void Reset()
+        {
+            _L = nullptr;
+            _thread = nullptr;
+            _ring.head = _ring.tail = 0u;
+        }
+
+        void SetEventCallbackStyle(const bool isEventCallbackStyle) { _ring.isEventCallbackStyle = isEventCallbackStyle ? 1u : 0u; }
+
+        // Returns false, and queues nothing, when the ring is full.
+        bool Queue(const uint32_t kind, const lua_Integer callbackIndex, const uberkey_key_event& event)
+        {
+            if (isFull())
+            {
+                return false;
+            }
+
+            auto& entry = _ring.entries[_ring.tail];
+            entry.event = event;
+            entry.table = static_cast<uint8_t>(kind + 1u);
+            entry.callbackIndex = static_cast<int32_t>(callbackIndex);
+
+            _ring.tail = (_ring.tail + 1u) & RingMask;
+            return true;
+        }
+
+        // Runs the dispatcher until it has drained the ring. A callback error ends the coroutine; the
+        //  error message is passed to reportError, and a new coroutine carries on with the next event.
+        // NOTE: Does nothing when called from a callback the dispatcher is running.
+        template<typename ReportError>
+        void Resume(ReportError reportError)
+        {
+            if (_isDispatching)
+            {
+                return;
+            }
+
+            _isDispatching = true;
+            while (nullptr != _thread && !isEmpty())
+            {
+                const auto result = lua_resume(_thread, 0);
+                if (LUA_YIELD == result)
+                {
+                    lua_settop(_thread, 0);
+                    continue;
+                }
+
+                const std::string message = lua_isstring(_thread, -1) ? lua_tostring(_thread, -1) : "(error object is not a string)";
+                CreateThread();
+                reportError(message);
+            }
+            _isDispatching = false;
+        }
+
+        bool isCreated() const { return nullptr != _thread; }
+        bool isDispatching() const { return _isDispatching; }
+        bool isEmpty() const { return _ring.head == _ring.tail; }
+        bool isFull() const { return ((_ring.tail + 1u) & RingMask) == _ring.head; }
+
+    private:
+        static const uint32_t RingMask = 255u;
+
+        KeyEventRing    _ring;
+        lua_State*      _L;
+        lua_State*      _thread;
+        bool            _isDispatching; // a callback run by the dispatcher may not resume it again
+
+        // Starts a new dispatcher coroutine; on Create(), and after a callback error kills the last one.
+        void CreateThread();
+
+        LuaDispatcher(const LuaDispatcher&) = delete;
+        LuaDispatcher& operator =(const LuaDispatcher&) = delete;
+    };
+} // namespace dispatch
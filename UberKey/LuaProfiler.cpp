@@ -0,0 +1,97 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "LuaProfiler.h"
+
+#include <algorithm>
+#include <vector>
+
+LuaProfiler::LuaProfiler()
+    : _isRunning(false)
+    , _sampleInterval(0)
+    , _sampleCount(0u)
+{
+}
+
+void LuaProfiler::Start(const int sampleInterval)
+{
+    _stacks.clear();
+    _sampleCount = 0u;
+    _sampleInterval = sampleInterval;
+    _isRunning = true;
+}
+
+void LuaProfiler::Stop()
+{
+    _isRunning = false;
+}
+
+void LuaProfiler::SetRoot(const std::string& root)
+{
+    _root = root;
+}
+
+void LuaProfiler::Sample(lua_State* L)
+{
+    if (!_isRunning)
+    {
+        return;
+    }
+
+    auto depth = 0;
+    lua_Debug ar;
+    while (depth < MaxDepth && 0 != lua_getstack(L, depth, &ar))
+    {
+        depth++;
+    }
+
+    // outermost frame first
+    _stack = _root;
+    for (auto level = depth - 1; level >= 0; level--)
+    {
+        if (0 == lua_getstack(L, level, &ar) || 0 == lua_getinfo(L, "Sn", &ar))
+        {
+            continue;
+        }
+
+        _stack += ';';
+        const auto frameStart = _stack.size();
+
+        _stack += (nullptr != ar.name) ? ar.name : "?";
+        if ('C' == ar.what[0])
+        {
+            _stack += " [C]";
+        }
+        else
+        {
+            _stack += " (";
+            _stack += ar.short_src;
+            if (ar.linedefined > 0)
+            {
+                _stack += ':';
+                _stack += std::to_string(ar.linedefined);
+            }
+            _stack += ')';
+        }
+
+        std::replace(_stack.begin() + frameStart, _stack.end(), ';', ':'); // ';' separates frames
+    }
+
+    _stacks[_stack]++;
+    _sampleCount++;
+}
+
+void LuaProfiler::Write(std::ostream& out) const
+{
+    // heaviest stacks first; flame graph tools don't care, but people reading the file do
+    std::vector<std::pair<std::string, uint64_t>> stacks(_stacks.begin(), _stacks.end());
+    std::sort(stacks.begin(), stacks.end(), [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b)
+    {
+        return a.second > b.second;
+    });
+
+    for (const auto& stack : stacks)
+    {
+        out << stack.first << ' ' << stack.second << '\n';
+    }
+}
@@ -0,0 +1,51 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+#include <lua.hpp>
+
+// Samples Lua call stacks from a count hook, and writes them out as collapsed stacks; one
+//  "root;caller;callee count" line per distinct stack, as flame graph tools expect.
+// NOTE: Only uses the Lua C API and the standard library; keep it free of Win32, so profiles can be
+//  taken wherever LuaJIT runs.
+class LuaProfiler final
+{
+public:
+    LuaProfiler();
+
+    // Starts collecting; discards any earlier samples. The interval is in Lua VM instructions.
+    void Start(int sampleInterval);
+    void Stop();
+
+    // Names the root frame of the samples that follow; e.g. the key binding whose callback is running.
+    void SetRoot(const std::string& root);
+
+    // Call from a LUA_MASKCOUNT hook set to the sample interval.
+    void Sample(lua_State* L);
+
+    // Writes the collapsed stacks collected so far.
+    void Write(std::ostream& out) const;
+
+    bool isRunning() const { return _isRunning; }
+    int sampleInterval() const { return _sampleInterval; }
+    uint64_t sampleCount() const { return _sampleCount; }
+
+private:
+    static const int MaxDepth = 64;
+
+    bool                                        _isRunning;
+    int                                         _sampleInterval;
+    uint64_t                                    _sampleCount;
+    std::string                                 _root;
+    std::string                                 _stack; // NOTE: reused by Sample() to avoid reallocating
+    std::unordered_map<std::string, uint64_t>   _stacks;
+
+    LuaProfiler(const LuaProfiler&) = delete;
+    LuaProfiler& operator =(const LuaProfiler&) = delete;
+};
@@ -0,0 +1,49 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "NativeHandlers.h"
+
+#include <algorithm>
+
+void NativeHandlerTable::Bind(uint32_t kind, uint32_t device, uint32_t code, const NativeHandler& handler)
+{
+    auto& list = _lists[Key(kind, device, code)];
+
+    auto handlers = list ? *list : std::vector<NativeHandler>();
+    handlers.insert(std::upper_bound(handlers.begin(), handlers.end(), handler, [](const NativeHandler& a, const NativeHandler& b)
+    {
+        return a.order < b.order;
+    }), handler);
+
+    list = std::make_shared<const std::vector<NativeHandler>>(std::move(handlers));
+}
+
+bool NativeHandlerTable::Unbind(uint32_t kind, uint32_t device, uint32_t code, uberkey_key_handler handler, void* context)
+{
+    const auto found = _lists.find(Key(kind, device, code));
+    if (_lists.end() == found)
+    {
+        return false;
+    }
+
+    auto handlers = *found->second;
+    const auto handlerIt = std::find_if(handlers.begin(), handlers.end(), [=](const NativeHandler& nativeHandler)
+    {
+        return handler == nativeHandler.handler && context == nativeHandler.context;
+    });
+    if (handlers.end() == handlerIt)
+    {
+        return false;
+    }
+
+    handlers.erase(handlerIt);
+    if (handlers.empty())
+    {
+        _lists.erase(found);
+    }
+    else
+    {
+        found->second = std::make_shared<const std::vector<NativeHandler>>(std::move(handlers));
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "UberKeyPlugin.h"
+
+// The handlers native plugins bind (see UberKeyPlugin.h), by binding kind, device slot, and code.
+//
+// Each key's handlers are an immutable list, sorted by order. Bind() and Unbind() publish a new list in
+//  place of the old one; the dispatch holds on to the list it found while it runs the handlers, so a
+//  handler may bind and unbind handlers as it likes, and nothing is copied per key event.
+// NOTE: Only uses the standard library; it's shared with the Linux host. Not thread safe; bind, unbind,
+//  and dispatch on one thread.
+
+struct NativeHandler
+{
+    int32_t             order;
+    uberkey_key_handler handler;
+    void*               context;
+};
+
+using NativeHandlerList = std::shared_ptr<const std::vector<NativeHandler>>;
+
+class NativeHandlerTable final
+{
+public:
+    NativeHandlerTable() {}
+
+    void Bind(uint32_t kind, uint32_t device, uint32_t code, const NativeHandler& handler);
+
+    // Returns false if no handler was bound with the same handler and context.
+    bool Unbind(uint32_t kind, uint32_t device, uint32_t code, uberkey_key_handler handler, void* context);
+
+    void Clear() { _lists.clear(); }
+
+    // Returns the key's handlers, or nullptr.
+    NativeHandlerList Find(uint32_t kind, uint32_t device, uint32_t code) const
+    {
+        if (_lists.empty())
+        {
+            return nullptr;
+        }
+
+        const auto found = _lists.find(Key(kind, device, code));
+        return (_lists.end() != found) ? found->second : nullptr;
+    }
+
+    bool empty() const { return _lists.empty(); }
+
+    // Runs the handlers ordered before the script's callback (order < 0), or the rest.
+    static void Run(const NativeHandlerList& handlers, const uberkey_key_event& event, const bool isBeforeScript)
+    {
+        if (!handlers)
+        {
+            return;
+        }
+
+        for (const auto& handler : *handlers)
+        {
+            if ((handler.order < 0) == isBeforeScript)
+            {
+                handler.handler(&event, handler.context);
+            }
+        }
+    }
+
+    // True if any of the handlers are ordered after the script's callback.
+    static bool HasHandlersAfterScript(const NativeHandlerList& handlers)
+    {
+        return handlers && !handlers->empty() && handlers->back().order >= 0;
+    }
+
+private:
+    std::unordered_map<uint32_t, NativeHandlerList> _lists;
+
+    static uint32_t Key(uint32_t kind, uint32_t device, uint32_t code)
+    {
+        return (kind << 24) | ((0xffu & device) << 16) | (0xffffu & code);
+    }
+
+    NativeHandlerTable(const NativeHandlerTable&) = delete;
+    NativeHandlerTable& operator =(const NativeHandlerTable&) = delete;
+};
@@ -0,0 +1,256 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "RemapImage.h"
+
+#include <cstring>
+
+namespace
+{
+    // True if count items of the size, at the offset, fit in the image, aligned.
+    bool IsTableInImage(const uint64_t offset, const uint64_t count, const uint64_t itemSize, const uint64_t imageSize)
+    {
+        return 0u == (offset % 4u) && offset <= imageSize && count * itemSize <= imageSize - offset;
+    }
+} // namespace
+
+uint32_t RemapImageChecksum(const uint8_t* data, size_t size)
+{
+    auto hash = 2166136261u;
+    for (size_t i = 0u; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+RemapImage::RemapImage()
+    : _pLayers(nullptr)
+    , _pActions(nullptr)
+    , _pSteps(nullptr)
+    , _pStrings(nullptr)
+    , _layerCount(0u)
+    , _layerMask(0u)
+    , _actionCount(0u)
+{
+}
+
+const char* RemapImage::Open(const void* pImage, size_t size)
+{
+    Close();
+
+    const auto pBytes = static_cast<const uint8_t*>(pImage);
+    if (nullptr == pBytes || size < sizeof(RemapImageHeader))
+    {
+        return "the image is truncated";
+    }
+
+    RemapImageHeader header;
+    ::memcpy(&header, pBytes, sizeof(header));
+
+    if (RemapImageMagic != header.magic)
+    {
+        return "not a remap image";
+    }
+    if (RemapImageVersion != header.version || sizeof(header) != header.headerSize)
+    {
+        return "the image was compiled for a different version of UberKey";
+    }
+    if (size != header.imageSize)
+    {
+        return "the image is truncated";
+    }
+    if (header.checksum != RemapImageChecksum(pBytes + sizeof(header), size - sizeof(header)))
+    {
+        return "the image is corrupt";
+    }
+
+    if (0u == header.layerCount || header.layerCount > RemapMaxLayers || 0u == header.actionCount ||
+        !IsTableInImage(header.layerOffset, header.layerCount, sizeof(RemapLayer), size) ||
+        !IsTableInImage(header.actionOffset, header.actionCount, sizeof(RemapAction), size) ||
+        !IsTableInImage(header.stepOffset, header.stepCount, sizeof(RemapKeyStep), size) ||
+        !IsTableInImage(header.stringsOffset, header.stringsSize, 1u, size) ||
+        0u == header.stringsSize || '\0' != pBytes[header.stringsOffset + header.stringsSize - 1u])
+    {
+        return "the image's tables are malformed";
+    }
+
+    const auto pLayers = reinterpret_cast<const RemapLayer*>(pBytes + header.layerOffset);
+    const auto pActions = reinterpret_cast<const RemapAction*>(pBytes + header.actionOffset);
+    const auto pSteps = reinterpret_cast<const RemapKeyStep*>(pBytes + header.stepOffset);
+
+    // Everything Lookup() hands out is checked here, once.
+    for (auto i = 0u; i < header.layerCount; i++)
+    {
+        if (pLayers[i].nameOffset >= header.stringsSize)
+        {
+            return "a layer's name is malformed";
+        }
+        for (const auto actionIndex : pLayers[i].actions)
+        {
+            if (actionIndex >= header.actionCount)
+            {
+                return "a layer refers to a missing action";
+            }
+        }
+    }
+
+    if (static_cast<uint8_t>(RemapActionType::None) != pActions[0].type)
+    {
+        return "the image's tables are malformed";
+    }
+    for (auto i = 0u; i < header.actionCount; i++)
+    {
+        const auto& action = pActions[i];
+        switch (static_cast<RemapActionType>(action.type))
+        {
+        case RemapActionType::None:
+        case RemapActionType::Block:
+            break;
+        case RemapActionType::Remap:
+            if (action.virtualKey > 0xffu)
+            {
+                return "an action remaps to a missing virtual key";
+            }
+            break;
+        case RemapActionType::Macro:
+            if (static_cast<uint64_t>(action.firstStep) + action.stepCount > header.stepCount)
+            {
+                return "a macro refers to missing key steps";
+            }
+            break;
+        case RemapActionType::HoldLayer:
+        case RemapActionType::ToggleLayer:
+            if (action.layer >= header.layerCount)
+            {
+                return "an action refers to a missing layer";
+            }
+            break;
+        default:
+            return "an action is of an unknown type";
+        }
+    }
+
+    for (auto i = 0u; i < header.stepCount; i++)
+    {
+        if (pSteps[i].virtualKey > 0xffu)
+        {
+            return "a macro sends a missing virtual key";
+        }
+    }
+
+    _pLayers = pLayers;
+    _pActions = pActions;
+    _pSteps = pSteps;
+    _pStrings = reinterpret_cast<const char*>(pBytes + header.stringsOffset);
+    _layerCount = header.layerCount;
+    _layerMask = (RemapMaxLayers == header.layerCount) ? ~0u : (1u << header.layerCount) - 1u;
+    _actionCount = header.actionCount;
+
+    return nullptr;
+}
+
+void RemapImage::Close()
+{
+    _pLayers = nullptr;
+    _pActions = nullptr;
+    _pSteps = nullptr;
+    _pStrings = nullptr;
+    _layerCount = 0u;
+    _layerMask = 0u;
+    _actionCount = 0u;
+}
+
+bool RemapImage::IsBound(uint_fast16_t virtualKey) const
+{
+    for (auto i = 0u; i < _layerCount; i++)
+    {
+        if (0u != _pLayers[i].actions[0xffu & virtualKey])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+RemapDispatcher::RemapDispatcher(const RemapImage& image)
+    : _image(image)
+{
+    Reset();
+}
+
+void RemapDispatcher::Make(uint_fast16_t virtualKey, RemapOutput& output)
+{
+    virtualKey &= 0xffu;
+
+    const auto isRepeat = _isMade[virtualKey];
+    _isMade[virtualKey] = true;
+
+    // An autorepeat repeats whatever the first make started.
+    const auto pAction = (isRepeat && nullptr != _heldActions[virtualKey]) ? _heldActions[virtualKey] : _image.Lookup(_activeLayers, virtualKey);
+    _heldActions[virtualKey] = pAction;
+
+    if (nullptr == pAction)
+    {
+        output.PassThrough();
+        return;
+    }
+
+    switch (static_cast<RemapActionType>(pAction->type))
+    {
+    case RemapActionType::Remap:
+        output.Send(pAction->virtualKey, false);
+        break;
+    case RemapActionType::Macro:
+        if (!isRepeat)
+        {
+            output.Send(_image.steps(*pAction), pAction->stepCount);
+        }
+        break;
+    case RemapActionType::HoldLayer:
+        _activeLayers |= 1u << pAction->layer;
+        break;
+    case RemapActionType::ToggleLayer:
+        if (!isRepeat)
+        {
+            _activeLayers ^= 1u << pAction->layer;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void RemapDispatcher::Break(uint_fast16_t virtualKey, RemapOutput& output)
+{
+    virtualKey &= 0xffu;
+
+    const auto pAction = _heldActions[virtualKey];
+    _heldActions[virtualKey] = nullptr;
+    _isMade[virtualKey] = false;
+
+    if (nullptr == pAction) // if (the make was passed through, or came before the dispatcher)
+    {
+        output.PassThrough();
+        return;
+    }
+
+    switch (static_cast<RemapActionType>(pAction->type))
+    {
+    case RemapActionType::Remap:
+        output.Send(pAction->virtualKey, true);
+        break;
+    case RemapActionType::HoldLayer:
+        _activeLayers &= ~(1u << pAction->layer);
+        break;
+    default:
+        break;
+    }
+}
+
+void RemapDispatcher::Reset()
+{
+    _activeLayers = 1u;
+    ::memset(_heldActions, 0, sizeof(_heldActions));
+    ::memset(_isMade, 0, sizeof(_isMade));
+}
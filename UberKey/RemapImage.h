@@ -0,0 +1,165 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The binary remap image.
+//
+// RemapCompiler turns a binding file into an image, and UberKey maps the image into memory and looks
+//  key events up in it where it lies; nothing is parsed or copied at start up. An image is a header,
+//  followed by the layer, action, key step, and string tables, each found by its offset from the start
+//  of the image. Everything is little endian, and 4 byte aligned.
+// NOTE: Only uses the standard library; keep it free of Win32, so images can be built, checked, and
+//  benchmarked wherever there's a C++ compiler.
+
+const uint32_t RemapImageMagic = 0x49524b55u; // "UKRI"
+const uint16_t RemapImageVersion = 1u;
+const uint32_t RemapMaxLayers = 32u;
+
+enum class RemapActionType : uint8_t
+{
+    None        = 0u,   // transparent; look in the next active layer down
+    Remap       = 1u,   // make and break another virtual key instead
+    Block       = 2u,   // swallow the key
+    Macro       = 3u,   // send the key steps when the key is made
+    HoldLayer   = 4u,   // activate a layer while the key is held
+    ToggleLayer = 5u,   // activate, or deactivate, a layer when the key is made
+};
+
+struct RemapImageHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t imageSize;
+    uint32_t checksum;      // FNV-1a of everything after the header
+    uint32_t layerCount;
+    uint32_t layerOffset;   // RemapLayer[layerCount]; layer 0 is the base layer, and always active
+    uint32_t actionCount;
+    uint32_t actionOffset;  // RemapAction[actionCount]; action 0 is RemapActionType::None
+    uint32_t stepCount;
+    uint32_t stepOffset;    // RemapKeyStep[stepCount]
+    uint32_t stringsSize;
+    uint32_t stringsOffset; // null terminated names
+};
+
+struct RemapLayer
+{
+    uint32_t nameOffset;    // into the strings
+    uint32_t reserved;
+    uint16_t actions[256];  // action index by virtual key; zero for none
+};
+
+struct RemapAction
+{
+    uint8_t  type;          // RemapActionType
+    uint8_t  layer;         // HoldLayer and ToggleLayer
+    uint16_t virtualKey;    // Remap
+    uint32_t firstStep;     // Macro
+    uint32_t stepCount;     // Macro
+};
+
+struct RemapKeyStep
+{
+    uint16_t virtualKey;
+    uint8_t  isBreak;
+    uint8_t  reserved;
+};
+
+uint32_t RemapImageChecksum(const uint8_t* data, size_t size);
+
+// A checked view of an image in memory. The memory must outlive the view.
+class RemapImage final
+{
+public:
+    RemapImage();
+
+    // Checks the image, and keeps a view of it. Returns nullptr, or what's wrong with the image.
+    const char* Open(const void* pImage, size_t size);
+    void Close();
+
+    // Finds the action for a virtual key in the topmost active layer that has one, or returns nullptr.
+    //  The active layers are a bit set; the base layer is active either way.
+    const RemapAction* Lookup(uint32_t activeLayers, uint_fast16_t virtualKey) const
+    {
+        auto layers = (activeLayers | 1u) & _layerMask;
+        for (auto layer = _layerCount; 0u != layers; )
+        {
+            layer--;
+            const auto bit = 1u << layer;
+            if (0u != (layers & bit))
+            {
+                const auto actionIndex = _pLayers[layer].actions[0xffu & virtualKey];
+                if (0u != actionIndex)
+                {
+                    return &_pActions[actionIndex];
+                }
+                layers &= ~bit;
+            }
+        }
+        return nullptr;
+    }
+
+    // True if any layer has an action for the virtual key.
+    bool IsBound(uint_fast16_t virtualKey) const;
+
+    const RemapKeyStep* steps(const RemapAction& action) const { return _pSteps + action.firstStep; }
+    const char* layerName(uint32_t layer) const { return _pStrings + _pLayers[layer].nameOffset; }
+    uint32_t layerCount() const { return _layerCount; }
+    uint32_t actionCount() const { return _actionCount; }
+    bool isOpen() const { return nullptr != _pLayers; }
+
+private:
+    const RemapLayer*   _pLayers;
+    const RemapAction*  _pActions;
+    const RemapKeyStep* _pSteps;
+    const char*         _pStrings;
+    uint32_t            _layerCount;
+    uint32_t            _layerMask;
+    uint32_t            _actionCount;
+
+    RemapImage(const RemapImage&) = delete;
+    RemapImage& operator =(const RemapImage&) = delete;
+};
+
+// Where a RemapDispatcher sends keys; each platform's output.
+class RemapOutput
+{
+public:
+    // Sends the key event being dispatched on, untouched.
+    virtual void PassThrough() = 0;
+    virtual void Send(uint_fast16_t virtualKey, bool isBreak) = 0;
+    virtual void Send(const RemapKeyStep* pSteps, uint32_t count) = 0;
+
+protected:
+    ~RemapOutput() {}
+};
+
+// Runs key events through an image's actions; the layers, and the keys being held, are its state.
+//  Every make and break of the keys the image binds must go through the same dispatcher, in order.
+class RemapDispatcher final
+{
+public:
+    explicit RemapDispatcher(const RemapImage& image);
+
+    // A make of a key that's already made is an autorepeat.
+    void Make(uint_fast16_t virtualKey, RemapOutput& output);
+    void Break(uint_fast16_t virtualKey, RemapOutput& output);
+
+    // Forgets the held keys, and deactivates every layer but the base layer.
+    void Reset();
+
+    uint32_t activeLayers() const { return _activeLayers; }
+
+private:
+    const RemapImage&  _image;
+    uint32_t           _activeLayers;
+    const RemapAction* _heldActions[256]; // the action each made key started; its break finishes it
+    bool               _isMade[256];
+
+    RemapDispatcher(const RemapDispatcher&) = delete;
+    RemapDispatcher& operator =(const RemapDispatcher&) = delete;
+};
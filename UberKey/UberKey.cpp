@@ -3,10 +3,20 @@
 
 #include "stdafx.h"
 #include "UberKey.h"
+#include "IdleCollector.h"
+#include "KeyDispatch.h"
+#include "LuaProfiler.h"
+#include "NativeHandlers.h"
+#include "RemapImage.h"
+#include "UberKeyControl.h"
+#include "UberKeyPlugin.h"
+#include "UberKeyShared.h"
+#include "VirtualKeys.h"
 
 #include <fstream>
 #include <iostream>
 #include <cassert>
+#include <cmath>
 
 using std::exception;
 using std::bad_alloc;
@@ -46,250 +56,6 @@ using std::numeric_limits;
 // https://msdn.microsoft.com/en-us/library/windows/desktop/ms646307%28v=vs.85%29.aspx
 //
 
-struct VirtualKeyMeta
-{
-    const char* name;
-    const char* info;
-    const char** altNames;
-
-    VirtualKeyMeta(const char* name, const char* info, const char* altNames[])
-        : name(name), info(info), altNames(altNames)
-    {
-    }
-};
-
-const char* altNames0x15[] = { "hangul", "hangeul", nullptr };
-const char* altNames0x19[] = { "hanja", nullptr };
-const char* altNames0x92[] = { "oem_nec_equal", nullptr };
-const size_t altNameCount = ((sizeof(altNames0x15) + sizeof(altNames0x19) + sizeof(altNames0x92)) / sizeof(char*)) - 3;
-
-static const VirtualKeyMeta virtualKeys[256] =
-{
-    { "", "", nullptr }, // 0x00
-    { "lbutton", "", nullptr }, // 0x01
-    { "rbutton", "", nullptr }, // 0x02
-    { "cancel", "", nullptr }, // 0x03
-    { "mbutton", "not contiguous with l & rbutton", nullptr }, // 0x04
-    { "xbutton1", "not contiguous with l & rbutton", nullptr }, // 0x05
-    { "xbutton2", "not contiguous with l & rbutton", nullptr }, // 0x06
-    { "", "unassigned", nullptr }, // 0x07
-    { "back", "", nullptr }, // 0x08
-    { "tab", "", nullptr }, // 0x09
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, // 0x0a - 0x0b
-    { "clear", "", nullptr }, // 0x0c
-    { "return", "", nullptr }, // 0x0d
-    { "", "", nullptr }, { "", "", nullptr }, // 0x0e - 0x0f
-    { "shift", "", nullptr }, // 0x10
-    { "control", "", nullptr }, // 0x11
-    { "menu", "", nullptr }, // 0x12
-    { "pause", "", nullptr }, // 0x13
-    { "capital", "", nullptr }, // 0x14
-    { "kana", "Japanese and Korean versions are different", altNames0x15 }, // 0x15
-    { "", "", nullptr }, // 0x16
-    { "junja", "", nullptr }, // 0x17
-    { "final", "", nullptr }, // 0x18
-    { "kanji", "Japanese and Korean versions are different", altNames0x19 }, // 0x19
-    { "", "", nullptr }, // 0x1a
-    { "escape", "", nullptr }, // 0x1b
-    { "convert", "", nullptr }, // 0x1c
-    { "nonconvert", "", nullptr }, // 0x1d
-    { "accept", "", nullptr }, // 0x1e
-    { "modechange", "", nullptr }, // 0x1f
-    { "space", "", nullptr }, // 0x20
-    { "prior", "", nullptr }, // 0x21
-    { "next", "", nullptr }, // 0x22
-    { "end", "", nullptr }, // 0x23
-    { "home", "", nullptr }, // 0x24
-    { "left", "", nullptr }, // 0x25
-    { "up", "", nullptr }, // 0x26
-    { "right", "", nullptr }, // 0x27
-    { "down", "", nullptr }, // 0x28
-    { "select", "", nullptr }, // 0x29
-    { "print", "", nullptr }, // 0x2a
-    { "execute", "", nullptr }, // 0x2b
-    { "snapshot", "", nullptr }, // 0x2c
-    { "insert", "", nullptr }, // 0x2d
-    { "delete", "", nullptr }, // 0x2e
-    { "help", "", nullptr }, // 0x2f
-    { "_0", "same as ASCII '0'", nullptr }, // 0x30
-    { "_1", "same as ASCII '1'", nullptr }, // 0x31
-    { "_2", "same as ASCII '2'", nullptr }, // 0x32
-    { "_3", "same as ASCII '3'", nullptr }, // 0x33
-    { "_4", "same as ASCII '4'", nullptr }, // 0x34
-    { "_5", "same as ASCII '5'", nullptr }, // 0x35
-    { "_6", "same as ASCII '6'", nullptr }, // 0x36
-    { "_7", "same as ASCII '7'", nullptr }, // 0x37
-    { "_8", "same as ASCII '8'", nullptr }, // 0x38
-    { "_9", "same as ASCII '9'", nullptr }, // 0x39
-    { "", "", nullptr }, { "", "", nullptr }, { "", "", nullptr }, // 0x3a - 0x3f
-    { "", "", nullptr }, { "", "", nullptr }, { "", "", nullptr },
-    { "", "unassigned", nullptr }, // 0x40
-    { "a", "same as ASCII 'A'", nullptr }, // 0x41
-    { "b", "same as ASCII 'B'", nullptr }, // 0x42
-    { "c", "same as ASCII 'C'", nullptr }, // 0x43
-    { "d", "same as ASCII 'D'", nullptr }, // 0x44
-    { "e", "same as ASCII 'E'", nullptr }, // 0x45
-    { "f", "same as ASCII 'F'", nullptr }, // 0x46
-    { "g", "same as ASCII 'G'", nullptr }, // 0x47
-    { "h", "same as ASCII 'H'", nullptr }, // 0x48
-    { "i", "same as ASCII 'I'", nullptr }, // 0x49
-    { "j", "same as ASCII 'J'", nullptr }, // 0x4a
-    { "k", "same as ASCII 'K'", nullptr }, // 0x4b
-    { "l", "same as ASCII 'L'", nullptr }, // 0x4c
-    { "m", "same as ASCII 'M'", nullptr }, // 0x4d
-    { "n", "same as ASCII 'N'", nullptr }, // 0x4e
-    { "o", "same as ASCII 'O'", nullptr }, // 0x4f
-    { "p", "same as ASCII 'P'", nullptr }, // 0x50
-    { "q", "same as ASCII 'Q'", nullptr }, // 0x51
-    { "r", "same as ASCII 'R'", nullptr }, // 0x52
-    { "s", "same as ASCII 'S'", nullptr }, // 0x53
-    { "t", "same as ASCII 'T'", nullptr }, // 0x54
-    { "u", "same as ASCII 'U'", nullptr }, // 0x55
-    { "v", "same as ASCII 'V'", nullptr }, // 0x56
-    { "w", "same as ASCII 'W'", nullptr }, // 0x57
-    { "x", "same as ASCII 'X'", nullptr }, // 0x58
-    { "y", "same as ASCII 'Y'", nullptr }, // 0x59
-    { "z", "same as ASCII 'Z'", nullptr }, // 0x5a
-    { "lwin", "", nullptr }, // 0x5b
-    { "rwin", "", nullptr }, // 0x5c
-    { "apps", "", nullptr }, // 0x5d
-    { "", "reserved", nullptr }, // 0x5e
-    { "sleep", "", nullptr }, // 0x5f
-    { "numpad0", "", nullptr }, // 0x60
-    { "numpad1", "", nullptr }, // 0x61
-    { "numpad2", "", nullptr }, // 0x62
-    { "numpad3", "", nullptr }, // 0x63
-    { "numpad4", "", nullptr }, // 0x64
-    { "numpad5", "", nullptr }, // 0x65
-    { "numpad6", "", nullptr }, // 0x66
-    { "numpad7", "", nullptr }, // 0x67
-    { "numpad8", "", nullptr }, // 0x68
-    { "numpad9", "", nullptr }, // 0x69
-    { "multiply", "", nullptr }, // 0x6a
-    { "add", "", nullptr }, // 0x6b
-    { "separator", "", nullptr }, // 0x6c
-    { "subtract", "", nullptr }, // 0x6d
-    { "decimal", "", nullptr }, // 0x6e
-    { "divide", "", nullptr }, // 0x6f
-    { "f1", "", nullptr }, // 0x70
-    { "f2", "", nullptr }, // 0x71
-    { "f3", "", nullptr }, // 0x72
-    { "f4", "", nullptr }, // 0x73
-    { "f5", "", nullptr }, // 0x74
-    { "f6", "", nullptr }, // 0x75
-    { "f7", "", nullptr }, // 0x76
-    { "f8", "", nullptr }, // 0x77
-    { "f9", "", nullptr }, // 0x78
-    { "f10", "", nullptr }, // 0x79
-    { "f11", "", nullptr }, // 0x7a
-    { "f12", "", nullptr }, // 0x7b
-    { "f13", "", nullptr }, // 0x7c
-    { "f14", "", nullptr }, // 0x7d
-    { "f15", "", nullptr }, // 0x7e
-    { "f16", "", nullptr }, // 0x7f
-    { "f17", "", nullptr }, // 0x80
-    { "f18", "", nullptr }, // 0x81
-    { "f19", "", nullptr }, // 0x82
-    { "f20", "", nullptr }, // 0x83
-    { "f21", "", nullptr }, // 0x84
-    { "f22", "", nullptr }, // 0x85
-    { "f23", "", nullptr }, // 0x86
-    { "f24", "", nullptr }, // 0x87
-    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, // 0x88 - 0x8f
-    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
-    { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
-    { "numlock", "", nullptr }, // 0x90
-    { "scroll", "", nullptr }, // 0x91
-    { "oem_fj_jisho", "Fujitsu/OASYS 'dictionary' key; NEC PC-9800 '=' key on numpad", altNames0x92 }, // 0x92
-    { "oem_fj_masshou", "Fujitsu/OASYS 'unregister word' key", nullptr }, // 0x93
-    { "oem_fj_touroku", "Fujitsu/OASYS 'register word' key", nullptr }, // 0x94
-    { "oem_fj_loya", "Fujitsu/OASYS 'left oyayubi' key", nullptr }, // 0x95
-    { "oem_fj_roya", "Fujitsu/OASYS 'right oyayubi' key", nullptr }, // 0x96
-    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, // 0x97 - 0x9f
-    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
-    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
-    { "lshift", "left Shift; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa0
-    { "rshift", "right Shift; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa1
-    { "lcontrol", "left Ctrl; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa2
-    { "rcontrol", "right Ctrl; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa3
-    { "lmenu", "left Alt; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa4
-    { "rmenu", "right Alt; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa5
-    { "browser_back", "", nullptr }, // 0xa6
-    { "browser_forward", "", nullptr }, // 0xa7
-    { "browser_refresh", "", nullptr }, // 0xa8
-    { "browser_stop", "", nullptr }, // 0xa9
-    { "browser_search", "", nullptr }, // 0xaa
-    { "browser_favorites", "", nullptr }, // 0xab
-    { "browser_home", "", nullptr }, // 0xac
-    { "volume_mute", "", nullptr }, // 0xad
-    { "volume_down", "", nullptr }, // 0xae
-    { "volume_up", "", nullptr }, // 0xaf
-    { "media_next_track", "", nullptr }, // 0xb0
-    { "media_prev_track", "", nullptr }, // 0xb1
-    { "media_stop", "", nullptr }, // 0xb2
-    { "media_play_pause", "", nullptr }, // 0xb3
-    { "launch_mail", "", nullptr }, // 0xb4
-    { "launch_media_select", "", nullptr }, // 0xb5
-    { "launch_app1", "", nullptr }, // 0xb6
-    { "launch_app2", "", nullptr }, // 0xb7
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, // 0xb8 - 0xb9
-    { "oem_1", "';:' for us", nullptr }, // 0xba
-    { "oem_plus", "'+' any country", nullptr }, // 0xbb
-    { "oem_comma", "',' any country", nullptr }, // 0xbc
-    { "oem_minus", "'-' any country", nullptr }, // 0xbd
-    { "oem_period", "'.' any country", nullptr }, // 0xbe
-    { "oem_2", "'/?' for us", nullptr }, // 0xbf
-    { "oem_3", "'`~' for us", nullptr }, // 0xc0
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr }, // 0xc1 - 0xd7
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
-    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
-    { "", "reserved", nullptr }, { "", "reserved", nullptr },
-    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, // 0xd8 - 0xda
-    { "oem_4", "'[{' for us", nullptr }, // 0xdb
-    { "oem_5", "'\\|' for us", nullptr }, // 0xdc
-    { "oem_6", "']}' for us", nullptr }, // 0xdd
-    { "oem_7", "''\"' for us", nullptr }, // 0xde
-    { "oem_8", "", nullptr }, // 0xdf
-    { "", "reserved", nullptr }, // 0xe0
-    { "oem_ax", "Various extended or enhanced keyboards; 'ax' key on japanese ax kbd", nullptr }, // 0xe1
-    { "oem_102", "Various extended or enhanced keyboards; \"<>\" or \"\\|\" on rt 102-key kbd.", nullptr }, // 0xe2
-    { "ico_help", "Various extended or enhanced keyboards; help key on ico", nullptr }, // 0xe3
-    { "ico_00", "Various extended or enhanced keyboards; 00 key on ico", nullptr }, // 0xe4
-    { "processkey", "", nullptr }, // 0xe5
-    { "ico_clear", "", nullptr }, // 0xe6
-    { "packet", "", nullptr }, // 0xe7
-    { "", "unassigned", nullptr }, // 0xe8
-    { "oem_reset", "Nokia/Ericsson", nullptr }, // 0xe9
-    { "oem_jump", "Nokia/Ericsson", nullptr }, // 0xea
-    { "oem_pa1", "Nokia/Ericsson", nullptr }, // 0xeb
-    { "oem_pa2", "Nokia/Ericsson", nullptr }, // 0xec
-    { "oem_pa3", "Nokia/Ericsson", nullptr }, // 0xed
-    { "oem_wsctrl", "Nokia/Ericsson", nullptr }, // 0xee
-    { "oem_cusel", "Nokia/Ericsson", nullptr }, // 0xef
-    { "oem_attn", "Nokia/Ericsson", nullptr }, // 0xf0
-    { "oem_finish", "Nokia/Ericsson", nullptr }, // 0xf1
-    { "oem_copy", "Nokia/Ericsson", nullptr }, // 0xf2
-    { "oem_auto", "Nokia/Ericsson", nullptr }, // 0xf3
-    { "oem_enlw", "Nokia/Ericsson", nullptr }, // 0xf4
-    { "oem_backtab", "Nokia/Ericsson", nullptr }, // 0xf5
-    { "attn", "", nullptr }, // 0xf6
-    { "crsel", "", nullptr }, // 0xf7
-    { "exsel", "", nullptr }, // 0xf8
-    { "ereof", "", nullptr }, // 0xf9
-    { "play", "", nullptr }, // 0xfa
-    { "zoom", "", nullptr }, // 0xfb
-    { "noname", "", nullptr }, // 0xfc
-    { "pa1", "", nullptr }, // 0xfd
-    { "oem_clear", "", nullptr }, // 0xfe
-    { "", "reserved", nullptr }  // 0xff
-};
-
-const auto virtualKeyCount = sizeof(virtualKeys) / sizeof(virtualKeys[0]);
-
 
 // Types
 //////////////////////////////////////////////////////////////////
@@ -308,10 +74,57 @@ struct Sizeui {
 using WindowMessageHandler = LRESULT(*)(WPARAM, LPARAM);
 using MessageMap = unordered_map<UINT, WindowMessageHandler>;
 
-// Bit maps of 256 scancodes and virtual keys.
-using KeyMap = uint32_t[256u / (sizeof(uint32_t) * 8u)];
+// Returns true when the key event was consumed, and should be filtered out of the system's input queue.
+using KeyInterceptionCallback = bool(*)(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time);
+
+// Identifies the key events this process injected with SendInput(), so they can be passed straight on.
+struct SelfInjectionFilter
+{
+    ULONG_PTR   signature;                  // the dwExtraInfo value this process tags its injected input with
+    bool        isVisible;                  // when set, self-injected key events are handed to the callbacks anyway
+    uint64_t    skippedHookEvents;          // self-injected key events the hook passed on without a callback
+    uint64_t    skippedRawInputEvents;      // self-injected raw input that wasn't dispatched to the callbacks
+};
+
+// Per virtual key debounce state, for keyboards with chattering switches. Windows are in milliseconds,
+//  measured with KBDLLHOOKSTRUCT::time; a zero window turns debouncing off for the key.
+enum DebounceMode : uint8_t
+{
+    EagerDebounce       = 0u,   // pass the first transition, then suppress the key for the window
+    DeferredDebounce    = 1u,   // only pass a transition once the key has been quiet for the window
+};
+
+struct DebounceFilter
+{
+    uint16_t    windows[256];
+    uint8_t     modes[256];
+    uint32_t    madeKeys[8];            // bit map of the key state the hook has let through
+    uint32_t    seenMadeKeys[8];        // bit map of the direction of each key's last event, let through or not
+    uint32_t    lastAcceptedTimes[256];
+    uint32_t    lastSeenTimes[256];     // the key's last change of direction; autorepeats don't count
+    uint32_t    suppressedCounts[256];
+};
 
-using KeyInterceptionCallback = void(*)(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation);
+// A key event as handed to the Lua callbacks. It's laid out for the LuaJIT FFI; keep it in sync with
+//  api::FfiDeclarations.
+struct KeyEventRecord
+{
+    int64_t  timestamp;         // QueryPerformanceCounter() ticks, taken when the event was first seen
+    uint64_t deviceHandle;      // RAWINPUTHEADER::hDevice; zero for injected input
+    uint32_t sequence;          // event stream sequence number; the hook and raw input sides of a key event share it
+    uint32_t extraInformation;
+    uint16_t virtualKey;
+    uint16_t scancode;
+    uint16_t repeatCount;       // count of autorepeated makes since the key was first made
+    uint8_t  e0;
+    uint8_t  e1;
+    uint8_t  device;            // device slot
+    uint8_t  injected;
+    uint8_t  isBreak;
+    uint8_t  sources;           // stream::EventSource flags
+    uint8_t  isConsumed;        // filtered out of the system's input queue by an interception callback
+    uint8_t  reserved[3];
+};
 
 // Implementation Data
 //////////////////////////////////////////////////////////////////
@@ -321,6 +134,18 @@ const DWORD WindowStyle         = WS_POPUP | WS_CAPTION |
                                   WS_SYSMENU | WS_MINIMIZEBOX;
 const DWORD WindowExtendedStyle = 0;
 
+// Posted to the main window when key events are waiting for the Lua dispatcher.
+const UINT DispatchKeyEventsMessage = WM_APP;
+
+// Posted to the main window when a control request is waiting to be run.
+const UINT ControlRequestMessage = WM_APP + 1;
+
+// Posted to the main window when the input thread has queued key events.
+const UINT CapturedInputMessage = WM_APP + 2;
+
+// Posted to the main thread when a device script has queued binding changes.
+const UINT BindingChangeMessage = WM_APP + 3;
+
 // Windows message handler functions.
 MessageMap      messageMap;
 
@@ -333,9 +158,12 @@ HWND                    _windowHandle = nullptr;
 vector<uint8_t>         _rawInputBuffer;
 bool                    _isReadingRawKeyboard;
 
-// Maps of the currently depressed keys.
+// Maps of the currently depressed keys (on any device).
 KeyMap madeScancodes = {};
 KeyMap madeVirtualKeys = {};
+
+// Union of the latch and interception maps of every device slot. These are the quick reject tests,
+//  the per-device maps in devices::keyboardDevices decide which callbacks actually run.
 KeyMap latchedScancodeMakes = {};
 KeyMap latchedVirtualKeyMakes = {};
 KeyMap latchedScancodeBreaks = {};
@@ -345,49 +173,30 @@ KeyMap interceptedVirtualKeyMakes = {};
 KeyMap interceptedScancodeBreaks = {};
 KeyMap interceptedVirtualKeyBreaks = {};
 
-///////////////////////////////////////////////
-
-lua_State* luaState = nullptr;
-vector<uint8_t> luaScriptBuffer;
-vector<uint8_t>::size_type luaScriptBufferReadPos;
-///////////////////////////////////////////////
+// Shared with the keyboard hook; the signature is set once, in Create(), before any input is sent.
+SelfInjectionFilter selfInjection = {};
 
-// Bit flag array template functions:
+// Shared with the keyboard hook.
+DebounceFilter debounce = {};
 
-template< typename T, size_t S >
-inline void Set(T (&array)[S], const unsigned int index)
-{
-    const auto WordBitCount = sizeof(T) * 8u;
-    const auto BitCountMask = WordBitCount - 1;
-    const auto ArraySizeMask = WordBitCount * S - 1;
-    const unsigned int clamped = ArraySizeMask & index;
-    array[clamped / WordBitCount] |= 0x1 << (BitCountMask & clamped);
-}
+///////////////////////////////////////////////
 
-template< typename T, size_t S >
-inline void Clear(T (&array)[S], const unsigned int index)
-{
-    const auto WordBitCount = sizeof(T) * 8u;
-    const auto BitCountMask = WordBitCount - 1;
-    const auto ArraySizeMask = WordBitCount * S - 1;
-    const unsigned int clamped = ArraySizeMask & index;
-    array[clamped / WordBitCount] &= ~(0x1 << (BitCountMask & clamped));
-}
+lua_State* luaState = nullptr;
+DWORD luaThreadId = 0u; // the thread that owns luaState, and pumps the window's messages
 
-template< typename T, size_t S >
-inline bool IsSet(T(&array)[S], const unsigned int index)
+// A Lua script file, read into memory for lua_load().
+struct LuaScriptSource
 {
-    const auto WordBitCount = sizeof(T) * 8u;
-    const auto BitCountMask = WordBitCount - 1;
-    const auto ArraySizeMask = WordBitCount * S - 1;
-    const unsigned int clamped = ArraySizeMask & index;
-    return 0u != (array[clamped / WordBitCount] & (0x1 << (BitCountMask & clamped)));
-}
+    vector<uint8_t> buffer;
+    vector<uint8_t>::size_type readPos;
+};
+///////////////////////////////////////////////
 
-template< typename T, size_t S >
-inline void Clear(T(&array)[S])
+inline int64_t ReadTimestamp()
 {
-    ::memset(array, 0u, sizeof(array));
+    LARGE_INTEGER counter;
+    ::QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
 }
 
 ///////////////////////////////////////////////
@@ -424,1416 +233,7031 @@ inline void ClearVirtualKeyBreakLatches() { Clear(latchedVirtualKeyBreaks); }
 
 ///////////////////////////////////////////////
 
-wstring GetProgramExecutablePath()
+// Keyboard Devices
+namespace devices
 {
-    vector<wchar_t> buffer(MAX_PATH);
+    // Slot zero is not a physical device; it holds the bindings that apply to every keyboard.
+    const uint_fast8_t AnyDevice = dispatch::AnyDevice;
+    const uint_fast8_t MaxDeviceCount = 16u;
 
-    for (int i = 0; i < 5; i++)
+    // A keyboard seen through the raw input system, along with the key state and bindings scoped to it.
+    struct KeyboardDevice
     {
-        const auto length = ::GetModuleFileNameW(nullptr, &buffer[0], static_cast<DWORD>(buffer.size()));
-        if (0 == length)
+        bool        isInUse;    // the slot has been handed out to a device, or reserved by a script
+        HANDLE      handle;     // RAWINPUTHEADER::hDevice; only valid while the device is connected
+        string      id;         // the identifier a script used to reserve this slot (upper case)
+        string      path;       // device interface path (upper case); stable across reconnects
+        uint16_t    vendorId;
+        uint16_t    productId;
+
+        KeyMap madeScancodes;
+        KeyMap madeVirtualKeys;
+        KeyMap latchedScancodeMakes;
+        KeyMap latchedVirtualKeyMakes;
+        KeyMap latchedScancodeBreaks;
+        KeyMap latchedVirtualKeyBreaks;
+        KeyMap interceptedScancodeMakes;
+        KeyMap interceptedVirtualKeyMakes;
+        KeyMap interceptedScancodeBreaks;
+        KeyMap interceptedVirtualKeyBreaks;
+
+        array<uint16_t, 256u> repeatCounts; // autorepeated makes per virtual key, since the key was first made
+    };
+
+    array<KeyboardDevice, MaxDeviceCount> keyboardDevices = {};
+
+    // Guards the slots' identities (isInUse, handle, id, path, and the vendor and product ids), and the
+    //  device scripts table, for keyboard.devices() on device script threads. Only the main thread
+    //  changes them, and the rest of a slot is only touched on the main thread.
+    std::mutex identityMutex;
+
+    // The low-level hook doesn't know which device a key event came from, and it sees a key event
+    //  before raw input does (a key event swallowed by the hook never produces raw input at all). So
+    //  the hook side is only told the device of a key press raw input has already seen; i.e. its make
+    //  got through, and this is its autorepeat or its break. This table holds the device slot each
+    //  scancode is held down on, by raw input's account; or AnyDevice.
+    array<uint8_t, 256u> scancodeDevices = {};
+
+    // The hook's view of which keys are down, for counting its autorepeats; an intercepted key event may
+    //  never show up as raw input. Kept for all devices at once, since the hook's device attribution can
+    //  change partway through a press, and keyed by HookKeyIndex(), since raw input (which clears a key
+    //  whose make was intercepted, but whose break wasn't) reports VK_SHIFT where the hook says VK_LSHIFT.
+    KeyMap hookMadeKeys = {};
+    array<uint16_t, 256u> hookRepeatCounts = {};
+
+    // Set 1 make codes are below 0x80; the E0 flag takes the top bit.
+    inline uint_fast16_t HookKeyIndex(const uint_fast16_t scancode, const bool e0)
+    {
+        return (0x7fu & scancode) | (e0 ? 0x80u : 0u);
+    }
+
+    // Raw input tends to arrive in runs from the same device; skip the table scan for those.
+    HANDLE          lastDeviceHandle = nullptr;
+    uint_fast8_t    lastDeviceSlot = AnyDevice;
+
+    inline KeyboardDevice& AnyKeyboard() { return keyboardDevices[AnyDevice]; }
+
+    string ToUpper(string text)
+    {
+        for (auto& ch : text)
         {
-            throw exception("failed to get a path to this program's executable");
+            if (ch >= 'a' && ch <= 'z')
+            {
+                ch = static_cast<char>(ch - 'a' + 'A');
+            }
         }
-        else if (buffer.size() == length && ERROR_INSUFFICIENT_BUFFER == ::GetLastError())
+        return text;
+    }
+
+    string GetRawInputDevicePath(const HANDLE hDevice)
+    {
+        UINT length = 0u;
+        if (0u != ::GetRawInputDeviceInfoW(hDevice, RIDI_DEVICENAME, nullptr, &length) || 0u == length)
         {
-            buffer.resize(buffer.size() * 2);
-            continue;
+            return string();
         }
 
-        wstring result(&buffer[0], &buffer[length]);
+        vector<wchar_t> buffer(length + 1u);
+        const auto copied = ::GetRawInputDeviceInfoW(hDevice, RIDI_DEVICENAME, &buffer[0], &length);
+        if (UINT(-1) == copied || 0u == copied)
+        {
+            return string();
+        }
 
-        auto bsi = result.find_last_of(L'\\');
-        result.resize(bsi + 1);
+        // NOTE: Device interface paths are plain ASCII.
+        string result;
+        result.reserve(copied);
+        for (auto i = 0u; i < copied && L'\0' != buffer[i]; i++)
+        {
+            result.push_back(static_cast<char>(buffer[i]));
+        }
 
-        return result;
+        return ToUpper(move(result));
     }
 
-    throw exception("failed to get a reasonable path to this program's executable");
-}
-
-const char* LuaReader(lua_State* L, void* data, size_t* size)
-{
-    UNREFERENCED_PARAMETER(L);
-    UNREFERENCED_PARAMETER(data);
+    // Reads a four digit hex number following the tag (i.e. "VID_046D") out of a device path.
+    uint16_t ParseDevicePathHex(const string& path, const char* tag)
+    {
+        const auto pos = path.find(tag);
+        if (string::npos == pos)
+        {
+            return 0u;
+        }
 
-    bool isEof = false;
+        return static_cast<uint16_t>(::strtoul(path.substr(pos + ::strlen(tag), 4u).c_str(), nullptr, 16));
+    }
 
-    if (luaScriptBuffer.empty())
+    void ClearKeyState(KeyboardDevice& device)
     {
-        isEof = true;
+        Clear(device.madeScancodes);
+        Clear(device.madeVirtualKeys);
+        device.repeatCounts.fill(0u);
     }
-    else if (luaScriptBufferReadPos >= luaScriptBuffer.size())
+
+    void AssignDevice(const uint_fast8_t slot, const HANDLE hDevice, string path)
     {
-        luaScriptBuffer.clear();
-        isEof = true;
+        auto& device = keyboardDevices[slot];
+        std::lock_guard<std::mutex> lock(identityMutex);
+        device.isInUse = true;
+        device.handle = hDevice;
+        device.vendorId = ParseDevicePathHex(path, "VID_");
+        device.productId = ParseDevicePathHex(path, "PID_");
+        device.path = move(path);
+        ClearKeyState(device);
     }
 
-    if (isEof)
+    // Gives a newly seen device a slot. Preference goes to the slot it had before it was disconnected,
+    //  then to a slot a script reserved for it, and finally to any unused slot.
+    uint_fast8_t AttachDevice(const HANDLE hDevice)
     {
-        if (nullptr != size)
+        auto path = GetRawInputDevicePath(hDevice);
+
+        if (!path.empty())
         {
-            *size = 0u;
+            for (auto slot = 1u; slot < MaxDeviceCount; slot++)
+            {
+                const auto& device = keyboardDevices[slot];
+                if (device.isInUse && nullptr == device.handle && device.path == path)
+                {
+                    AssignDevice(slot, hDevice, move(path));
+                    return slot;
+                }
+            }
+
+            for (auto slot = 1u; slot < MaxDeviceCount; slot++)
+            {
+                const auto& device = keyboardDevices[slot];
+                if (device.isInUse && nullptr == device.handle && device.path.empty() &&
+                    !device.id.empty() && string::npos != path.find(device.id))
+                {
+                    AssignDevice(slot, hDevice, move(path));
+                    return slot;
+                }
+            }
         }
-        return nullptr;
+
+        for (auto slot = 1u; slot < MaxDeviceCount; slot++)
+        {
+            if (!keyboardDevices[slot].isInUse)
+            {
+                AssignDevice(slot, hDevice, move(path));
+                return slot;
+            }
+        }
+
+        // Out of slots; the device only gets the bindings for any device.
+        return AnyDevice;
     }
 
-    if (nullptr == size)
+    void DetachDevice(const HANDLE hDevice)
     {
-        return nullptr;
+        for (auto slot = 1u; slot < MaxDeviceCount; slot++)
+        {
+            auto& device = keyboardDevices[slot];
+            if (hDevice == device.handle)
+            {
+                // Keep the slot, along with its bindings, for when the device comes back.
+                std::lock_guard<std::mutex> lock(identityMutex);
+                device.handle = nullptr;
+                ClearKeyState(device);
+            }
+        }
+
+        if (hDevice == lastDeviceHandle)
+        {
+            lastDeviceHandle = nullptr;
+            lastDeviceSlot = AnyDevice;
+        }
     }
 
-    const auto pos = luaScriptBufferReadPos;
+    uint_fast8_t FindDeviceSlot(const HANDLE hDevice)
+    {
+        if (nullptr == hDevice) // if (the input was injected, rather than coming from a device)
+        {
+            return AnyDevice;
+        }
 
-    luaScriptBufferReadPos = luaScriptBuffer.size();
+        if (hDevice == lastDeviceHandle)
+        {
+            return lastDeviceSlot;
+        }
 
-    *size = luaScriptBuffer.size() - pos;
+        auto result = AnyDevice;
+        {
+            auto slot = 1u;
+            for (; slot < MaxDeviceCount; slot++)
+            {
+                if (hDevice == keyboardDevices[slot].handle)
+                {
+                    result = slot;
+                    break;
+                }
+            }
 
-    return reinterpret_cast<const char*>(&luaScriptBuffer[pos]);
-}
+            if (MaxDeviceCount == slot)
+            {
+                result = AttachDevice(hDevice);
+            }
+        }
 
-void BackgroundApplicationProcessing()
-{
-    //std::cout << std::hex;
-    //for (auto i = 0; i < 256; i++)
-    //{
-    //    if (IsKeyMade(i))
-    //    {
-    //        std::cout << std::hex << i << ' ';
-    //    }
-    //}
-    //std::cout << std::dec;
+        lastDeviceHandle = hDevice;
+        lastDeviceSlot = result;
 
-    ClearScancodes();
-    ClearVirtualKeys();
-}
+        return result;
+    }
 
-void Close()
-{
-    ::PostMessageW(_windowHandle, WM_CLOSE, 0, 0);
-}
+    // Returns the slot reserved for the identifier, reserving one if need be. The identifier is any
+    //  part of a device's interface path (i.e. "VID_046D&PID_C52B"). Returns AnyDevice if the table is full.
+    uint_fast8_t ReserveDeviceSlot(const string& identifier)
+    {
+        const auto id = ToUpper(identifier);
 
-LRESULT Paint(WPARAM wParam, LPARAM lParam)
-{
-    //pGraphicsRenderer->process_wm_paint();
-    return ::DefWindowProcW(_windowHandle, WM_PAINT, wParam, lParam);
-}
+        for (auto slot = 1u; slot < MaxDeviceCount; slot++)
+        {
+            if (keyboardDevices[slot].isInUse && keyboardDevices[slot].id == id)
+            {
+                return slot;
+            }
+        }
 
-string LuaTypeToString(lua_State* L, int stackIndex)
-{
-    string result;
-    stringstream ss;
+        for (auto slot = 1u; slot < MaxDeviceCount; slot++)
+        {
+            auto& device = keyboardDevices[slot];
+            if (device.isInUse && device.id.empty() && string::npos != device.path.find(id))
+            {
+                std::lock_guard<std::mutex> lock(identityMutex);
+                device.id = id;
+                return slot;
+            }
+        }
 
-    // if (the stack index is relative) convert it to an absolute index
-    const auto absIndex = (stackIndex < 0) ? lua_gettop(L) + 1 + stackIndex : stackIndex;
+        for (auto slot = 1u; slot < MaxDeviceCount; slot++)
+        {
+            auto& device = keyboardDevices[slot];
+            if (!device.isInUse)
+            {
+                std::lock_guard<std::mutex> lock(identityMutex);
+                device.isInUse = true;
+                device.id = id;
+                return slot;
+            }
+        }
 
-    const auto typeId = lua_type(L, absIndex);
+        return AnyDevice;
+    }
 
-    switch (typeId)
+    // Counts autorepeated makes, using the key state maps; a make for a key that's already made is a repeat.
+    inline uint16_t CountRepeat(KeyMap& madeVirtualKeys, array<uint16_t, 256u>& repeatCounts, const uint_fast16_t virtualKey, const bool isBreak)
     {
-    case LUA_TBOOLEAN:
-        ss << ((lua_toboolean(L, absIndex)) ? "true" : "false");
-        break;
-    case LUA_TFUNCTION:
-        if (lua_iscfunction(L, absIndex))
-        {
-            ss << "Native function: 0x" << std::hex << lua_tocfunction(L, absIndex) << std::dec;
-        }
-        else
+        auto& repeatCount = repeatCounts[virtualKey & 0xffu];
+
+        if (isBreak)
         {
-            ss << "Lua function";
+            const auto count = repeatCount;
+            repeatCount = 0u;
+            Clear(madeVirtualKeys, virtualKey);
+            return count;
         }
-        break;
-    case LUA_TLIGHTUSERDATA:
-        ss << "Light user-data: 0x" << std::hex << lua_touserdata(L, absIndex) << std::dec;
-        break;
-    case LUA_TNIL:
-        ss << "nil";
-        break;
-    case LUA_TNUMBER:
-        ss << lua_tonumber(L, absIndex);
-        break;
-    case LUA_TSTRING:
-        ss << '"' << lua_tostring(L, absIndex) << '"'; // NOTE: this ignores the possibility of embedded nulls
-        break;
-    case LUA_TTABLE:
-        ss << "{ ";
 
-        lua_pushnil(L); // prime the pump: push the first table key to start the enumeration
-        if (0 != lua_next(L, absIndex))
+        if (IsSet(madeVirtualKeys, virtualKey)) // if (the key was already made) it's autorepeating
         {
-            ss << LuaTypeToString(L, -2) << " = " << LuaTypeToString(L, -1); // print key = value
-
-            lua_pop(L, 1); // pop the value; leave the key for the next iteration
-
-            while (0 != lua_next(L, absIndex))
+            if (repeatCount < std::numeric_limits<uint16_t>::max())
             {
-                ss << ", " << LuaTypeToString(L, -2) << " = " << LuaTypeToString(L, -1); // print the key = value
-
-                lua_pop(L, 1); // pop the value; leave the key for the next iteration
+                ++repeatCount;
             }
         }
+        else
+        {
+            Set(madeVirtualKeys, virtualKey);
+        }
 
-        ss << " }";
-        break;
-    case LUA_TTHREAD:
-        ss << "Lua thread: 0x" << std::hex << lua_tothread(L, absIndex) << std::dec;
-        break;
-    case LUA_TUSERDATA:
-        ss << "User-data block: 0x" << std::hex << lua_touserdata(L, absIndex) << std::dec;
-        break;
-    default:
-        ss << "unrecognized-type";
-        break;
+        return repeatCount;
     }
 
-    result = move(ss.str());
+    inline void RecordScancodeDevice(const uint_fast16_t scancode, const uint_fast8_t slot, const bool isBreak)
+    {
+        scancodeDevices[0xffu & scancode] = static_cast<uint8_t>(isBreak ? AnyDevice : slot);
+    }
 
-    return result;
-}
+    // Returns AnyDevice when the device isn't known; per-device bindings don't apply then.
+    inline uint_fast8_t CorrelateHookEvent(const uint_fast16_t scancode)
+    {
+        return scancodeDevices[0xffu & scancode];
+    }
 
-int LuaDumpStack(lua_State* L)
-{
-    const auto argc = lua_gettop(L);
+    // A break the hook swallows never shows up as raw input; the press is over all the same.
+    inline void ForgetHookEvent(const uint_fast16_t scancode)
+    {
+        scancodeDevices[0xffu & scancode] = static_cast<uint8_t>(AnyDevice);
+    }
 
-    if (0 == argc)
+    // Called for raw input's breaks; the hook doesn't see the break of a key that only has its make
+    //  intercepted, and the key's next make would read as an autorepeat.
+    inline void ReleaseHookKey(const uint_fast16_t scancode, const bool e0)
     {
-        std::wcout << "\nstack is empty" << endl;
-        return 0;
+        const auto index = HookKeyIndex(scancode, e0);
+        Clear(hookMadeKeys, index);
+        hookRepeatCounts[index] = 0u;
     }
+} // namespace devices
 
-    std::wcout << L"\nStack Dump" << endl;
-    std::wcout << L"----------" << endl;
+// Key Usage
+namespace usage
+{
+    // How often each key is used, and how; to prune profiles and tune layouts by. Counts are kept for
+    //  every virtual key and scancode, for each physical make and break, and for each callback table
+    //  dispatched on. Only the main thread counts, with relaxed atomic loads and stores (plain moves
+    //  and an add on x86, so it costs no more than an increment), into an array of its own;
+    //  a background thread copies it out now and then, and saves the totals (including those of
+    //  earlier runs) to UberKey.usage, in the program's directory.
+    enum Action : uint8_t
+    {
+        Make,               // physical key events, by virtual key
+        Break,
+        ScancodeMake,       // the same, by scancode
+        ScancodeBreak,
+        FirstBinding,       // then one for each uberkey_binding_kind; key events dispatched to the callback table
+        ActionCount = FirstBinding + 8u,
+    };
 
-    for (auto i = argc; i >= 1; i--)
+    const char* const ActionNames[ActionCount] =
     {
-        std::cout << i << ": " << LuaTypeToString(L, i) << endl;
-    }
+        "make", "break", "scancode_make", "scancode_break",
+        "listen_for_scancode_make", "listen_for_scancode_break", "listen_for_virtual_key_make", "listen_for_virtual_key_break",
+        "intercept_scancode_make", "intercept_scancode_break", "intercept_virtual_key_make", "intercept_virtual_key_break",
+    };
 
-    return argc;
-}
+    const uint32_t CodeCount = 256u;
 
-int LuaPrintReplacement(lua_State* L)
-{
-    const auto topIndex = lua_gettop(L);
+    struct Counters
+    {
+        uint32_t counts[ActionCount][CodeCount];
+    };
 
-    for (int i = 1; i <= topIndex; i++)
+    // The live counts; atomic, so a snapshot can read them while the main thread counts.
+    struct LiveCounters
     {
-        if (lua_isstring(L, i)) // if (the object is a string or a number that's easily converted to a string)
-        {
-            std::cout << lua_tostring(L, i);
-        }
-        else // else (see if the object has a __tostring() method)
+        std::atomic<uint32_t> counts[ActionCount][CodeCount];
+    };
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "usage::LiveCounters must be as compact as Counters");
+
+    alignas(64) LiveCounters counters = {}; // NOTE: main thread only writes it; aligned, so nothing else shares its cache lines
+    Counters baseline = {};             // the totals saved by earlier runs
+
+    // UberKey.usage; the header, then the totals, by action and code.
+    struct FileHeader
+    {
+        char        magic[4];   // "UKUS"
+        uint32_t    version;
+        uint32_t    actionCount;
+        uint32_t    codeCount;
+        int64_t     savedTime;  // FILETIME
+    };
+
+    const uint32_t FileVersion = 1u;
+    const DWORD SnapshotMilliseconds = 5u * 60u * 1000u;
+
+    std::thread snapshotThread;
+    HANDLE stopEvent = nullptr;
+    wstring fileName;
+    std::mutex fileMutex; // serializes saves
+
+    inline void Count(const Action action, const uint_fast16_t code)
+    {
+        // NOTE: Not fetch_add(); there's only one writer, so there's no need for a locked instruction.
+        auto& count = counters.counts[action][0xffu & code];
+        count.store(count.load(std::memory_order_relaxed) + 1u, std::memory_order_relaxed);
+    }
+
+    // Counts a physical key event once, however many views of it there are.
+    inline void CountKeyEvent(const KeyEventRecord& keyEvent)
+    {
+        if (keyEvent.injected)
         {
-            if (0 == luaL_getmetafield(L, i, "__tostring")) // if (the object doesn't have a __tostring() method)
-            {
-                std::cout << LuaTypeToString(L, i);
-            }
-            else if (LUA_TFUNCTION != lua_type(L, lua_gettop(L))) // if (the object's __tostring member isn't a legal function)
-            {
-                // NOTE: This would be a strange case.
-                lua_pop(L, 1);
-                std::cout << LuaTypeToString(L, i);
-            }
-            else // else (the __tostring() method is on the stack)
-            {
-                lua_pushvalue(L, i); // duplicate the object to invoke tostring() on
-                const auto result = lua_pcall(L, 1, LUA_MULTRET, 0); // call __tostring(obj)
-                if (LUA_ERRRUN == result)
-                {
-                    std::wcout << "Lua runtime error." << std::endl;
-                }
-                else if (LUA_ERRMEM == result)
-                {
-                    std::wcout << "Lua memory allocation error." << std::endl;
-                }
-                else if (LUA_ERRERR == result)
-                {
-                    std::wcout << "Lua error while running the error handler function." << std::endl;
-                }
-                else if (0 != result)
-                {
-                    std::wcout << "Lua unknown error." << std::endl;
-                }
+            return;
+        }
 
-                // Output the result of __tostring(obj)
-                std::cout << lua_tostring(L, lua_gettop(L));
+        Count(keyEvent.isBreak ? Break : Make, keyEvent.virtualKey);
+        Count(keyEvent.isBreak ? ScancodeBreak : ScancodeMake, keyEvent.scancode);
+    }
 
-                // Pop the string to restore the stack.
-                lua_pop(L, 1);
+    // The totals so far. Main thread, or a snapshot racing it; an increment that's missed shows up in the next one.
+    void Snapshot(Counters& totals)
+    {
+        for (auto action = 0u; action < ActionCount; action++)
+        {
+            for (auto code = 0u; code < CodeCount; code++)
+            {
+                totals.counts[action][code] = baseline.counts[action][code] + counters.counts[action][code].load(std::memory_order_relaxed);
             }
         }
     }
 
-    std::wcout << std::endl;
+    bool Save()
+    {
+        std::unique_ptr<Counters> pTotals(new Counters());
+        Snapshot(*pTotals);
 
-    return 0;
-}
+        FileHeader header = { { 'U', 'K', 'U', 'S' }, FileVersion, ActionCount, CodeCount, 0 };
+        FILETIME now;
+        ::GetSystemTimeAsFileTime(&now);
+        header.savedTime = static_cast<int64_t>((static_cast<uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime);
 
-// NOTE: These declarations are needed by hook::InstallLowLevelKeyboardHook().
-namespace api
-{
-    void InterceptedScancodeMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation);
-    void InterceptedScancodeBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation);
-    void InterceptedVirtualKeyMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation);
-    void InterceptedVirtualKeyBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation);
-} // namespace api
+        std::lock_guard<std::mutex> lock(fileMutex);
 
-// Hook Procedure
-namespace hook
-{
-    class LowLevelKeyboardHook final
-    {
-    public:
-        LowLevelKeyboardHook()
-            : _hLowLevelKeyboardHook(nullptr)
+        // Written aside, then moved over the old file; so there's always a whole file to read.
+        const auto tempFileName = fileName + L".tmp";
+        bool isWritten;
         {
+            std::ofstream file(tempFileName, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(pTotals->counts), sizeof(pTotals->counts));
+            file.close();
+            isWritten = !file.fail();
         }
 
-        explicit LowLevelKeyboardHook(const HHOOK hLowLevelKeyboardHook)
-            : _hLowLevelKeyboardHook(hLowLevelKeyboardHook)
+        if (!isWritten || FALSE == ::MoveFileExW(tempFileName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING))
         {
+            (void)::DeleteFileW(tempFileName.c_str()); // NOTE: a partial file is of no use; the old one stands
+            return false;
         }
+        return true;
+    }
 
-        ~LowLevelKeyboardHook()
-        {
-            reset();
-        }
+    // Reads the totals saved by earlier runs; a file that doesn't match is ignored, and overwritten later.
+    void Load()
+    {
+        std::ifstream file(fileName, std::ios_base::in | std::ios_base::binary);
 
-        explicit operator bool() const
+        FileHeader header = {};
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file.good() || 0 != ::memcmp(header.magic, "UKUS", 4u) || FileVersion != header.version ||
+            ActionCount != header.actionCount || CodeCount != header.codeCount)
         {
-            return nullptr != _hLowLevelKeyboardHook;
+            return;
         }
 
-        operator const HHOOK&() const
+        std::unique_ptr<Counters> pTotals(new Counters());
+        file.read(reinterpret_cast<char*>(pTotals->counts), sizeof(pTotals->counts));
+        if (file.good())
         {
-            return _hLowLevelKeyboardHook;
+            baseline = *pTotals;
         }
+    }
 
-        void reset(const HHOOK hLowLevelKeyboardHook = nullptr)
+    void Run()
+    {
+        while (WAIT_TIMEOUT == ::WaitForSingleObject(stopEvent, SnapshotMilliseconds))
         {
-            if (nullptr != _hLowLevelKeyboardHook)
+            if (!Save())
             {
-                const auto result = ::UnhookWindowsHookEx(_hLowLevelKeyboardHook);
-                if (0 == result)
-                {
-                    const auto lastError = ::GetLastError();
-                    std::wcout << L"failed to unhook low-level keyboard filter: 0x" << std::hex << lastError << std::dec << std::endl;
-                    assert(false);
-                }
+                std::wcout << L"Failed to save the key usage to " << fileName << std::endl;
             }
-
-            _hLowLevelKeyboardHook = hLowLevelKeyboardHook;
         }
+    }
 
-    private:
-        HHOOK _hLowLevelKeyboardHook;
-
-        LowLevelKeyboardHook(const LowLevelKeyboardHook&) = delete;
-        LowLevelKeyboardHook& operator =(const LowLevelKeyboardHook&) = delete;
-    };
+    void Start(const wstring& usageFileName)
+    {
+        fileName = usageFileName;
+        Load();
 
-    LowLevelKeyboardHook keyboardHook;
+        stopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        snapshotThread = std::thread(&Run);
+    }
 
-    void InstallLowLevelKeyboardHook()
+    // Main thread only; saves the final totals.
+    void Stop()
     {
-        HMODULE hDllModule;
+        if (!snapshotThread.joinable())
         {
-            hDllModule = ::LoadLibraryExW(L"KeyFilter.dll", nullptr, LOAD_LIBRARY_SEARCH_APPLICATION_DIR);
-            if (nullptr == hDllModule)
-            {
-                std::wcout << L"LoadLibrary failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
-                return;
-            }
+            return;
         }
 
-        auto freeLibrary = [hDllModule]()
-        {
-            const auto result = ::FreeLibrary(hDllModule);
-            if (0 == result)
-            {
-                std::wcout << L"failed to free hook library 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
-            }
-        };
+        ::SetEvent(stopEvent);
+        snapshotThread.join();
+        ::CloseHandle(stopEvent);
+        stopEvent = nullptr;
 
-        using InitializeFilterHooks_t = HRESULT (*)(KeyMap* pInterceptedScancodeMakes, KeyMap* pInterceptedScancodeBreaks,
-            KeyMap* pInterceptedVirtualKeyMakes, KeyMap* pInterceptedVirtualKeyBreaks,
-            KeyInterceptionCallback interceptedScancodeMake, KeyInterceptionCallback interceptedScancodeBreak,
-            KeyInterceptionCallback interceptedVirtualKeyMake, KeyInterceptionCallback interceptedVirtualKeyBreak);
+        (void)Save();
+    }
 
-        InitializeFilterHooks_t InitializeFilterHooks;
-        {
-            InitializeFilterHooks = reinterpret_cast<InitializeFilterHooks_t>(::GetProcAddress(hDllModule, "Initialize"));
-            if (nullptr == InitializeFilterHooks)
-            {
-                std::wcout << L"GetProcAddress failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+    // A view of one action's totals, laid out like a key state table's; each key's cell shows how
+    //  heavily it's used, relative to the most used key, on a log scale: "::" for the least, up
+    //  through "-=+*#%" to "@@" for the most, and ".." for keys never used.
+    string Heatmap(const Action action)
+    {
+        static const char Ramp[] = ":-=+*#%@";
+        const auto LevelCount = sizeof(Ramp) - 1u;
+        const auto LineLength = 16u;
 
-                freeLibrary();
+        std::unique_ptr<Counters> pTotals(new Counters());
+        Snapshot(*pTotals);
+        const auto& counts = pTotals->counts[action];
 
-                return;
-            }
-        }
+        const auto maxCount = *std::max_element(std::begin(counts), std::end(counts));
+        const auto scale = (maxCount > 1u) ? static_cast<double>(LevelCount - 1u) / std::log(static_cast<double>(maxCount)) : 0.0;
 
+        string result;
+        result.reserve(CodeCount * 4u);
+        for (auto code = 0u; code < CodeCount; code++)
         {
-            const auto hr = InitializeFilterHooks(&interceptedScancodeMakes, &interceptedScancodeBreaks,
-                &interceptedVirtualKeyMakes, &interceptedVirtualKeyBreaks,
-                &api::InterceptedScancodeMakeHander, &api::InterceptedScancodeBreakHander,
-                &api::InterceptedVirtualKeyMakeHander, &api::InterceptedVirtualKeyBreakHander);
-            if (FAILED(hr))
+            if (0u == counts[code])
             {
-                std::wcout << L"InitializeFilterHooks failed" << std::endl;
-
-                assert(false);
-
-                freeLibrary();
+                result += "..";
+            }
+            else
+            {
+                // NOTE: the most used keys always get the top level; with a most of one, the scale is zero
+                const auto level = (maxCount == counts[code]) ? LevelCount - 1u :
+                    std::min(static_cast<size_t>(std::log(static_cast<double>(counts[code])) * scale + 0.5), LevelCount - 1u);
+                result.append(2u, Ramp[level]);
+            }
 
-                return;
+            if (0 == (code + 1) % LineLength)
+            {
+                result += '\n';
+            }
+            else if (0 == (code + 1) % (LineLength / 2))
+            {
+                result += " -- ";
+            }
+            else
+            {
+                result += ' ';
             }
         }
 
-        HOOKPROC pHookFunction;
-        {
-            pHookFunction = reinterpret_cast<HOOKPROC>(::GetProcAddress(hDllModule, "LowLevelKeyboardProc"));
-            if (nullptr == pHookFunction)
-            {
-                std::wcout << L"GetProcAddress failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+        result.resize(result.size() - 1); // shave off the last linefeed
+        return result;
+    }
+} // namespace usage
 
-                freeLibrary();
+namespace stream
+{
+    // The keyboard hook and raw input both report every key event, each on its own schedule: the
+    //  hook's view arrives first, and raw input follows once the hook lets the event through (an
+    //  event the hook consumes never shows up as raw input). Both run on the window's thread, so
+    //  the merge is just a correlation table; each physical key event gets one sequence number, and
+    //  one entry in the stream, whichever side (or both) saw it.
+    // NOTE: The stream is a record, not the dispatch queue. Interceptions are still dispatched from the
+    //  hook, which has to decide an event's fate before raw input exists, and listeners from raw input;
+    //  they're de-duplicated only in that both calls carry the same sequence number.
+    enum EventSource : uint8_t
+    {
+        FromHook        = 0x01u,
+        FromRawInput    = 0x02u,
+    };
 
-                return;
-            }
-        }
+    // The most recent key events, by sequence number. Exposed to the main script as keyboard.ffi.stream.
+    struct EventStream
+    {
+        uint32_t        nextSequence;
+        uint32_t        reserved;
+        KeyEventRecord  events[256];
+    };
 
-        keyboardHook.reset(::SetWindowsHookExW(WH_KEYBOARD_LL, pHookFunction, hDllModule, 0));
+    const uint32_t StreamMask = 255u;
 
-        if (!keyboardHook)
-        {
-            std::wcout << L"SetWindowsHook failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+    EventStream eventStream = {};
 
-            freeLibrary();
+    // Hook events that haven't been matched up with their raw input yet.
+    struct PendingHookEvent
+    {
+        uint32_t    sequence;
+        uint32_t    hookTime;   // KBDLLHOOKSTRUCT::time; the same for every hook callback of one key event
+        uint16_t    scancode;
+        bool        e0;
+        bool        isBreak;
+        bool        isPending;
+    };
 
-            return;
-        }
+    array<PendingHookEvent, 16u> pendingHookEvents = {};
+
+    // Raw input later than this isn't the same key event the hook saw.
+    const int64_t CorrelationWindowMilliseconds = 500;
+
+    // Merge stage measurements.
+    uint64_t    mergedEventCount = 0u;      // key events seen by both the hook and raw input
+    uint64_t    correlationTicks = 0u;      // QPC ticks spent in the merge stage
+    uint64_t    correlationCount = 0u;
+
+    inline KeyEventRecord& StreamEntry(const uint32_t sequence)
+    {
+        return eventStream.events[sequence & StreamMask];
     }
 
-    void DisableLowLevelKeyboardHook()
+    uint32_t Append(const KeyEventRecord& keyEvent)
     {
-        keyboardHook.reset();
-        // NOTE: It's not possible to unload the DLL after the hook has been made.
+        const auto sequence = eventStream.nextSequence++;
+        usage::CountKeyEvent(keyEvent);
+
+        auto& entry = StreamEntry(sequence);
+        entry = keyEvent;
+        entry.sequence = sequence;
+
+        return sequence;
     }
-} // namespace hook
 
-namespace api
-{
-    template<const char* const CodeTypename>
-    inline uint_fast16_t CheckCodeArgumentFromLua(lua_State* L, int argumentIndex)
+    class CorrelationTimer
     {
-        uint_fast16_t result;
+    public:
+        CorrelationTimer()
+            : _start(ReadTimestamp()) {}
 
-        const auto code = luaL_checkinteger(L, argumentIndex);
-        if (code < 0 || code > numeric_limits<uint16_t>::max())
+        ~CorrelationTimer()
         {
-            luaL_error(L, "%s (%p) is out of range", CodeTypename, code);
+            correlationTicks += ReadTimestamp() - _start;
+            correlationCount++;
         }
 
-        result = static_cast<uint_fast16_t>(code);
-        return result;
-    }
+    private:
+        const int64_t _start;
+    };
 
-    template<
-        typename T,
-        T& bitmap,
-        const char* const Typename,
-        const char* const MetatableTypename,
-        const char* const Luaname
-    >
-    class CodeTable
+    // Gives the hook's view of a key event its sequence number. The hook calls back once for the
+    //  virtual key, and again for the scancode, when both are intercepted; those share a sequence.
+    //  Returns false for the second of those callbacks.
+    bool MergeHookEvent(KeyEventRecord& keyEvent, const uint32_t hookTime)
     {
-    public:
+        CorrelationTimer timer;
 
-        static int SetIndex(lua_State* L)
+        keyEvent.sources = FromHook;
+
+        PendingHookEvent* pOldest = &pendingHookEvents[0];
+        for (auto& pending : pendingHookEvents)
         {
-            luaL_error(L, "%s table is not user writable", Typename); // Does a long jump; never returns.
+            if (!pending.isPending)
+            {
+                pOldest = &pending;
+                continue;
+            }
 
-            // NOTE: luaL_error() prevents this code from executing.
-            return 0;
+            if (hookTime == pending.hookTime && keyEvent.scancode == pending.scancode &&
+                (0 != keyEvent.e0) == pending.e0 && (0 != keyEvent.isBreak) == pending.isBreak) // if (another callback for the same key event)
+            {
+                const auto& entry = StreamEntry(pending.sequence);
+                keyEvent.sequence = pending.sequence;
+                keyEvent.timestamp = entry.timestamp;
+                keyEvent.repeatCount = entry.repeatCount;
+                return false;
+            }
+
+            if (pOldest->isPending && pending.sequence < pOldest->sequence)
+            {
+                pOldest = &pending;
+            }
         }
 
-        static int Index(lua_State* L)
+        keyEvent.sequence = Append(keyEvent);
+
+        // NOTE: When the table's full, the oldest pending event gets its raw input treated as a new key event.
+        pOldest->sequence = keyEvent.sequence;
+        pOldest->hookTime = hookTime;
+        pOldest->scancode = keyEvent.scancode;
+        pOldest->e0 = (0 != keyEvent.e0);
+        pOldest->isBreak = (0 != keyEvent.isBreak);
+        pOldest->isPending = true;
+
+        return true;
+    }
+
+    // Called once the hook's callbacks have decided an event's fate.
+    void CompleteHookEvent(const KeyEventRecord& keyEvent, const bool isConsumed)
+    {
+        if (!isConsumed)
         {
-            (void)luaL_checkudata(L, 1, MetatableTypename);
-            const auto code = CheckCodeArgumentFromLua<Typename>(L, 2);
+            return; // raw input is on its way
+        }
 
-            const auto isMade = IsSet(bitmap, code);
-            lua_pushboolean(L, isMade);
-            lua_replace(L, 2);
-            return 1;
+        auto& entry = StreamEntry(keyEvent.sequence);
+        if (keyEvent.sequence == entry.sequence)
+        {
+            entry.isConsumed = true;
         }
 
-        static int Length(lua_State* L)
+        for (auto& pending : pendingHookEvents)
         {
-            const auto totalBitCount = sizeof(bitmap) * 8u;
-            lua_pushinteger(L, totalBitCount);
-            return 1;
+            if (pending.isPending && keyEvent.sequence == pending.sequence)
+            {
+                pending.isPending = false;
+            }
         }
+    }
 
-        static int ToString(lua_State* L)
+    // Gives raw input its sequence number; either that of the hook event it follows, or a new one.
+    void MergeRawInputEvent(KeyEventRecord& keyEvent)
+    {
+        CorrelationTimer timer;
+
+        static const auto WindowTicks = []()
         {
-            string table;
+            LARGE_INTEGER frequency;
+            ::QueryPerformanceFrequency(&frequency);
+            return frequency.QuadPart * CorrelationWindowMilliseconds / 1000;
+        }();
 
+        PendingHookEvent* pMatch = nullptr;
+        for (auto& pending : pendingHookEvents)
+        {
+            if (!pending.isPending)
             {
-                string result;
+                continue;
+            }
 
-                const auto LineLength = 16u;
+            const auto& entry = StreamEntry(pending.sequence);
+            if (pending.sequence != entry.sequence || keyEvent.timestamp - entry.timestamp > WindowTicks) // if (stale)
+            {
+                pending.isPending = false;
+                continue;
+            }
 
-                const auto wordSize = sizeof(bitmap[0]);
-                const auto wordCount = sizeof(bitmap) / wordSize;
-                const auto wordBitCount = wordSize * 8u;
+            if (keyEvent.scancode == pending.scancode && (0 != keyEvent.e0) == pending.e0 && (0 != keyEvent.isBreak) == pending.isBreak &&
+                (nullptr == pMatch || pending.sequence < pMatch->sequence)) // the oldest match; hook events arrive in order
+            {
+                pMatch = &pending;
+            }
+        }
 
-                stringstream s;
-                s << std::hex;
+        if (nullptr == pMatch) // if (the hook didn't see this one) e.g. the hook isn't installed
+        {
+            keyEvent.sources = FromRawInput;
+            keyEvent.sequence = Append(keyEvent);
+            return;
+        }
 
-                auto key = 0u;
-                for (auto w = 0; w < wordCount; w++)
-                {
-                    const auto word = bitmap[w];
-                    for (auto b = 0; b < wordBitCount; b++, key++)
-                    {
-                        const auto isMade = 0u != (word & (0x1 << b));
-                        if (isMade)
-                        {
-                            s << key;
-                        }
-                        else
-                        {
-                            s << "..";
-                        }
+        pMatch->isPending = false;
+        mergedEventCount++;
 
-                        if (0 == (key + 1) % LineLength)
-                        {
-                            s << '\n';
-                        }
-                        else if (0 == (key + 1) % (LineLength / 2))
-                        {
-                            s << " -- ";
-                        }
-                        else
-                        {
-                            s << ' ';
-                        }
-                    }
-                }
+        // The raw input side knows the device, the E1 prefix and the repeat count; the hook side saw it first.
+        auto& entry = StreamEntry(pMatch->sequence);
+        keyEvent.sequence = entry.sequence;
+        keyEvent.timestamp = entry.timestamp;
+        keyEvent.sources = FromHook | FromRawInput;
+        entry = keyEvent;
+    }
+} // namespace stream
 
-                table = move(s.str());
-                table.resize(table.size() - 1); // shave off the last linefeed
-            }
+// Latency Tracing
+namespace trace
+{
+    // Spans of each key event's trip through UberKey, from its capture to the SendInput() calls its
+    //  callbacks make, tied together by the event's sequence number. Spans are written into a ring,
+    //  from any thread, without a lock; recording one costs a QPC read or two and an interlocked
+    //  increment, so tracing is on by default. The ring is exported on demand in Chrome's Trace Event
+    //  format, for chrome://tracing or Perfetto.
+    enum class Stage : uint8_t
+    {
+        Hook,       // the hook's callback; or, with the capture thread, until the event is queued
+        RawInput,   // a WM_INPUT message; as above
+        Queue,      // waiting in the capture queue for the main thread
+        Dispatch,   // the native handlers and callbacks of one callback table
+        Lua,        // one Lua callback; or, in Lua dispatch mode, one batch of them
+        Inject,     // one SendInput() call
+    };
 
-            lua_pushlstring(L, table.c_str(), table.length());
-            return 1;
-        }
+    const char* const StageNames[] = { "hook", "raw_input", "queue", "dispatch", "lua", "inject" };
 
-        static void CreateTable(lua_State* L)
-        {
-            static const luaL_Reg MetatableFunctions[] =
-            {
-                { "__newindex", &SetIndex },
-                { "__index", &Index },
-                { "__len", &Length },
-                { "__tostring", &ToString },
-                { nullptr, nullptr }
-            };
+    const uint32_t NoSequence = numeric_limits<uint32_t>::max();
 
-            {
-                void* v = lua_newuserdata(L, 0); // push the userdata handle onto stack
-                if (nullptr == v)
-                {
-                    throw runtime_error("failed to create a new Lua userdata object (likely caused by out-of-memory condition)");
-                }
-            }
+    // The capture thread takes key events before they have sequence numbers; what it does for one is
+    //  charged to a capture sequence number, until the main thread links the two.
+    // NOTE: Sequence numbers reach this range after two billion key events; a trace could mislink then.
+    const uint32_t FirstCaptureSequence = 0x80000000u;
 
-            {
-                const auto result = luaL_newmetatable(L, MetatableTypename); // push meta-table
-                if (0 == result)
-                {
-                    throw logic_error("failed to create a new Lua metatable, it already exists");
-                }
+    struct Span
+    {
+        int64_t     start;              // QPC
+        int64_t     end;
+        uint32_t    sequence;
+        uint32_t    threadId;
+        uint32_t    captureSequence;    // NoSequence, or the capture sequence number that's the same key event
+        Stage       stage;
+    };
 
-                luaL_register(L, nullptr, MetatableFunctions); // register meta-table functions
-            }
+    // A span in the ring; each word is atomic, so Write() can copy one while it's being written.
+    struct SpanSlot
+    {
+        std::atomic<int64_t>    start;
+        std::atomic<int64_t>    end;
+        std::atomic<uint32_t>   sequence;
+        std::atomic<uint32_t>   threadId;
+        std::atomic<uint32_t>   captureSequence;
+        std::atomic<Stage>      stage;
+    };
 
-            {
-                const auto result = lua_setmetatable(L, -2); // pop the metatable; assign the metatable to the userdata handle
-                if (0 == result)
-                {
-                    throw runtime_error("failed to set a Lua userdata object's metatable");
-                }
-            }
+    const uint32_t SpanCount = 16384u; // a couple of thousand key events
+    const uint32_t SpanMask = SpanCount - 1u;
 
-            lua_setglobal(L, Luaname); // pop the userdata handle, and add it to the global scope
-        }
-    }; // class CodeTable
+    array<SpanSlot, SpanCount> spans;
+    array<std::atomic<uint32_t>, SpanCount> stamps; // a span's index plus one; zero while it's written
+    std::atomic<uint32_t> nextSpan(0u);
+    std::atomic<bool> isEnabled(true);
 
-    enum class CodeType { VirtualKey, Scancode };
-    enum class KeyAction { Make, Break };
+    std::mutex threadNamesMutex;
+    vector<std::pair<uint32_t, const char*>> threadNames;
 
-    // Define a scancode types for Lua.
-    namespace sc
+    // The key event this thread is dispatching; SendInput() calls are charged to it.
+    thread_local uint32_t currentSequence = NoSequence;
+
+    uint32_t nextCaptureSequence = 0u; // NOTE: capture thread only
+
+    // Capture thread only.
+    inline uint32_t NewCaptureSequence()
     {
-        extern const char Typename[] = "scancode";
-        extern const char MetatableTypename[] = "UberKey.ScancodeStates";
-        extern const char Luaname[] = "scancodes";
-        extern const char MakeLatches[] = "UberKey.ScancodeMakeLatches";
-        extern const char BreakLatches[] = "UberKey.ScancodeBreakLatches";
-        extern const char MakeInterceptions[] = "UberKey.ScancodeMakeInterceptions";
-        extern const char BreakInterceptions[] = "UberKey.ScancodeBreakInterceptions";
+        return FirstCaptureSequence + (nextCaptureSequence++ % (NoSequence - FirstCaptureSequence));
+    }
 
-        using ScancodeTable = CodeTable<decltype(madeScancodes), madeVirtualKeys, Typename, MetatableTypename, Luaname>;
-    } // namespace sct
+    void Record(const Span& span)
+    {
+        if (!isEnabled.load(std::memory_order_relaxed))
+        {
+            return;
+        }
 
-    // Define a virtual key types for Lua.
-    namespace vk
+        const auto index = nextSpan.fetch_add(1u, std::memory_order_relaxed);
+        auto& stamp = stamps[index & SpanMask];
+        auto& slot = spans[index & SpanMask];
+
+        stamp.store(0u, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.start.store(span.start, std::memory_order_relaxed);
+        slot.end.store(span.end, std::memory_order_relaxed);
+        slot.sequence.store(span.sequence, std::memory_order_relaxed);
+        slot.threadId.store(span.threadId, std::memory_order_relaxed);
+        slot.captureSequence.store(span.captureSequence, std::memory_order_relaxed);
+        slot.stage.store(span.stage, std::memory_order_relaxed);
+        stamp.store(index + 1u, std::memory_order_release);
+    }
+
+    void Record(const Stage stage, const uint32_t sequence, const int64_t start, const int64_t end, const uint32_t threadId = ::GetCurrentThreadId())
     {
-        extern const char Typename[] = "virtual key";
-        extern const char MetatableTypename[] = "UberKey.VirtualKeyStates";
-        extern const char Luaname[] = "virtual_keys";
-        extern const char MakeLatches[] = "UberKey.VirtualKeyMakeLatches";
-        extern const char BreakLatches[] = "UberKey.VirtualKeyBreakLatches";
-        extern const char MakeInterceptions[] = "UberKey.VirtualKeyMakeInterceptions";
-        extern const char BreakInterceptions[] = "UberKey.VirtualKeyBreakInterceptions";
+        const Span span = { start, end, sequence, threadId, NoSequence, stage };
+        Record(span);
+    }
 
-        using VirtualKeyTable = CodeTable<decltype(madeVirtualKeys), madeVirtualKeys, Typename, MetatableTypename, Luaname>;
-    } // namespace vkt
+    // Records a span from construction to destruction.
+    class Scope
+    {
+    public:
+        Scope(const Stage stage, const uint32_t sequence)
+            : _start(ReadTimestamp())
+            , _sequence(sequence)
+            , _stage(stage) {}
+
+        ~Scope()
+        {
+            Record(_stage, _sequence, _start, ReadTimestamp());
+        }
+
+    private:
+        const int64_t   _start;
+        const uint32_t  _sequence;
+        const Stage     _stage;
+    };
 
-    template<CodeType useCode, const char* const CallbackTablename>
-    void KeyCallbackHandler(lua_State* L, uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool e1, uint_fast32_t extraInformation)
+    // Charges this thread's SendInput() calls to a key event, until destruction.
+    class SequenceScope
     {
-        lua_pushstring(L, CallbackTablename); // push the callback table's name
-        lua_rawget(L, LUA_REGISTRYINDEX); // pop table name; push callback table
+    public:
+        explicit SequenceScope(const uint32_t sequence)
+            : _previous(currentSequence)
+        {
+            currentSequence = sequence;
+        }
+
+        ~SequenceScope()
+        {
+            currentSequence = _previous;
+        }
+
+    private:
+        const uint32_t _previous;
+    };
 
-        assert(lua_istable(L, lua_gettop(L)));
+    // ::SendInput(), traced.
+    UINT SendInput(const UINT count, LPINPUT pInputs, const int size)
+    {
+        const auto start = ReadTimestamp();
+        const auto result = ::SendInput(count, pInputs, size);
+        Record(Stage::Inject, currentSequence, start, ReadTimestamp());
+        return result;
+    }
 
-        lua_rawgeti(L, -1, (useCode == CodeType::VirtualKey) ? virtualKey : scancode); // push callback function
+    // Names the calling thread in exported traces.
+    void NameThread(const char* const name)
+    {
+        const auto threadId = static_cast<uint32_t>(::GetCurrentThreadId());
 
-        assert(lua_isfunction(L, -1));
+        std::lock_guard<std::mutex> lock(threadNamesMutex);
+        for (auto& thread : threadNames)
+        {
+            if (threadId == thread.first) // if (a thread id that's been reused)
+            {
+                thread.second = name;
+                return;
+            }
+        }
+        threadNames.emplace_back(threadId, name);
+    }
 
-        lua_replace(L, -2); // overwrite the callback table with the callback function; NOTE: not required, just frees a stack position
+    // Writes the spans still in the ring as a Chrome trace; each span is a complete event, and the
+    //  spans of one key event are linked by a flow. Returns the number of spans written.
+    size_t Write(std::ostream& out)
+    {
+        vector<Span> copies;
+        copies.reserve(SpanCount);
 
-        // push the callback function default parameters, starting with the virtual key code
-        lua_pushinteger(L, virtualKey);
-        lua_pushinteger(L, scancode);
-        lua_pushboolean(L, e0);
-        lua_pushboolean(L, e1);
-        lua_pushinteger(L, extraInformation);
+        const auto next = nextSpan.load(std::memory_order_acquire);
+        for (auto index = (next > SpanCount) ? next - SpanCount : 0u; index != next; index++)
+        {
+            // NOTE: A span that's written meanwhile, or that was never finished, is skipped.
+            const auto stamp = stamps[index & SpanMask].load(std::memory_order_acquire);
+            const auto& slot = spans[index & SpanMask];
+            Span span;
+            span.start = slot.start.load(std::memory_order_relaxed);
+            span.end = slot.end.load(std::memory_order_relaxed);
+            span.sequence = slot.sequence.load(std::memory_order_relaxed);
+            span.threadId = slot.threadId.load(std::memory_order_relaxed);
+            span.captureSequence = slot.captureSequence.load(std::memory_order_relaxed);
+            span.stage = slot.stage.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (index + 1u == stamp && stamp == stamps[index & SpanMask].load(std::memory_order_relaxed))
+            {
+                copies.push_back(span);
+            }
+        }
 
-        // Do callback(virtualKey, scancode, e0, e1, extraInformation)
+        // The capture thread's spans join their key events; those whose link was overwritten stay apart.
+        unordered_map<uint32_t, uint32_t> captureSequences; // the sequence numbers, by capture sequence number
+        for (const auto& span : copies)
         {
-            const auto result = lua_pcall(L, 5, 0, 0);
+            if (NoSequence != span.captureSequence)
+            {
+                captureSequences[span.captureSequence] = span.sequence;
+            }
+        }
+        for (auto& span : copies)
+        {
+            const auto link = captureSequences.find(span.sequence);
+            if (captureSequences.end() != link)
+            {
+                span.sequence = link->second;
+            }
+        }
+
+        std::sort(copies.begin(), copies.end(), [](const Span& a, const Span& b) { return a.start < b.start; });
 
-            if (LUA_ERRRUN == result)
+        unordered_map<uint32_t, uint32_t> remainingSpans; // by sequence; for the flow's end
+        for (const auto& span : copies)
+        {
+            if (NoSequence != span.sequence)
             {
-                std::wcout << "Lua runtime error." << std::endl;
+                remainingSpans[span.sequence]++;
             }
-            else if (LUA_ERRMEM == result)
+        }
+
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceFrequency(&frequency);
+        const auto base = copies.empty() ? 0 : copies.front().start;
+        const auto ToMicroseconds = [&](const int64_t ticks) { return static_cast<double>(ticks) * 1e6 / static_cast<double>(frequency.QuadPart); };
+        const auto pid = ::GetCurrentProcessId();
+
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        out << std::fixed;
+        out.precision(3);
+
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << luaThreadId << ",\"args\":{\"name\":\"main\"}}";
+        {
+            std::lock_guard<std::mutex> lock(threadNamesMutex);
+            for (const auto& thread : threadNames)
             {
-                std::wcout << "Lua memory allocation error." << std::endl;
+                out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread.first << ",\"args\":{\"name\":\"" << thread.second << "\"}}";
             }
-            else if (LUA_ERRERR == result)
+        }
+
+        unordered_map<uint32_t, bool> isFlowStarted;
+        for (const auto& span : copies)
+        {
+            const auto ts = ToMicroseconds(span.start - base);
+
+            out << ",\n{\"name\":\"" << StageNames[static_cast<size_t>(span.stage)] << "\",\"cat\":\"input\",\"ph\":\"X\",\"ts\":" << ts <<
+                ",\"dur\":" << ToMicroseconds(span.end - span.start) << ",\"pid\":" << pid << ",\"tid\":" << span.threadId;
+            if (NoSequence == span.sequence)
             {
-                std::wcout << "Lua error while running the error handler function." << std::endl;
+                out << '}';
+                continue;
             }
-            else if (0 != result)
+            out << ",\"args\":{\"sequence\":" << span.sequence << "}}";
+
+            const auto remaining = --remainingSpans[span.sequence];
+            auto& isStarted = isFlowStarted[span.sequence];
+            if (0u == remaining && !isStarted) // if (the key event's only span)
             {
-                std::wcout << "Lua unknown error." << std::endl;
+                continue;
             }
+
+            const auto phase = !isStarted ? 's' : ((0u == remaining) ? 'f' : 't');
+            isStarted = true;
+            out << ",\n{\"name\":\"key event\",\"cat\":\"input\",\"ph\":\"" << phase << "\",\"bp\":\"e\",\"id\":" << span.sequence <<
+                ",\"ts\":" << ts << ",\"pid\":" << pid << ",\"tid\":" << span.threadId << '}';
         }
+
+        out << "\n]}\n";
+        return copies.size();
+    }
+} // namespace trace
+
+// Publishes the key state to other processes, through a named shared memory segment written with a
+//  seqlock; see UberKeyShared.h.
+namespace shared
+{
+    HANDLE mapping = nullptr;
+    uberkey_shared_segment* pSegment = nullptr;
+    uberkey_key_state state = {}; // what was last published
+
+    static_assert(sizeof(uberkey_key_state().made_scancodes) == sizeof(KeyMap), "uberkey_key_state no longer matches KeyMap");
+
+    inline void CopyKeyMaps()
+    {
+        ::memcpy(state.made_scancodes, madeScancodes, sizeof(KeyMap));
+        ::memcpy(state.made_virtual_keys, madeVirtualKeys, sizeof(KeyMap));
+        ::memcpy(state.intercepted_scancode_makes, interceptedScancodeMakes, sizeof(KeyMap));
+        ::memcpy(state.intercepted_scancode_breaks, interceptedScancodeBreaks, sizeof(KeyMap));
+        ::memcpy(state.intercepted_virtual_key_makes, interceptedVirtualKeyMakes, sizeof(KeyMap));
+        ::memcpy(state.intercepted_virtual_key_breaks, interceptedVirtualKeyBreaks, sizeof(KeyMap));
     }
 
-    void InterceptedVirtualKeyMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation)
+    // Publishes the key maps along with the key event that changed them.
+    // NOTE: Only call on the thread that pumps the window's messages; the segment has one writer.
+    inline void Publish(const KeyEventRecord& keyEvent)
     {
-        if (nullptr == luaState)
+        if (nullptr == pSegment)
         {
             return;
         }
-        KeyCallbackHandler<CodeType::VirtualKey, vk::MakeInterceptions>(luaState, virtualKey, scancode, e0, false, extraInformation);
+        assert(luaThreadId == ::GetCurrentThreadId());
+
+        state.event_sequence = keyEvent.sequence;
+        state.event_timestamp = keyEvent.timestamp;
+        CopyKeyMaps();
+        uberkey_write_state(*pSegment, state);
     }
 
-    void InterceptedVirtualKeyBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation)
+    // Publishes the key maps after a binding changed them. Device scripts' binding changes are applied,
+    //  and published, on the main thread too; see api::ApplyBindingChanges().
+    // NOTE: Only call on the thread that pumps the window's messages; the segment has one writer.
+    inline void PublishKeyMaps()
     {
-        if (nullptr == luaState)
+        if (nullptr == pSegment)
         {
             return;
         }
-        KeyCallbackHandler<CodeType::VirtualKey, vk::BreakInterceptions>(luaState, virtualKey, scancode, e0, false, extraInformation);
+        assert(luaThreadId == ::GetCurrentThreadId());
+
+        CopyKeyMaps();
+        uberkey_write_state(*pSegment, state);
     }
 
-    void InterceptedScancodeMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation)
+    void Create()
     {
-        if (nullptr == luaState)
+        mapping = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(uberkey_shared_segment), UBERKEY_SHARED_NAME);
+        if (nullptr == mapping)
+        {
+            std::wcout << L"Failed to create the shared key state." << std::endl;
+            return;
+        }
+        if (ERROR_ALREADY_EXISTS == ::GetLastError()) // if (another UberKey is publishing)
+        {
+            std::wcout << L"The shared key state is already published by another process." << std::endl;
+            ::CloseHandle(mapping);
+            mapping = nullptr;
+            return;
+        }
+
+        pSegment = static_cast<uberkey_shared_segment*>(::MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(uberkey_shared_segment)));
+        if (nullptr == pSegment)
         {
+            ::CloseHandle(mapping);
+            mapping = nullptr;
             return;
         }
-        KeyCallbackHandler<CodeType::Scancode, sc::MakeInterceptions>(luaState, virtualKey, scancode, e0, false, extraInformation);
+
+        pSegment->writer_process_id = ::GetCurrentProcessId();
+        pSegment->version = UBERKEY_SHARED_VERSION;
+        std::atomic_thread_fence(std::memory_order_release);
+        pSegment->magic = UBERKEY_SHARED_MAGIC; // NOTE: written last; readers check it
     }
 
-    void InterceptedScancodeBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, uint_fast32_t extraInformation)
+    void Destroy()
     {
-        if (nullptr == luaState)
+        if (nullptr != pSegment)
         {
-            return;
+            ::UnmapViewOfFile(pSegment);
+            pSegment = nullptr;
+        }
+        if (nullptr != mapping)
+        {
+            ::CloseHandle(mapping);
+            mapping = nullptr;
         }
-        KeyCallbackHandler<CodeType::Scancode, sc::BreakInterceptions>(luaState, virtualKey, scancode, e0, false, extraInformation);
     }
+} // namespace shared
 
-    template<KeyMap& keyMap, const char* const CallbackTablename, const char* const Typename>
-    int SetKeyCallback(lua_State* L)
+// Device Scripts
+namespace scripts
+{
+    // The key state a device script sees. The input thread publishes a copy along with each event.
+    struct KeyStateSnapshot
     {
-        // Argument checking
-        if (lua_gettop(L) < 2) // if (there are less than 2 Lua arguments passed to this function)
+        KeyMap madeScancodes;       // any device
+        KeyMap madeVirtualKeys;     // any device
+        KeyMap deviceScancodes;     // the script's own device
+        KeyMap deviceVirtualKeys;   // the script's own device
+    };
+
+    struct QueuedKeyEvent
+    {
+        const char*         callbackTablename;
+        bool                isVirtualKeyCallback;
+        KeyEventRecord      keyEvent;
+        KeyStateSnapshot    keyState;
+    };
+
+    // Runs a script file in its own Lua state, on its own thread, for the key events of one device.
+    class DeviceScript final
+    {
+    public:
+        DeviceScript(const uint_fast8_t device, const wstring& fileName)
+            : _device(device)
+            , _fileName(fileName)
+            , _keyState()
+            , _queueHead(0u)
+            , _queueCount(0u)
+            , _droppedEventCount(0u)
+            , _isStopping(false)
+            , _thread(&DeviceScript::Run, this)
         {
-            luaL_error(L, "not enough arguments; ([integer] %s, [function] callback)", Typename);
         }
 
-        const auto code = CheckCodeArgumentFromLua<Typename>(L, 1);
-        luaL_checktype(L, 2, LUA_TFUNCTION);
+        ~DeviceScript()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _isStopping = true;
+            }
+            _eventReady.notify_one();
+            _thread.join();
+        }
 
-        // Add function to callback table.
-        Set(keyMap, code);
+        // Hands an event to the script's thread. Returns false if the queue was full, and the event dropped.
+        bool Enqueue(const QueuedKeyEvent& keyEvent)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (QueueLength == _queueCount)
+                {
+                    _droppedEventCount++;
+                    return false;
+                }
 
-        lua_pushstring(L, CallbackTablename); // push the name of the callback table
-        lua_rawget(L, LUA_REGISTRYINDEX); // pop table name; push callback table
+                _queue[(_queueHead + _queueCount) % QueueLength] = keyEvent;
+                _queueCount++;
+            }
+            _eventReady.notify_one();
+            return true;
+        }
 
-        lua_replace(L, 1); // pop the callback table and move it over the key code argument on the stack
+        uint_fast8_t device() const { return _device; }
+        const wstring& fileName() const { return _fileName; }
+        uint_fast32_t droppedEventCount() const { return _droppedEventCount; }
 
-        lua_rawseti(L, 1, code); // callbacks[code] = argv[2]; pop callback
+        // NOTE: Only meaningful on the script's own thread.
+        const KeyStateSnapshot& keyState() const { return _keyState; }
 
-        assert(lua_gettop(L) == 1);
-        // NOTE: let Lua clean the callback table off the stack
+    private:
+        static const size_t QueueLength = 256u;
 
-        return 0;
-    }
+        const uint_fast8_t      _device;
+        const wstring           _fileName;
+        KeyStateSnapshot        _keyState;
 
-    template<KeyMap& keyMap, const char* const CallbackTablename, const char* const Typename>
-    int ClearKeyCallback(lua_State* L)
+        array<QueuedKeyEvent, QueueLength> _queue;
+        size_t                  _queueHead;
+        size_t                  _queueCount;
+        uint_fast32_t           _droppedEventCount;
+        bool                    _isStopping;
+        std::mutex              _mutex;
+        std::condition_variable _eventReady;
+        std::thread             _thread; // NOTE: must be constructed last
+
+        void Run();
+
+        DeviceScript(const DeviceScript&) = delete;
+        DeviceScript& operator =(const DeviceScript&) = delete;
+    };
+
+    array<std::unique_ptr<DeviceScript>, devices::MaxDeviceCount> deviceScripts;
+
+    // Replaces, or with nullptr stops, a device's script. The old script is stopped outside the lock,
+    //  since its thread may be waiting on it.
+    // NOTE: Main thread only.
+    void SetDeviceScript(const uint_fast8_t device, DeviceScript* pScript)
     {
-        // Argument checking
-        if (lua_gettop(L) < 1) // if (no arguments passed to this function)
+        std::unique_ptr<DeviceScript> pOldScript(pScript);
         {
-            luaL_error(L, "not enough arguments; ([integer] %s)", Typename);
+            std::lock_guard<std::mutex> lock(devices::identityMutex);
+            pOldScript.swap(deviceScripts[device]);
         }
+        pOldScript.reset(); // joins the old script's thread
+    }
 
-        const auto code = CheckCodeArgumentFromLua<Typename>(L, 1);
+    // Registry entry that marks a Lua state as belonging to a device script.
+    extern const char ContextName[] = "UberKey.DeviceScript";
 
-        // Remove function from callback table.
-        Clear(keyMap, code);
+    // Returns nullptr for the main script's Lua state.
+    DeviceScript* FindDeviceScript(lua_State* L)
+    {
+        lua_getfield(L, LUA_REGISTRYINDEX, ContextName);
+        const auto pScript = static_cast<DeviceScript*>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return pScript;
+    }
 
-        lua_pushstring(L, CallbackTablename); // push the name of the callback table
-        lua_rawget(L, LUA_REGISTRYINDEX); // pop table name; push callback table
+    bool EnqueueKeyEvent(const char* const callbackTablename, const bool isVirtualKeyCallback, const KeyEventRecord& keyEvent)
+    {
+        const auto& keyboard = devices::keyboardDevices[keyEvent.device];
+
+        QueuedKeyEvent queuedEvent;
+        queuedEvent.callbackTablename = callbackTablename;
+        queuedEvent.isVirtualKeyCallback = isVirtualKeyCallback;
+        queuedEvent.keyEvent = keyEvent;
+        ::memcpy(queuedEvent.keyState.madeScancodes, madeScancodes, sizeof(KeyMap));
+        ::memcpy(queuedEvent.keyState.madeVirtualKeys, madeVirtualKeys, sizeof(KeyMap));
+        ::memcpy(queuedEvent.keyState.deviceScancodes, keyboard.madeScancodes, sizeof(KeyMap));
+        ::memcpy(queuedEvent.keyState.deviceVirtualKeys, keyboard.madeVirtualKeys, sizeof(KeyMap));
+
+        return deviceScripts[keyEvent.device]->Enqueue(queuedEvent);
+    }
+} // namespace scripts
 
-        lua_replace(L, 1); // pop the callback table and move it over the key code argument on the stack
+// Runs the main script's garbage collector in the message loop's idle time, rather than whenever an
+//  allocation inside a key callback tips it over.
+namespace collector
+{
+    IdleCollector idle;
+} // namespace collector
 
-        lua_pushnil(L); // push nil to delete any Lua callback
-        lua_rawseti(L, 1, code); // callbacks[code] = nil; pop nil
+// Counts each Lua state's allocations, and holds it to a memory limit. LuaJIT 2.0 only accepts a custom
+//  allocator in 32-bit builds; 64-bit builds sample the collector's count after each callback instead.
+namespace memory
+{
+    struct MemoryAccount
+    {
+        size_t      limit;              // bytes; zero for no limit
+        size_t      inUse;
+        size_t      peak;
+        uint64_t    allocatedBytes;     // every byte allocated, including growth by reallocation
+        uint64_t    allocationCount;
+        uint64_t    refusedCount;       // allocations refused for the limit
+    };
 
-        assert(lua_gettop(L) == 1);
-        // NOTE: letting Lua clean the callback table off the stack
+    struct CallbackAllocation
+    {
+        uint64_t    callCount;
+        uint64_t    allocatingCallCount;
+        uint64_t    totalBytes;
+        uint64_t    maxBytes;
+    };
 
-        return 0;
-    }
+    // Allocations by callback table name, and callback index. Per thread, like the Lua states.
+    thread_local unordered_map<const char*, unordered_map<lua_Integer, CallbackAllocation>> callbackAllocations;
 
-    void CreateCallbackTables(lua_State* L)
-    {
-        // Create tables in the Lua registery for tracking latch callbacks
-        lua_pushstring(L, sc::MakeLatches); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+    // Used when there's no account; per thread, like the Lua states.
+    thread_local size_t sampledLimit = 0u;
+    thread_local size_t sampledPeak = 0u;
+    thread_local uint64_t sampledOverLimitCount = 0u;
 
-        lua_pushstring(L, sc::BreakLatches); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+    // Set by a callback that ran into the limit, or went over it. The collection is left to the thread's
+    //  idle time; a full collection on the key path would hold up the key event.
+    thread_local bool isCollectionPending = false;
 
-        lua_pushstring(L, vk::MakeLatches); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+    void* AccountingAllocator(void* ud, void* ptr, size_t osize, size_t nsize)
+    {
+        auto& account = *static_cast<MemoryAccount*>(ud);
+        const auto oldSize = (nullptr != ptr) ? osize : 0u;
 
-        lua_pushstring(L, vk::BreakLatches); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+        if (0u == nsize)
+        {
+            account.inUse -= oldSize;
+            ::free(ptr);
+            return nullptr;
+        }
 
-        // Create tables in the Lua registery for tracking latch callbacks
-        lua_pushstring(L, sc::MakeInterceptions); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+        // NOTE: Lua expects shrinking a block to always succeed.
+        if (nsize > oldSize && 0u != account.limit && account.inUse - oldSize + nsize > account.limit)
+        {
+            account.refusedCount++;
+            return nullptr;
+        }
 
-        lua_pushstring(L, sc::BreakInterceptions); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+        const auto p = ::realloc(ptr, nsize);
+        if (nullptr == p)
+        {
+            return nullptr;
+        }
 
-        lua_pushstring(L, vk::MakeInterceptions); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+        account.inUse = account.inUse - oldSize + nsize;
+        if (account.inUse > account.peak)
+        {
+            account.peak = account.inUse;
+        }
+        if (nsize > oldSize)
+        {
+            account.allocatedBytes += nsize - oldSize;
+            account.allocationCount++;
+        }
 
-        lua_pushstring(L, vk::BreakInterceptions); // push callback table name
-        lua_createtable(L, 256, 0); // push callback table
-        lua_rawset(L, LUA_REGISTRYINDEX); // pop the callback table; pop the table name
+        return p;
     }
 
-    uint_fast16_t VirtualKeyToScancode(uint_fast16_t virtualKey)
+    int Panic(lua_State* L)
     {
-        const auto result = ::MapVirtualKeyW(virtualKey, MAPVK_VK_TO_VSC);
-        return static_cast<uint_fast16_t>(result);
-    }
-
-    uint_fast16_t ScancodeToVirtualKey(uint_fast16_t scancode)
-    {
-        // NOTE: Even using the MAPVK_VSC_TO_VK_EX flag to convert the enhanced scancodes to
-        // virtual keys that distinguish left and right, it turns out that the SendInput() API will
-        // end up down-casting them to the generic virtual key codes anyway.
-        const auto result = ::MapVirtualKeyW(scancode, MAPVK_VSC_TO_VK_EX);
-        return static_cast<uint_fast16_t>(result);
+        std::wcout << "PANIC: unprotected error in call to Lua API (" << lua_tostring(L, -1) << ")" << std::endl;
+        return 0;
     }
 
-    template< const char* const Typename, CodeType codeType, KeyAction keyAction >
-    int SendKey(lua_State* L)
+    lua_State* NewState()
     {
-        const auto argc = lua_gettop(L);
+#if defined(_WIN64)
+        return luaL_newstate(); // NOTE: LuaJIT 2.0's lua_newstate() fails in 64-bit builds
+#else
+        std::unique_ptr<MemoryAccount> pAccount(new MemoryAccount());
 
-        if (argc < 1)
+        const auto L = lua_newstate(&AccountingAllocator, pAccount.get());
+        if (nullptr != L)
         {
-            luaL_error(L, "not enough arguments; ([integer], [[integer]])");
+            lua_atpanic(L, &Panic);
+            (void)pAccount.release(); // NOTE: freed by CloseState()
         }
 
-        const auto extendedCode = CheckCodeArgumentFromLua<sc::Typename>(L, 1);
-        const auto code = (argc >= 2) ? CheckCodeArgumentFromLua<Typename>(L, 2) : CheckCodeArgumentFromLua<Typename>(L, 1);
+        return L;
+#endif
+    }
 
-        // TODO: decide if this needs to be here
-        //if (CodeType::VirtualKey == codeType && (code < 1 || code > 254))
-        //{
-        //    luaL_error(L, "argument out-of-range; virtual key must be in the range of 1 to 254");
-        //}
+    // Returns nullptr when the state uses LuaJIT's own allocator.
+    MemoryAccount* FindAccount(lua_State* L)
+    {
+        void* ud = nullptr;
+        return (&AccountingAllocator == lua_getallocf(L, &ud)) ? static_cast<MemoryAccount*>(ud) : nullptr;
+    }
 
-        INPUT input;
-        input.type = INPUT_KEYBOARD;
-        auto& ki = input.ki;
+    void CloseState(lua_State* L)
+    {
+        const auto pAccount = FindAccount(L);
+        lua_close(L);
+        delete pAccount;
+    }
 
-        ki.wVk = static_cast<WORD>((CodeType::VirtualKey == codeType) ? code : ScancodeToVirtualKey((extendedCode << 8) | code));
-        ki.wScan = static_cast<WORD>((CodeType::Scancode == codeType) ? code : VirtualKeyToScancode(code));
-        ki.dwFlags = ((0xe0 == extendedCode) ? KEYEVENTF_EXTENDEDKEY : 0u) | ((KeyAction::Make == keyAction) ? 0u : KEYEVENTF_KEYUP) | 
-            ((CodeType::Scancode == codeType) ? KEYEVENTF_SCANCODE : 0u);
-        ki.time = 0u;
-        ki.dwExtraInfo = 0u;
+    inline size_t InUse(lua_State* L)
+    {
+        return static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024u + lua_gc(L, LUA_GCCOUNTB, 0);
+    }
 
-        const auto result = ::SendInput(1, &input, sizeof(input));
-        if (0 == result)
+    // Without an account, the bytes in use; which only grows between collections.
+    inline uint64_t AllocatedBytes(lua_State* L)
+    {
+        const auto pAccount = FindAccount(L);
+        return (nullptr != pAccount) ? pAccount->allocatedBytes : InUse(L);
+    }
+
+    void SetLimit(lua_State* L, const size_t limit)
+    {
+        const auto pAccount = FindAccount(L);
+        if (nullptr != pAccount)
         {
-            std::wcout << L"failed to send input -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            pAccount->limit = limit;
+        }
+        else
+        {
+            sampledLimit = limit;
         }
-
-        // letting Lua clean the stack
-
-        return 0;
     }
 
-    array<INPUT, 32u> inputBuffer; // NOTE: The size of this array needs to be an even number.
-
-    int SendKeys(lua_State* L)
+    // Makes room after a callback that ran into the limit, or, without an account, went over it.
+    void CollectOverLimit(lua_State* L)
     {
-        const auto argc = lua_gettop(L);
+        isCollectionPending = false;
+        lua_gc(L, LUA_GCCOLLECT, 0);
 
-        for (auto argi = 0; argi < argc;)
+        if (L == luaState && IdleCollector::Mode::Idle == collector::idle.mode())
         {
-            UINT ui = 0u;
-
-            for (; ui < inputBuffer.size() && argi < argc; ui++, argi++)
-            {
-                const auto virtualKey = static_cast<WORD>(CheckCodeArgumentFromLua<vk::Typename>(L, argi + 1));
-                const auto scancode = static_cast<WORD>(VirtualKeyToScancode(virtualKey));
-
-                inputBuffer[ui].type = INPUT_KEYBOARD;
-                auto& kiMake = inputBuffer[ui].ki;
-
-                kiMake.wVk = virtualKey;
-                kiMake.wScan = scancode;
-                kiMake.dwFlags = 0u;
-                kiMake.time = 0u;
-                kiMake.dwExtraInfo = 0u;
-
-                ui++;
-
-                inputBuffer[ui].type = INPUT_KEYBOARD;
-                auto& kiBreak = inputBuffer[ui].ki;
-
-                kiBreak.wVk = virtualKey;
-                kiBreak.wScan = scancode;
-                kiBreak.dwFlags = KEYEVENTF_KEYUP;
-                kiBreak.time = 0u;
-                kiBreak.dwExtraInfo = 0u;
-            }
+            collector::idle.SetMode(L, collector::idle.mode()); // NOTE: a full collection re-arms the automatic collector
+        }
 
-            const auto result = ::SendInput(ui, &inputBuffer[0], sizeof(inputBuffer[0]));
-            if (0 == result)
+        if (nullptr == FindAccount(L) && 0u != sampledLimit && InUse(L) > sampledLimit) // if (it's not garbage)
+        {
+            if (0u == sampledOverLimitCount++)
             {
-                std::wcout << L"failed to send input -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+                std::wcout << "Lua memory limit exceeded." << std::endl;
             }
         }
-
-        // letting Lua clean the stack
-
-        return 0;
     }
 
-    array<WCHAR, 2048u> unicodeOutput;
+    // Call between key events, on the Lua state's own thread.
+    void RunPendingCollection(lua_State* L)
+    {
+        if (isCollectionPending)
+        {
+            CollectOverLimit(L);
+        }
+    }
 
-    // This function checks and flushes the input buffer if full.
-    struct CheckFlushInputBuffer
+    // Charges the bytes a callback allocated to it.
+    void AccountForCallback(lua_State* L, const char* const callbackTablename, lua_Integer callbackIndex, const uint64_t allocatedBefore, const int result)
     {
-        CheckFlushInputBuffer(UINT& inputBufferIndex)
-            : _inputBufferIndex(inputBufferIndex) {}
+        const auto allocatedAfter = AllocatedBytes(L);
+        const auto bytes = (allocatedAfter > allocatedBefore) ? allocatedAfter - allocatedBefore : 0u;
 
-        void operator()(bool forceFlush = false)
+        auto& allocation = callbackAllocations[callbackTablename][callbackIndex];
+        allocation.callCount++;
+        if (0u != bytes)
         {
-            if (0 == _inputBufferIndex)
-            {
-                return;
-            }
+            allocation.allocatingCallCount++;
+            allocation.totalBytes += bytes;
+            allocation.maxBytes = max(allocation.maxBytes, bytes);
+        }
 
-            if (_inputBufferIndex < inputBuffer.size() && !forceFlush)
+        if (nullptr != FindAccount(L))
+        {
+            if (LUA_ERRMEM == result)
             {
-                return;
+                isCollectionPending = true;
             }
+            return;
+        }
 
-            const auto result = ::SendInput(_inputBufferIndex, &inputBuffer[0], sizeof(inputBuffer[0]));
-
-            if (0 == result)
-            {
-                std::wcout << L"failed to send artificial keyboard input -- error code: 0x" <<
-                    std::hex << ::GetLastError() << std::dec << std::endl;
-            }
+        // NOTE: Without an account (64-bit builds), the limit is only checked here, by sampling the count
+        //  after the callback; any collection waits for RunPendingCollection().
+        const auto inUse = InUse(L);
+        sampledPeak = max(sampledPeak, inUse);
 
-            _inputBufferIndex = 0u;
+        if (0u != sampledLimit && inUse > sampledLimit)
+        {
+            isCollectionPending = true;
         }
+    }
 
-    private:
-        UINT& _inputBufferIndex;
-    };
-
-    struct VirtualKeyRecordWriter
+    void ForgetCallback(const char* const callbackTablename, lua_Integer callbackIndex)
     {
-        VirtualKeyRecordWriter(UINT& inputBufferIndex)
-            : _inputBufferIndex(inputBufferIndex) {}
-
-        template< KeyAction keyAction >
-        void WriteVirtualKey(uint_fast16_t virtualKey)
+        const auto found = callbackAllocations.find(callbackTablename);
+        if (callbackAllocations.end() != found)
         {
-            inputBuffer[_inputBufferIndex].type = INPUT_KEYBOARD;
-            auto& ki = inputBuffer[_inputBufferIndex].ki;
+            found->second.erase(callbackIndex);
+        }
+    }
+} // namespace memory
 
-            const auto scancode = static_cast<WORD>(VirtualKeyToScancode(virtualKey));
+///////////////////////////////////////////////
 
-            ki.wVk = static_cast<WORD>(virtualKey);
-            ki.wScan = scancode;
-            ki.dwFlags = (KeyAction::Make == keyAction) ? 0u : KEYEVENTF_KEYUP;
-            ki.time = 0u;
-            ki.dwExtraInfo = 0u;
+wstring GetProgramExecutablePath()
+{
+    vector<wchar_t> buffer(MAX_PATH);
 
-            _inputBufferIndex++;
+    for (int i = 0; i < 5; i++)
+    {
+        const auto length = ::GetModuleFileNameW(nullptr, &buffer[0], static_cast<DWORD>(buffer.size()));
+        if (0 == length)
+        {
+            throw exception("failed to get a path to this program's executable");
         }
-
-        template< KeyAction keyAction, uint_fast16_t virtualKey >
-        void WriteVirtualKey()
+        else if (buffer.size() == length && ERROR_INSUFFICIENT_BUFFER == ::GetLastError())
         {
-            inputBuffer[_inputBufferIndex].type = INPUT_KEYBOARD;
-            auto& ki = inputBuffer[_inputBufferIndex].ki;
-
-            const auto scancode = static_cast<WORD>(VirtualKeyToScancode(virtualKey));
-
-            ki.wVk = virtualKey;
-            ki.wScan = scancode;
-            ki.dwFlags = (KeyAction::Make == keyAction) ? 0u : KEYEVENTF_KEYUP;
-            ki.time = 0u;
-            ki.dwExtraInfo = 0u;
-
-            _inputBufferIndex++;
+            buffer.resize(buffer.size() * 2);
+            continue;
         }
 
-    private:
-        UINT& _inputBufferIndex;
-    };
+        wstring result(&buffer[0], &buffer[length]);
 
-    struct CheckSetModifier
-    {
-        CheckSetModifier(VirtualKeyRecordWriter& virtualKeyBuffer, CheckFlushInputBuffer& checkFlushInputBuffer)
-            : _vkbuf(virtualKeyBuffer), _CheckFlushVirtualKeys(checkFlushInputBuffer) {}
+        auto bsi = result.find_last_of(L'\\');
+        result.resize(bsi + 1);
 
-        template< uint_fast16_t virtualKey >
-        void CheckSet(bool modifierKey, bool& currentModifierKeyState)
-        {
-            if (modifierKey != currentModifierKeyState)
-            {
-                if (currentModifierKeyState)
-                {
-                    // break virtual key
-                    _vkbuf.WriteVirtualKey<KeyAction::Break, virtualKey>();
-                }
-                else
-                {
-                    // make virtual key
-                    _vkbuf.WriteVirtualKey<KeyAction::Make, virtualKey>();
-                }
+        return result;
+    }
 
-                currentModifierKeyState = !currentModifierKeyState;
+    throw exception("failed to get a reasonable path to this program's executable");
+}
 
-                // if (that fills the input buffer) send and restart
-                _CheckFlushVirtualKeys();
-            }
-        }
+const char* LuaReader(lua_State* L, void* data, size_t* size)
+{
+    UNREFERENCED_PARAMETER(L);
 
-    private:
-        VirtualKeyRecordWriter& _vkbuf;
-        CheckFlushInputBuffer& _CheckFlushVirtualKeys;
-    };
+    auto& source = *static_cast<LuaScriptSource*>(data);
 
-    struct Utf8To16Converter
+    bool isEof = false;
+
+    if (source.buffer.empty())
     {
-        Utf8To16Converter(const char* str, size_t length)
-            : _str(str)
-            , _strLength(length)
-            , _offset(0)
-            , _maxOutputLength(unicodeOutput.size() / 3) {}
+        isEof = true;
+    }
+    else if (source.readPos >= source.buffer.size())
+    {
+        source.buffer.clear();
+        isEof = true;
+    }
 
-        // Returns count of characters convertered.
-        int operator()()
+    if (isEof)
+    {
+        if (nullptr != size)
         {
-            int result; // characters converted
+            *size = 0u;
+        }
+        return nullptr;
+    }
 
-            if (_offset == _strLength)
-            {
-                return 0;
-            }
+    if (nullptr == size)
+    {
+        return nullptr;
+    }
 
-            int length = static_cast<int>(min(_maxOutputLength, _strLength - _offset));
-            int insufficientBufferRetries = 3;
+    const auto pos = source.readPos;
 
-            // Adjust length so that it falls between code points.
-            auto BreakUtf8String = [this, &length]()
-            {
-                if ((_offset + length) >= _strLength)
-                {
-                    return;
-                }
+    source.readPos = source.buffer.size();
 
-                if (0 == (0x80 & _str[length]) || 0x3 == (_str[length] >> 6))
-                {
-                    return;
-                }
+    *size = source.buffer.size() - pos;
 
-                int i = length - 1;
-                auto ch = _str[i];
+    return reinterpret_cast<const char*>(&source.buffer[pos]);
+}
 
-                // back up to the start of the previous code point
-                while (0 != (0x80 & ch) && 0x3 != (ch >> 6) && i > 0)
-                {
-                    ch = _str[--i];
-                }
+// Runs when the message queue is empty.
+void BackgroundApplicationProcessing()
+{
+    //std::cout << std::hex;
+    //for (auto i = 0; i < 256; i++)
+    //{
+    //    if (IsKeyMade(i))
+    //    {
+    //        std::cout << std::hex << i << ' ';
+    //    }
+    //}
+    //std::cout << std::dec;
+
+    if (nullptr != luaState && memory::isCollectionPending)
+    {
+        memory::RunPendingCollection(luaState);
+    }
+    else if (nullptr != luaState && collector::idle.HasIdleWork(luaState))
+    {
+        (void)collector::idle.RunSlice(luaState);
+    }
+}
+
+// Returns true when BackgroundApplicationProcessing() has something to do.
+bool IsBackgroundProcessingPending()
+{
+    return nullptr != luaState && (memory::isCollectionPending || collector::idle.HasIdleWork(luaState));
+}
+
+void Close()
+{
+    ::PostMessageW(_windowHandle, WM_CLOSE, 0, 0);
+}
+
+LRESULT Paint(WPARAM wParam, LPARAM lParam)
+{
+    //pGraphicsRenderer->process_wm_paint();
+    return ::DefWindowProcW(_windowHandle, WM_PAINT, wParam, lParam);
+}
+
+string LuaTypeToString(lua_State* L, int stackIndex)
+{
+    string result;
+    stringstream ss;
+
+    // if (the stack index is relative) convert it to an absolute index
+    const auto absIndex = (stackIndex < 0) ? lua_gettop(L) + 1 + stackIndex : stackIndex;
+
+    const auto typeId = lua_type(L, absIndex);
+
+    switch (typeId)
+    {
+    case LUA_TBOOLEAN:
+        ss << ((lua_toboolean(L, absIndex)) ? "true" : "false");
+        break;
+    case LUA_TFUNCTION:
+        if (lua_iscfunction(L, absIndex))
+        {
+            ss << "Native function: 0x" << std::hex << lua_tocfunction(L, absIndex) << std::dec;
+        }
+        else
+        {
+            ss << "Lua function";
+        }
+        break;
+    case LUA_TLIGHTUSERDATA:
+        ss << "Light user-data: 0x" << std::hex << lua_touserdata(L, absIndex) << std::dec;
+        break;
+    case LUA_TNIL:
+        ss << "nil";
+        break;
+    case LUA_TNUMBER:
+        ss << lua_tonumber(L, absIndex);
+        break;
+    case LUA_TSTRING:
+        ss << '"' << lua_tostring(L, absIndex) << '"'; // NOTE: this ignores the possibility of embedded nulls
+        break;
+    case LUA_TTABLE:
+        ss << "{ ";
+
+        lua_pushnil(L); // prime the pump: push the first table key to start the enumeration
+        if (0 != lua_next(L, absIndex))
+        {
+            ss << LuaTypeToString(L, -2) << " = " << LuaTypeToString(L, -1); // print key = value
+
+            lua_pop(L, 1); // pop the value; leave the key for the next iteration
+
+            while (0 != lua_next(L, absIndex))
+            {
+                ss << ", " << LuaTypeToString(L, -2) << " = " << LuaTypeToString(L, -1); // print the key = value
+
+                lua_pop(L, 1); // pop the value; leave the key for the next iteration
+            }
+        }
+
+        ss << " }";
+        break;
+    case LUA_TTHREAD:
+        ss << "Lua thread: 0x" << std::hex << lua_tothread(L, absIndex) << std::dec;
+        break;
+    case LUA_TUSERDATA:
+        ss << "User-data block: 0x" << std::hex << lua_touserdata(L, absIndex) << std::dec;
+        break;
+    default:
+        ss << "unrecognized-type";
+        break;
+    }
+
+    result = move(ss.str());
+
+    return result;
+}
+
+int LuaDumpStack(lua_State* L)
+{
+    const auto argc = lua_gettop(L);
+
+    if (0 == argc)
+    {
+        std::wcout << "\nstack is empty" << endl;
+        return 0;
+    }
+
+    std::wcout << L"\nStack Dump" << endl;
+    std::wcout << L"----------" << endl;
+
+    for (auto i = argc; i >= 1; i--)
+    {
+        std::cout << i << ": " << LuaTypeToString(L, i) << endl;
+    }
+
+    return argc;
+}
+
+int LuaPrintReplacement(lua_State* L)
+{
+    const auto topIndex = lua_gettop(L);
+
+    for (int i = 1; i <= topIndex; i++)
+    {
+        if (lua_isstring(L, i)) // if (the object is a string or a number that's easily converted to a string)
+        {
+            std::cout << lua_tostring(L, i);
+        }
+        else // else (see if the object has a __tostring() method)
+        {
+            if (0 == luaL_getmetafield(L, i, "__tostring")) // if (the object doesn't have a __tostring() method)
+            {
+                std::cout << LuaTypeToString(L, i);
+            }
+            else if (LUA_TFUNCTION != lua_type(L, lua_gettop(L))) // if (the object's __tostring member isn't a legal function)
+            {
+                // NOTE: This would be a strange case.
+                lua_pop(L, 1);
+                std::cout << LuaTypeToString(L, i);
+            }
+            else // else (the __tostring() method is on the stack)
+            {
+                lua_pushvalue(L, i); // duplicate the object to invoke tostring() on
+                const auto result = lua_pcall(L, 1, LUA_MULTRET, 0); // call __tostring(obj)
+                if (LUA_ERRRUN == result)
+                {
+                    std::wcout << "Lua runtime error." << std::endl;
+                }
+                else if (LUA_ERRMEM == result)
+                {
+                    std::wcout << "Lua memory allocation error." << std::endl;
+                }
+                else if (LUA_ERRERR == result)
+                {
+                    std::wcout << "Lua error while running the error handler function." << std::endl;
+                }
+                else if (0 != result)
+                {
+                    std::wcout << "Lua unknown error." << std::endl;
+                }
+
+                // Output the result of __tostring(obj)
+                std::cout << lua_tostring(L, lua_gettop(L));
+
+                // Pop the string to restore the stack.
+                lua_pop(L, 1);
+            }
+        }
+    }
+
+    std::wcout << std::endl;
+
+    return 0;
+}
+
+// NOTE: These declarations are needed by hook::InstallLowLevelKeyboardHook().
+namespace api
+{
+    bool InterceptedScancodeMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time);
+    bool InterceptedScancodeBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time);
+    bool InterceptedVirtualKeyMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time);
+    bool InterceptedVirtualKeyBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time);
+} // namespace api
+
+// The input capture thread; see below. The hook, and raw input, are set up on it when it's running.
+namespace capture
+{
+    enum class HookKind : uint8_t { ScancodeMake, ScancodeBreak, VirtualKeyMake, VirtualKeyBreak };
+
+    enum class Command : WPARAM { InstallHook, RemoveHook, EnableRawInput, DisableRawInput, Stop };
+
+    template<HookKind kind>
+    bool CaptureHookEvent(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time);
+
+    void Stop();
+    void DispatchQueue();
+
+    const UINT CommandMessage = WM_APP;
+
+    DWORD threadId = 0u;
+    HWND window = nullptr; // message only; the raw input target
+
+    bool IsRunning()
+    {
+        return nullptr != window;
+    }
+
+    // Runs the command on the capture thread, and waits for it. Returns false if there's no capture
+    //  thread, or if this is it; the caller does the work itself then.
+    bool Forward(const Command command)
+    {
+        if (nullptr == window || ::GetCurrentThreadId() == threadId)
+        {
+            return false;
+        }
+
+        ::SendMessageW(window, CommandMessage, static_cast<WPARAM>(command), 0);
+        return true;
+    }
+
+    // A log2 histogram of delays, in microseconds.
+    struct LatencyHistogram
+    {
+        uint64_t counts[32];    // counts[i] holds the delays below 2^i microseconds, and not below 2^(i - 1)
+        uint64_t count;
+        int64_t  maxMicroseconds;
+
+        void Add(const int64_t microseconds)
+        {
+            auto bucket = 0u;
+            while (bucket < 31u && microseconds >= (int64_t(1) << bucket))
+            {
+                bucket++;
+            }
+
+            counts[bucket]++;
+            count++;
+            maxMicroseconds = max(maxMicroseconds, microseconds);
+        }
+
+        // An upper bound on the percentile, in seconds; the top of its bucket, or the maximum.
+        double Percentile(const double fraction) const
+        {
+            auto remaining = static_cast<uint64_t>(fraction * count);
+            for (auto bucket = 0u; bucket < 32u; bucket++)
+            {
+                if (counts[bucket] > remaining)
+                {
+                    return min(static_cast<double>(int64_t(1) << bucket), static_cast<double>(maxMicroseconds)) / 1e6;
+                }
+                remaining -= counts[bucket];
+            }
+            return static_cast<double>(maxMicroseconds) / 1e6;
+        }
+    };
+
+    // From the system's time stamp on a hook or raw input event, to the start of its dispatch. The
+    //  time stamps are GetTickCount() ticks, so these are only as fine as the system timer.
+    LatencyHistogram delays = {};
+
+    // From the capture thread taking an event, to the start of its dispatch; QPC ticks.
+    LatencyHistogram queueDelays = {};
+
+    std::atomic<uint64_t> droppedCount(0u); // events the capture thread had no room to queue
+
+    inline void RecordDelay(const uint32_t time)
+    {
+        delays.Add(static_cast<int64_t>(static_cast<uint32_t>(::GetTickCount() - time)) * 1000); // NOTE: unsigned; survives the tick count wrapping
+    }
+} // namespace capture
+
+// Hook Procedure
+namespace hook
+{
+    class LowLevelKeyboardHook final
+    {
+    public:
+        LowLevelKeyboardHook()
+            : _hLowLevelKeyboardHook(nullptr)
+        {
+        }
+
+        explicit LowLevelKeyboardHook(const HHOOK hLowLevelKeyboardHook)
+            : _hLowLevelKeyboardHook(hLowLevelKeyboardHook)
+        {
+        }
+
+        ~LowLevelKeyboardHook()
+        {
+            reset();
+        }
+
+        explicit operator bool() const
+        {
+            return nullptr != _hLowLevelKeyboardHook;
+        }
+
+        operator const HHOOK&() const
+        {
+            return _hLowLevelKeyboardHook;
+        }
+
+        void reset(const HHOOK hLowLevelKeyboardHook = nullptr)
+        {
+            if (nullptr != _hLowLevelKeyboardHook)
+            {
+                const auto result = ::UnhookWindowsHookEx(_hLowLevelKeyboardHook);
+                if (0 == result)
+                {
+                    const auto lastError = ::GetLastError();
+                    std::wcout << L"failed to unhook low-level keyboard filter: 0x" << std::hex << lastError << std::dec << std::endl;
+                    assert(false);
+                }
+            }
+
+            _hLowLevelKeyboardHook = hLowLevelKeyboardHook;
+        }
+
+    private:
+        HHOOK _hLowLevelKeyboardHook;
+
+        LowLevelKeyboardHook(const LowLevelKeyboardHook&) = delete;
+        LowLevelKeyboardHook& operator =(const LowLevelKeyboardHook&) = delete;
+    };
+
+    LowLevelKeyboardHook keyboardHook;
+
+    void InstallLowLevelKeyboardHook()
+    {
+        if (capture::Forward(capture::Command::InstallHook)) // if (the capture thread installed it)
+        {
+            return;
+        }
+
+        HMODULE hDllModule;
+        {
+            hDllModule = ::LoadLibraryExW(L"KeyFilter.dll", nullptr, LOAD_LIBRARY_SEARCH_APPLICATION_DIR);
+            if (nullptr == hDllModule)
+            {
+                std::wcout << L"LoadLibrary failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+                return;
+            }
+        }
+
+        auto freeLibrary = [hDllModule]()
+        {
+            const auto result = ::FreeLibrary(hDllModule);
+            if (0 == result)
+            {
+                std::wcout << L"failed to free hook library 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            }
+        };
+
+        using InitializeFilterHooks_t = HRESULT (*)(KeyMap* pInterceptedScancodeMakes, KeyMap* pInterceptedScancodeBreaks,
+            KeyMap* pInterceptedVirtualKeyMakes, KeyMap* pInterceptedVirtualKeyBreaks,
+            KeyInterceptionCallback interceptedScancodeMake, KeyInterceptionCallback interceptedScancodeBreak,
+            KeyInterceptionCallback interceptedVirtualKeyMake, KeyInterceptionCallback interceptedVirtualKeyBreak,
+            SelfInjectionFilter* pSelfInjectionFilter, DebounceFilter* pDebounceFilter);
+
+        InitializeFilterHooks_t InitializeFilterHooks;
+        {
+            InitializeFilterHooks = reinterpret_cast<InitializeFilterHooks_t>(::GetProcAddress(hDllModule, "Initialize"));
+            if (nullptr == InitializeFilterHooks)
+            {
+                std::wcout << L"GetProcAddress failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+
+                freeLibrary();
+
+                return;
+            }
+        }
+
+        {
+            // The capture thread runs the remap image, and queues hook events; the main thread runs their
+            //  callbacks later.
+            using capture::HookKind;
+            const auto isCaptured = capture::IsRunning();
+            const auto hr = InitializeFilterHooks(&interceptedScancodeMakes, &interceptedScancodeBreaks,
+                &interceptedVirtualKeyMakes, &interceptedVirtualKeyBreaks,
+                isCaptured ? &capture::CaptureHookEvent<HookKind::ScancodeMake> : &api::InterceptedScancodeMakeHander,
+                isCaptured ? &capture::CaptureHookEvent<HookKind::ScancodeBreak> : &api::InterceptedScancodeBreakHander,
+                isCaptured ? &capture::CaptureHookEvent<HookKind::VirtualKeyMake> : &api::InterceptedVirtualKeyMakeHander,
+                isCaptured ? &capture::CaptureHookEvent<HookKind::VirtualKeyBreak> : &api::InterceptedVirtualKeyBreakHander,
+                &selfInjection, &debounce);
+            if (FAILED(hr))
+            {
+                std::wcout << L"InitializeFilterHooks failed" << std::endl;
+
+                assert(false);
+
+                freeLibrary();
+
+                return;
+            }
+        }
+
+        HOOKPROC pHookFunction;
+        {
+            pHookFunction = reinterpret_cast<HOOKPROC>(::GetProcAddress(hDllModule, "LowLevelKeyboardProc"));
+            if (nullptr == pHookFunction)
+            {
+                std::wcout << L"GetProcAddress failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+
+                freeLibrary();
+
+                return;
+            }
+        }
+
+        keyboardHook.reset(::SetWindowsHookExW(WH_KEYBOARD_LL, pHookFunction, hDllModule, 0));
+
+        if (!keyboardHook)
+        {
+            std::wcout << L"SetWindowsHook failed: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+
+            freeLibrary();
+
+            return;
+        }
+    }
+
+    void DisableLowLevelKeyboardHook()
+    {
+        if (capture::Forward(capture::Command::RemoveHook))
+        {
+            return;
+        }
+
+        keyboardHook.reset();
+        // NOTE: It's not possible to unload the DLL after the hook has been made.
+    }
+} // namespace hook
+
+namespace expansions
+{
+    // Abbreviation expansion. The triggers are compiled into an Aho-Corasick automaton over UTF-16
+    //  code units, which the typed characters walk one step per character; so the cost of a keystroke
+    //  doesn't grow with the number of abbreviations.
+    const uint32_t Root = 0u;
+    const uint32_t NoNode = numeric_limits<uint32_t>::max();
+    const uint32_t NoExpansion = numeric_limits<uint32_t>::max();
+
+    struct Expansion
+    {
+        string      triggerText;        // UTF-8, as the script gave it
+        wstring     trigger;
+        wstring     replacement;
+        int         callbackReference;  // LUA_NOREF, unless a Lua function makes the replacement
+        bool        isImmediate;        // expand as soon as the trigger is typed; otherwise on the next word boundary
+        bool        isAnywhere;         // the trigger may start in the middle of a word
+    };
+
+    struct Node
+    {
+        uint32_t    fail;
+        uint32_t    outputLink;         // the nearest node down the fail chain that ends a trigger; Root for none
+        uint32_t    expansion;          // the expansion whose trigger ends at this node
+        uint32_t    firstChild;
+        uint32_t    nextSibling;
+        uint16_t    depth;
+        wchar_t     ch;                 // the code unit on the edge from the parent
+    };
+
+    vector<Expansion> expansions;
+    vector<uint32_t> freeSlots; // removed expansions' slots, for reuse
+    vector<Node> nodes = { { Root, Root, NoExpansion, NoNode, NoNode, 0u, 0 } };
+    unordered_map<uint64_t, uint32_t> edges; // (node << 16 | code unit) -> child node
+    bool isCompiled = true;
+    size_t expansionCount = 0u;
+
+    // The characters typed since the last reset, and the automaton state after each.
+    const uint32_t HistorySize = 64u;
+    const size_t MaxTriggerLength = HistorySize / 2u;
+
+    struct TypedCharacter
+    {
+        wchar_t     ch;
+        uint32_t    state;
+    };
+
+    array<TypedCharacter, HistorySize> history;
+    uint32_t typedCount = 0u;       // characters typed since the last reset
+    uint32_t historyCount = 0u;     // how many of those are still in the history
+    uint32_t state = Root;
+
+    thread_local vector<INPUT> expansionInput; // reused; an expansion is sent with one SendInput() call
+
+    // Calls an expansion's Lua function with its trigger, and leaves its replacement, or nil. Run with
+    //  lua_pcall(), so a refused allocation (interning the trigger, or converting a number the function
+    //  returned) is an error rather than a panic.
+    int CallExpansionFunction(lua_State* L)
+    {
+        const auto& expansion = *static_cast<const Expansion*>(lua_touserdata(L, 1));
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, expansion.callbackReference); // push the function
+        lua_pushlstring(L, expansion.triggerText.data(), expansion.triggerText.size()); // push the trigger
+        lua_call(L, 1, 1); // pop the function and trigger; push the replacement
+
+        if (!lua_isstring(L, -1)) // if (the function returned nothing usable)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+
+        (void)lua_tolstring(L, -1, nullptr); // NOTE: converts a number in place
+        return 1;
+    }
+
+    // CallExpansionFunction(), kept in the registry so pushing it doesn't allocate.
+    int callExpansionReference = LUA_NOREF;
+
+    inline uint32_t FindEdge(const uint32_t node, const wchar_t ch)
+    {
+        const auto found = edges.find((static_cast<uint64_t>(node) << 16) | static_cast<uint16_t>(ch));
+        return (edges.end() == found) ? NoNode : found->second;
+    }
+
+    // Returns the expansion slot for the trigger's terminal node, adding nodes as needed.
+    uint32_t& TriggerExpansion(const wstring& trigger)
+    {
+        auto node = Root;
+        for (const auto ch : trigger)
+        {
+            auto child = FindEdge(node, ch);
+            if (NoNode == child)
+            {
+                child = static_cast<uint32_t>(nodes.size());
+                nodes.push_back({ Root, Root, NoExpansion, NoNode, nodes[node].firstChild, static_cast<uint16_t>(nodes[node].depth + 1u), ch });
+                nodes[node].firstChild = child;
+                edges[(static_cast<uint64_t>(node) << 16) | static_cast<uint16_t>(ch)] = child;
+            }
+            node = child;
+        }
+
+        isCompiled = false;
+        return nodes[node].expansion;
+    }
+
+    // Returns the expansion of the trigger, or NoExpansion.
+    uint32_t FindTrigger(const wstring& trigger)
+    {
+        auto node = Root;
+        for (const auto ch : trigger)
+        {
+            node = FindEdge(node, ch);
+            if (NoNode == node)
+            {
+                return NoExpansion;
+            }
+        }
+
+        return nodes[node].expansion;
+    }
+
+    // Builds the fail and output links, breadth first.
+    void Compile()
+    {
+        vector<uint32_t> queue;
+        queue.reserve(nodes.size());
+        queue.push_back(Root);
+
+        for (size_t i = 0u; i < queue.size(); i++)
+        {
+            const auto parent = queue[i];
+            for (auto child = nodes[parent].firstChild; NoNode != child; child = nodes[child].nextSibling)
+            {
+                queue.push_back(child);
+            }
+        }
+
+        // Parents come before their children in the queue, so walking it in order works.
+        for (const auto node : queue)
+        {
+            for (auto child = nodes[node].firstChild; NoNode != child; child = nodes[child].nextSibling)
+            {
+                auto& childNode = nodes[child];
+                const auto ch = childNode.ch;
+
+                childNode.fail = Root;
+                if (Root != node)
+                {
+                    for (auto fail = nodes[node].fail;; fail = nodes[fail].fail)
+                    {
+                        const auto next = FindEdge(fail, ch);
+                        if (NoNode != next)
+                        {
+                            childNode.fail = next;
+                            break;
+                        }
+                        if (Root == fail)
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                const auto& failNode = nodes[childNode.fail];
+                childNode.outputLink = (NoExpansion != failNode.expansion) ? childNode.fail : failNode.outputLink;
+            }
+        }
+
+        isCompiled = true;
+    }
+
+    inline uint32_t Step(uint32_t node, const wchar_t ch)
+    {
+        for (;;)
+        {
+            const auto next = FindEdge(node, ch);
+            if (NoNode != next)
+            {
+                return next;
+            }
+            if (Root == node)
+            {
+                return Root;
+            }
+            node = nodes[node].fail;
+        }
+    }
+
+    void Reset()
+    {
+        state = Root;
+        typedCount = 0u;
+        historyCount = 0u;
+    }
+
+    inline bool IsWordCharacter(const wchar_t ch)
+    {
+        return 0 != ::iswalnum(ch) || L'_' == ch;
+    }
+
+    // Is the character typed before a trigger, of the given length, ending with the last typed character
+    //  a word boundary? Anything from before the last reset counts as one.
+    bool IsWordStart(const uint32_t triggerLength)
+    {
+        if (typedCount <= triggerLength || historyCount <= triggerLength)
+        {
+            return true;
+        }
+
+        const auto position = typedCount - triggerLength - 1u;
+        return !IsWordCharacter(history[position % HistorySize].ch);
+    }
+
+    // Returns the longest expansion whose trigger ends at the node, and whose rules are met.
+    uint32_t FindMatch(const uint32_t node, const bool isImmediate)
+    {
+        auto match = (NoExpansion != nodes[node].expansion) ? node : nodes[node].outputLink;
+        for (; Root != match; match = nodes[match].outputLink)
+        {
+            const auto& expansion = expansions[nodes[match].expansion];
+            if (expansion.isImmediate == isImmediate && (expansion.isAnywhere || IsWordStart(nodes[match].depth)))
+            {
+                return nodes[match].expansion;
+            }
+        }
+
+        return NoExpansion;
+    }
+
+    wstring Utf8ToUtf16(const char* str, size_t length)
+    {
+        wstring result;
+        if (0u == length)
+        {
+            return result;
+        }
+
+        const auto count = ::MultiByteToWideChar(CP_UTF8, 0, str, static_cast<int>(length), nullptr, 0);
+        if (count <= 0)
+        {
+            std::wcout << L"UTF8 to UTF16 translation failed -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            return result;
+        }
+
+        result.resize(count);
+        ::MultiByteToWideChar(CP_UTF8, 0, str, static_cast<int>(length), &result[0], count);
+
+        return result;
+    }
+
+    // Returns false if the text isn't valid UTF-8; unlike Utf8ToUtf16(), which substitutes U+FFFD.
+    bool TryUtf8ToUtf16(const char* str, size_t length, wstring& result)
+    {
+        result.clear();
+        if (0u == length)
+        {
+            return true;
+        }
+
+        const auto count = ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, str, static_cast<int>(length), nullptr, 0);
+        if (count <= 0)
+        {
+            return false;
+        }
+
+        result.resize(count);
+        ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, str, static_cast<int>(length), &result[0], count);
+
+        return true;
+    }
+
+    void AppendKey(const WORD virtualKey, const WORD scancode, const DWORD flags)
+    {
+        INPUT input = {};
+        input.type = INPUT_KEYBOARD;
+        input.ki.wVk = virtualKey;
+        input.ki.wScan = scancode;
+        input.ki.dwFlags = flags;
+        input.ki.dwExtraInfo = selfInjection.signature;
+
+        expansionInput.push_back(input);
+        input.ki.dwFlags |= KEYEVENTF_KEYUP;
+        expansionInput.push_back(input);
+    }
+
+    void AppendCharacter(const wchar_t ch)
+    {
+        switch (ch)
+        {
+        case L'\r':
+        case L'\n':
+            AppendKey(VK_RETURN, 0u, 0u);
+            break;
+        case L'\t':
+            AppendKey(VK_TAB, 0u, 0u);
+            break;
+        default:
+            AppendKey(0u, static_cast<WORD>(ch), KEYEVENTF_UNICODE);
+            break;
+        }
+    }
+
+    // Erases the trigger (and the boundary character, when there is one) and types the replacement.
+    void Expand(const Expansion& expansion, const wchar_t boundary)
+    {
+        wstring dynamicReplacement;
+        if (LUA_NOREF != expansion.callbackReference) // if (a Lua function makes the replacement)
+        {
+            // NOTE: Neither push allocates; see CallExpansionFunction().
+            lua_rawgeti(luaState, LUA_REGISTRYINDEX, callExpansionReference); // push CallExpansionFunction()
+            lua_pushlightuserdata(luaState, const_cast<Expansion*>(&expansion)); // push the expansion
+
+            if (0 != lua_pcall(luaState, 1, 1, 0)) // pop the function and expansion; push the replacement
+            {
+                std::cout << "Lua runtime error in expansion: " << lua_tostring(luaState, -1) << std::endl;
+                lua_pop(luaState, 1);
+                return;
+            }
+
+            size_t length = 0u;
+            const auto text = lua_tolstring(luaState, -1, &length);
+            if (nullptr == text) // if (the function returned nothing usable) leave the trigger alone
+            {
+                lua_pop(luaState, 1);
+                return;
+            }
+
+            dynamicReplacement = Utf8ToUtf16(text, length);
+            lua_pop(luaState, 1); // pop the replacement
+        }
+
+        const auto& replacement = (LUA_NOREF != expansion.callbackReference) ? dynamicReplacement : expansion.replacement;
+
+        expansionInput.clear();
+
+        const auto eraseCount = expansion.trigger.size() + ((0 != boundary) ? 1u : 0u);
+        for (size_t i = 0u; i < eraseCount; i++)
+        {
+            AppendKey(VK_BACK, 0u, 0u);
+        }
+
+        for (const auto ch : replacement)
+        {
+            AppendCharacter(ch);
+        }
+
+        if (0 != boundary)
+        {
+            AppendCharacter(boundary);
+        }
+
+        const auto result = trace::SendInput(static_cast<UINT>(expansionInput.size()), &expansionInput[0], sizeof(expansionInput[0]));
+        if (0 == result)
+        {
+            std::wcout << L"failed to send expansion -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+        }
+    }
+
+    void Type(const wchar_t ch)
+    {
+        if (!IsWordCharacter(ch)) // if (a word boundary) expand a trigger that's waiting on one
+        {
+            const auto match = FindMatch(state, false);
+            if (NoExpansion != match)
+            {
+                Expand(expansions[match], ch);
+                Reset();
+                return;
+            }
+        }
+
+        state = Step(state, ch);
+        history[typedCount % HistorySize] = { ch, state };
+        typedCount++;
+        historyCount = min(historyCount + 1u, HistorySize);
+
+        const auto match = FindMatch(state, true);
+        if (NoExpansion != match)
+        {
+            Expand(expansions[match], 0);
+            Reset();
+        }
+    }
+
+    void Backspace()
+    {
+        if (historyCount <= 1u)
+        {
+            Reset();
+            return;
+        }
+
+        typedCount--;
+        historyCount--;
+        state = history[(typedCount - 1u) % HistorySize].state;
+    }
+
+    // Feeds a key make to the expansion engine; called for raw input that this process didn't send.
+    void ProcessKeyMake(const KeyEventRecord& keyEvent)
+    {
+        if (0u == expansionCount)
+        {
+            return;
+        }
+
+        if (!isCompiled)
+        {
+            Compile();
+        }
+
+        switch (keyEvent.virtualKey)
+        {
+        case VK_BACK:
+            Backspace();
+            return;
+        case VK_ESCAPE:
+        case VK_PRIOR: case VK_NEXT: case VK_END: case VK_HOME:
+        case VK_LEFT: case VK_UP: case VK_RIGHT: case VK_DOWN:
+        case VK_INSERT: case VK_DELETE:
+            Reset(); // the caret has probably moved
+            return;
+        default:
+            break;
+        }
+
+        const auto isControlMade = IsSet(madeVirtualKeys, VK_CONTROL);
+        const auto isAltMade = IsSet(madeVirtualKeys, VK_MENU);
+        if (isControlMade != isAltMade || IsSet(madeVirtualKeys, VK_LWIN) || IsSet(madeVirtualKeys, VK_RWIN)) // if (a shortcut; AltGr is Ctrl+Alt)
+        {
+            Reset();
+            return;
+        }
+
+        BYTE keyState[256];
+        for (auto i = 0u; i < 256u; i++)
+        {
+            keyState[i] = IsSet(madeVirtualKeys, i) ? 0x80u : 0u;
+        }
+        keyState[VK_CAPITAL] |= static_cast<BYTE>(::GetKeyState(VK_CAPITAL) & 0x1);
+        keyState[VK_NUMLOCK] |= static_cast<BYTE>(::GetKeyState(VK_NUMLOCK) & 0x1);
+
+        const auto hkl = ::GetKeyboardLayout(::GetWindowThreadProcessId(::GetForegroundWindow(), nullptr));
+
+        WCHAR characters[4];
+        const UINT DontChangeKeyboardState = 0x4u; // keeps dead keys working for the focused application
+        const auto count = ::ToUnicodeEx(keyEvent.virtualKey, keyEvent.scancode, keyState, characters, 4, DontChangeKeyboardState, hkl);
+
+        for (auto i = 0; i < count; i++)
+        {
+            Type(characters[i]);
+        }
+    }
+} // namespace expansions
+
+namespace macros
+{
+    // Recorded key events, in a compact delta-time format:
+    //  MacroHeader, then per key event: the delay since the previous event in microseconds (LEB128
+    //  varint), a MacroEventFlags byte, the scancode byte, and the virtual key byte.
+    struct MacroHeader
+    {
+        char        magic[4];
+        uint32_t    eventCount;
+    };
+
+    const char MacroMagic[4] = { 'U', 'K', 'M', '1' };
+
+    enum MacroEventFlags : uint8_t
+    {
+        MacroBreak  = 0x01u,
+        MacroE0     = 0x02u,
+    };
+
+    struct MacroEvent
+    {
+        uint64_t    delayMicroseconds;
+        uint8_t     flags;
+        uint8_t     scancode;
+        uint8_t     virtualKey;
+    };
+
+    const size_t MinEncodedEventSize = 4u; // a one byte delay, the flags, the scancode, and the virtual key
+
+    inline int64_t TicksPerSecond()
+    {
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceFrequency(&frequency);
+        return frequency.QuadPart;
+    }
+
+    void AppendVarint(vector<uint8_t>& buffer, uint64_t value)
+    {
+        while (value >= 0x80u)
+        {
+            buffer.push_back(static_cast<uint8_t>(0x80u | (0x7fu & value)));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<uint8_t>(value));
+    }
+
+    bool ReadVarint(const uint8_t*& p, const uint8_t* const end, uint64_t& value)
+    {
+        value = 0u;
+        for (auto shift = 0u; shift < 64u && p < end; shift += 7u)
+        {
+            const auto byte = *p++;
+            value |= static_cast<uint64_t>(0x7fu & byte) << shift;
+            if (0u == (0x80u & byte))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Recording; on the window's thread.
+    bool            isRecording = false;
+    vector<uint8_t> recording;
+    uint32_t        recordedCount = 0u;
+    int64_t         lastRecordedTimestamp = 0;
+
+    void StartRecording()
+    {
+        recording.assign(sizeof(MacroHeader), 0u);
+        recordedCount = 0u;
+        lastRecordedTimestamp = ReadTimestamp();
+        isRecording = true;
+    }
+
+    // Records a physical key event; both raw input, and hook events that never reach raw input.
+    void Record(const KeyEventRecord& keyEvent)
+    {
+        if (!isRecording)
+        {
+            return;
+        }
+
+        static const auto Frequency = TicksPerSecond();
+
+        const auto ticks = max<int64_t>(0, keyEvent.timestamp - lastRecordedTimestamp);
+        lastRecordedTimestamp = max(lastRecordedTimestamp, keyEvent.timestamp);
+
+        AppendVarint(recording, static_cast<uint64_t>(ticks) * 1000000u / Frequency);
+        recording.push_back(static_cast<uint8_t>((keyEvent.isBreak ? MacroBreak : 0u) | (keyEvent.e0 ? MacroE0 : 0u)));
+        recording.push_back(static_cast<uint8_t>(keyEvent.scancode));
+        recording.push_back(static_cast<uint8_t>(keyEvent.virtualKey));
+        recordedCount++;
+    }
+
+    vector<uint8_t> StopRecording()
+    {
+        isRecording = false;
+
+        MacroHeader header;
+        ::memcpy(header.magic, MacroMagic, sizeof(header.magic));
+        header.eventCount = recordedCount;
+        ::memcpy(&recording[0], &header, sizeof(header));
+
+        vector<uint8_t> result;
+        result.swap(recording);
+        return result;
+    }
+
+    bool Decode(const uint8_t* const data, const size_t size, vector<MacroEvent>& events)
+    {
+        MacroHeader header;
+        if (size < sizeof(header))
+        {
+            return false;
+        }
+
+        ::memcpy(&header, data, sizeof(header));
+        if (0 != ::memcmp(header.magic, MacroMagic, sizeof(header.magic)))
+        {
+            return false;
+        }
+
+        events.clear();
+        events.reserve(min<size_t>(header.eventCount, (size - sizeof(header)) / MinEncodedEventSize)); // NOTE: don't trust the header's count
+
+        const uint8_t* p = data + sizeof(header);
+        const auto end = data + size;
+        for (auto i = 0u; i < header.eventCount; i++)
+        {
+            MacroEvent event;
+            if (!ReadVarint(p, end, event.delayMicroseconds) || end - p < 3)
+            {
+                return false;
+            }
+            event.flags = p[0];
+            event.scancode = p[1];
+            event.virtualKey = p[2];
+            p += 3;
+
+            events.push_back(event);
+        }
+
+        return true;
+    }
+
+    // Memory mapped macro files.
+    bool Save(const wstring& fileName, const uint8_t* const data, const size_t size)
+    {
+        const auto hFile = ::CreateFileW(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0u, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (INVALID_HANDLE_VALUE == hFile)
+        {
+            std::wcout << L"failed to create macro file -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            return false;
+        }
+
+        auto isSaved = false;
+        const auto hMapping = ::CreateFileMappingW(hFile, nullptr, PAGE_READWRITE, 0u, static_cast<DWORD>(size), nullptr);
+        if (nullptr != hMapping)
+        {
+            const auto pView = ::MapViewOfFile(hMapping, FILE_MAP_WRITE, 0u, 0u, size);
+            if (nullptr != pView)
+            {
+                ::memcpy(pView, data, size);
+                ::UnmapViewOfFile(pView);
+                isSaved = true;
+            }
+            ::CloseHandle(hMapping);
+        }
+
+        if (!isSaved)
+        {
+            std::wcout << L"failed to map macro file -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+        }
+
+        ::CloseHandle(hFile);
+        return isSaved;
+    }
+
+    // Calls the reader with a view of the whole file.
+    template<typename Reader>
+    bool Load(const wstring& fileName, Reader reader)
+    {
+        const auto hFile = ::CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (INVALID_HANDLE_VALUE == hFile)
+        {
+            std::wcout << L"failed to open macro file -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            return false;
+        }
+
+        auto isLoaded = false;
+        LARGE_INTEGER size;
+        if (::GetFileSizeEx(hFile, &size) && size.QuadPart >= static_cast<LONGLONG>(sizeof(MacroHeader)))
+        {
+            const auto hMapping = ::CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0u, 0u, nullptr);
+            if (nullptr != hMapping)
+            {
+                const auto pView = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0u, 0u, 0u);
+                if (nullptr != pView)
+                {
+                    isLoaded = reader(static_cast<const uint8_t*>(pView), static_cast<size_t>(size.QuadPart));
+                    ::UnmapViewOfFile(pView);
+                }
+                ::CloseHandle(hMapping);
+            }
+        }
+
+        ::CloseHandle(hFile);
+        return isLoaded;
+    }
+
+    struct PlaybackOptions
+    {
+        double      speed;                      // 2.0 plays twice as fast; 0 plays without any delays
+        uint64_t    maxDelayMicroseconds;       // longer pauses are shortened to this
+        bool        isSink;                     // emit to memory, rather than SendInput()
+    };
+
+    // How closely playback kept to the recorded timing.
+    struct PlaybackStats
+    {
+        uint32_t    eventCount;
+        double      totalJitterSeconds;
+        double      maxJitterSeconds;
+        bool        isPlaying;
+    };
+
+    // Plays macros back on their own thread, timed with a high resolution waitable timer.
+    class Player
+    {
+    public:
+        Player()
+            : _stopEvent(nullptr)
+            , _stats() {}
+
+        ~Player()
+        {
+            Stop();
+
+            if (nullptr != _stopEvent)
+            {
+                ::CloseHandle(_stopEvent);
+            }
+        }
+
+        void Play(vector<MacroEvent>&& events, const PlaybackOptions& options)
+        {
+            Stop();
+
+            if (nullptr == _stopEvent)
+            {
+                _stopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+                if (nullptr == _stopEvent)
+                {
+                    throw runtime_error("failed to create the playback stop event");
+                }
+            }
+            ::ResetEvent(_stopEvent);
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stats = PlaybackStats();
+                _stats.isPlaying = true;
+                _sink.clear();
+                _sink.reserve(events.size());
+            }
+
+            _thread = std::thread(&Player::Run, this, move(events), options);
+        }
+
+        void Stop()
+        {
+            if (_thread.joinable())
+            {
+                ::SetEvent(_stopEvent);
+                _thread.join();
+            }
+        }
+
+        PlaybackStats stats() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _stats;
+        }
+
+        // The key events played to the in-memory sink, with the time each was emitted.
+        vector<KeyEventRecord> sink() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _sink;
+        }
+
+    private:
+        void Run(vector<MacroEvent> events, PlaybackOptions options);
+        bool WaitUntil(HANDLE hTimer, int64_t target);
+        void Emit(const MacroEvent& event, int64_t emitted, bool isSink);
+
+        HANDLE                  _stopEvent;
+        std::thread             _thread;
+        mutable std::mutex      _mutex;
+        PlaybackStats           _stats;
+        vector<KeyEventRecord>  _sink;
+
+        Player(const Player&) = delete;
+        Player& operator =(const Player&) = delete;
+    };
+
+    // Returns false when playback was stopped.
+    bool Player::WaitUntil(const HANDLE hTimer, const int64_t target)
+    {
+        static const auto Frequency = TicksPerSecond();
+        const auto SpinTicks = Frequency / 1000; // spin through the last millisecond
+
+        auto remaining = target - ReadTimestamp();
+        if (remaining > SpinTicks && nullptr != hTimer)
+        {
+            LARGE_INTEGER dueTime;
+            dueTime.QuadPart = -((remaining - SpinTicks) * 10000000 / Frequency); // relative, in 100ns units
+            ::SetWaitableTimer(hTimer, &dueTime, 0, nullptr, nullptr, FALSE);
+
+            const HANDLE handles[] = { _stopEvent, hTimer };
+            if (WAIT_OBJECT_0 == ::WaitForMultipleObjects(2u, handles, FALSE, INFINITE))
+            {
+                return false;
+            }
+        }
+        else if (remaining > SpinTicks)
+        {
+            if (WAIT_OBJECT_0 == ::WaitForSingleObject(_stopEvent, static_cast<DWORD>((remaining - SpinTicks) * 1000 / Frequency)))
+            {
+                return false;
+            }
+        }
+
+        while (ReadTimestamp() < target)
+        {
+            std::this_thread::yield();
+        }
+
+        return true;
+    }
+
+    void Player::Run(vector<MacroEvent> events, PlaybackOptions options)
+    {
+        static const auto Frequency = TicksPerSecond();
+
+        auto hTimer = ::CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (nullptr == hTimer) // if (an older Windows) fall back to a regular timer
+        {
+            hTimer = ::CreateWaitableTimerExW(nullptr, nullptr, 0u, TIMER_ALL_ACCESS);
+        }
+
+        // The keys the macro has made, and not yet broken; by scancode, with the E0 flag as bit 8.
+        uint32_t madeKeys[512u / 32u] = {};
+        uint8_t madeVirtualKeys[512u] = {};
+        auto isStopped = false;
+
+        const auto start = ReadTimestamp();
+        double scheduledMicroseconds = 0.0;
+
+        for (const auto& event : events)
+        {
+            if (options.speed > 0.0)
+            {
+                scheduledMicroseconds += min(event.delayMicroseconds, options.maxDelayMicroseconds) / options.speed;
+            }
+            const auto target = start + static_cast<int64_t>(scheduledMicroseconds * Frequency / 1000000.0);
+
+            if (!WaitUntil(hTimer, target))
+            {
+                isStopped = true;
+                break;
+            }
+
+            const auto key = event.scancode | ((MacroE0 & event.flags) ? 0x100u : 0u);
+            if (MacroBreak & event.flags)
+            {
+                Clear(madeKeys, key);
+            }
+            else
+            {
+                Set(madeKeys, key);
+                madeVirtualKeys[key] = event.virtualKey;
+            }
+
+            const auto emitted = ReadTimestamp();
+            Emit(event, emitted, options.isSink);
+
+            {
+                const auto jitterSeconds = static_cast<double>(emitted - target) / Frequency;
+
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stats.eventCount++;
+                _stats.totalJitterSeconds += jitterSeconds;
+                _stats.maxJitterSeconds = max(_stats.maxJitterSeconds, jitterSeconds);
+            }
+        }
+
+        // Stopped partway through; break whatever the macro left made, so no key is stuck down.
+        if (isStopped)
+        {
+            for (auto key = 0u; key < 512u; key++)
+            {
+                if (IsSet(madeKeys, key))
+                {
+                    MacroEvent event = {};
+                    event.flags = static_cast<uint8_t>(MacroBreak | ((0x100u & key) ? MacroE0 : 0u));
+                    event.scancode = static_cast<uint8_t>(key);
+                    event.virtualKey = madeVirtualKeys[key];
+                    Emit(event, ReadTimestamp(), options.isSink);
+                }
+            }
+        }
+
+        if (nullptr != hTimer)
+        {
+            ::CloseHandle(hTimer);
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.isPlaying = false;
+    }
+
+    void Player::Emit(const MacroEvent& event, const int64_t emitted, const bool isSink)
+    {
+        if (isSink)
+        {
+            KeyEventRecord keyEvent = {};
+            keyEvent.timestamp = emitted;
+            keyEvent.scancode = event.scancode;
+            keyEvent.virtualKey = event.virtualKey;
+            keyEvent.e0 = (0u != (MacroE0 & event.flags));
+            keyEvent.isBreak = (0u != (MacroBreak & event.flags));
+            keyEvent.injected = true;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _sink.push_back(keyEvent);
+        }
+        else
+        {
+            INPUT input = {};
+            input.type = INPUT_KEYBOARD;
+            input.ki.wScan = event.scancode;
+            input.ki.dwFlags = KEYEVENTF_SCANCODE | ((MacroE0 & event.flags) ? KEYEVENTF_EXTENDEDKEY : 0u) |
+                ((MacroBreak & event.flags) ? KEYEVENTF_KEYUP : 0u);
+            input.ki.dwExtraInfo = selfInjection.signature;
+
+            if (0 == trace::SendInput(1u, &input, sizeof(input)))
+            {
+                std::wcout << L"failed to play back macro input -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            }
+        }
+    }
+
+    Player player;
+} // namespace macros
+
+namespace api
+{
+    template<const char* const CodeTypename>
+    inline uint_fast16_t CheckCodeArgumentFromLua(lua_State* L, int argumentIndex)
+    {
+        uint_fast16_t result;
+
+        const auto code = luaL_checkinteger(L, argumentIndex);
+        if (code < 0 || code > numeric_limits<uint16_t>::max())
+        {
+            luaL_error(L, "%s (%p) is out of range", CodeTypename, code);
+        }
+
+        result = static_cast<uint_fast16_t>(code);
+        return result;
+    }
+
+    template<
+        typename T,
+        T& bitmap,
+        const char* const Typename,
+        const char* const MetatableTypename,
+        const char* const Luaname
+    >
+    class CodeTable
+    {
+    public:
+
+        static int SetIndex(lua_State* L)
+        {
+            luaL_error(L, "%s table is not user writable", Typename); // Does a long jump; never returns.
+
+            // NOTE: luaL_error() prevents this code from executing.
+            return 0;
+        }
+
+        static int Index(lua_State* L)
+        {
+            const auto& keyMap = **static_cast<const T**>(luaL_checkudata(L, 1, MetatableTypename));
+            const auto code = CheckCodeArgumentFromLua<Typename>(L, 2);
+
+            const auto isMade = IsSet(keyMap, code);
+            lua_pushboolean(L, isMade);
+            lua_replace(L, 2);
+            return 1;
+        }
+
+        static int Length(lua_State* L)
+        {
+            const auto totalBitCount = sizeof(bitmap) * 8u;
+            lua_pushinteger(L, totalBitCount);
+            return 1;
+        }
+
+        static int ToString(lua_State* L)
+        {
+            const auto& keyMap = **static_cast<const T**>(luaL_checkudata(L, 1, MetatableTypename));
+
+            string table;
+
+            {
+                string result;
+
+                const auto LineLength = 16u;
+
+                const auto wordSize = sizeof(bitmap[0]);
+                const auto wordCount = sizeof(bitmap) / wordSize;
+                const auto wordBitCount = wordSize * 8u;
+
+                stringstream s;
+                s << std::hex;
+
+                auto key = 0u;
+                for (auto w = 0; w < wordCount; w++)
+                {
+                    const auto word = keyMap[w];
+                    for (auto b = 0; b < wordBitCount; b++, key++)
+                    {
+                        const auto isMade = 0u != (word & (0x1 << b));
+                        if (isMade)
+                        {
+                            s << key;
+                        }
+                        else
+                        {
+                            s << "..";
+                        }
+
+                        if (0 == (key + 1) % LineLength)
+                        {
+                            s << '\n';
+                        }
+                        else if (0 == (key + 1) % (LineLength / 2))
+                        {
+                            s << " -- ";
+                        }
+                        else
+                        {
+                            s << ' ';
+                        }
+                    }
+                }
+
+                table = move(s.str());
+                table.resize(table.size() - 1); // shave off the last linefeed
+            }
+
+            lua_pushlstring(L, table.c_str(), table.length());
+            return 1;
+        }
+
+        // The table is a view of pKeyMap, which defaults to the live key state.
+        static void CreateTable(lua_State* L, const T* pKeyMap = &bitmap)
+        {
+            static const luaL_Reg MetatableFunctions[] =
+            {
+                { "__newindex", &SetIndex },
+                { "__index", &Index },
+                { "__len", &Length },
+                { "__tostring", &ToString },
+                { nullptr, nullptr }
+            };
+
+            {
+                void* v = lua_newuserdata(L, sizeof(pKeyMap)); // push the userdata handle onto stack
+                if (nullptr == v)
+                {
+                    throw runtime_error("failed to create a new Lua userdata object (likely caused by out-of-memory condition)");
+                }
+
+                *static_cast<const T**>(v) = pKeyMap;
+            }
+
+            {
+                const auto result = luaL_newmetatable(L, MetatableTypename); // push meta-table
+                if (0 == result)
+                {
+                    throw logic_error("failed to create a new Lua metatable, it already exists");
+                }
+
+                luaL_register(L, nullptr, MetatableFunctions); // register meta-table functions
+            }
+
+            {
+                const auto result = lua_setmetatable(L, -2); // pop the metatable; assign the metatable to the userdata handle
+                if (0 == result)
+                {
+                    throw runtime_error("failed to set a Lua userdata object's metatable");
+                }
+            }
+
+            lua_setglobal(L, Luaname); // pop the userdata handle, and add it to the global scope
+        }
+    }; // class CodeTable
+
+    enum class CodeType { VirtualKey, Scancode };
+    enum class KeyAction { Make, Break };
+
+    // Define a scancode types for Lua.
+    namespace sc
+    {
+        using dispatch::sc::Typename;
+        extern const char MetatableTypename[] = "UberKey.ScancodeStates";
+        extern const char Luaname[] = "scancodes";
+        using dispatch::sc::MakeLatches;
+        using dispatch::sc::BreakLatches;
+        using dispatch::sc::MakeInterceptions;
+        using dispatch::sc::BreakInterceptions;
+
+        using ScancodeTable = CodeTable<decltype(madeScancodes), madeScancodes, Typename, MetatableTypename, Luaname>;
+    } // namespace sct
+
+    // Define a virtual key types for Lua.
+    namespace vk
+    {
+        using dispatch::vk::Typename;
+        extern const char MetatableTypename[] = "UberKey.VirtualKeyStates";
+        extern const char Luaname[] = "virtual_keys";
+        using dispatch::vk::MakeLatches;
+        using dispatch::vk::BreakLatches;
+        using dispatch::vk::MakeInterceptions;
+        using dispatch::vk::BreakInterceptions;
+
+        using VirtualKeyTable = CodeTable<decltype(madeVirtualKeys), madeVirtualKeys, Typename, MetatableTypename, Luaname>;
+    } // namespace vkt
+
+    // Names a binding after the keyboard function that made it; e.g. "intercept_virtual_key_make(0x41)",
+    //  or "listen_for_scancode_break(0x1e, 2)" for a binding to device 2.
+    string BindingName(const char* const CallbackTablename, lua_Integer callbackIndex)
+    {
+        static const std::pair<const char*, const char*> FunctionNames[] =
+        {
+            { sc::MakeLatches, "listen_for_scancode_make" },
+            { sc::BreakLatches, "listen_for_scancode_break" },
+            { vk::MakeLatches, "listen_for_virtual_key_make" },
+            { vk::BreakLatches, "listen_for_virtual_key_break" },
+            { sc::MakeInterceptions, "intercept_scancode_make" },
+            { sc::BreakInterceptions, "intercept_scancode_break" },
+            { vk::MakeInterceptions, "intercept_virtual_key_make" },
+            { vk::BreakInterceptions, "intercept_virtual_key_break" },
+        };
+
+        stringstream name;
+        for (const auto& functionName : FunctionNames)
+        {
+            if (functionName.first == CallbackTablename)
+            {
+                name << functionName.second;
+                break;
+            }
+        }
+
+        name << "(0x" << std::hex << (0xffff & callbackIndex) << std::dec;
+        if (0 != (callbackIndex >> 16)) // if (bound to one device)
+        {
+            name << ", " << (callbackIndex >> 16);
+        }
+        name << ')';
+
+        return name.str();
+    }
+
+    static_assert(sizeof(KeyEventRecord) == 40u, "KeyEventRecord no longer matches its FFI declaration");
+    static_assert(sizeof(KeyMap) == 32u, "KeyMap no longer matches its FFI declaration");
+
+    // Each thread running Lua callbacks (main or device script) has its own record.
+    thread_local KeyEventRecord currentKeyEvent = {};
+
+    using dispatch::CallbackIndex;
+
+    // Set by keyboard.set_callback_style(); per thread, like the Lua states.
+    thread_local bool isEventCallbackStyle = false;
+    thread_local int eventObjectReference = LUA_NOREF; // keyboard.ffi.event
+
+    // Instruction budget
+    //
+    // Set by keyboard.set_callback_budget(); per thread, like the Lua states. The count hook is only set
+    //  while a callback runs. A callback that keeps running out of instructions is unbound.
+    struct CallbackBudget
+    {
+        int         instructionCount;   // zero for no budget
+        uint32_t    maxOverruns;
+        uint64_t    armedCount;         // callbacks run with the hook set; for the profiler too
+        int64_t     armingTicks;        // time spent setting and clearing the hook
+        uint64_t    overrunCount;
+        uint64_t    disabledCount;
+    };
+
+    thread_local CallbackBudget callbackBudget = { 0, 3u };
+    thread_local bool isBudgetExceeded = false;
+    thread_local unordered_map<const char*, unordered_map<lua_Integer, uint32_t>> overrunCounts;
+
+    // Set by keyboard.profile_start(); samples the main script's callbacks.
+    LuaProfiler profiler;
+    wstring profileFileName;
+
+    // Set by keyboard.set_jit_diagnostics(); the main script's trace report table, or LUA_NOREF.
+    int jitReportReference = LUA_NOREF;
+
+    // Files the trace events that follow under the named binding.
+    // Run with lua_cpcall(); interning the name allocates, and may be refused.
+    int SetJitBindingProtected(lua_State* L)
+    {
+        const auto bindingName = static_cast<const char*>(lua_touserdata(L, 1));
+        lua_rawgeti(L, LUA_REGISTRYINDEX, jitReportReference); // push the report
+        lua_pushstring(L, bindingName);
+        lua_setfield(L, -2, "binding"); // report.binding = bindingName
+        return 0;
+    }
+
+    void SetJitBinding(lua_State* L, const char* bindingName)
+    {
+        if (0 != lua_cpcall(L, &SetJitBindingProtected, const_cast<char*>(bindingName)))
+        {
+            lua_pop(L, 1); // pop the error; the report just names the previous binding
+        }
+    }
+
+    // The count hook's state while a callback runs; shared by the instruction budget and the profiler.
+    thread_local int hookInterval = 0;
+    thread_local int hookBudget = 0; // zero when not budgeted
+    thread_local int64_t instructionsRun = 0;
+    thread_local int64_t nextSampleAt = 0; // zero when not sampling
+
+    void CallbackHook(lua_State* L, lua_Debug* ar)
+    {
+        UNREFERENCED_PARAMETER(ar);
+
+        instructionsRun += hookInterval;
+
+        if (0 != nextSampleAt && instructionsRun >= nextSampleAt)
+        {
+            profiler.Sample(L);
+            nextSampleAt += profiler.sampleInterval();
+        }
+
+        if (0 != hookBudget && instructionsRun >= hookBudget)
+        {
+            isBudgetExceeded = true;
+            luaL_error(L, "callback ran out of instructions (budget: %d)", hookBudget);
+        }
+    }
+
+    // Sets the count hook, if the budget or the profiler needs it. Returns true if the hook was set.
+    //  The budget is in instructions; with zero, only the profiler's samples are taken.
+    bool SetCallbackHook(lua_State* L, const string& bindingName, const int budget)
+    {
+        const auto isSampling = (L == luaState && profiler.isRunning());
+
+        if (!isSampling && 0 == budget)
+        {
+            return false;
+        }
+
+        if (isSampling)
+        {
+            profiler.SetRoot(bindingName);
+            hookInterval = (0 != budget) ? min(budget, profiler.sampleInterval()) : profiler.sampleInterval();
+            nextSampleAt = profiler.sampleInterval();
+        }
+        else
+        {
+            hookInterval = budget;
+            nextSampleAt = 0;
+        }
+        hookBudget = budget;
+        instructionsRun = 0;
+        isBudgetExceeded = false;
+
+        lua_sethook(L, &CallbackHook, LUA_MASKCOUNT, hookInterval);
+        return true;
+    }
+
+    // Sets the count hook for a callback, under keyboard.set_callback_budget()'s budget.
+    inline bool SetCallbackHook(lua_State* L, const string& bindingName)
+    {
+        return SetCallbackHook(L, bindingName, callbackBudget.instructionCount);
+    }
+
+    void DisableKeyCallback(lua_State* L, const char* const CallbackTablename, lua_Integer callbackIndex);
+
+    // Counts an overrun against a callback, and unbinds it after too many.
+    void ChargeOverrun(lua_State* L, const char* const CallbackTablename, lua_Integer callbackIndex)
+    {
+        callbackBudget.overrunCount++;
+
+        auto& overruns = overrunCounts[CallbackTablename][callbackIndex];
+        if (++overruns >= callbackBudget.maxOverruns)
+        {
+            overrunCounts[CallbackTablename].erase(callbackIndex);
+            callbackBudget.disabledCount++;
+            std::wcout << "Callback disabled after running out of instructions " << overruns << " times." << std::endl;
+
+            DisableKeyCallback(L, CallbackTablename, callbackIndex);
+        }
+    }
+
+    void KeyCallbackHandler(lua_State* L, const char* const CallbackTablename, lua_Integer callbackIndex, const KeyEventRecord& keyEvent)
+    {
+        if (!dispatch::PushKeyCallback(L, CallbackTablename, callbackIndex)) // if (only native handlers are bound to the key)
+        {
+            return;
+        }
+
+        // publish the event to keyboard.ffi.event
+        currentKeyEvent = keyEvent;
+
+        const auto argumentCount = dispatch::PushKeyCallbackArguments(L, reinterpret_cast<const uberkey_key_event&>(keyEvent), isEventCallbackStyle ? eventObjectReference : LUA_NOREF);
+
+        // Do callback(virtualKey, scancode, e0, e1, extraInformation, device) or callback(event)
+        {
+            trace::SequenceScope sequenceScope(keyEvent.sequence); // NOTE: device scripts' threads too
+            const auto isJitReporting = (L == luaState && LUA_NOREF != jitReportReference);
+            if (isJitReporting)
+            {
+                SetJitBinding(L, BindingName(CallbackTablename, callbackIndex).c_str());
+            }
+
+            const auto start = ReadTimestamp();
+            const auto isHooked = SetCallbackHook(L, (L == luaState && profiler.isRunning()) ? BindingName(CallbackTablename, callbackIndex) : string());
+            if (isHooked)
+            {
+                callbackBudget.armingTicks += ReadTimestamp() - start;
+            }
+
+            const auto allocatedBefore = memory::AllocatedBytes(L);
+            const auto callStart = ReadTimestamp();
+            const auto result = lua_pcall(L, argumentCount, 0, 0);
+            trace::Record(trace::Stage::Lua, keyEvent.sequence, callStart, ReadTimestamp());
+            memory::AccountForCallback(L, CallbackTablename, callbackIndex, allocatedBefore, result);
+
+            if (isHooked)
+            {
+                const auto start = ReadTimestamp();
+                lua_sethook(L, nullptr, 0, 0);
+                callbackBudget.armingTicks += ReadTimestamp() - start;
+                callbackBudget.armedCount++;
+            }
+
+            if (isJitReporting)
+            {
+                SetJitBinding(L, "script");
+            }
+
+            if (0 != result)
+            {
+                std::wcout << dispatch::CallbackErrorDescription(result) << std::endl;
+            }
+
+            if (0 != result && isBudgetExceeded)
+            {
+                isBudgetExceeded = false;
+                ChargeOverrun(L, CallbackTablename, callbackIndex);
+            }
+        }
+    }
+
+    // Lua Dispatch Mode
+    //
+    // The main script may have its callbacks run by a dispatcher loop written in Lua, resumed once per
+    //  batch of key events; see dispatch::LuaDispatcher. Device scripts always use native dispatch.
+
+    enum class DispatchMode { Native, Lua };
+
+    DispatchMode dispatchMode = DispatchMode::Native;
+
+    // The callback tables in the order the dispatcher indexes them (from 1); by binding kind.
+    using dispatch::CallbackTableNames;
+
+    inline uint8_t CallbackTableId(const char* const callbackTablename)
+    {
+        return static_cast<uint8_t>(dispatch::BindingKindOf(callbackTablename) + 1u);
+    }
+
+    dispatch::LuaDispatcher luaDispatcher;
+
+    void CreateDispatcher(lua_State* L)
+    {
+        luaDispatcher.Create(L, reinterpret_cast<uberkey_key_event*>(&currentKeyEvent));
+        luaDispatcher.SetEventCallbackStyle(isEventCallbackStyle);
+    }
+
+    // Runs the dispatcher until it has drained the ring.
+    void ResumeDispatcher()
+    {
+        if (luaDispatcher.isDispatching() || luaDispatcher.isEmpty())
+        {
+            return;
+        }
+
+        // NOTE: the dispatcher runs callbacks itself, so its samples are all rooted at the dispatcher
+        // NOTE: Not budgeted; the budget is per callback, and this is a whole batch of them.
+        const auto isHooked = SetCallbackHook(luaState, "lua_dispatcher", 0);
+        if (LUA_NOREF != jitReportReference)
+        {
+            SetJitBinding(luaState, "lua_dispatcher");
+        }
+
+        {
+            trace::Scope span(trace::Stage::Lua, trace::NoSequence); // the whole batch; the events aren't told apart
+
+            // A callback raised an error, which ends the coroutine; report it, and start over with the next event.
+            luaDispatcher.Resume([](const string& message)
+            {
+                std::cout << "Lua runtime error in dispatched callback: " << message << std::endl;
+            });
+        }
+
+        if (isHooked)
+        {
+            lua_sethook(luaState, nullptr, 0, 0);
+        }
+        if (LUA_NOREF != jitReportReference)
+        {
+            SetJitBinding(luaState, "script");
+        }
+    }
+
+    void QueueKeyCallback(const char* const CallbackTablename, lua_Integer callbackIndex, const KeyEventRecord& keyEvent)
+    {
+        if (luaDispatcher.isFull()) // dispatch what's there now
+        {
+            ResumeDispatcher();
+        }
+
+        const auto isNewBatch = luaDispatcher.isEmpty();
+        if (!luaDispatcher.Queue(dispatch::BindingKindOf(CallbackTablename), callbackIndex, reinterpret_cast<const uberkey_key_event&>(keyEvent))) // if (still full; queued from a dispatched callback)
+        {
+            std::wcout << L"Lua dispatcher ring overflow; key event dropped." << std::endl;
+            return;
+        }
+
+        if (isNewBatch) // have the event loop resume the dispatcher
+        {
+            ::PostMessageW(_windowHandle, DispatchKeyEventsMessage, 0, 0);
+        }
+    }
+
+    // How often a make binding's callback runs while its key autorepeats. The filters live with the
+    //  Lua state that made the binding, and are checked before any Lua code runs.
+    enum class RepeatMode : uint8_t
+    {
+        Every,      // every repeat; the default
+        First,      // the first make only
+        EveryNth,   // the first make, and every Nth repeat
+        MaxRate,    // no more often than a given number of times per second
+    };
+
+    struct RepeatFilter
+    {
+        RepeatMode  mode;
+        uint32_t    n;
+        int64_t     intervalTicks;
+        int64_t     lastRun;
+    };
+
+    thread_local unordered_map<uint32_t, RepeatFilter> repeatFilters;
+
+    inline uint32_t RepeatFilterKey(const char* const CallbackTablename, lua_Integer callbackIndex)
+    {
+        return (static_cast<uint32_t>(CallbackTableId(CallbackTablename)) << 24) | static_cast<uint32_t>(callbackIndex);
+    }
+
+    bool IsRepeatFiltered(const char* const CallbackTablename, lua_Integer callbackIndex, const KeyEventRecord& keyEvent)
+    {
+        if (keyEvent.isBreak || repeatFilters.empty())
+        {
+            return false;
+        }
+
+        const auto found = repeatFilters.find(RepeatFilterKey(CallbackTablename, callbackIndex));
+        if (repeatFilters.end() == found)
+        {
+            return false;
+        }
+
+        auto& filter = found->second;
+        switch (filter.mode)
+        {
+        case RepeatMode::First:
+            return 0u != keyEvent.repeatCount;
+        case RepeatMode::EveryNth:
+            return 0u != (keyEvent.repeatCount % filter.n);
+        case RepeatMode::MaxRate:
+            if (0u != keyEvent.repeatCount && keyEvent.timestamp - filter.lastRun < filter.intervalTicks)
+            {
+                return true;
+            }
+            filter.lastRun = keyEvent.timestamp;
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    // JIT Diagnostics
+    //
+    // Attaches to LuaJIT's trace events, and counts trace starts, stops, and aborts by the binding whose
+    //  callback was running. Abort reasons name the keyboard function when one of ours is to blame.
+
+    const char JitReportSource[] = R"(
+        local report = { binding = "script", bindings = {} }
+        local jit = require("jit")
+        local util = require("jit.util")
+        local has_vmdef, vmdef = pcall(require, "jit.vmdef")
+
+        local api_names
+        local function describe(func, pc)
+            if api_names == nil then
+                api_names = {}
+                for name, f in pairs(keyboard) do
+                    if type(f) == "function" then
+                        api_names[f] = "keyboard." .. name
+                    end
+                end
+            end
+            if api_names[func] then
+                return api_names[func]
+            end
+
+            local info = util.funcinfo(func, pc)
+            if info.loc then
+                return info.loc
+            elseif info.ffid and has_vmdef and vmdef.ffnames[info.ffid] then
+                return vmdef.ffnames[info.ffid]
+            elseif info.addr then
+                return string.format("C:%x", info.addr)
+            end
+            return "?"
+        end
+
+        local function reason(err, info)
+            if type(err) == "number" then
+                if type(info) == "function" then
+                    info = describe(info)
+                end
+                if has_vmdef and vmdef.traceerr[err] then
+                    return string.format(vmdef.traceerr[err], info)
+                end
+                return "trace error " .. err
+            end
+            return tostring(err)
+        end
+
+        local function handler(what, tr, func, pc, otr, oex)
+            local entry = report.bindings[report.binding]
+            if entry == nil then
+                entry = { starts = 0, stops = 0, aborts = 0, reasons = {} }
+                report.bindings[report.binding] = entry
+            end
+
+            if what == "start" then
+                entry.starts = entry.starts + 1
+            elseif what == "stop" then
+                entry.stops = entry.stops + 1
+            elseif what == "abort" then
+                entry.aborts = entry.aborts + 1
+                local key = reason(otr, oex) .. " at " .. describe(func, pc)
+                entry.reasons[key] = (entry.reasons[key] or 0) + 1
+            end
+        end
+
+        local function format()
+            local lines = {}
+            for binding, entry in pairs(report.bindings) do
+                lines[#lines + 1] = string.format("%s: %d started, %d stopped, %d aborted",
+                    binding, entry.starts, entry.stops, entry.aborts)
+                for text, count in pairs(entry.reasons) do
+                    lines[#lines + 1] = string.format("    %5d  %s", count, text)
+                end
+            end
+            return table.concat(lines, "\n") .. "\n"
+        end
+
+        report.handler = handler
+        report.format = format
+        return report
+    )";
+
+    // Attaches the trace event handler, or, given false, detaches it.
+    void EnableJitDiagnostics(lua_State* L, const bool isEnabled)
+    {
+        if (isEnabled == (LUA_NOREF != jitReportReference))
+        {
+            return;
+        }
+
+        if (isEnabled)
+        {
+            const auto result = luaL_loadbuffer(L, JitReportSource, sizeof(JitReportSource) - 1u, "UberKey_JitReport"); // push the chunk
+            if (LUA_ERRMEM == result)
+            {
+                throw bad_alloc();
+            }
+            else if (0 != result)
+            {
+                throw logic_error("failed to compile the JIT report");
+            }
+
+            if (0 != lua_pcall(L, 0, 1, 0)) // pop the chunk; push the report
+            {
+                const string message = lua_tostring(L, -1);
+                lua_pop(L, 1);
+                throw runtime_error("failed to create the JIT report: " + message);
+            }
+            jitReportReference = luaL_ref(L, LUA_REGISTRYINDEX); // pop the report
+        }
+
+        // jit.attach(report.handler, "trace") or jit.attach(report.handler)
+        lua_getglobal(L, "jit"); // push jit
+        lua_getfield(L, -1, "attach"); // push jit.attach
+        lua_rawgeti(L, LUA_REGISTRYINDEX, jitReportReference); // push the report
+        lua_getfield(L, -1, "handler"); // push report.handler
+        lua_replace(L, -2); // overwrite the report with its handler
+        auto argumentCount = 1;
+        if (isEnabled)
+        {
+            lua_pushliteral(L, "trace");
+            argumentCount++;
+        }
+        const auto result = lua_pcall(L, argumentCount, 0, 0); // pop jit.attach and its arguments
+        lua_pop(L, (0 != result) ? 2 : 1); // pop any error message, and jit
+
+        if (!isEnabled)
+        {
+            luaL_unref(L, LUA_REGISTRYINDEX, jitReportReference);
+            jitReportReference = LUA_NOREF;
+        }
+
+        if (0 != result)
+        {
+            throw runtime_error("failed to attach to the JIT's trace events");
+        }
+    }
+
+    // Native Handlers
+    //
+    // Handlers bound by plugins (see UberKeyPlugin.h). They share the key maps with the Lua callbacks, and
+    //  are called from the key dispatch, on the main thread, around the key's Lua callback. With the capture
+    //  thread, that's after the hook has returned; only the remap image runs on the capture thread, from the hook.
+
+    NativeHandlerTable nativeHandlers;
+
+    static_assert(sizeof(uberkey_key_event) == sizeof(KeyEventRecord), "uberkey_key_event no longer matches KeyEventRecord");
+
+    inline NativeHandlerList FindNativeHandlers(const char* const CallbackTablename, lua_Integer callbackIndex)
+    {
+        if (nativeHandlers.empty())
+        {
+            return nullptr;
+        }
+
+        // NOTE: the table ids are the binding kinds, plus one
+        const auto index = static_cast<uint32_t>(callbackIndex);
+        return nativeHandlers.Find(CallbackTableId(CallbackTablename) - 1u, index >> 16, 0xffffu & index);
+    }
+
+    inline void RunNativeHandlers(const NativeHandlerList& handlers, const KeyEventRecord& keyEvent, const bool isBeforeLua)
+    {
+        NativeHandlerTable::Run(handlers, reinterpret_cast<const uberkey_key_event&>(keyEvent), isBeforeLua);
+    }
+
+    inline void RunKeyCallback(lua_State* L, const char* const CallbackTablename, lua_Integer callbackIndex, const KeyEventRecord& keyEvent)
+    {
+        // NOTE: held until the handlers are done; a handler may bind or unbind handlers
+        const auto handlers = FindNativeHandlers(CallbackTablename, callbackIndex);
+
+        RunNativeHandlers(handlers, keyEvent, true);
+
+        if (!IsRepeatFiltered(CallbackTablename, callbackIndex, keyEvent)) // NOTE: an intercepted key is still consumed
+        {
+            if (DispatchMode::Lua == dispatchMode && L == luaState && !NativeHandlerTable::HasHandlersAfterScript(handlers))
+            {
+                QueueKeyCallback(CallbackTablename, callbackIndex, keyEvent);
+            }
+            else
+            {
+                // Handlers ordered after the Lua callback need it to have run; so the key is dispatched now,
+                //  after the events already queued for the dispatcher.
+                if (DispatchMode::Lua == dispatchMode && L == luaState)
+                {
+                    ResumeDispatcher();
+                }
+                KeyCallbackHandler(L, CallbackTablename, callbackIndex, keyEvent);
+            }
+        }
+
+        RunNativeHandlers(handlers, keyEvent, false);
+    }
+
+    // A callback table's uberkey_binding_kind; a constant, once the template's instantiated.
+    template<const char* const CallbackTablename>
+    inline uint32_t BindingKindOf()
+    {
+        return (sc::MakeLatches == CallbackTablename) ? UBERKEY_LISTEN_FOR_SCANCODE_MAKE :
+            (sc::BreakLatches == CallbackTablename) ? UBERKEY_LISTEN_FOR_SCANCODE_BREAK :
+            (vk::MakeLatches == CallbackTablename) ? UBERKEY_LISTEN_FOR_VIRTUAL_KEY_MAKE :
+            (vk::BreakLatches == CallbackTablename) ? UBERKEY_LISTEN_FOR_VIRTUAL_KEY_BREAK :
+            (sc::MakeInterceptions == CallbackTablename) ? UBERKEY_INTERCEPT_SCANCODE_MAKE :
+            (sc::BreakInterceptions == CallbackTablename) ? UBERKEY_INTERCEPT_SCANCODE_BREAK :
+            (vk::MakeInterceptions == CallbackTablename) ? UBERKEY_INTERCEPT_VIRTUAL_KEY_MAKE : UBERKEY_INTERCEPT_VIRTUAL_KEY_BREAK;
+    }
+
+    // Runs the callbacks bound to any device, and to the given device, when their key maps are set.
+    //  Returns true if any callback was run.
+    template<CodeType useCode, const char* const CallbackTablename, KeyMap devices::KeyboardDevice::* keyMap>
+    bool DispatchKeyCallbacks(lua_State* L, const KeyEventRecord& keyEvent)
+    {
+        const auto code = (useCode == CodeType::VirtualKey) ? keyEvent.virtualKey : keyEvent.scancode;
+        const auto device = keyEvent.device;
+
+        trace::SequenceScope sequenceScope(keyEvent.sequence);
+        const auto start = ReadTimestamp();
+
+        const auto isDispatched = dispatch::DispatchKeyCallbacks(devices::AnyKeyboard().*keyMap, devices::keyboardDevices[device].*keyMap, device, code, [&](const uint_fast8_t slot, const lua_Integer callbackIndex)
+        {
+            if (devices::AnyDevice != slot && scripts::deviceScripts[slot]) // if (the device has its own script) let the script's thread run the callback
+            {
+                const auto handlers = FindNativeHandlers(CallbackTablename, callbackIndex);
+                RunNativeHandlers(handlers, keyEvent, true);
+                (void)scripts::EnqueueKeyEvent(CallbackTablename, useCode == CodeType::VirtualKey, keyEvent);
+                RunNativeHandlers(handlers, keyEvent, false);
+            }
+            else
+            {
+                RunKeyCallback(L, CallbackTablename, callbackIndex, keyEvent);
+            }
+        });
+
+        if (isDispatched)
+        {
+            usage::Count(static_cast<usage::Action>(usage::FirstBinding + BindingKindOf<CallbackTablename>()), code);
+            trace::Record(trace::Stage::Dispatch, keyEvent.sequence, start, ReadTimestamp());
+        }
+
+        return isDispatched;
+    }
+
+    // Fills in a key event seen by the low-level hook, and merges it into the event stream.
+    KeyEventRecord MakeHookKeyEvent(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, bool isBreak, uint_fast32_t time, int64_t timestamp)
+    {
+        KeyEventRecord keyEvent = {};
+        keyEvent.timestamp = timestamp;
+        keyEvent.virtualKey = static_cast<uint16_t>(virtualKey);
+        keyEvent.scancode = static_cast<uint16_t>(scancode);
+        keyEvent.e0 = e0;
+        keyEvent.injected = injected;
+        keyEvent.extraInformation = static_cast<uint32_t>(extraInformation);
+        keyEvent.device = static_cast<uint8_t>(devices::CorrelateHookEvent(scancode));
+        keyEvent.deviceHandle = reinterpret_cast<uint64_t>(devices::keyboardDevices[keyEvent.device].handle);
+        keyEvent.isBreak = isBreak;
+
+        if (!stream::MergeHookEvent(keyEvent, static_cast<uint32_t>(time))) // if (the second callback for this key event)
+        {
+            keyEvent.device = stream::StreamEntry(keyEvent.sequence).device;
+            keyEvent.deviceHandle = reinterpret_cast<uint64_t>(devices::keyboardDevices[keyEvent.device].handle);
+        }
+        else
+        {
+            if (isBreak)
+            {
+                devices::ForgetHookEvent(scancode);
+            }
+
+            keyEvent.repeatCount = devices::CountRepeat(devices::hookMadeKeys, devices::hookRepeatCounts, devices::HookKeyIndex(scancode, e0), isBreak);
+            stream::StreamEntry(keyEvent.sequence).repeatCount = keyEvent.repeatCount;
+        }
+
+        return keyEvent;
+    }
+
+    void CompleteHookEvent(const KeyEventRecord& keyEvent, const bool isConsumed)
+    {
+        stream::CompleteHookEvent(keyEvent, isConsumed);
+
+        if (isConsumed && !(keyEvent.injected && selfInjection.signature == keyEvent.extraInformation)) // if (it won't show up as raw input)
+        {
+            macros::Record(keyEvent);
+        }
+    }
+
+    bool InterceptedVirtualKeyMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time)
+    {
+        if (nullptr == luaState)
+        {
+            return false;
+        }
+        const auto start = ReadTimestamp();
+        capture::RecordDelay(static_cast<uint32_t>(time));
+        const auto keyEvent = MakeHookKeyEvent(virtualKey, scancode, e0, injected, extraInformation, false, time, start);
+        const auto isConsumed = DispatchKeyCallbacks<CodeType::VirtualKey, vk::MakeInterceptions, &devices::KeyboardDevice::interceptedVirtualKeyMakes>(luaState, keyEvent);
+        CompleteHookEvent(keyEvent, isConsumed);
+        trace::Record(trace::Stage::Hook, keyEvent.sequence, start, ReadTimestamp());
+        return isConsumed;
+    }
+
+    bool InterceptedVirtualKeyBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time)
+    {
+        if (nullptr == luaState)
+        {
+            return false;
+        }
+        const auto start = ReadTimestamp();
+        capture::RecordDelay(static_cast<uint32_t>(time));
+        const auto keyEvent = MakeHookKeyEvent(virtualKey, scancode, e0, injected, extraInformation, true, time, start);
+        const auto isConsumed = DispatchKeyCallbacks<CodeType::VirtualKey, vk::BreakInterceptions, &devices::KeyboardDevice::interceptedVirtualKeyBreaks>(luaState, keyEvent);
+        CompleteHookEvent(keyEvent, isConsumed);
+        trace::Record(trace::Stage::Hook, keyEvent.sequence, start, ReadTimestamp());
+        return isConsumed;
+    }
+
+    bool InterceptedScancodeMakeHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time)
+    {
+        if (nullptr == luaState)
+        {
+            return false;
+        }
+        const auto start = ReadTimestamp();
+        capture::RecordDelay(static_cast<uint32_t>(time));
+        const auto keyEvent = MakeHookKeyEvent(virtualKey, scancode, e0, injected, extraInformation, false, time, start);
+        const auto isConsumed = DispatchKeyCallbacks<CodeType::Scancode, sc::MakeInterceptions, &devices::KeyboardDevice::interceptedScancodeMakes>(luaState, keyEvent);
+        CompleteHookEvent(keyEvent, isConsumed);
+        trace::Record(trace::Stage::Hook, keyEvent.sequence, start, ReadTimestamp());
+        return isConsumed;
+    }
+
+    bool InterceptedScancodeBreakHander(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time)
+    {
+        if (nullptr == luaState)
+        {
+            return false;
+        }
+        const auto start = ReadTimestamp();
+        capture::RecordDelay(static_cast<uint32_t>(time));
+        const auto keyEvent = MakeHookKeyEvent(virtualKey, scancode, e0, injected, extraInformation, true, time, start);
+        const auto isConsumed = DispatchKeyCallbacks<CodeType::Scancode, sc::BreakInterceptions, &devices::KeyboardDevice::interceptedScancodeBreaks>(luaState, keyEvent);
+        CompleteHookEvent(keyEvent, isConsumed);
+        trace::Record(trace::Stage::Hook, keyEvent.sequence, start, ReadTimestamp());
+        return isConsumed;
+    }
+
+    // The optional device argument is either a device slot number, or a device identifier string.
+    uint_fast8_t CheckDeviceArgumentFromLua(lua_State* L, int argumentIndex)
+    {
+        // A device script only ever deals with its own device.
+        {
+            const auto pScript = scripts::FindDeviceScript(L);
+            if (nullptr != pScript)
+            {
+                return pScript->device();
+            }
+        }
+
+        if (lua_isnoneornil(L, argumentIndex))
+        {
+            return devices::AnyDevice;
+        }
+
+        if (LUA_TSTRING == lua_type(L, argumentIndex))
+        {
+            const auto slot = devices::ReserveDeviceSlot(lua_tostring(L, argumentIndex));
+            if (devices::AnyDevice == slot)
+            {
+                luaL_error(L, "too many devices; no more than %d may be used", devices::MaxDeviceCount - 1);
+            }
+            return slot;
+        }
+
+        const auto slot = luaL_checkinteger(L, argumentIndex);
+        if (slot < 0 || slot >= devices::MaxDeviceCount)
+        {
+            luaL_error(L, "device (%d) is out of range", static_cast<int>(slot));
+        }
+
+        return static_cast<uint_fast8_t>(slot);
+    }
+
+    // The optional repeat argument is "all" (the default), "first", { every = n }, or { max_rate = hz }.
+    //  Returns false when every repeat should run the callback.
+    bool CheckRepeatArgumentFromLua(lua_State* L, int argumentIndex, RepeatFilter& filter)
+    {
+        filter = RepeatFilter();
+
+        if (lua_isnoneornil(L, argumentIndex))
+        {
+            return false;
+        }
+
+        if (LUA_TSTRING == lua_type(L, argumentIndex))
+        {
+            const string mode = lua_tostring(L, argumentIndex);
+            if ("all" == mode)
+            {
+                return false;
+            }
+            else if ("first" == mode)
+            {
+                filter.mode = RepeatMode::First;
+                return true;
+            }
+
+            luaL_error(L, "unrecognized repeat mode \"%s\"; expected \"all\" or \"first\"", mode.c_str());
+        }
+
+        luaL_checktype(L, argumentIndex, LUA_TTABLE);
+
+        lua_getfield(L, argumentIndex, "every"); // push t.every
+        lua_getfield(L, argumentIndex, "max_rate"); // push t.max_rate
+        if (!lua_isnil(L, -2))
+        {
+            const auto n = luaL_checkinteger(L, -2);
+            if (n < 1)
+            {
+                luaL_error(L, "repeat interval (%d) must be at least 1", static_cast<int>(n));
+            }
+            filter.mode = RepeatMode::EveryNth;
+            filter.n = static_cast<uint32_t>(n);
+        }
+        else if (!lua_isnil(L, -1))
+        {
+            const auto hz = luaL_checknumber(L, -1);
+            if (!(hz > 0.0))
+            {
+                luaL_error(L, "repeat rate must be greater than zero");
+            }
+
+            LARGE_INTEGER frequency;
+            ::QueryPerformanceFrequency(&frequency);
+
+            filter.mode = RepeatMode::MaxRate;
+            filter.intervalTicks = static_cast<int64_t>(frequency.QuadPart / hz);
+            filter.lastRun = numeric_limits<int64_t>::min();
+        }
+        else
+        {
+            luaL_error(L, "repeat table needs an \"every\" or \"max_rate\" field");
+        }
+        lua_pop(L, 2);
+
+        return true;
+    }
+
+    void ClearKeyMaps(KeyMap& keyMap, KeyMap devices::KeyboardDevice::* deviceKeyMap, const uint_fast8_t device, const uint_fast16_t code)
+    {
+        Clear(devices::keyboardDevices[device].*deviceKeyMap, code);
+
+        // Only clear the union map once no device has the code bound.
+        {
+            auto isBound = false;
+            for (const auto& keyboard : devices::keyboardDevices)
+            {
+                isBound = isBound || IsSet(keyboard.*deviceKeyMap, code);
+            }
+
+            if (!isBound)
+            {
+                Clear(keyMap, code);
+            }
+        }
+    }
+
+    // Binding Changes
+    //
+    // The key maps are read by the key dispatch, on the main thread, without a lock; so a device script
+    //  doesn't change them itself. Its threads queue the change, and the main thread applies it between
+    //  key events. A device script's binding takes effect shortly after the call returns.
+
+    struct BindingChange
+    {
+        KeyMap*                             keyMap;
+        KeyMap devices::KeyboardDevice::*   deviceKeyMap;
+        const char*                         callbackTablename;
+        uint_fast8_t                        device;
+        uint_fast16_t                       code;
+        bool                                isBound;
+    };
+
+    std::mutex bindingChangeMutex; // guards bindingChanges
+    vector<BindingChange> bindingChanges;
+
+    void PostBindingChange(const BindingChange& change)
+    {
+        auto isFirst = false;
+        {
+            std::lock_guard<std::mutex> lock(bindingChangeMutex);
+            isFirst = bindingChanges.empty();
+            bindingChanges.push_back(change);
+        }
+
+        if (isFirst) // if (the main thread hasn't already been told)
+        {
+            // NOTE: Posted to the thread, rather than the window; a script can start before the window exists.
+            ::PostThreadMessageW(luaThreadId, BindingChangeMessage, 0, 0);
+        }
+    }
+
+    // NOTE: Main thread only.
+    void ApplyBindingChange(const BindingChange& change)
+    {
+        if (change.isBound)
+        {
+            Set(devices::keyboardDevices[change.device].*change.deviceKeyMap, change.code);
+            Set(*change.keyMap, change.code);
+        }
+        else if (nullptr == FindNativeHandlers(change.callbackTablename, CallbackIndex(change.device, change.code))) // if (no plugin still needs the key)
+        {
+            ClearKeyMaps(*change.keyMap, change.deviceKeyMap, change.device, change.code);
+        }
+    }
+
+    // NOTE: Main thread only.
+    void ApplyBindingChanges()
+    {
+        vector<BindingChange> changes;
+        {
+            std::lock_guard<std::mutex> lock(bindingChangeMutex);
+            changes.swap(bindingChanges);
+        }
+
+        for (const auto& change : changes)
+        {
+            ApplyBindingChange(change);
+        }
+
+        if (!changes.empty())
+        {
+            shared::PublishKeyMaps();
+        }
+    }
+
+    // Applies the change, or queues it for the main thread when called from a device script.
+    void ChangeBinding(lua_State* L, const BindingChange& change)
+    {
+        if (nullptr != scripts::FindDeviceScript(L))
+        {
+            PostBindingChange(change);
+            return;
+        }
+
+        ApplyBindingChange(change);
+        shared::PublishKeyMaps();
+    }
+
+    template<KeyMap& keyMap, KeyMap devices::KeyboardDevice::* deviceKeyMap, const char* const CallbackTablename, const char* const Typename>
+    int SetKeyCallback(lua_State* L)
+    {
+        // Argument checking
+        if (lua_gettop(L) < 2) // if (there are less than 2 Lua arguments passed to this function)
+        {
+            luaL_error(L, "not enough arguments; ([integer] %s, [function] callback, [[device]], [[repeat]])", Typename);
+        }
+
+        const auto code = CheckCodeArgumentFromLua<Typename>(L, 1);
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        const auto device = CheckDeviceArgumentFromLua(L, 3);
+        RepeatFilter repeatFilter;
+        const auto isRepeatFiltered = CheckRepeatArgumentFromLua(L, 4, repeatFilter);
+        lua_settop(L, 2);
+
+        if (nullptr == scripts::FindDeviceScript(L) && scripts::deviceScripts[device])
+        {
+            luaL_error(L, "device (%d) is bound to its own script", static_cast<int>(device));
+        }
+
+        // Rebinding a key resets its repeat filter.
+        {
+            const auto key = RepeatFilterKey(CallbackTablename, CallbackIndex(device, code));
+            if (isRepeatFiltered)
+            {
+                repeatFilters[key] = repeatFilter;
+            }
+            else
+            {
+                repeatFilters.erase(key);
+            }
+        }
+
+        // Add function to callback table.
+        ChangeBinding(L, BindingChange{ &keyMap, deviceKeyMap, CallbackTablename, device, code, true });
+
+        dispatch::StoreKeyCallback(L, CallbackTablename, CallbackIndex(device, code)); // callbacks[code] = argv[2]; pop callback
+
+        assert(lua_gettop(L) == 1);
+
+        return 0;
+    }
+
+    template<KeyMap& keyMap, KeyMap devices::KeyboardDevice::* deviceKeyMap, const char* const CallbackTablename, const char* const Typename>
+    int ClearKeyCallback(lua_State* L)
+    {
+        // Argument checking
+        if (lua_gettop(L) < 1) // if (no arguments passed to this function)
+        {
+            luaL_error(L, "not enough arguments; ([integer] %s, [[device]])", Typename);
+        }
+
+        const auto code = CheckCodeArgumentFromLua<Typename>(L, 1);
+        const auto device = CheckDeviceArgumentFromLua(L, 2);
+        lua_settop(L, 1);
+
+        repeatFilters.erase(RepeatFilterKey(CallbackTablename, CallbackIndex(device, code)));
+        memory::ForgetCallback(CallbackTablename, CallbackIndex(device, code));
+
+        // Remove function from callback table.
+        ChangeBinding(L, BindingChange{ &keyMap, deviceKeyMap, CallbackTablename, device, code, false });
+
+        lua_pushnil(L); // push nil to delete any Lua callback
+        dispatch::StoreKeyCallback(L, CallbackTablename, CallbackIndex(device, code)); // callbacks[code] = nil; pop nil
+
+        assert(lua_gettop(L) == 1);
+
+        return 0;
+    }
+
+    void DisableKeyCallback(lua_State* L, const char* const CallbackTablename, lua_Integer callbackIndex)
+    {
+        // In the order of CallbackTableNames.
+        static const lua_CFunction ClearFunctions[] =
+        {
+            &ClearKeyCallback<latchedScancodeMakes, &devices::KeyboardDevice::latchedScancodeMakes, sc::MakeLatches, sc::Typename>,
+            &ClearKeyCallback<latchedScancodeBreaks, &devices::KeyboardDevice::latchedScancodeBreaks, sc::BreakLatches, sc::Typename>,
+            &ClearKeyCallback<latchedVirtualKeyMakes, &devices::KeyboardDevice::latchedVirtualKeyMakes, vk::MakeLatches, vk::Typename>,
+            &ClearKeyCallback<latchedVirtualKeyBreaks, &devices::KeyboardDevice::latchedVirtualKeyBreaks, vk::BreakLatches, vk::Typename>,
+            &ClearKeyCallback<interceptedScancodeMakes, &devices::KeyboardDevice::interceptedScancodeMakes, sc::MakeInterceptions, sc::Typename>,
+            &ClearKeyCallback<interceptedScancodeBreaks, &devices::KeyboardDevice::interceptedScancodeBreaks, sc::BreakInterceptions, sc::Typename>,
+            &ClearKeyCallback<interceptedVirtualKeyMakes, &devices::KeyboardDevice::interceptedVirtualKeyMakes, vk::MakeInterceptions, vk::Typename>,
+            &ClearKeyCallback<interceptedVirtualKeyBreaks, &devices::KeyboardDevice::interceptedVirtualKeyBreaks, vk::BreakInterceptions, vk::Typename>,
+        };
+        static_assert(sizeof(ClearFunctions) / sizeof(ClearFunctions[0]) == sizeof(CallbackTableNames) / sizeof(CallbackTableNames[0]), "ClearFunctions no longer matches CallbackTableNames");
+
+        lua_pushcfunction(L, ClearFunctions[CallbackTableId(CallbackTablename) - 1u]); // push the clear function
+        lua_pushinteger(L, 0xffff & callbackIndex); // push the code
+        lua_pushinteger(L, callbackIndex >> 16); // push the device
+        if (0 != lua_pcall(L, 2, 0, 0)) // pop the function and arguments
+        {
+            lua_pop(L, 1); // pop the error message
+        }
+    }
+
+    uint_fast16_t VirtualKeyToScancode(uint_fast16_t virtualKey)
+    {
+        const auto result = ::MapVirtualKeyW(virtualKey, MAPVK_VK_TO_VSC);
+        return static_cast<uint_fast16_t>(result);
+    }
+
+    uint_fast16_t ScancodeToVirtualKey(uint_fast16_t scancode)
+    {
+        // NOTE: Even using the MAPVK_VSC_TO_VK_EX flag to convert the enhanced scancodes to
+        // virtual keys that distinguish left and right, it turns out that the SendInput() API will
+        // end up down-casting them to the generic virtual key codes anyway.
+        const auto result = ::MapVirtualKeyW(scancode, MAPVK_VSC_TO_VK_EX);
+        return static_cast<uint_fast16_t>(result);
+    }
+
+    template< const char* const Typename, CodeType codeType, KeyAction keyAction >
+    int SendKey(lua_State* L)
+    {
+        const auto argc = lua_gettop(L);
+
+        if (argc < 1)
+        {
+            luaL_error(L, "not enough arguments; ([integer], [[integer]])");
+        }
+
+        const auto extendedCode = CheckCodeArgumentFromLua<sc::Typename>(L, 1);
+        const auto code = (argc >= 2) ? CheckCodeArgumentFromLua<Typename>(L, 2) : CheckCodeArgumentFromLua<Typename>(L, 1);
+
+        // TODO: decide if this needs to be here
+        //if (CodeType::VirtualKey == codeType && (code < 1 || code > 254))
+        //{
+        //    luaL_error(L, "argument out-of-range; virtual key must be in the range of 1 to 254");
+        //}
+
+        INPUT input;
+        input.type = INPUT_KEYBOARD;
+        auto& ki = input.ki;
+
+        ki.wVk = static_cast<WORD>((CodeType::VirtualKey == codeType) ? code : ScancodeToVirtualKey((extendedCode << 8) | code));
+        ki.wScan = static_cast<WORD>((CodeType::Scancode == codeType) ? code : VirtualKeyToScancode(code));
+        ki.dwFlags = ((0xe0 == extendedCode) ? KEYEVENTF_EXTENDEDKEY : 0u) | ((KeyAction::Make == keyAction) ? 0u : KEYEVENTF_KEYUP) | 
+            ((CodeType::Scancode == codeType) ? KEYEVENTF_SCANCODE : 0u);
+        ki.time = 0u;
+        ki.dwExtraInfo = selfInjection.signature;
+
+        const auto result = trace::SendInput(1, &input, sizeof(input));
+        if (0 == result)
+        {
+            std::wcout << L"failed to send input -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+        }
+
+        // letting Lua clean the stack
+
+        return 0;
+    }
+
+    thread_local array<INPUT, 32u> inputBuffer; // NOTE: The size of this array needs to be an even number.
+
+    int SendKeys(lua_State* L)
+    {
+        const auto argc = lua_gettop(L);
+
+        for (auto argi = 0; argi < argc;)
+        {
+            UINT ui = 0u;
+
+            for (; ui < inputBuffer.size() && argi < argc; ui++, argi++)
+            {
+                const auto virtualKey = static_cast<WORD>(CheckCodeArgumentFromLua<vk::Typename>(L, argi + 1));
+                const auto scancode = static_cast<WORD>(VirtualKeyToScancode(virtualKey));
+
+                inputBuffer[ui].type = INPUT_KEYBOARD;
+                auto& kiMake = inputBuffer[ui].ki;
+
+                kiMake.wVk = virtualKey;
+                kiMake.wScan = scancode;
+                kiMake.dwFlags = 0u;
+                kiMake.time = 0u;
+                kiMake.dwExtraInfo = selfInjection.signature;
+
+                ui++;
+
+                inputBuffer[ui].type = INPUT_KEYBOARD;
+                auto& kiBreak = inputBuffer[ui].ki;
+
+                kiBreak.wVk = virtualKey;
+                kiBreak.wScan = scancode;
+                kiBreak.dwFlags = KEYEVENTF_KEYUP;
+                kiBreak.time = 0u;
+                kiBreak.dwExtraInfo = selfInjection.signature;
+            }
+
+            const auto result = trace::SendInput(ui, &inputBuffer[0], sizeof(inputBuffer[0]));
+            if (0 == result)
+            {
+                std::wcout << L"failed to send input -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            }
+        }
+
+        // letting Lua clean the stack
+
+        return 0;
+    }
+
+    thread_local array<WCHAR, 2048u> unicodeOutput;
+
+    // This function checks and flushes the input buffer if full.
+    struct CheckFlushInputBuffer
+    {
+        CheckFlushInputBuffer(UINT& inputBufferIndex)
+            : _inputBufferIndex(inputBufferIndex) {}
+
+        void operator()(bool forceFlush = false)
+        {
+            if (0 == _inputBufferIndex)
+            {
+                return;
+            }
+
+            if (_inputBufferIndex < inputBuffer.size() && !forceFlush)
+            {
+                return;
+            }
+
+            const auto result = trace::SendInput(_inputBufferIndex, &inputBuffer[0], sizeof(inputBuffer[0]));
+
+            if (0 == result)
+            {
+                std::wcout << L"failed to send artificial keyboard input -- error code: 0x" <<
+                    std::hex << ::GetLastError() << std::dec << std::endl;
+            }
+
+            _inputBufferIndex = 0u;
+        }
+
+    private:
+        UINT& _inputBufferIndex;
+    };
+
+    struct VirtualKeyRecordWriter
+    {
+        VirtualKeyRecordWriter(UINT& inputBufferIndex)
+            : _inputBufferIndex(inputBufferIndex) {}
+
+        template< KeyAction keyAction >
+        void WriteVirtualKey(uint_fast16_t virtualKey)
+        {
+            inputBuffer[_inputBufferIndex].type = INPUT_KEYBOARD;
+            auto& ki = inputBuffer[_inputBufferIndex].ki;
+
+            const auto scancode = static_cast<WORD>(VirtualKeyToScancode(virtualKey));
+
+            ki.wVk = static_cast<WORD>(virtualKey);
+            ki.wScan = scancode;
+            ki.dwFlags = (KeyAction::Make == keyAction) ? 0u : KEYEVENTF_KEYUP;
+            ki.time = 0u;
+            ki.dwExtraInfo = selfInjection.signature;
+
+            _inputBufferIndex++;
+        }
+
+        template< KeyAction keyAction, uint_fast16_t virtualKey >
+        void WriteVirtualKey()
+        {
+            inputBuffer[_inputBufferIndex].type = INPUT_KEYBOARD;
+            auto& ki = inputBuffer[_inputBufferIndex].ki;
+
+            const auto scancode = static_cast<WORD>(VirtualKeyToScancode(virtualKey));
+
+            ki.wVk = virtualKey;
+            ki.wScan = scancode;
+            ki.dwFlags = (KeyAction::Make == keyAction) ? 0u : KEYEVENTF_KEYUP;
+            ki.time = 0u;
+            ki.dwExtraInfo = selfInjection.signature;
+
+            _inputBufferIndex++;
+        }
+
+    private:
+        UINT& _inputBufferIndex;
+    };
+
+    struct CheckSetModifier
+    {
+        CheckSetModifier(VirtualKeyRecordWriter& virtualKeyBuffer, CheckFlushInputBuffer& checkFlushInputBuffer)
+            : _vkbuf(virtualKeyBuffer), _CheckFlushVirtualKeys(checkFlushInputBuffer) {}
+
+        template< uint_fast16_t virtualKey >
+        void CheckSet(bool modifierKey, bool& currentModifierKeyState)
+        {
+            if (modifierKey != currentModifierKeyState)
+            {
+                if (currentModifierKeyState)
+                {
+                    // break virtual key
+                    _vkbuf.WriteVirtualKey<KeyAction::Break, virtualKey>();
+                }
+                else
+                {
+                    // make virtual key
+                    _vkbuf.WriteVirtualKey<KeyAction::Make, virtualKey>();
+                }
+
+                currentModifierKeyState = !currentModifierKeyState;
+
+                // if (that fills the input buffer) send and restart
+                _CheckFlushVirtualKeys();
+            }
+        }
+
+    private:
+        VirtualKeyRecordWriter& _vkbuf;
+        CheckFlushInputBuffer& _CheckFlushVirtualKeys;
+    };
+
+    struct Utf8To16Converter
+    {
+        Utf8To16Converter(const char* str, size_t length)
+            : _str(str)
+            , _strLength(length)
+            , _offset(0)
+            , _maxOutputLength(unicodeOutput.size() / 3) {}
+
+        // Returns count of characters convertered.
+        int operator()()
+        {
+            int result; // characters converted
+
+            if (_offset == _strLength)
+            {
+                return 0;
+            }
+
+            int length = static_cast<int>(min(_maxOutputLength, _strLength - _offset));
+            int insufficientBufferRetries = 3;
+
+            // Adjust length so that it falls between code points.
+            auto BreakUtf8String = [this, &length]()
+            {
+                if ((_offset + length) >= _strLength)
+                {
+                    return;
+                }
+
+                if (0 == (0x80 & _str[length]) || 0x3 == (_str[length] >> 6))
+                {
+                    return;
+                }
+
+                int i = length - 1;
+                auto ch = _str[i];
+
+                // back up to the start of the previous code point
+                while (0 != (0x80 & ch) && 0x3 != (ch >> 6) && i > 0)
+                {
+                    ch = _str[--i];
+                }
+
+                length = i + 1;
+            };
+
+            BreakUtf8String();
+
+            for (;;)
+            {
+                result = ::MultiByteToWideChar(
+                    CP_UTF8,
+                    0,
+                    &_str[_offset],
+                    static_cast<int>(length),
+                    &unicodeOutput[0],
+                    static_cast<int>(unicodeOutput.size())
+                    );
+
+                if (0xFFFD == result) // if (invalid UTF encodings)
+                {
+                    std::wcout << L"UTF8 to UTF16 translation failed; the input byte/char sequences are invalid" << std::endl;
+                    // TODO: produce an error message for Lua?
+                    return 0;
+                }
+
+                if (0 == result)
+                {
+                    const auto lastError = ::GetLastError();
+
+                    // if (the problem is insufficient buffer)
+                    if (ERROR_INSUFFICIENT_BUFFER == lastError && insufficientBufferRetries)
+                    {
+                        // try again with a smaller range
+                        length /= 2;
+                        insufficientBufferRetries--;
+
+                        // Adjust length so that it falls between code points.
+                        BreakUtf8String();
+
+                        continue;
+                    }
+
+                    switch (lastError)
+                    {
+                    case ERROR_INSUFFICIENT_BUFFER:
+                        std::wcout << L"UTF8 to UTF16 translation failed; insufficient buffer" << std::endl;
+                        break;
+                    case ERROR_INVALID_FLAGS:
+                        std::wcout << L"UTF8 to UTF16 translation failed; invalid flags passed to MultiByteToWideChar()" << std::endl;
+                        break;
+                    case ERROR_INVALID_PARAMETER:
+                        std::wcout << L"UTF8 to UTF16 translation failed; invalid parameter passed to MultiByteToWideChar()" << std::endl;
+                        break;
+                    case ERROR_NO_UNICODE_TRANSLATION:
+                        std::wcout << L"UTF8 to UTF16 translation failed; invalid unicode was found in string" << std::endl;
+                        break;
+                    default:
+                        std::wcout << L"UTF8 to UTF16 translation failed with unrecognized error code: 0x" << std::hex << lastError << std::dec << std::endl;
+                        break;
+                    }
+
+                    // TODO: produce an error message for Lua
+
+                    return 0;
+                }
+
+                break;
+            }
+
+            _offset += length;
+
+            return result;
+        }
+
+    private:
+        const char* const _str;
+        const size_t _strLength;
+        const size_t _maxOutputLength;
+
+        size_t _offset;
+    };
+
+    int SendText(lua_State* L)
+    {
+        //VkKeyScanEx();
+        const auto argc = lua_gettop(L);
+
+        // Current write position into the virtual key inputBuffer.
+        UINT inputBufferIndex = 0u;
+
+        bool shiftMade = false;
+        bool ctrlMade = false;
+        bool altMade = false;
+        bool hankakuMade = false;
+
+        auto CheckFlushVirtualKeys = CheckFlushInputBuffer(inputBufferIndex);
+        auto vkbuf = VirtualKeyRecordWriter(inputBufferIndex);
+        auto modifierState = CheckSetModifier(vkbuf, CheckFlushVirtualKeys);
+
+        for (auto arg = 0; arg < argc; arg++)
+        {
+            size_t strLength;
+            const char* str;
+            {
+                str = lua_tolstring(L, arg + 1, &strLength);
+
+                // make sure the argument is a string
+                if (nullptr == str)
+                {
+                    std::wcout << L"failed to convert function parameter " << (arg + 1) << L" to a string" << std::endl;
+                    // TODO: maybe produce a Lua error message?
+                    continue; // the function argument is not a string
+                }
+            }
+
+            // NOTE: This won't handle strings longer than numeric_limits<int>::max().
+            strLength = min(static_cast<decltype(strLength)>(numeric_limits<int>::max()), strLength);
+
+            // assume the string is UTF-8 and convert it to native UTF-16
+
+            // do the string conversion and output in chunks
+            auto StringConvert = Utf8To16Converter(str, strLength);
+
+            auto length = StringConvert();
+
+            while (0 != length)
+            {
+                for (decltype(length) i = 0u; i < length; i++)
+                {
+                    const auto ch = unicodeOutput[i];
+
+                    uint_fast16_t virtualKey;
+                    bool shift;
+                    bool ctrl;
+                    bool alt;
+                    bool hankaku;
+
+                    {
+                        const auto result = ::VkKeyScanW(ch);
+                        virtualKey = static_cast<uint8_t>(result);
+                        uint_fast8_t modifierFlags = static_cast<uint8_t>(result >> 8);
+
+                        if (-1 == static_cast<int8_t>(virtualKey) && -1 == static_cast<int8_t>(modifierFlags))
+                        {
+                            std::wcout << L"failed to convert unicode code point to virtual key sequence" << std::endl;
+                            continue; // move to next code point
+                        }
+
+                        shift = 0 != (0x1 & modifierFlags);
+                        ctrl = 0 != (0x2 & modifierFlags);
+                        alt = 0 != (0x4 & modifierFlags);
+                        hankaku = 0 != (0x8 & modifierFlags);
+                    }
+
+                    // With the virtual key code and required modifers known,
+                    //  output the required sequence of virtual keys.
+
+                    {
+                        // Make sure the modifier keys are set correctly.
+                        modifierState.CheckSet<VK_SHIFT>(shift, shiftMade);
+                        modifierState.CheckSet<VK_CONTROL>(ctrl, ctrlMade);
+                        modifierState.CheckSet<VK_MENU>(alt, altMade);
+                        modifierState.CheckSet<VK_OEM_AUTO>(hankaku, hankakuMade);
+
+                        // output virtual key make and break
+                        vkbuf.WriteVirtualKey<KeyAction::Make>(virtualKey);
+                        CheckFlushVirtualKeys();
+
+                        vkbuf.WriteVirtualKey<KeyAction::Break>(virtualKey);
+                        CheckFlushVirtualKeys();
+                    }
+                } // for ( the length of the string range )
+
+                length = StringConvert();
+            } // while ( 0 != length )
+        } // for ( each string passed to this function from Lua )
+
+        // Clear any modifier keys.
+        bool clearFlag = false;
+        modifierState.CheckSet<VK_SHIFT>(clearFlag, shiftMade);
+        modifierState.CheckSet<VK_CONTROL>(clearFlag, ctrlMade);
+        modifierState.CheckSet<VK_MENU>(clearFlag, altMade);
+        modifierState.CheckSet<VK_OEM_AUTO>(clearFlag, hankakuMade);
+        CheckFlushVirtualKeys(true); // Force a final flush.
+
+        // letting Lua clean the stack
+
+        return 0;
+    }
+
+    // keyboard.device(identifier) -> device
+    int GetDevice(lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TSTRING);
+        const auto device = CheckDeviceArgumentFromLua(L, 1);
+        lua_pushinteger(L, device);
+        return 1;
+    }
+
+    // keyboard.devices() -> { { device, id, path, vendor_id, product_id, connected, [script], [dropped_events] }, ... }
+    int ListDevices(lua_State* L)
+    {
+        lua_newtable(L); // push the device list
+
+        // Copied out under the lock; so a Lua error can't leave it held.
+        struct DeviceIdentity
+        {
+            uint_fast8_t    slot;
+            string          id;
+            string          path;
+            uint16_t        vendorId;
+            uint16_t        productId;
+            bool            isConnected;
+            bool            hasScript;
+            wstring         scriptFileName;
+            uint_fast32_t   droppedEventCount;
+        };
+        vector<DeviceIdentity> identities;
+        {
+            std::lock_guard<std::mutex> lock(devices::identityMutex);
+            for (auto slot = 1u; slot < devices::MaxDeviceCount; slot++)
+            {
+                const auto& keyboard = devices::keyboardDevices[slot];
+                if (!keyboard.isInUse)
+                {
+                    continue;
+                }
+
+                const auto& pScript = scripts::deviceScripts[slot];
+                identities.push_back(DeviceIdentity{ static_cast<uint_fast8_t>(slot), keyboard.id, keyboard.path, keyboard.vendorId, keyboard.productId,
+                    nullptr != keyboard.handle, nullptr != pScript, pScript ? pScript->fileName() : wstring(), pScript ? pScript->droppedEventCount() : 0u });
+            }
+        }
+
+        auto listIndex = 1;
+        for (const auto& identity : identities)
+        {
+            const auto slot = identity.slot;
+
+            lua_createtable(L, 0, 8); // push the device description
+            lua_pushinteger(L, slot);
+            lua_setfield(L, -2, "device");
+            lua_pushstring(L, identity.id.c_str());
+            lua_setfield(L, -2, "id");
+            lua_pushstring(L, identity.path.c_str());
+            lua_setfield(L, -2, "path");
+            lua_pushinteger(L, identity.vendorId);
+            lua_setfield(L, -2, "vendor_id");
+            lua_pushinteger(L, identity.productId);
+            lua_setfield(L, -2, "product_id");
+            lua_pushboolean(L, identity.isConnected);
+            lua_setfield(L, -2, "connected");
+
+            if (identity.hasScript)
+            {
+                const auto& fileName = identity.scriptFileName;
+                lua_pushstring(L, string(fileName.begin(), fileName.end()).c_str()); // NOTE: script names are expected to be ASCII
+                lua_setfield(L, -2, "script");
+                lua_pushinteger(L, identity.droppedEventCount);
+                lua_setfield(L, -2, "dropped_events");
+            }
+
+            lua_rawseti(L, -2, listIndex++); // pop the device description into the list
+        }
+
+        return 1;
+    }
+
+    // keyboard.is_virtual_key_made(virtual_key, [device]) / keyboard.is_scancode_made(scancode, [device])
+    template<CodeType codeType, const char* const Typename>
+    int IsKeyMade(lua_State* L)
+    {
+        const auto code = CheckCodeArgumentFromLua<Typename>(L, 1);
+        const auto isDeviceGiven = !lua_isnoneornil(L, 2);
+        const auto device = CheckDeviceArgumentFromLua(L, 2);
+        const auto isVirtualKey = CodeType::VirtualKey == codeType;
+
+        const KeyMap* pKeyMap;
+        {
+            const auto pScript = scripts::FindDeviceScript(L);
+            if (nullptr != pScript) // if (a device script) only the published snapshot may be read
+            {
+                const auto& keyState = pScript->keyState();
+                pKeyMap = (isDeviceGiven) ? ((isVirtualKey) ? &keyState.deviceVirtualKeys : &keyState.deviceScancodes) :
+                    ((isVirtualKey) ? &keyState.madeVirtualKeys : &keyState.madeScancodes);
+            }
+            else if (devices::AnyDevice == device)
+            {
+                pKeyMap = (isVirtualKey) ? &madeVirtualKeys : &madeScancodes;
+            }
+            else
+            {
+                const auto& keyboard = devices::keyboardDevices[device];
+                pKeyMap = (isVirtualKey) ? &keyboard.madeVirtualKeys : &keyboard.madeScancodes;
+            }
+        }
+
+        lua_pushboolean(L, IsSet(*pKeyMap, code));
+        return 1;
+    }
+
+    // Raises a Lua error when called from a device script.
+    void CheckMainScript(lua_State* L, const char* functionName)
+    {
+        if (luaThreadId != ::GetCurrentThreadId())
+        {
+            luaL_error(L, "%s() is only available to the main script", functionName);
+        }
+    }
+
+    // keyboard.run_device_script(device, file_name)
+    int RunDeviceScript(lua_State* L)
+    {
+        CheckMainScript(L, "run_device_script");
+
+        const auto device = CheckDeviceArgumentFromLua(L, 1);
+        size_t length;
+        const auto fileName = luaL_checklstring(L, 2, &length);
+
+        if (devices::AnyDevice == device)
+        {
+            luaL_error(L, "a device script must be bound to a single device");
+        }
+
+        scripts::SetDeviceScript(device, nullptr); // stop any script already running for the device
+        ApplyBindingChanges(); // so none of the old script's bindings land after they're dropped
+
+        // NOTE: The main script's bindings for this device are dropped, the device script owns them now.
+        {
+            auto& keyboard = devices::keyboardDevices[device];
+            Clear(keyboard.latchedScancodeMakes);
+            Clear(keyboard.latchedVirtualKeyMakes);
+            Clear(keyboard.latchedScancodeBreaks);
+            Clear(keyboard.latchedVirtualKeyBreaks);
+            Clear(keyboard.interceptedScancodeMakes);
+            Clear(keyboard.interceptedVirtualKeyMakes);
+            Clear(keyboard.interceptedScancodeBreaks);
+            Clear(keyboard.interceptedVirtualKeyBreaks);
+        }
+
+        scripts::SetDeviceScript(device, new scripts::DeviceScript(device, wstring(fileName, fileName + length)));
+
+        return 0;
+    }
+
+    // keyboard.set_dispatch_mode("native" | "lua")
+    int SetDispatchMode(lua_State* L)
+    {
+        CheckMainScript(L, "set_dispatch_mode");
+
+        const string mode = luaL_checkstring(L, 1);
+
+        if ("native" == mode)
+        {
+            ResumeDispatcher(); // finish off any queued events first
+            dispatchMode = DispatchMode::Native;
+        }
+        else if ("lua" == mode)
+        {
+            if (!luaDispatcher.isCreated())
+            {
+                try
+                {
+                    CreateDispatcher(L);
+                }
+                catch (const exception& e)
+                {
+                    luaL_error(L, "%s", e.what());
+                }
+            }
+            dispatchMode = DispatchMode::Lua;
+        }
+        else
+        {
+            luaL_error(L, "unrecognized dispatch mode \"%s\"; expected \"native\" or \"lua\"", mode.c_str());
+        }
+
+        return 0;
+    }
+
+    // keyboard.set_callback_style("arguments" | "event")
+    // In the event style, callbacks get one argument: keyboard.ffi.event, the same object every call.
+    int SetCallbackStyle(lua_State* L)
+    {
+        const string style = luaL_checkstring(L, 1);
+
+        bool isEventStyle;
+        if ("arguments" == style)
+        {
+            isEventStyle = false;
+        }
+        else if ("event" == style)
+        {
+            isEventStyle = true;
+        }
+        else
+        {
+            return luaL_error(L, "unrecognized callback style \"%s\"; expected \"arguments\" or \"event\"", style.c_str());
+        }
+
+        if (isEventStyle && LUA_NOREF == eventObjectReference) // NOTE: the arguments style needs no FFI
+        {
+            return luaL_error(L, "the event callback style requires keyboard.ffi");
+        }
+
+        if (L == luaState)
+        {
+            ResumeDispatcher(); // queued events were bound expecting the old style
+            luaDispatcher.SetEventCallbackStyle(isEventStyle);
+        }
+        isEventCallbackStyle = isEventStyle;
+
+        return 0;
+    }
+
+    // keyboard.set_self_injection_visible(boolean)
+    int SetSelfInjectionVisible(lua_State* L)
+    {
+        CheckMainScript(L, "set_self_injection_visible");
+
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        selfInjection.isVisible = (0 != lua_toboolean(L, 1));
+
+        return 0;
+    }
+
+    // hook_skipped, raw_input_skipped = keyboard.skipped_self_injections()
+    int GetSkippedSelfInjections(lua_State* L)
+    {
+        lua_pushnumber(L, static_cast<lua_Number>(selfInjection.skippedHookEvents));
+        lua_pushnumber(L, static_cast<lua_Number>(selfInjection.skippedRawInputEvents));
+        return 2;
+    }
+
+    // keyboard.debounce(virtual_key, milliseconds, ["eager" | "deferred"])
+    int SetDebounce(lua_State* L)
+    {
+        CheckMainScript(L, "debounce");
+
+        const auto virtualKey = CheckCodeArgumentFromLua<vk::Typename>(L, 1);
+        const auto window = luaL_checkinteger(L, 2);
+        if (window < 0 || window > numeric_limits<uint16_t>::max())
+        {
+            luaL_error(L, "debounce window (%d) is out of range", static_cast<int>(window));
+        }
+
+        DebounceMode mode = EagerDebounce;
+        if (!lua_isnoneornil(L, 3))
+        {
+            const string modeName = luaL_checkstring(L, 3);
+            if ("deferred" == modeName)
+            {
+                mode = DeferredDebounce;
+            }
+            else if ("eager" != modeName)
+            {
+                luaL_error(L, "unrecognized debounce mode \"%s\"; expected \"eager\" or \"deferred\"", modeName.c_str());
+            }
+        }
+
+        const auto key = 0xffu & virtualKey;
+        debounce.modes[key] = mode;
+        debounce.windows[key] = static_cast<uint16_t>(window);
+
+        return 0;
+    }
+
+    // keyboard.debounce_count(virtual_key)
+    int GetDebounceCount(lua_State* L)
+    {
+        const auto virtualKey = CheckCodeArgumentFromLua<vk::Typename>(L, 1);
+        lua_pushnumber(L, static_cast<lua_Number>(debounce.suppressedCounts[0xffu & virtualKey]));
+        return 1;
+    }
+
+    // keyboard.add_expansion(trigger, replacement, [options])
+    // The replacement is a string, or a function that's passed the trigger and returns a string.
+    //  The options table takes the booleans: immediate, anywhere.
+    int AddExpansion(lua_State* L)
+    {
+        CheckMainScript(L, "add_expansion");
+
+        size_t triggerLength = 0u;
+        const auto triggerText = luaL_checklstring(L, 1, &triggerLength);
+
+        expansions::Expansion expansion;
+        expansion.triggerText.assign(triggerText, triggerLength);
+        expansion.callbackReference = LUA_NOREF;
+        expansion.isImmediate = false;
+        expansion.isAnywhere = false;
+
+        if (!expansions::TryUtf8ToUtf16(triggerText, triggerLength, expansion.trigger))
+        {
+            luaL_error(L, "expansion trigger isn't valid UTF-8");
+        }
+
+        if (expansion.trigger.empty() || expansion.trigger.size() > expansions::MaxTriggerLength)
+        {
+            luaL_error(L, "expansion trigger must be 1 to %d characters long", static_cast<int>(expansions::MaxTriggerLength));
+        }
+
+        if (lua_istable(L, 3))
+        {
+            lua_getfield(L, 3, "immediate"); // push options.immediate
+            expansion.isImmediate = (0 != lua_toboolean(L, -1));
+            lua_getfield(L, 3, "anywhere"); // push options.anywhere
+            expansion.isAnywhere = (0 != lua_toboolean(L, -1));
+            lua_pop(L, 2);
+        }
+        else if (!lua_isnoneornil(L, 3))
+        {
+            luaL_checktype(L, 3, LUA_TTABLE);
+        }
+
+        if (lua_isfunction(L, 2))
+        {
+            if (LUA_NOREF == expansions::callExpansionReference)
+            {
+                lua_pushcfunction(L, &expansions::CallExpansionFunction);
+                expansions::callExpansionReference = luaL_ref(L, LUA_REGISTRYINDEX); // pop the function
+            }
+
+            lua_pushvalue(L, 2); // push the function
+            expansion.callbackReference = luaL_ref(L, LUA_REGISTRYINDEX); // pop the function
+        }
+        else
+        {
+            size_t replacementLength = 0u;
+            const auto replacement = luaL_checklstring(L, 2, &replacementLength);
+            if (!expansions::TryUtf8ToUtf16(replacement, replacementLength, expansion.replacement))
+            {
+                luaL_error(L, "expansion replacement isn't valid UTF-8");
+            }
+        }
+
+        auto& slot = expansions::TriggerExpansion(expansion.trigger);
+        if (expansions::NoExpansion == slot)
+        {
+            auto& freeSlots = expansions::freeSlots;
+            if (freeSlots.empty())
+            {
+                slot = static_cast<uint32_t>(expansions::expansions.size());
+                expansions::expansions.push_back(move(expansion));
+            }
+            else // reuse a removed expansion's slot
+            {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+                expansions::expansions[slot] = move(expansion);
+            }
+            expansions::expansionCount++;
+        }
+        else // replace the trigger's expansion
+        {
+            luaL_unref(L, LUA_REGISTRYINDEX, expansions::expansions[slot].callbackReference);
+            expansions::expansions[slot] = move(expansion);
+        }
+
+        return 0;
+    }
+
+    // keyboard.remove_expansion(trigger)
+    int RemoveExpansion(lua_State* L)
+    {
+        CheckMainScript(L, "remove_expansion");
+
+        size_t triggerLength = 0u;
+        const auto triggerText = luaL_checklstring(L, 1, &triggerLength);
+        wstring trigger;
+        if (!expansions::TryUtf8ToUtf16(triggerText, triggerLength, trigger))
+        {
+            luaL_error(L, "expansion trigger isn't valid UTF-8");
+        }
+
+        const auto found = expansions::FindTrigger(trigger);
+        if (expansions::NoExpansion == found)
+        {
+            return 0;
+        }
+
+        auto& expansion = expansions::expansions[found];
+        luaL_unref(L, LUA_REGISTRYINDEX, expansion.callbackReference);
+        expansion = expansions::Expansion();
+        expansion.callbackReference = LUA_NOREF;
+
+        // NOTE: The automaton keeps the trigger's nodes; the slot goes to the next expansion added.
+        expansions::TriggerExpansion(trigger) = expansions::NoExpansion;
+        expansions::freeSlots.push_back(found);
+        expansions::expansionCount--;
+
+        return 0;
+    }
+
+    // keyboard.record_start()
+    int StartMacroRecording(lua_State* L)
+    {
+        CheckMainScript(L, "record_start");
+        macros::StartRecording();
+        return 0;
+    }
+
+    // macro = keyboard.record_stop()
+    int StopMacroRecording(lua_State* L)
+    {
+        CheckMainScript(L, "record_stop");
+
+        if (!macros::isRecording)
+        {
+            luaL_error(L, "not recording; call keyboard.record_start() first");
+        }
+
+        const auto macro = macros::StopRecording();
+        lua_pushlstring(L, reinterpret_cast<const char*>(&macro[0]), macro.size()); // push the macro
+        return 1;
+    }
+
+    // A file name argument; UTF-8, relative to the program's directory.
+    inline wstring CheckFileNameFromLua(lua_State* L, int argumentIndex)
+    {
+        size_t length;
+        const auto fileName = luaL_checklstring(L, argumentIndex, &length);
+        return GetProgramExecutablePath() + expansions::Utf8ToUtf16(fileName, length);
+    }
+
+    // keyboard.save_macro(file_name, macro)
+    int SaveMacro(lua_State* L)
+    {
+        const auto fileName = CheckFileNameFromLua(L, 1);
+        size_t size;
+        const auto macro = luaL_checklstring(L, 2, &size);
+
+        lua_pushboolean(L, macros::Save(fileName, reinterpret_cast<const uint8_t*>(macro), size));
+        return 1;
+    }
+
+    // macro = keyboard.load_macro(file_name)
+    int LoadMacro(lua_State* L)
+    {
+        const auto fileName = CheckFileNameFromLua(L, 1);
+
+        vector<macros::MacroEvent> events;
+        const auto isLoaded = macros::Load(fileName, [L, &events](const uint8_t* data, size_t size)
+        {
+            if (!macros::Decode(data, size, events))
+            {
+                return false;
+            }
+            lua_pushlstring(L, reinterpret_cast<const char*>(data), size); // push the macro
+            return true;
+        });
+
+        if (!isLoaded)
+        {
+            lua_pushnil(L);
+        }
+        return 1;
+    }
+
+    // keyboard.play_macro(macro, [options])
+    // The options table takes: speed (default 1), max_delay (seconds), sink (boolean).
+    int PlayMacro(lua_State* L)
+    {
+        CheckMainScript(L, "play_macro");
+
+        size_t size;
+        const auto macro = luaL_checklstring(L, 1, &size);
+
+        vector<macros::MacroEvent> events;
+        if (!macros::Decode(reinterpret_cast<const uint8_t*>(macro), size, events))
+        {
+            luaL_error(L, "not a macro");
+        }
+
+        macros::PlaybackOptions options;
+        options.speed = 1.0;
+        options.maxDelayMicroseconds = numeric_limits<uint64_t>::max();
+        options.isSink = false;
+
+        if (lua_istable(L, 2))
+        {
+            lua_getfield(L, 2, "speed"); // push options.speed
+            options.speed = luaL_optnumber(L, -1, 1.0);
+            lua_getfield(L, 2, "max_delay"); // push options.max_delay
+            if (!lua_isnil(L, -1))
+            {
+                options.maxDelayMicroseconds = static_cast<uint64_t>(max(0.0, luaL_checknumber(L, -1)) * 1000000.0);
+            }
+            lua_getfield(L, 2, "sink"); // push options.sink
+            options.isSink = (0 != lua_toboolean(L, -1));
+            lua_pop(L, 3);
+
+            if (options.speed < 0.0)
+            {
+                luaL_error(L, "playback speed must not be negative");
+            }
+        }
+
+        try
+        {
+            macros::player.Play(move(events), options);
+        }
+        catch (const exception& e)
+        {
+            luaL_error(L, "%s", e.what());
+        }
+
+        return 0;
+    }
+
+    // keyboard.stop_macro()
+    int StopMacro(lua_State* L)
+    {
+        CheckMainScript(L, "stop_macro");
+        macros::player.Stop();
+        return 0;
+    }
+
+    // keyboard.macro_playback_stats()
+    int GetMacroPlaybackStats(lua_State* L)
+    {
+        const auto stats = macros::player.stats();
+
+        lua_createtable(L, 0, 4); // push the stats table
+
+        lua_pushinteger(L, stats.eventCount);
+        lua_setfield(L, -2, "events");
+
+        lua_pushnumber(L, (0u != stats.eventCount) ? stats.totalJitterSeconds / stats.eventCount : 0.0);
+        lua_setfield(L, -2, "mean_jitter");
+
+        lua_pushnumber(L, stats.maxJitterSeconds);
+        lua_setfield(L, -2, "max_jitter");
+
+        lua_pushboolean(L, stats.isPlaying);
+        lua_setfield(L, -2, "playing");
+
+        return 1;
+    }
+
+    // keyboard.macro_sink()
+    // Returns the key events played to the in-memory sink, with the time each was emitted (in seconds,
+    //  from the first).
+    int GetMacroSink(lua_State* L)
+    {
+        const auto sink = macros::player.sink();
+        const auto frequency = static_cast<lua_Number>(macros::TicksPerSecond());
+
+        lua_createtable(L, static_cast<int>(sink.size()), 0); // push the event list
+        for (size_t i = 0u; i < sink.size(); i++)
+        {
+            const auto& keyEvent = sink[i];
+
+            lua_createtable(L, 0, 5); // push the event
+            lua_pushinteger(L, keyEvent.virtualKey);
+            lua_setfield(L, -2, "virtual_key");
+            lua_pushinteger(L, keyEvent.scancode);
+            lua_setfield(L, -2, "scancode");
+            lua_pushboolean(L, keyEvent.e0);
+            lua_setfield(L, -2, "e0");
+            lua_pushboolean(L, keyEvent.isBreak);
+            lua_setfield(L, -2, "is_break");
+            lua_pushnumber(L, (keyEvent.timestamp - sink[0].timestamp) / frequency);
+            lua_setfield(L, -2, "time");
+
+            lua_rawseti(L, -2, static_cast<int>(i + 1u)); // pop the event into the list
+        }
+
+        return 1;
+    }
+
+    // keyboard.set_gc_mode("idle" | "auto", [options])
+    int SetGcMode(lua_State* L)
+    {
+        CheckMainScript(L, "set_gc_mode");
+
+        const string mode = luaL_checkstring(L, 1);
+
+        IdleCollector::Mode value;
+        if ("idle" == mode)
+        {
+            value = IdleCollector::Mode::Idle;
+        }
+        else if ("auto" == mode)
+        {
+            value = IdleCollector::Mode::Automatic;
+        }
+        else
+        {
+            return luaL_error(L, "unrecognized gc mode \"%s\"; expected \"idle\" or \"auto\"", mode.c_str());
+        }
+
+        auto settings = collector::idle.settings();
+        if (!lua_isnoneornil(L, 2))
+        {
+            luaL_checktype(L, 2, LUA_TTABLE);
+
+            lua_getfield(L, 2, "slice"); // push options.slice
+            if (!lua_isnil(L, -1))
+            {
+                settings.sliceSeconds = luaL_checknumber(L, -1);
+                luaL_argcheck(L, settings.sliceSeconds >= 0.0, 2, "slice must not be negative");
+            }
+            lua_getfield(L, 2, "step_size"); // push options.step_size
+            if (!lua_isnil(L, -1))
+            {
+                settings.stepSize = luaL_checkint(L, -1);
+                luaL_argcheck(L, settings.stepSize >= 0, 2, "step_size must not be negative");
+            }
+            lua_getfield(L, 2, "idle_threshold"); // push options.idle_threshold
+            if (!lua_isnil(L, -1))
+            {
+                settings.idleThreshold = luaL_checkint(L, -1);
+            }
+            lua_getfield(L, 2, "max_debt"); // push options.max_debt
+            if (!lua_isnil(L, -1))
+            {
+                settings.maxDebt = luaL_checkint(L, -1);
+            }
+            lua_pop(L, 4);
+        }
+
+        collector::idle.SetSettings(settings);
+        collector::idle.SetMode(L, value);
+
+        return 0;
+    }
+
+    // keyboard.gc_stats()
+    int GetGcStats(lua_State* L)
+    {
+        CheckMainScript(L, "gc_stats");
+
+        const auto& stats = collector::idle.stats();
+
+        lua_createtable(L, 0, 9); // push the stats table
+
+        lua_pushstring(L, (IdleCollector::Mode::Idle == collector::idle.mode()) ? "idle" : "auto");
+        lua_setfield(L, -2, "mode");
+
+        lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0));
+        lua_setfield(L, -2, "memory");
+
+        lua_pushnumber(L, static_cast<lua_Number>(stats.cycleCount));
+        lua_setfield(L, -2, "cycles");
+
+        lua_pushnumber(L, static_cast<lua_Number>(stats.sliceCount));
+        lua_setfield(L, -2, "slices");
+
+        lua_pushnumber(L, static_cast<lua_Number>(stats.busySliceCount));
+        lua_setfield(L, -2, "busy_slices");
+
+        lua_pushnumber(L, static_cast<lua_Number>(stats.stepCount));
+        lua_setfield(L, -2, "steps");
+
+        lua_pushnumber(L, IdleCollector::NanosecondsToSeconds(stats.lastPause));
+        lua_setfield(L, -2, "last_pause");
+
+        lua_pushnumber(L, IdleCollector::NanosecondsToSeconds(stats.maxPause));
+        lua_setfield(L, -2, "max_pause");
+
+        lua_pushnumber(L, (0u != stats.sliceCount) ? IdleCollector::NanosecondsToSeconds(stats.totalPause) / stats.sliceCount : 0.0);
+        lua_setfield(L, -2, "mean_pause");
+
+        return 1;
+    }
+
+    // keyboard.set_memory_limit(kb)
+    // A limit of zero removes the limit. Applies to the calling script's Lua state.
+    int SetMemoryLimit(lua_State* L)
+    {
+        const auto limit = luaL_checknumber(L, 1);
+        luaL_argcheck(L, limit >= 0.0, 1, "the limit must not be negative");
+
+        memory::SetLimit(L, static_cast<size_t>(limit * 1024.0));
+
+        return 0;
+    }
+
+    // keyboard.memory_stats()
+    int GetMemoryStats(lua_State* L)
+    {
+        const auto pAccount = memory::FindAccount(L);
+
+        lua_createtable(L, 0, 8); // push the stats table
+
+        lua_pushboolean(L, nullptr != pAccount);
+        lua_setfield(L, -2, "accounting");
+
+        lua_pushnumber(L, static_cast<lua_Number>(memory::InUse(L)));
+        lua_setfield(L, -2, "in_use");
+
+        if (nullptr != pAccount)
+        {
+            lua_pushnumber(L, static_cast<lua_Number>(pAccount->limit));
+            lua_setfield(L, -2, "limit");
+            lua_pushnumber(L, static_cast<lua_Number>(pAccount->peak));
+            lua_setfield(L, -2, "peak");
+            lua_pushnumber(L, static_cast<lua_Number>(pAccount->allocatedBytes));
+            lua_setfield(L, -2, "allocated");
+            lua_pushnumber(L, static_cast<lua_Number>(pAccount->allocationCount));
+            lua_setfield(L, -2, "allocations");
+            lua_pushnumber(L, static_cast<lua_Number>(pAccount->refusedCount));
+            lua_setfield(L, -2, "refused");
+        }
+        else
+        {
+            lua_pushnumber(L, static_cast<lua_Number>(memory::sampledLimit));
+            lua_setfield(L, -2, "limit");
+            lua_pushnumber(L, static_cast<lua_Number>(memory::sampledPeak));
+            lua_setfield(L, -2, "peak");
+            lua_pushnumber(L, static_cast<lua_Number>(memory::sampledOverLimitCount));
+            lua_setfield(L, -2, "over_limit");
+        }
+
+        lua_newtable(L); // push the callback list
+        auto count = 0;
+        for (const auto& table : memory::callbackAllocations)
+        {
+            for (const auto& entry : table.second)
+            {
+                const auto& allocation = entry.second;
+
+                lua_createtable(L, 0, 7); // push the callback's entry
+                lua_pushstring(L, table.first);
+                lua_setfield(L, -2, "table");
+                lua_pushinteger(L, static_cast<lua_Integer>(entry.first >> 16));
+                lua_setfield(L, -2, "device");
+                lua_pushinteger(L, static_cast<lua_Integer>(0xffff & entry.first));
+                lua_setfield(L, -2, "code");
+                lua_pushnumber(L, static_cast<lua_Number>(allocation.callCount));
+                lua_setfield(L, -2, "calls");
+                lua_pushnumber(L, static_cast<lua_Number>(allocation.allocatingCallCount));
+                lua_setfield(L, -2, "allocating_calls");
+                lua_pushnumber(L, static_cast<lua_Number>(allocation.totalBytes));
+                lua_setfield(L, -2, "bytes");
+                lua_pushnumber(L, static_cast<lua_Number>(allocation.maxBytes));
+                lua_setfield(L, -2, "max_bytes");
+
+                lua_rawseti(L, -2, ++count); // pop the entry into the list
+            }
+        }
+        lua_setfield(L, -2, "callbacks"); // pop the callback list into the stats table
+
+        return 1;
+    }
+
+    // keyboard.set_callback_budget(instructions, [max_overruns])
+    // Applies to the calling script's callbacks; zero instructions removes the budget.
+    int SetCallbackBudget(lua_State* L)
+    {
+        const auto instructionCount = luaL_checkint(L, 1);
+        const auto maxOverruns = luaL_optint(L, 2, 3);
+        luaL_argcheck(L, instructionCount >= 0, 1, "the budget must not be negative");
+        luaL_argcheck(L, maxOverruns >= 1, 2, "at least one overrun must be allowed");
+
+        callbackBudget.instructionCount = instructionCount;
+        callbackBudget.maxOverruns = static_cast<uint32_t>(maxOverruns);
+        overrunCounts.clear();
+
+        return 0;
+    }
+
+    // keyboard.callback_budget_stats()
+    int GetCallbackBudgetStats(lua_State* L)
+    {
+        lua_createtable(L, 0, 5); // push the stats table
+
+        lua_pushinteger(L, callbackBudget.instructionCount);
+        lua_setfield(L, -2, "budget");
+
+        lua_pushnumber(L, static_cast<lua_Number>(callbackBudget.armedCount));
+        lua_setfield(L, -2, "callbacks");
+
+        lua_pushnumber(L, static_cast<lua_Number>(callbackBudget.overrunCount));
+        lua_setfield(L, -2, "overruns");
+
+        lua_pushnumber(L, static_cast<lua_Number>(callbackBudget.disabledCount));
+        lua_setfield(L, -2, "disabled");
+
+        // average time spent setting and clearing the hook for each callback, in seconds
+        {
+            LARGE_INTEGER frequency;
+            ::QueryPerformanceFrequency(&frequency);
+
+            const auto count = (0u != callbackBudget.armedCount) ? callbackBudget.armedCount : 1u;
+            lua_pushnumber(L, static_cast<lua_Number>(callbackBudget.armingTicks) / count / frequency.QuadPart);
+            lua_setfield(L, -2, "arming_seconds");
+        }
+
+        return 1;
+    }
+
+    // Runs the function at the stack index the given number of times; with the count hook set around
+    //  each call, as KeyCallbackHandler() sets it, when budgeted. Returns the QPC ticks taken, or -1 if a
+    //  call failed; its error is left on the stack then.
+    int64_t TimeCalls(lua_State* L, const int functionIndex, const int calls, const bool isBudgeted)
+    {
+        const auto start = ReadTimestamp();
+        for (auto i = 0; i < calls; i++)
+        {
+            if (isBudgeted)
+            {
+                (void)SetCallbackHook(L, string());
+            }
+
+            lua_pushvalue(L, functionIndex); // push the function
+            const auto result = lua_pcall(L, 0, 0, 0); // pop the function
+
+            if (isBudgeted)
+            {
+                lua_sethook(L, nullptr, 0, 0);
+            }
+
+            if (0 != result)
+            {
+                return -1;
+            }
+        }
+        return ReadTimestamp() - start;
+    }
+
+    // keyboard.benchmark_callback_budget(callback, calls, [instructions])
+    // Times the callback, called without arguments, with and without the instruction budget; so the
+    //  budget's cost to a compiled callback can be measured before turning it on.
+    int BenchmarkCallbackBudget(lua_State* L)
+    {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        const auto calls = luaL_checkint(L, 2);
+        const auto instructionCount = luaL_optint(L, 3, (0 != callbackBudget.instructionCount) ? callbackBudget.instructionCount : 1000000);
+        luaL_argcheck(L, calls >= 1, 2, "at least one call must be made");
+        luaL_argcheck(L, instructionCount >= 1, 3, "the budget must be positive");
+        lua_settop(L, 1);
+
+        const auto savedInstructionCount = callbackBudget.instructionCount;
+        callbackBudget.instructionCount = instructionCount;
+
+        // Each run is warmed up first, so the JIT has compiled what it's going to. Compiled code is
+        //  flushed in between; a budgeted callback never got the chance to be compiled without the hook.
+        int64_t ticks[2] = {}; // unbudgeted, budgeted
+        auto isFailed = false;
+        for (auto isBudgeted = 0; isBudgeted < 2 && !isFailed; isBudgeted++)
+        {
+            if (0 != isBudgeted)
+            {
+                lua_getglobal(L, "jit"); // push jit
+                lua_getfield(L, -1, "flush"); // push jit.flush
+                const auto result = lua_pcall(L, 0, 0, 0); // pop jit.flush
+                lua_pop(L, (0 != result) ? 2 : 1); // pop any error message, and jit
+            }
+
+            isFailed = TimeCalls(L, 1, calls, 0 != isBudgeted) < 0;
+            if (!isFailed)
+            {
+                ticks[isBudgeted] = TimeCalls(L, 1, calls, 0 != isBudgeted);
+                isFailed = ticks[isBudgeted] < 0;
+            }
+        }
+
+        callbackBudget.instructionCount = savedInstructionCount;
+        if (isFailed)
+        {
+            return lua_error(L); // rethrow the callback's error
+        }
+
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceFrequency(&frequency);
+        const auto totalCalls = static_cast<double>(calls);
+
+        lua_createtable(L, 0, 4); // push the results
+        lua_pushinteger(L, instructionCount);
+        lua_setfield(L, -2, "budget");
+        lua_pushnumber(L, static_cast<lua_Number>(ticks[0]) / frequency.QuadPart / totalCalls);
+        lua_setfield(L, -2, "unbudgeted_seconds");
+        lua_pushnumber(L, static_cast<lua_Number>(ticks[1]) / frequency.QuadPart / totalCalls);
+        lua_setfield(L, -2, "budgeted_seconds");
+        lua_pushnumber(L, (0 != ticks[0]) ? static_cast<lua_Number>(ticks[1]) / ticks[0] : 0.0);
+        lua_setfield(L, -2, "ratio");
+
+        return 1;
+    }
+
+    // keyboard.profile_start(file_name, [interval])
+    // Samples the main script's callbacks every interval Lua VM instructions, until profile_stop().
+    int StartProfile(lua_State* L)
+    {
+        CheckMainScript(L, "profile_start");
+
+        const auto fileName = CheckFileNameFromLua(L, 1);
+        const auto interval = luaL_optint(L, 2, 1000);
+        luaL_argcheck(L, interval > 0, 2, "the interval must be positive");
+
+        profileFileName = fileName;
+        profiler.Start(interval);
+
+        return 0;
+    }
+
+    // keyboard.profile_stop()
+    // Writes the profile as collapsed stacks, and returns the number of samples.
+    int StopProfile(lua_State* L)
+    {
+        CheckMainScript(L, "profile_stop");
+
+        if (!profiler.isRunning())
+        {
+            return luaL_error(L, "the profiler isn't running");
+        }
+        profiler.Stop();
+
+        std::ofstream outFile(profileFileName, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        profiler.Write(outFile);
+        if (!outFile.good())
+        {
+            return luaL_error(L, "failed to write the profile");
+        }
+
+        lua_pushnumber(L, static_cast<lua_Number>(profiler.sampleCount()));
+        return 1;
+    }
+
+    // keyboard.set_jit_diagnostics(enabled)
+    int SetJitDiagnostics(lua_State* L)
+    {
+        CheckMainScript(L, "set_jit_diagnostics");
+
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+
+        try
+        {
+            EnableJitDiagnostics(L, 0 != lua_toboolean(L, 1));
+        }
+        catch (const exception& e)
+        {
+            luaL_error(L, "%s", e.what());
+        }
+
+        return 0;
+    }
+
+    // keyboard.jit_report([file_name])
+    // Returns the trace counts by binding; and, given a file name, also writes them to that file.
+    int GetJitReport(lua_State* L)
+    {
+        CheckMainScript(L, "jit_report");
+
+        if (LUA_NOREF == jitReportReference)
+        {
+            return luaL_error(L, "JIT diagnostics aren't enabled; see keyboard.set_jit_diagnostics()");
+        }
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, jitReportReference); // push the report
+
+        if (!lua_isnoneornil(L, 1))
+        {
+            const auto fileName = CheckFileNameFromLua(L, 1);
+
+            lua_getfield(L, -1, "format"); // push report.format
+            lua_call(L, 0, 1); // pop report.format; push the text
+
+            size_t textLength;
+            const auto text = lua_tolstring(L, -1, &textLength);
+
+            std::ofstream outFile(fileName, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            outFile.write(text, textLength);
+            if (!outFile.good())
+            {
+                return luaL_error(L, "failed to write the JIT report");
+            }
+            lua_pop(L, 1); // pop the text
+        }
+
+        lua_getfield(L, -1, "bindings"); // push report.bindings
+        return 1;
+    }
+
+    // keyboard.event_stream_stats()
+    int GetEventStreamStats(lua_State* L)
+    {
+        lua_createtable(L, 0, 3); // push the stats table
+
+        lua_pushnumber(L, static_cast<lua_Number>(stream::eventStream.nextSequence));
+        lua_setfield(L, -2, "events");
+
+        lua_pushnumber(L, static_cast<lua_Number>(stream::mergedEventCount));
+        lua_setfield(L, -2, "merged");
+
+        // average time spent correlating each hook or raw input event, in seconds
+        {
+            LARGE_INTEGER frequency;
+            ::QueryPerformanceFrequency(&frequency);
+
+            const auto count = (0u != stream::correlationCount) ? stream::correlationCount : 1u;
+            lua_pushnumber(L, static_cast<lua_Number>(stream::correlationTicks) / count / frequency.QuadPart);
+            lua_setfield(L, -2, "correlation_seconds");
+        }
+
+        return 1;
+    }
+
+    // keyboard.capture_stats()
+    int GetCaptureStats(lua_State* L)
+    {
+        lua_createtable(L, 0, 9); // push the stats table
+
+        lua_pushstring(L, capture::IsRunning() ? "thread" : "inline");
+        lua_setfield(L, -2, "mode");
+
+        lua_pushnumber(L, static_cast<lua_Number>(capture::delays.count));
+        lua_setfield(L, -2, "events");
+
+        lua_pushnumber(L, static_cast<lua_Number>(capture::droppedCount.load()));
+        lua_setfield(L, -2, "dropped");
+
+        // upper bounds, in seconds
+        const struct
+        {
+            const char*                         name;
+            const capture::LatencyHistogram&    histogram;
+            double                              fraction;
+        } Percentiles[] =
+        {
+            { "delay_p50_seconds", capture::delays, 0.5 },
+            { "delay_p99_seconds", capture::delays, 0.99 },
+            { "delay_max_seconds", capture::delays, 1.0 },
+            { "queue_p50_seconds", capture::queueDelays, 0.5 },
+            { "queue_p99_seconds", capture::queueDelays, 0.99 },
+            { "queue_max_seconds", capture::queueDelays, 1.0 },
+        };
+        for (const auto& percentile : Percentiles)
+        {
+            lua_pushnumber(L, percentile.histogram.Percentile(percentile.fraction));
+            lua_setfield(L, -2, percentile.name);
+        }
+
+        return 1;
+    }
+
+    // keyboard.set_tracing(enabled)
+    int SetTracing(lua_State* L)
+    {
+        CheckMainScript(L, "set_tracing");
+
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        trace::isEnabled.store(0 != lua_toboolean(L, 1));
+
+        return 0;
+    }
+
+    // keyboard.export_trace(file_name)
+    // Writes the recent key events' spans as a Chrome trace, and returns the number of spans.
+    int ExportTrace(lua_State* L)
+    {
+        CheckMainScript(L, "export_trace");
+
+        const auto fileName = CheckFileNameFromLua(L, 1);
+
+        std::ofstream outFile(fileName, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        const auto spanCount = trace::Write(outFile);
+        if (!outFile.good())
+        {
+            return luaL_error(L, "failed to write the trace");
+        }
+
+        lua_pushnumber(L, static_cast<lua_Number>(spanCount));
+        return 1;
+    }
+
+    usage::Action CheckUsageActionArgumentFromLua(lua_State* L, int argumentIndex)
+    {
+        const auto name = luaL_checkstring(L, argumentIndex);
+        for (auto i = 0u; i < usage::ActionCount; i++)
+        {
+            if (0 == ::strcmp(usage::ActionNames[i], name))
+            {
+                return static_cast<usage::Action>(i);
+            }
+        }
+
+        luaL_error(L, "unknown key usage (%s)", name); // Does a long jump; never returns.
+        return usage::Make;
+    }
+
+    // keyboard.key_usage(action)
+    // Returns the action's totals, by code; keys never used are left out.
+    int GetKeyUsage(lua_State* L)
+    {
+        CheckMainScript(L, "key_usage");
+
+        const auto action = CheckUsageActionArgumentFromLua(L, 1);
+
+        std::unique_ptr<usage::Counters> pTotals(new usage::Counters());
+        usage::Snapshot(*pTotals);
+
+        lua_newtable(L);
+        for (auto code = 0u; code < usage::CodeCount; code++)
+        {
+            const auto count = pTotals->counts[action][code];
+            if (0u != count)
+            {
+                lua_pushnumber(L, static_cast<lua_Number>(count));
+                lua_rawseti(L, -2, static_cast<int>(code));
+            }
+        }
+
+        return 1;
+    }
+
+    // keyboard.key_usage_heatmap(action)
+    int GetKeyUsageHeatmap(lua_State* L)
+    {
+        CheckMainScript(L, "key_usage_heatmap");
+
+        const auto heatmap = usage::Heatmap(CheckUsageActionArgumentFromLua(L, 1));
+        lua_pushlstring(L, heatmap.c_str(), heatmap.length());
+        return 1;
+    }
+
+    // keyboard.save_key_usage()
+    int SaveKeyUsage(lua_State* L)
+    {
+        CheckMainScript(L, "save_key_usage");
+
+        if (!usage::Save())
+        {
+            return luaL_error(L, "failed to save the key usage");
+        }
+        return 0;
+    }
+
+    // keyboard.stop_device_script(device)
+    int StopDeviceScript(lua_State* L)
+    {
+        CheckMainScript(L, "stop_device_script");
+
+        const auto device = CheckDeviceArgumentFromLua(L, 1);
+        scripts::SetDeviceScript(device, nullptr);
+        ApplyBindingChanges();
+
+        return 0;
+    }
+
+    int HookKeyboard(lua_State* L)
+    {
+        CheckMainScript(L, "hook");
+        hook::InstallLowLevelKeyboardHook();
+        return 0;
+    }
+
+    int UnhookKeyboard(lua_State* L)
+    {
+        CheckMainScript(L, "unhook");
+        hook::DisableLowLevelKeyboardHook();
+        return 0;
+    }
+
+    // SIDE-EFFECT: Leaves the keyboard table on the Lua stack.
+    void RegisterKeyboardFunctions(lua_State* L)
+    {
+        static const luaL_Reg KeyboardFunctions[] =
+        {
+            { "listen_for_virtual_key_make", &SetKeyCallback<latchedVirtualKeyMakes, &devices::KeyboardDevice::latchedVirtualKeyMakes, vk::MakeLatches, vk::Typename> },
+            { "listen_for_virtual_key_break", &SetKeyCallback<latchedVirtualKeyBreaks, &devices::KeyboardDevice::latchedVirtualKeyBreaks, vk::BreakLatches, vk::Typename> },
+            { "listen_for_scancode_make", &SetKeyCallback<latchedScancodeMakes, &devices::KeyboardDevice::latchedScancodeMakes, sc::MakeLatches, sc::Typename> },
+            { "listen_for_scancode_break", &SetKeyCallback<latchedScancodeBreaks, &devices::KeyboardDevice::latchedScancodeBreaks, sc::BreakLatches, sc::Typename> },
+            { "stop_listening_for_virtual_key_make", &ClearKeyCallback<latchedVirtualKeyMakes, &devices::KeyboardDevice::latchedVirtualKeyMakes, vk::MakeLatches, vk::Typename> },
+            { "stop_listening_for_virtual_key_break", &ClearKeyCallback<latchedVirtualKeyBreaks, &devices::KeyboardDevice::latchedVirtualKeyBreaks, vk::BreakLatches, vk::Typename> },
+            { "stop_listening_for_scancode_make", &ClearKeyCallback<latchedScancodeMakes, &devices::KeyboardDevice::latchedScancodeMakes, sc::MakeLatches, sc::Typename> },
+            { "stop_listening_for_scancode_break", &ClearKeyCallback<latchedScancodeBreaks, &devices::KeyboardDevice::latchedScancodeBreaks, sc::BreakLatches, sc::Typename> },
+            { "send_virtual_key_make", &SendKey<vk::Typename, CodeType::VirtualKey, KeyAction::Make> },
+            { "send_virtual_key_break", &SendKey<vk::Typename, CodeType::VirtualKey, KeyAction::Break> },
+            { "send_scancode_make", &SendKey<vk::Typename, CodeType::Scancode, KeyAction::Make> },
+            { "send_scancode_break", &SendKey<vk::Typename, CodeType::Scancode, KeyAction::Break> },
+            { "send_keys", &SendKeys },
+            { "send_text", &SendText },
+            { "hook", &HookKeyboard },
+            { "unhook", &UnhookKeyboard },
+            { "intercept_virtual_key_make", &SetKeyCallback<interceptedVirtualKeyMakes, &devices::KeyboardDevice::interceptedVirtualKeyMakes, vk::MakeInterceptions, vk::Typename> },
+            { "intercept_virtual_key_break", &SetKeyCallback<interceptedVirtualKeyBreaks, &devices::KeyboardDevice::interceptedVirtualKeyBreaks, vk::BreakInterceptions, vk::Typename> },
+            { "intercept_scancode_make", &SetKeyCallback<interceptedScancodeMakes, &devices::KeyboardDevice::interceptedScancodeMakes, sc::MakeInterceptions, sc::Typename> },
+            { "intercept_scancode_break", &SetKeyCallback<interceptedScancodeBreaks, &devices::KeyboardDevice::interceptedScancodeBreaks, sc::BreakInterceptions, sc::Typename> },
+            { "stop_intercepting_virtual_key_make", &ClearKeyCallback<interceptedVirtualKeyMakes, &devices::KeyboardDevice::interceptedVirtualKeyMakes, vk::MakeInterceptions, vk::Typename> },
+            { "stop_intercepting_virtual_key_break", &ClearKeyCallback<interceptedVirtualKeyBreaks, &devices::KeyboardDevice::interceptedVirtualKeyBreaks, vk::BreakInterceptions, vk::Typename> },
+            { "stop_intercepting_scancode_make", &ClearKeyCallback<interceptedScancodeMakes, &devices::KeyboardDevice::interceptedScancodeMakes, sc::MakeInterceptions, sc::Typename> },
+            { "stop_intercepting_scancode_break", &ClearKeyCallback<interceptedScancodeBreaks, &devices::KeyboardDevice::interceptedScancodeBreaks, sc::BreakInterceptions, sc::Typename> },
+            { "device", &GetDevice },
+            { "devices", &ListDevices },
+            { "is_virtual_key_made", &IsKeyMade<CodeType::VirtualKey, vk::Typename> },
+            { "is_scancode_made", &IsKeyMade<CodeType::Scancode, sc::Typename> },
+            { "run_device_script", &RunDeviceScript },
+            { "stop_device_script", &StopDeviceScript },
+            { "set_dispatch_mode", &SetDispatchMode },
+            { "set_callback_style", &SetCallbackStyle },
+            { "set_self_injection_visible", &SetSelfInjectionVisible },
+            { "skipped_self_injections", &GetSkippedSelfInjections },
+            { "event_stream_stats", &GetEventStreamStats },
+            { "capture_stats", &GetCaptureStats },
+            { "set_tracing", &SetTracing },
+            { "export_trace", &ExportTrace },
+            { "key_usage", &GetKeyUsage },
+            { "key_usage_heatmap", &GetKeyUsageHeatmap },
+            { "save_key_usage", &SaveKeyUsage },
+            { "debounce", &SetDebounce },
+            { "debounce_count", &GetDebounceCount },
+            { "add_expansion", &AddExpansion },
+            { "remove_expansion", &RemoveExpansion },
+            { "record_start", &StartMacroRecording },
+            { "record_stop", &StopMacroRecording },
+            { "save_macro", &SaveMacro },
+            { "load_macro", &LoadMacro },
+            { "play_macro", &PlayMacro },
+            { "stop_macro", &StopMacro },
+            { "macro_playback_stats", &GetMacroPlaybackStats },
+            { "macro_sink", &GetMacroSink },
+            { "set_gc_mode", &SetGcMode },
+            { "gc_stats", &GetGcStats },
+            { "set_memory_limit", &SetMemoryLimit },
+            { "memory_stats", &GetMemoryStats },
+            { "set_callback_budget", &SetCallbackBudget },
+            { "callback_budget_stats", &GetCallbackBudgetStats },
+            { "benchmark_callback_budget", &BenchmarkCallbackBudget },
+            { "profile_start", &StartProfile },
+            { "profile_stop", &StopProfile },
+            { "set_jit_diagnostics", &SetJitDiagnostics },
+            { "jit_report", &GetJitReport },
+            { nullptr, nullptr }
+        };
+
+        // Register latch functions
+        luaL_register(L, "keyboard", KeyboardFunctions);
+    }
+
+    // Creates virtual key description table
+    // NOTE: Creates a new table and inserts that table inside the table at the top of the Lua stack.
+    void CreateVirtualKeyDescriptionTable(lua_State* L)
+    {
+        lua_pushliteral(L, "virtual_key_descriptions"); // push the name of the virtual key description table
+
+        lua_createtable(L, virtualKeyCount, 0); // create virtual key description table t and push onto stack
+
+        for (auto i = 0u; i < virtualKeyCount; i++)
+        {
+            const auto& vk = virtualKeys[i];
+
+            lua_pushstring(L, vk.info); // push the virtual key metadata v
+            lua_rawseti(L, -2, i); // t[virtualKey] = v
+        }
+
+        lua_rawset(L, -3); // insert the description table into the table below it on the stack; pop description table.
+    }
+
+    // Creates the virtual key symbolic maps
+    void CreateVirtualKeySymbolicNameTable(lua_State* L)
+    {
+        lua_createtable(L, virtualKeyCount, virtualKeyCount + altNameCount); // create table t and push onto stack
+
+        for (auto i = 0u; i < virtualKeyCount; i++)
+        {
+            const auto& vk = virtualKeys[i];
+
+            // Map virtual key enumeration-to-code
+            lua_pushstring(L, vk.name); // push the enumeration name k
+            lua_pushinteger(L, i); // push the virtual key code v to the top of the stack
+            lua_rawset(L, -3); // t[k] = v
+
+            // Map virtual key known-alternate enumerations-to-code
+            if (nullptr != vk.altNames)
+            {
+                auto altIndex = 0u;
+                auto alt = vk.altNames[altIndex++];
+
+                while (nullptr != alt)
+                {
+                    lua_pushstring(L, alt); // push the enumeration name k
+                    lua_pushinteger(L, i); // push the virtual key code v to the top of the stack
+                    lua_rawset(L, -3); // t[k] = v
+
+                    alt = vk.altNames[altIndex++];
+                }
+            }
+
+            // Reverse lookup, map virtual key code-to-enumeration
+            lua_pushstring(L, vk.name); // push the enumeration name v
+            lua_rawseti(L, -2, i); // t[virtual_key_code] = v
+        }
+
+        lua_setglobal(L, "vk"); // push the virtual key names and codes into Lua's global scope
+    }
+
+    // Builds keyboard.ffi: LuaJIT FFI views of the key state maps, and the event record. Reading these
+    //  compiles to plain loads, where the scancodes and virtual_keys tables abort trace compilation.
+    const char FfiDeclarations[] = R"(
+        local scancodes, virtual_keys, event, ticks_per_second, stream = ...
+        local ffi = require("ffi")
+        local bit = require("bit")
+        local band, lshift, rshift = bit.band, bit.lshift, bit.rshift
+
+        ffi.cdef[[
+            typedef struct { uint32_t words[8]; } uberkey_key_map;
+            typedef struct {
+                int64_t  timestamp;
+                uint64_t device_handle;
+                uint32_t sequence;
+                uint32_t extra_information;
+                uint16_t virtual_key;
+                uint16_t scancode;
+                uint16_t repeat_count;
+                uint8_t  e0;
+                uint8_t  e1;
+                uint8_t  device;
+                uint8_t  injected;
+                uint8_t  is_break;
+                uint8_t  sources;
+                uint8_t  is_consumed;
+                uint8_t  reserved[3];
+            } uberkey_key_event;
+            typedef struct {
+                uint32_t next_sequence;
+                uint32_t reserved;
+                uberkey_key_event events[256];
+            } uberkey_event_stream;
+        ]]
+
+        local keyboard_ffi = {
+            scancodes = ffi.cast("const uberkey_key_map*", scancodes),
+            virtual_keys = ffi.cast("const uberkey_key_map*", virtual_keys),
+            event = ffi.cast("const uberkey_key_event*", event),
+            ticks_per_second = ticks_per_second,
+            stream = stream and ffi.cast("const uberkey_event_stream*", stream),
+        }
+
+        function keyboard_ffi.is_made(key_map, code)
+            return band(key_map.words[band(rshift(code, 5), 7)], lshift(1, band(code, 31))) ~= 0
+        end
+
+        keyboard.ffi = keyboard_ffi
+        return keyboard_ffi.event
+    )";
+
+    void CreateFfiViews(lua_State* L, const KeyMap* pScancodes, const KeyMap* pVirtualKeys, const stream::EventStream* pStream)
+    {
+        {
+            const auto result = luaL_loadbuffer(L, FfiDeclarations, sizeof(FfiDeclarations) - 1u, "UberKey_FFI"); // push the chunk
+            if (LUA_ERRMEM == result)
+            {
+                throw bad_alloc();
+            }
+            else if (0 != result)
+            {
+                throw logic_error("failed to compile the FFI declarations");
+            }
+        }
+
+        lua_pushlightuserdata(L, const_cast<KeyMap*>(pScancodes));
+        lua_pushlightuserdata(L, const_cast<KeyMap*>(pVirtualKeys));
+        lua_pushlightuserdata(L, &currentKeyEvent);
+        {
+            LARGE_INTEGER frequency;
+            ::QueryPerformanceFrequency(&frequency);
+            lua_pushnumber(L, static_cast<lua_Number>(frequency.QuadPart));
+        }
+        if (nullptr != pStream)
+        {
+            lua_pushlightuserdata(L, const_cast<stream::EventStream*>(pStream));
+        }
+        else
+        {
+            lua_pushnil(L);
+        }
+
+        // NOTE: Lua states run on the thread that created them, so the thread_local event record's address is stable.
+        if (0 != lua_pcall(L, 5, 1, 0)) // pop the chunk and arguments, push the event object
+        {
+            std::cout << "failed to create keyboard.ffi: " << lua_tostring(L, -1) << std::endl;
+            lua_pop(L, 1);
+            return;
+        }
+
+        // Keep the event object handed to event style callbacks; the same cdata every call.
+        eventObjectReference = luaL_ref(L, LUA_REGISTRYINDEX); // pop the event object
+    }
+
+    // Create and expose this application's Lua APIs.
+    void OpenUberKeyLuaLibrary(lua_State* L)
+    {
+        const KeyMap* pScancodes = &madeScancodes;
+        const KeyMap* pVirtualKeys = &madeVirtualKeys;
+        const stream::EventStream* pStream = &stream::eventStream;
+
+        const auto pScript = scripts::FindDeviceScript(L);
+        if (nullptr != pScript) // if (a device script) the key state views show the published snapshot
+        {
+            pScancodes = &pScript->keyState().madeScancodes;
+            pVirtualKeys = &pScript->keyState().madeVirtualKeys;
+            pStream = nullptr; // the stream is written on the main thread
+        }
+
+        sc::ScancodeTable::CreateTable(L, pScancodes);
+        vk::VirtualKeyTable::CreateTable(L, pVirtualKeys);
+        dispatch::CreateCallbackTables(L);
+        CreateVirtualKeySymbolicNameTable(L);
+
+        // Create the keyboard namespace in Lua.
+        RegisterKeyboardFunctions(L);
+
+        // Stuff that goes in the keyboard namespace below HERE.
+        ////////////////////////////////////////////////////////
+        CreateVirtualKeyDescriptionTable(L);
+
+        assert(1 == lua_gettop(L));
+        lua_pop(L, 1); // Clean the keyboard namespace off the Lua stack.
+
+        CreateFfiViews(L, pScancodes, pVirtualKeys, pStream);
+    }
+} // namespace api
+
+// Loads the native plugins from the "plugins" directory, and gives them the host's function table.
+namespace plugins
+{
+    struct BindingKind
+    {
+        const char*                         callbackTablename;
+        KeyMap*                             keyMap;
+        KeyMap devices::KeyboardDevice::*   deviceKeyMap;
+    };
+
+    // In the order of uberkey_binding_kind.
+    const BindingKind BindingKinds[] =
+    {
+        { api::sc::MakeLatches, &latchedScancodeMakes, &devices::KeyboardDevice::latchedScancodeMakes },
+        { api::sc::BreakLatches, &latchedScancodeBreaks, &devices::KeyboardDevice::latchedScancodeBreaks },
+        { api::vk::MakeLatches, &latchedVirtualKeyMakes, &devices::KeyboardDevice::latchedVirtualKeyMakes },
+        { api::vk::BreakLatches, &latchedVirtualKeyBreaks, &devices::KeyboardDevice::latchedVirtualKeyBreaks },
+        { api::sc::MakeInterceptions, &interceptedScancodeMakes, &devices::KeyboardDevice::interceptedScancodeMakes },
+        { api::sc::BreakInterceptions, &interceptedScancodeBreaks, &devices::KeyboardDevice::interceptedScancodeBreaks },
+        { api::vk::MakeInterceptions, &interceptedVirtualKeyMakes, &devices::KeyboardDevice::interceptedVirtualKeyMakes },
+        { api::vk::BreakInterceptions, &interceptedVirtualKeyBreaks, &devices::KeyboardDevice::interceptedVirtualKeyBreaks },
+    };
+
+    inline bool IsBindingValid(uint32_t kind, uint32_t code, uint32_t device)
+    {
+        return kind < sizeof(BindingKinds) / sizeof(BindingKinds[0]) && code < 256u && device < devices::MaxDeviceCount;
+    }
+
+    // True if a Lua callback, or a device script, has the key bound.
+    bool IsLuaBound(const BindingKind& bindingKind, lua_Integer callbackIndex, uint32_t device)
+    {
+        if (nullptr != scripts::deviceScripts[device])
+        {
+            return true;
+        }
+        if (nullptr == luaState)
+        {
+            return false;
+        }
+
+        return dispatch::IsKeyCallbackBound(luaState, bindingKind.callbackTablename, callbackIndex);
+    }
+
+    int32_t UBERKEY_CALL Bind(uint32_t kind, uint32_t code, uint32_t device, int32_t order, uberkey_key_handler handler, void* context)
+    {
+        if (!IsBindingValid(kind, code, device) || nullptr == handler)
+        {
+            return -1;
+        }
+
+        const auto& bindingKind = BindingKinds[kind];
+        const auto callbackIndex = api::CallbackIndex(static_cast<uint_fast8_t>(device), static_cast<uint_fast16_t>(code));
+
+        const NativeHandler nativeHandler = { order, handler, context };
+        api::nativeHandlers.Bind(kind, device, code, nativeHandler);
+
+        Set(*bindingKind.keyMap, code);
+        Set(devices::keyboardDevices[device].*bindingKind.deviceKeyMap, code);
+        shared::PublishKeyMaps();
+
+        return 0;
+    }
+
+    int32_t UBERKEY_CALL Unbind(uint32_t kind, uint32_t code, uint32_t device, uberkey_key_handler handler, void* context)
+    {
+        if (!IsBindingValid(kind, code, device))
+        {
+            return -1;
+        }
+
+        const auto& bindingKind = BindingKinds[kind];
+        const auto callbackIndex = api::CallbackIndex(static_cast<uint_fast8_t>(device), static_cast<uint_fast16_t>(code));
+
+        if (!api::nativeHandlers.Unbind(kind, device, code, handler, context))
+        {
+            return -1;
+        }
+        if (nullptr != api::nativeHandlers.Find(kind, device, code)) // if (other handlers still need the key)
+        {
+            return 0;
+        }
+
+        // Leave the key maps alone while a Lua callback, or a device script, still has the key bound.
+        if (!IsLuaBound(bindingKind, callbackIndex, device))
+        {
+            api::ClearKeyMaps(*bindingKind.keyMap, bindingKind.deviceKeyMap, static_cast<uint_fast8_t>(device), static_cast<uint_fast16_t>(code));
+            shared::PublishKeyMaps();
+        }
+
+        return 0;
+    }
+
+    void UBERKEY_CALL Log(const char* message)
+    {
+        std::cout << message << std::endl;
+    }
+
+    const uberkey_host Host = { UBERKEY_PLUGIN_ABI_VERSION, &Bind, &Unbind, &Log };
+
+    struct Plugin
+    {
+        HMODULE                         module;
+        uberkey_plugin_unload_function  unload;
+    };
+
+    vector<Plugin> loadedPlugins;
+
+    void LoadPlugins()
+    {
+        const auto directory = GetProgramExecutablePath() + L"plugins\\";
+
+        WIN32_FIND_DATAW findData;
+        const auto findHandle = ::FindFirstFileW((directory + L"*.dll").c_str(), &findData);
+        if (INVALID_HANDLE_VALUE == findHandle)
+        {
+            return; // no plugins
+        }
+
+        do
+        {
+            const auto path = directory + findData.cFileName;
+
+            const auto module = ::LoadLibraryW(path.c_str());
+            if (nullptr == module)
+            {
+                std::wcout << L"Failed to load plugin: " << findData.cFileName << std::endl;
+                continue;
+            }
+
+            const auto load = reinterpret_cast<uberkey_plugin_load_function>(::GetProcAddress(module, UBERKEY_PLUGIN_LOAD_NAME));
+            const auto unload = reinterpret_cast<uberkey_plugin_unload_function>(::GetProcAddress(module, UBERKEY_PLUGIN_UNLOAD_NAME));
+            if (nullptr == load || 0 != load(&Host))
+            {
+                std::wcout << L"Plugin failed to initialize: " << findData.cFileName << std::endl;
+                ::FreeLibrary(module);
+                continue;
+            }
+
+            std::wcout << L"Loaded plugin: " << findData.cFileName << std::endl;
+
+            const Plugin plugin = { module, unload };
+            loadedPlugins.push_back(plugin);
+        } while (::FindNextFileW(findHandle, &findData));
+
+        ::FindClose(findHandle);
+    }
+
+    void UnloadPlugins()
+    {
+        api::nativeHandlers.Clear();
+
+        for (auto it = loadedPlugins.rbegin(); it != loadedPlugins.rend(); ++it)
+        {
+            if (nullptr != it->unload)
+            {
+                it->unload();
+            }
+            ::FreeLibrary(it->module);
+        }
+        loadedPlugins.clear();
+    }
+} // namespace plugins
+
+// Remap Images
+//
+// A compiled binding file (see RemapImage.h), mapped read-only from UberKey.ukr. Its keys are bound like
+//  a plugin's, and each intercepted key is looked up in the image where it lies. Keys with no action in
+//  the active layers are sent on again, untouched.
+namespace remaps
+{
+    const wchar_t ImageFileName[] = L"UberKey.ukr";
+
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const void* pView = nullptr;
+    RemapImage image;
+
+    RemapDispatcher dispatcher(image);
+
+    // Sends the image's keys with SendInput(), and the keys it passes through as they came.
+    class InputOutput final : public RemapOutput
+    {
+    public:
+        explicit InputOutput(const uberkey_key_event& event)
+            : _event(event)
+        {
+        }
+
+        void PassThrough() override
+        {
+            Send(_event.virtual_key, _event.scancode, 0u != _event.e0, 0u != _event.is_break);
+        }
+
+        void Send(const uint_fast16_t virtualKey, const bool isBreak) override
+        {
+            Send(virtualKey, api::VirtualKeyToScancode(virtualKey), false, isBreak);
+        }
+
+        void Send(const RemapKeyStep* pSteps, const uint32_t count) override
+        {
+            macroInput.clear();
+
+            for (auto i = 0u; i < count; i++)
+            {
+                INPUT input = {};
+                input.type = INPUT_KEYBOARD;
+                input.ki.wVk = pSteps[i].virtualKey;
+                input.ki.wScan = static_cast<WORD>(api::VirtualKeyToScancode(pSteps[i].virtualKey));
+                input.ki.dwFlags = (0u != pSteps[i].isBreak) ? KEYEVENTF_KEYUP : 0u;
+                input.ki.dwExtraInfo = selfInjection.signature;
+                macroInput.push_back(input);
+            }
 
-                length = i + 1;
-            };
+            if (!macroInput.empty() && 0 == trace::SendInput(static_cast<UINT>(macroInput.size()), &macroInput[0], sizeof(macroInput[0])))
+            {
+                std::wcout << L"failed to send remap macro -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            }
+        }
 
-            BreakUtf8String();
+    private:
+        const uberkey_key_event& _event;
 
-            for (;;)
+        static thread_local vector<INPUT> macroInput; // reused; a macro is sent with one SendInput() call
+
+        static void Send(const uint_fast16_t virtualKey, const uint_fast16_t scancode, const bool isExtended, const bool isBreak)
+        {
+            INPUT input = {};
+            input.type = INPUT_KEYBOARD;
+            input.ki.wVk = static_cast<WORD>(virtualKey);
+            input.ki.wScan = static_cast<WORD>(scancode);
+            input.ki.dwFlags = (isExtended ? KEYEVENTF_EXTENDEDKEY : 0u) | (isBreak ? KEYEVENTF_KEYUP : 0u);
+            input.ki.dwExtraInfo = selfInjection.signature;
+
+            if (0 == trace::SendInput(1u, &input, sizeof(input)))
             {
-                result = ::MultiByteToWideChar(
-                    CP_UTF8,
-                    0,
-                    &_str[_offset],
-                    static_cast<int>(length),
-                    &unicodeOutput[0],
-                    static_cast<int>(unicodeOutput.size())
-                    );
+                std::wcout << L"failed to send remapped key -- error code: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            }
+        }
 
-                if (0xFFFD == result) // if (invalid UTF encodings)
-                {
-                    std::wcout << L"UTF8 to UTF16 translation failed; the input byte/char sequences are invalid" << std::endl;
-                    // TODO: produce an error message for Lua?
-                    return 0;
-                }
+        InputOutput(const InputOutput&) = delete;
+        InputOutput& operator =(const InputOutput&) = delete;
+    };
 
-                if (0 == result)
-                {
-                    const auto lastError = ::GetLastError();
+    thread_local vector<INPUT> InputOutput::macroInput;
 
-                    // if (the problem is insufficient buffer)
-                    if (ERROR_INSUFFICIENT_BUFFER == lastError && insufficientBufferRetries)
-                    {
-                        // try again with a smaller range
-                        length /= 2;
-                        insufficientBufferRetries--;
+    void UBERKEY_CALL HandleMake(const uberkey_key_event* event, void* context)
+    {
+        UNREFERENCED_PARAMETER(context);
 
-                        // Adjust length so that it falls between code points.
-                        BreakUtf8String();
+        if (capture::IsRunning()) // if (the capture thread ran it already)
+        {
+            return;
+        }
 
-                        continue;
-                    }
+        InputOutput output(*event);
+        dispatcher.Make(event->virtual_key, output);
+    }
 
-                    switch (lastError)
-                    {
-                    case ERROR_INSUFFICIENT_BUFFER:
-                        std::wcout << L"UTF8 to UTF16 translation failed; insufficient buffer" << std::endl;
-                        break;
-                    case ERROR_INVALID_FLAGS:
-                        std::wcout << L"UTF8 to UTF16 translation failed; invalid flags passed to MultiByteToWideChar()" << std::endl;
-                        break;
-                    case ERROR_INVALID_PARAMETER:
-                        std::wcout << L"UTF8 to UTF16 translation failed; invalid parameter passed to MultiByteToWideChar()" << std::endl;
-                        break;
-                    case ERROR_NO_UNICODE_TRANSLATION:
-                        std::wcout << L"UTF8 to UTF16 translation failed; invalid unicode was found in string" << std::endl;
-                        break;
-                    default:
-                        std::wcout << L"UTF8 to UTF16 translation failed with unrecognized error code: 0x" << std::hex << lastError << std::dec << std::endl;
-                        break;
-                    }
+    void UBERKEY_CALL HandleBreak(const uberkey_key_event* event, void* context)
+    {
+        UNREFERENCED_PARAMETER(context);
 
-                    // TODO: produce an error message for Lua
+        if (capture::IsRunning())
+        {
+            return;
+        }
 
-                    return 0;
+        InputOutput output(*event);
+        dispatcher.Break(event->virtual_key, output);
+    }
+
+    // With the capture thread, the image is run there, from the hook, while the hook holds the key event;
+    //  so the keys it sends go out in order with the keys passing through, just as they do inline. The
+    //  dispatcher is only ever used by the one thread.
+    // NOTE: Capture thread only. The event's sequence number is a capture sequence number; the key event
+    //  doesn't have its own yet.
+    void CaptureKeyEvent(const uberkey_key_event& event)
+    {
+        if (!image.isOpen() || !image.IsBound(event.virtual_key))
+        {
+            return;
+        }
+
+        trace::SequenceScope sequenceScope(event.sequence);
+        InputOutput output(event);
+        if (0u != event.is_break)
+        {
+            dispatcher.Break(event.virtual_key, output);
+        }
+        else
+        {
+            dispatcher.Make(event.virtual_key, output);
+        }
+    }
+
+    void Unload()
+    {
+        dispatcher.Reset();
+        image.Close();
+
+        if (nullptr != pView)
+        {
+            ::UnmapViewOfFile(pView);
+            pView = nullptr;
+        }
+        if (nullptr != mapping)
+        {
+            ::CloseHandle(mapping);
+            mapping = nullptr;
+        }
+        if (INVALID_HANDLE_VALUE != file)
+        {
+            ::CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // Maps the image, if there is one, and binds its keys. Returns true if an image was loaded.
+    bool Load()
+    {
+        file = ::CreateFileW((GetProgramExecutablePath() + ImageFileName).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (INVALID_HANDLE_VALUE == file)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER size;
+        if (!::GetFileSizeEx(file, &size) || 0 == size.QuadPart || size.QuadPart > numeric_limits<uint32_t>::max())
+        {
+            std::wcout << L"The remap image is empty, or too large." << std::endl;
+            Unload();
+            return false;
+        }
+
+        mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        pView = (nullptr != mapping) ? ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (nullptr == pView)
+        {
+            std::wcout << L"Failed to map the remap image: 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+            Unload();
+            return false;
+        }
+
+        const auto pError = image.Open(pView, static_cast<size_t>(size.QuadPart));
+        if (nullptr != pError)
+        {
+            std::wcout << L"The remap image can't be used; " << pError << std::endl;
+            Unload();
+            return false;
+        }
+
+        for (auto virtualKey = 0u; virtualKey < 256u; virtualKey++)
+        {
+            if (image.IsBound(virtualKey))
+            {
+                plugins::Bind(UBERKEY_INTERCEPT_VIRTUAL_KEY_MAKE, virtualKey, devices::AnyDevice, -1, &HandleMake, nullptr);
+                plugins::Bind(UBERKEY_INTERCEPT_VIRTUAL_KEY_BREAK, virtualKey, devices::AnyDevice, -1, &HandleBreak, nullptr);
+            }
+        }
+
+        if (!hook::keyboardHook)
+        {
+            hook::InstallLowLevelKeyboardHook();
+        }
+
+        std::wcout << L"Loaded a remap image with " << image.layerCount() << L" layers." << std::endl;
+        return true;
+    }
+} // namespace remaps
+
+void ReadLuaScript(const wstring& fileName, LuaScriptSource& source)
+{
+    const auto path = GetProgramExecutablePath();
+
+    std::ifstream inFile(path + fileName, std::ios_base::in | std::ios_base::binary);
+    if (!inFile.good())
+    {
+        throw exception("failed to read Lua script file");
+    }
+
+    source.buffer.clear();
+    source.readPos = 0u;
+    decltype(source.buffer)::size_type pos = 0u;
+
+    while (inFile.good())
+    {
+        if (pos == source.buffer.size())
+        {
+            source.buffer.resize(source.buffer.size() + 4096);
+        }
+        inFile.read(reinterpret_cast<char*>(&source.buffer[pos]), source.buffer.size() - pos);
+        const auto count = inFile.gcount();
+        pos = static_cast<decltype(pos)>((pos + count < numeric_limits<decltype(pos)>::max()) ? pos + count : numeric_limits<decltype(pos)>::max());
+    }
+
+    if (pos != source.buffer.size())
+    {
+        source.buffer.resize(pos);
+    }
+}
+
+// Creates a Lua state with the standard libraries and this application's APIs.
+lua_State* CreateLuaState(scripts::DeviceScript* pScript = nullptr)
+{
+    lua_State* L = memory::NewState();
+    if (nullptr == L)
+    {
+        throw exception("failed to create Lua state");
+    }
+
+    if (nullptr != pScript)
+    {
+        lua_pushlightuserdata(L, pScript);
+        lua_setfield(L, LUA_REGISTRYINDEX, scripts::ContextName);
+    }
+
+    // Provide the std libs.
+    luaL_openlibs(L);
+    api::OpenUberKeyLuaLibrary(L);
+
+    // Provide some C functions.
+    lua_register(L, "print", &LuaPrintReplacement);
+    lua_register(L, "dumpstack", &LuaDumpStack);
+
+    return L;
+}
+
+// Compiles and runs a script file from the program's directory. Returns false if the script failed;
+//  the error has been written to the console.
+bool RunLuaScript(lua_State* L, const wstring& fileName, const char* chunkName)
+{
+    LuaScriptSource source;
+    ReadLuaScript(fileName, source);
+
+    {
+        const auto result = lua_load(L, &LuaReader, &source, chunkName);
+        if (LUA_ERRSYNTAX == result)
+        {
+            std::wcout << L"Syntax error compiling Lua script." << std::endl;
+        }
+        else if (LUA_ERRMEM == result)
+        {
+            throw bad_alloc();
+        }
+        else if (0 != result)
+        {
+            std::wcout << L"Unknown error compiling Lua script." << std::endl;
+        }
+    }
+
+    {
+        const auto result = lua_pcall(L, 0, LUA_MULTRET, 0);
+        if (LUA_ERRRUN == result)
+        {
+            std::wcout << "Lua runtime error." << std::endl;
+        }
+        else if (LUA_ERRMEM == result)
+        {
+            std::wcout << "Lua memory allocation error." << std::endl;
+        }
+        else if (LUA_ERRERR == result)
+        {
+            std::wcout << "Lua error while running the error handler function." << std::endl;
+        }
+        else if (0 != result)
+        {
+            std::wcout << "Lua unknown error." << std::endl;
+        }
+
+        if (0 != result)
+        {
+            LuaDumpStack(L);
+        }
+
+        return 0 == result;
+    }
+}
+
+void scripts::DeviceScript::Run()
+{
+    lua_State* L = nullptr;
+    trace::NameThread("device script");
+
+    try
+    {
+        L = CreateLuaState(this);
+        RunLuaScript(L, _fileName, "UberKey_Device_Script");
+
+        for (;;)
+        {
+            QueuedKeyEvent queuedEvent;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _eventReady.wait(lock, [this]() { return _isStopping || 0u != _queueCount; });
+
+                if (_isStopping)
+                {
+                    break;
                 }
 
-                break;
+                queuedEvent = _queue[_queueHead];
+                _queueHead = (_queueHead + 1u) % QueueLength;
+                _queueCount--;
             }
 
-            _offset += length;
+            _keyState = queuedEvent.keyState;
 
-            return result;
+            const auto& keyEvent = queuedEvent.keyEvent;
+            const auto code = (queuedEvent.isVirtualKeyCallback) ? keyEvent.virtualKey : keyEvent.scancode;
+            const auto callbackIndex = api::CallbackIndex(_device, code);
+            if (!api::IsRepeatFiltered(queuedEvent.callbackTablename, callbackIndex, keyEvent))
+            {
+                api::KeyCallbackHandler(L, queuedEvent.callbackTablename, callbackIndex, keyEvent);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (0u != _queueCount) // if (more events are waiting) collect once the queue's empty
+                {
+                    continue;
+                }
+            }
+            memory::RunPendingCollection(L);
         }
+    }
+    catch (const exception& e)
+    {
+        std::wcout << L"Device script terminated by an exception: " << e.what() << std::endl;
+    }
 
-    private:
-        const char* const _str;
-        const size_t _strLength;
-        const size_t _maxOutputLength;
+    if (nullptr != L)
+    {
+        memory::CloseState(L);
+    }
+}
 
-        size_t _offset;
+// Control Server
+//
+// Serves the requests of UberKeyControl.h on a named pipe. The pipe is only read and written on the
+//  server's own thread. Each request is posted to the main window, and run there between key events;
+//  so the key dispatch never sees a half applied change, and never waits on a client.
+namespace control
+{
+    struct Request
+    {
+        uberkey_control_request header;
+        vector<uint8_t>         payload;
+        uint32_t                status;
+        string                  reply;
+        bool                    isDone;
     };
 
-    int SendText(lua_State* L)
+    std::thread serverThread;
+    HANDLE stopEvent = nullptr;
+    HWND windowHandle = nullptr;
+
+    std::mutex mutex; // guards pPendingRequest, isStopping, and Request::isDone
+    std::condition_variable requestDone;
+    Request* pPendingRequest = nullptr;
+    bool isStopping = false;
+
+    uint64_t requestCount = 0u; // NOTE: main thread only
+    bool isKeyLogging = true;   // raw key makes are written to the console
+
+    inline void Fail(Request& request, const uint32_t status, const char* const message)
     {
-        //VkKeyScanEx();
-        const auto argc = lua_gettop(L);
+        request.status = status;
+        request.reply = message;
+    }
 
-        // Current write position into the virtual key inputBuffer.
-        UINT inputBufferIndex = 0u;
+    void LoadScript(Request& request)
+    {
+        if (request.payload.empty())
+        {
+            return Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "no script file name");
+        }
 
-        bool shiftMade = false;
-        bool ctrlMade = false;
-        bool altMade = false;
-        bool hankakuMade = false;
+        const auto fileName = expansions::Utf8ToUtf16(reinterpret_cast<const char*>(request.payload.data()), request.payload.size());
+        try
+        {
+            if (!RunLuaScript(luaState, fileName, "UberKey_Control_Script"))
+            {
+                Fail(request, UBERKEY_CONTROL_FAILED, "the script failed; see UberKey's console");
+            }
+        }
+        catch (const exception& e)
+        {
+            Fail(request, UBERKEY_CONTROL_FAILED, e.what());
+        }
+    }
+
+    void SetBinding(Request& request)
+    {
+        uberkey_control_binding binding;
+        if (sizeof(binding) != request.payload.size())
+        {
+            return Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "malformed binding");
+        }
+        ::memcpy(&binding, request.payload.data(), sizeof(binding));
+
+        if (!plugins::IsBindingValid(binding.kind, binding.code, binding.device))
+        {
+            return Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "no such binding kind, code, or device");
+        }
+
+        const auto& bindingKind = plugins::BindingKinds[binding.kind];
+        const auto device = static_cast<uint_fast8_t>(binding.device);
+        const auto code = static_cast<uint_fast16_t>(binding.code);
+        const auto callbackIndex = api::CallbackIndex(device, code);
+
+        if (nullptr == api::FindNativeHandlers(bindingKind.callbackTablename, callbackIndex) && !plugins::IsLuaBound(bindingKind, callbackIndex, device))
+        {
+            return Fail(request, UBERKEY_CONTROL_FAILED, "the key isn't bound");
+        }
 
-        auto CheckFlushVirtualKeys = CheckFlushInputBuffer(inputBufferIndex);
-        auto vkbuf = VirtualKeyRecordWriter(inputBufferIndex);
-        auto modifierState = CheckSetModifier(vkbuf, CheckFlushVirtualKeys);
+        // The callbacks stay bound; only the key maps change, and with them what's latched or intercepted.
+        if (0u != binding.is_enabled)
+        {
+            Set(devices::keyboardDevices[device].*bindingKind.deviceKeyMap, code);
+            Set(*bindingKind.keyMap, code);
+        }
+        else
+        {
+            api::ClearKeyMaps(*bindingKind.keyMap, bindingKind.deviceKeyMap, device, code);
+        }
+        shared::PublishKeyMaps();
+    }
 
-        for (auto arg = 0; arg < argc; arg++)
+    // Writes "table.field value" lines for the scalar fields of the table at the top of the stack.
+    void WriteStatsTable(lua_State* L, const char* const tableName, std::ostream& out)
+    {
+        vector<string> lines;
+
+        lua_pushnil(L); // push the first key
+        while (0 != lua_next(L, -2)) // pop the key; push the next key and value
         {
-            size_t strLength;
-            const char* str;
+            const auto valueType = lua_type(L, -1);
+            if (LUA_TSTRING == lua_type(L, -2) && (LUA_TNUMBER == valueType || LUA_TBOOLEAN == valueType || LUA_TSTRING == valueType))
             {
-                str = lua_tolstring(L, arg + 1, &strLength);
-
-                // make sure the argument is a string
-                if (nullptr == str)
+                std::ostringstream line;
+                line.precision(15);
+                line << tableName << '.' << lua_tostring(L, -2) << ' ';
+                if (LUA_TNUMBER == valueType)
                 {
-                    std::wcout << L"failed to convert function parameter " << (arg + 1) << L" to a string" << std::endl;
-                    // TODO: maybe produce a Lua error message?
-                    continue; // the function argument is not a string
+                    line << lua_tonumber(L, -1);
+                }
+                else if (LUA_TBOOLEAN == valueType)
+                {
+                    line << (lua_toboolean(L, -1) ? "true" : "false");
                 }
+                else
+                {
+                    line << lua_tostring(L, -1);
+                }
+                lines.push_back(line.str());
             }
 
-            // NOTE: This won't handle strings longer than numeric_limits<int>::max().
-            strLength = min(static_cast<decltype(strLength)>(numeric_limits<int>::max()), strLength);
-
-            // assume the string is UTF-8 and convert it to native UTF-16
+            lua_pop(L, 1); // pop the value; leave the key for the next iteration
+        }
 
-            // do the string conversion and output in chunks
-            auto StringConvert = Utf8To16Converter(str, strLength);
+        std::sort(lines.begin(), lines.end());
+        for (const auto& line : lines)
+        {
+            out << line << '\n';
+        }
+    }
 
-            auto length = StringConvert();
+    void DumpCounters(Request& request)
+    {
+        // The same numbers the scripts see.
+        static const struct
+        {
+            const char*     name;
+            lua_CFunction   function;
+        } StatsFunctions[] =
+        {
+            { "event_stream", &api::GetEventStreamStats },
+            { "capture", &api::GetCaptureStats },
+            { "gc", &api::GetGcStats },
+            { "memory", &api::GetMemoryStats },
+            { "callback_budget", &api::GetCallbackBudgetStats },
+            { "macro_playback", &api::GetMacroPlaybackStats },
+        };
 
-            while (0 != length)
+        std::ostringstream out;
+        for (const auto& stats : StatsFunctions)
+        {
+            lua_pushcfunction(luaState, stats.function); // push the stats function
+            if (0 != lua_pcall(luaState, 0, 1, 0)) // pop the function; push the stats table, or an error
             {
-                for (decltype(length) i = 0u; i < length; i++)
-                {
-                    const auto ch = unicodeOutput[i];
+                lua_pop(luaState, 1); // pop the error message
+                continue;
+            }
 
-                    uint_fast16_t virtualKey;
-                    bool shift;
-                    bool ctrl;
-                    bool alt;
-                    bool hankaku;
+            WriteStatsTable(luaState, stats.name, out);
+            lua_pop(luaState, 1); // pop the stats table
+        }
 
-                    {
-                        const auto result = ::VkKeyScanW(ch);
-                        virtualKey = static_cast<uint8_t>(result);
-                        uint_fast8_t modifierFlags = static_cast<uint8_t>(result >> 8);
+        out << "self_injection.hook_skipped " << selfInjection.skippedHookEvents << '\n';
+        out << "self_injection.raw_input_skipped " << selfInjection.skippedRawInputEvents << '\n';
+        out << "control.requests " << requestCount << '\n';
 
-                        if (-1 == static_cast<int8_t>(virtualKey) && -1 == static_cast<int8_t>(modifierFlags))
-                        {
-                            std::wcout << L"failed to convert unicode code point to virtual key sequence" << std::endl;
-                            continue; // move to next code point
-                        }
+        request.reply = out.str();
+    }
 
-                        shift = 0 != (0x1 & modifierFlags);
-                        ctrl = 0 != (0x2 & modifierFlags);
-                        alt = 0 != (0x4 & modifierFlags);
-                        hankaku = 0 != (0x8 & modifierFlags);
-                    }
+    void ExportTrace(Request& request)
+    {
+        if (request.payload.empty())
+        {
+            return Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "no trace file name");
+        }
 
-                    // With the virtual key code and required modifers known,
-                    //  output the required sequence of virtual keys.
+        const auto fileName = expansions::Utf8ToUtf16(reinterpret_cast<const char*>(request.payload.data()), request.payload.size());
+        std::ofstream outFile(GetProgramExecutablePath() + fileName, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        const auto spanCount = trace::Write(outFile);
+        if (!outFile.good())
+        {
+            return Fail(request, UBERKEY_CONTROL_FAILED, "failed to write the trace");
+        }
 
-                    {
-                        // Make sure the modifier keys are set correctly.
-                        modifierState.CheckSet<VK_SHIFT>(shift, shiftMade);
-                        modifierState.CheckSet<VK_CONTROL>(ctrl, ctrlMade);
-                        modifierState.CheckSet<VK_MENU>(alt, altMade);
-                        modifierState.CheckSet<VK_OEM_AUTO>(hankaku, hankakuMade);
+        request.reply = std::to_string(spanCount) + " spans written";
+    }
 
-                        // output virtual key make and break
-                        vkbuf.WriteVirtualKey<KeyAction::Make>(virtualKey);
-                        CheckFlushVirtualKeys();
+    void SetKeyLogging(Request& request)
+    {
+        uint32_t isEnabled;
+        if (sizeof(isEnabled) != request.payload.size())
+        {
+            return Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "malformed logging switch");
+        }
+        ::memcpy(&isEnabled, request.payload.data(), sizeof(isEnabled));
 
-                        vkbuf.WriteVirtualKey<KeyAction::Break>(virtualKey);
-                        CheckFlushVirtualKeys();
-                    }
-                } // for ( the length of the string range )
+        isKeyLogging = (0u != isEnabled);
+    }
 
-                length = StringConvert();
-            } // while ( 0 != length )
-        } // for ( each string passed to this function from Lua )
+    // The budget for an evaluated chunk when keyboard.set_callback_budget() hasn't set one; a chunk that
+    //  never ends would otherwise hold up every key event for good.
+    const int EvaluateInstructionCount = 10000000;
 
-        // Clear any modifier keys.
-        bool clearFlag = false;
-        modifierState.CheckSet<VK_SHIFT>(clearFlag, shiftMade);
-        modifierState.CheckSet<VK_CONTROL>(clearFlag, ctrlMade);
-        modifierState.CheckSet<VK_MENU>(clearFlag, altMade);
-        modifierState.CheckSet<VK_OEM_AUTO>(clearFlag, hankakuMade);
-        CheckFlushVirtualKeys(true); // Force a final flush.
+    // Runs a chunk in the main script's state, always under an instruction budget; the callbacks' own, if
+    //  one is set.
+    void Evaluate(Request& request)
+    {
+        if (request.payload.empty())
+        {
+            return Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "no Lua source");
+        }
 
-        // letting Lua clean the stack
+        const auto L = luaState;
+        const auto top = lua_gettop(L);
 
-        return 0;
-    }
+        if (0 != luaL_loadbuffer(L, reinterpret_cast<const char*>(request.payload.data()), request.payload.size(), "=control")) // push the chunk, or an error
+        {
+            Fail(request, UBERKEY_CONTROL_FAILED, lua_tostring(L, -1));
+            lua_settop(L, top);
+            return;
+        }
 
-    int HookKeyboard(lua_State* L)
-    {
-        UNREFERENCED_PARAMETER(L);
-        hook::InstallLowLevelKeyboardHook();
-        return 0;
+        const auto budget = (0 != api::callbackBudget.instructionCount) ? api::callbackBudget.instructionCount : EvaluateInstructionCount;
+        const auto isHooked = api::SetCallbackHook(L, "control", budget);
+        const auto result = lua_pcall(L, 0, LUA_MULTRET, 0); // pop the chunk; push its results, or an error
+        if (isHooked)
+        {
+            lua_sethook(L, nullptr, 0, 0);
+        }
+        api::isBudgetExceeded = false; // NOTE: no binding to charge the overrun to
+
+        if (0 != result)
+        {
+            Fail(request, UBERKEY_CONTROL_FAILED, lua_isstring(L, -1) ? lua_tostring(L, -1) : "Lua error");
+        }
+        else
+        {
+            for (auto i = top + 1; i <= lua_gettop(L); i++)
+            {
+                if (i > top + 1)
+                {
+                    request.reply += '\t';
+                }
+                request.reply += LuaTypeToString(L, i);
+            }
+        }
+
+        lua_settop(L, top);
     }
 
-    int UnhookKeyboard(lua_State* L)
+    void Run(Request& request)
     {
-        UNREFERENCED_PARAMETER(L);
-        hook::DisableLowLevelKeyboardHook();
-        return 0;
+        request.status = UBERKEY_CONTROL_OK;
+        requestCount++;
+
+        switch (request.header.command)
+        {
+        case UBERKEY_CONTROL_LOAD_SCRIPT:
+            LoadScript(request);
+            break;
+        case UBERKEY_CONTROL_SET_BINDING:
+            SetBinding(request);
+            break;
+        case UBERKEY_CONTROL_DUMP_COUNTERS:
+            DumpCounters(request);
+            break;
+        case UBERKEY_CONTROL_SET_KEY_LOGGING:
+            SetKeyLogging(request);
+            break;
+        case UBERKEY_CONTROL_EVALUATE:
+            Evaluate(request);
+            break;
+        case UBERKEY_CONTROL_EXPORT_TRACE:
+            ExportTrace(request);
+            break;
+        default:
+            Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "unknown command");
+            break;
+        }
     }
 
-    // SIDE-EFFECT: Leaves the keyboard table on the Lua stack.
-    void RegisterKeyboardFunctions(lua_State* L)
+    // Runs the request the server thread posted, if it's still waiting. Main thread only.
+    void RunPendingRequest()
     {
-        static const luaL_Reg KeyboardFunctions[] =
+        Request* pRequest;
         {
-            { "listen_for_virtual_key_make", &SetKeyCallback<latchedVirtualKeyMakes, vk::MakeLatches, vk::Typename> },
-            { "listen_for_virtual_key_break", &SetKeyCallback<latchedVirtualKeyBreaks, vk::BreakLatches, vk::Typename> },
-            { "listen_for_scancode_make", &SetKeyCallback<latchedScancodeMakes, sc::MakeLatches, sc::Typename> },
-            { "listen_for_scancode_break", &SetKeyCallback<latchedScancodeBreaks, sc::BreakLatches, sc::Typename> },
-            { "stop_listening_for_virtual_key_make", &ClearKeyCallback<latchedVirtualKeyMakes, vk::MakeLatches, vk::Typename> },
-            { "stop_listening_for_virtual_key_break", &ClearKeyCallback<latchedVirtualKeyBreaks, vk::BreakLatches, vk::Typename> },
-            { "stop_listening_for_scancode_make", &ClearKeyCallback<latchedScancodeMakes, sc::MakeLatches, sc::Typename> },
-            { "stop_listening_for_scancode_break", &ClearKeyCallback<latchedScancodeBreaks, sc::BreakLatches, sc::Typename> },
-            { "send_virtual_key_make", &SendKey<vk::Typename, CodeType::VirtualKey, KeyAction::Make> },
-            { "send_virtual_key_break", &SendKey<vk::Typename, CodeType::VirtualKey, KeyAction::Break> },
-            { "send_scancode_make", &SendKey<vk::Typename, CodeType::Scancode, KeyAction::Make> },
-            { "send_scancode_break", &SendKey<vk::Typename, CodeType::Scancode, KeyAction::Break> },
-            { "send_keys", &SendKeys },
-            { "send_text", &SendText },
-            { "hook", &HookKeyboard },
-            { "unhook", &UnhookKeyboard },
-            { "intercept_virtual_key_make", &SetKeyCallback<interceptedVirtualKeyMakes, vk::MakeInterceptions, vk::Typename> },
-            { "intercept_virtual_key_break", &SetKeyCallback<interceptedVirtualKeyBreaks, vk::BreakInterceptions, vk::Typename> },
-            { "intercept_scancode_make", &SetKeyCallback<interceptedScancodeMakes, sc::MakeInterceptions, sc::Typename> },
-            { "intercept_scancode_break", &SetKeyCallback<interceptedScancodeBreaks, sc::BreakInterceptions, sc::Typename> },
-            { "stop_intercepting_virtual_key_make", &ClearKeyCallback<interceptedVirtualKeyMakes, vk::MakeInterceptions, vk::Typename> },
-            { "stop_intercepting_virtual_key_break", &ClearKeyCallback<interceptedVirtualKeyBreaks, vk::BreakInterceptions, vk::Typename> },
-            { "stop_intercepting_scancode_make", &ClearKeyCallback<interceptedScancodeMakes, sc::MakeInterceptions, sc::Typename> },
-            { "stop_intercepting_scancode_break", &ClearKeyCallback<interceptedScancodeBreaks, sc::BreakInterceptions, sc::Typename> },
-            { nullptr, nullptr }
-        };
+            std::lock_guard<std::mutex> lock(mutex);
+            pRequest = pPendingRequest;
+            pPendingRequest = nullptr;
+        }
 
-        // Register latch functions
-        luaL_register(L, "keyboard", KeyboardFunctions);
+        if (nullptr == pRequest)
+        {
+            return;
+        }
+
+        Run(*pRequest);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pRequest->isDone = true;
+        }
+        requestDone.notify_one();
     }
 
-    // Creates virtual key description table
-    // NOTE: Creates a new table and inserts that table inside the table at the top of the Lua stack.
-    void CreateVirtualKeyDescriptionTable(lua_State* L)
+    // Hands a request to the main thread, and waits for it to be run.
+    void Submit(Request& request)
     {
-        lua_pushliteral(L, "virtual_key_descriptions"); // push the name of the virtual key description table
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!isStopping)
+        {
+            pPendingRequest = &request;
+            ::PostMessageW(windowHandle, ControlRequestMessage, 0, 0);
+            requestDone.wait(lock, [&request]() { return request.isDone || isStopping; });
+        }
 
-        lua_createtable(L, virtualKeyCount, 0); // create virtual key description table t and push onto stack
+        if (!request.isDone)
+        {
+            request.status = UBERKEY_CONTROL_STOPPING;
+            request.reply = "UberKey is exiting";
+        }
+    }
 
-        for (auto i = 0u; i < virtualKeyCount; i++)
+    // Waits for overlapped pipe I/O to finish, or for the server to stop. Returns false if the I/O
+    //  failed, or was cancelled.
+    bool WaitForPipe(HANDLE pipe, OVERLAPPED& overlapped, const BOOL isStarted, DWORD& transferred)
+    {
+        if (!isStarted && ERROR_IO_PENDING != ::GetLastError())
         {
-            const auto& vk = virtualKeys[i];
+            return false;
+        }
 
-            lua_pushstring(L, vk.info); // push the virtual key metadata v
-            lua_rawseti(L, -2, i); // t[virtualKey] = v
+        const HANDLE events[] = { overlapped.hEvent, stopEvent };
+        if (WAIT_OBJECT_0 != ::WaitForMultipleObjects(2, events, FALSE, INFINITE)) // if (stopping)
+        {
+            ::CancelIo(pipe);
+            (void)::GetOverlappedResult(pipe, &overlapped, &transferred, TRUE); // NOTE: the buffer is in use until the cancel finishes
+            return false;
         }
 
-        lua_rawset(L, -3); // insert the description table into the table below it on the stack; pop description table.
+        return FALSE != ::GetOverlappedResult(pipe, &overlapped, &transferred, FALSE);
     }
 
-    // Creates the virtual key symbolic maps
-    void CreateVirtualKeySymbolicNameTable(lua_State* L)
+    bool Connect(HANDLE pipe, OVERLAPPED& overlapped)
     {
-        lua_createtable(L, virtualKeyCount, virtualKeyCount + altNameCount); // create table t and push onto stack
-
-        for (auto i = 0u; i < virtualKeyCount; i++)
+        if (::ConnectNamedPipe(pipe, &overlapped) || ERROR_PIPE_CONNECTED == ::GetLastError()) // if (already connected)
         {
-            const auto& vk = virtualKeys[i];
+            return true;
+        }
 
-            // Map virtual key enumeration-to-code
-            lua_pushstring(L, vk.name); // push the enumeration name k
-            lua_pushinteger(L, i); // push the virtual key code v to the top of the stack
-            lua_rawset(L, -3); // t[k] = v
+        DWORD transferred;
+        return WaitForPipe(pipe, overlapped, FALSE, transferred);
+    }
 
-            // Map virtual key known-alternate enumerations-to-code
-            if (nullptr != vk.altNames)
+    // Reads, or writes, the whole buffer.
+    bool Transfer(HANDLE pipe, OVERLAPPED& overlapped, void* buffer, DWORD size, const bool isWrite)
+    {
+        auto pBytes = static_cast<uint8_t*>(buffer);
+        while (0u != size)
+        {
+            DWORD transferred = 0u;
+            const auto isStarted = isWrite ? ::WriteFile(pipe, pBytes, size, nullptr, &overlapped) : ::ReadFile(pipe, pBytes, size, nullptr, &overlapped);
+            if (!WaitForPipe(pipe, overlapped, isStarted, transferred) || 0u == transferred)
             {
-                auto altIndex = 0u;
-                auto alt = vk.altNames[altIndex++];
-
-                while (nullptr != alt)
-                {
-                    lua_pushstring(L, alt); // push the enumeration name k
-                    lua_pushinteger(L, i); // push the virtual key code v to the top of the stack
-                    lua_rawset(L, -3); // t[k] = v
-
-                    alt = vk.altNames[altIndex++];
-                }
+                return false;
             }
 
-            // Reverse lookup, map virtual key code-to-enumeration
-            lua_pushstring(L, vk.name); // push the enumeration name v
-            lua_rawseti(L, -2, i); // t[virtual_key_code] = v
+            pBytes += transferred;
+            size -= transferred;
         }
 
-        lua_setglobal(L, "vk"); // push the virtual key names and codes into Lua's global scope
+        return true;
     }
 
-    // Create and expose this application's Lua APIs.
-    void OpenUberKeyLuaLibrary(lua_State* L)
+    void ServeClient(HANDLE pipe, OVERLAPPED& overlapped)
     {
-        sc::ScancodeTable::CreateTable(L);
-        vk::VirtualKeyTable::CreateTable(L);
-        CreateCallbackTables(L);
-        CreateVirtualKeySymbolicNameTable(L);
+        for (;;)
+        {
+            Request request;
+            request.isDone = false;
+            if (!Transfer(pipe, overlapped, &request.header, sizeof(request.header), false))
+            {
+                return; // the client hung up, or the server is stopping
+            }
 
-        // Create the keyboard namespace in Lua.
-        RegisterKeyboardFunctions(L);
+            const auto isValid = (UBERKEY_CONTROL_VERSION == request.header.version && UBERKEY_CONTROL_MAX_PAYLOAD >= request.header.length);
+            if (isValid)
+            {
+                request.payload.resize(request.header.length);
+                if (!request.payload.empty() && !Transfer(pipe, overlapped, request.payload.data(), static_cast<DWORD>(request.payload.size()), false))
+                {
+                    return;
+                }
 
-        // Stuff that goes in the keyboard namespace below HERE.
-        ////////////////////////////////////////////////////////
-        CreateVirtualKeyDescriptionTable(L);
+                Submit(request);
+            }
+            else
+            {
+                Fail(request, UBERKEY_CONTROL_BAD_REQUEST, "unsupported protocol version, or payload too long");
+            }
 
-        assert(1 == lua_gettop(L));
-        lua_pop(L, 1); // Clean the keyboard namespace off the Lua stack.
-    }
-} // namespace api
+            uberkey_control_response response = { request.status, static_cast<uint32_t>(request.reply.size()) };
+            if (!Transfer(pipe, overlapped, &response, sizeof(response), true) ||
+                (!request.reply.empty() && !Transfer(pipe, overlapped, &request.reply[0], response.length, true)))
+            {
+                return;
+            }
 
-LRESULT Create(WPARAM wParam, LPARAM lParam)
-{
-    luaState = luaL_newstate(); // Create the initial lua state.
-    if (nullptr == luaState)
-    {
-        throw exception("failed to create Lua state");
+            if (!isValid) // NOTE: the rest of the stream can't be trusted
+            {
+                return;
+            }
+        }
     }
 
-    // Provide the std libs.
-    luaL_openlibs(luaState);
-    api::OpenUberKeyLuaLibrary(luaState);
-
-    // Provide some C functions.
-    lua_register(luaState, "print", &LuaPrintReplacement);
-    lua_register(luaState, "dumpstack", &LuaDumpStack);
-
+    void Serve()
     {
-        const auto path = GetProgramExecutablePath();
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
 
-        std::ifstream inFile(path + L"UberKey.lua", std::ios_base::in | std::ios_base::binary);
-        if (!inFile.good())
+        while (WAIT_OBJECT_0 != ::WaitForSingleObject(stopEvent, 0))
         {
-			throw exception("failed to read UberKey.lua");
-        }
-
-        luaScriptBuffer.clear();
-        decltype(luaScriptBuffer)::size_type pos = 0u;
+            // One client at a time. The default security only lets this user, and administrators, write to the pipe.
+            const auto pipe = ::CreateNamedPipeW(
+                UBERKEY_CONTROL_PIPE_NAME,
+                PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                1, 4096, 4096, 0, nullptr);
+            if (INVALID_HANDLE_VALUE == pipe)
+            {
+                std::wcout << L"Failed to create the control pipe; is another UberKey running?" << std::endl;
+                break;
+            }
 
-        while (inFile.good())
-        {
-            if (pos == luaScriptBuffer.size())
+            if (Connect(pipe, overlapped))
             {
-                luaScriptBuffer.resize(luaScriptBuffer.size() + 4096);
+                ServeClient(pipe, overlapped);
             }
-            inFile.read(reinterpret_cast<char*>(&luaScriptBuffer[pos]), luaScriptBuffer.size() - pos);
-            const auto count = inFile.gcount();
-            pos = static_cast<decltype(pos)>((pos + count < numeric_limits<decltype(pos)>::max()) ? pos + count : numeric_limits<decltype(pos)>::max());
-        }
 
-        if (pos != luaScriptBuffer.size())
-        {
-            luaScriptBuffer.resize(pos);
+            ::DisconnectNamedPipe(pipe);
+            ::CloseHandle(pipe);
         }
+
+        ::CloseHandle(overlapped.hEvent);
     }
 
+    void Start(const HWND window)
     {
-        const auto result = lua_load(luaState, &LuaReader, nullptr, "UberKey_Main_Script");
-        if (LUA_ERRSYNTAX == result)
-        {
-            std::wcout << L"Syntax error compiling initial Lua script." << std::endl;
-        }
-        else if (LUA_ERRMEM == result)
-        {
-            throw bad_alloc();
-        }
-        else if (0 != result)
-        {
-            std::wcout << L"Unknown error compiling initial Lua script." << std::endl;
-        }
+        windowHandle = window;
+        stopEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        serverThread = std::thread(&Serve);
     }
 
+    // Main thread only.
+    void Stop()
     {
-        const auto result = lua_pcall(luaState, 0, LUA_MULTRET, 0);
-        if (LUA_ERRRUN == result)
-        {
-            std::wcout << "Lua runtime error." << std::endl;
-        }
-        else if (LUA_ERRMEM == result)
+        if (!serverThread.joinable())
         {
-            std::wcout << "Lua memory allocation error." << std::endl;
-        }
-        else if (LUA_ERRERR == result)
-        {
-            std::wcout << "Lua error while running the error handler function." << std::endl;
-        }
-        else if (0 != result)
-        {
-            std::wcout << "Lua unknown error." << std::endl;
+            return;
         }
 
-        if (0 != result)
         {
-            LuaDumpStack(luaState);
+            std::lock_guard<std::mutex> lock(mutex);
+            isStopping = true;
+            pPendingRequest = nullptr;
         }
+        requestDone.notify_one();
+        ::SetEvent(stopEvent);
+
+        serverThread.join();
+        ::CloseHandle(stopEvent);
+        stopEvent = nullptr;
+    }
+} // namespace control
+
+// Makes up the dwExtraInfo value that marks this process's SendInput() key events. Raw input only
+//  carries 32 bits of it, so the signature is kept to 32 bits.
+ULONG_PTR MakeSelfInjectionSignature()
+{
+    auto signature = static_cast<uint32_t>(::GetCurrentProcessId()) * 2654435761u; // Knuth's multiplicative hash
+    signature ^= static_cast<uint32_t>(ReadTimestamp());
+    signature ^= 0x554b0000u; // "UK"
+
+    return (0u != signature) ? signature : 0x554b0000u; // zero is what everyone else sends
+}
+
+LRESULT Create(WPARAM wParam, LPARAM lParam)
+{
+    selfInjection.signature = MakeSelfInjectionSignature();
+    shared::Create();
+    usage::Start(GetProgramExecutablePath() + L"UberKey.usage");
+
+    luaThreadId = ::GetCurrentThreadId();
+    luaState = CreateLuaState(); // Create the initial lua state.
+    collector::idle.SetMode(luaState, IdleCollector::Mode::Idle);
+
+    plugins::LoadPlugins();
+
+    // With a remap image, the main script is optional.
+    const auto isRemapped = remaps::Load();
+    if (!isRemapped || INVALID_FILE_ATTRIBUTES != ::GetFileAttributesW((GetProgramExecutablePath() + L"UberKey.lua").c_str()))
+    {
+        RunLuaScript(luaState, L"UberKey.lua", "UberKey_Main_Script");
     }
 
     {
@@ -1920,11 +7344,50 @@ LRESULT Character(WPARAM wParam, LPARAM lParam)
 
 LRESULT Destroy(WPARAM wParam, LPARAM lParam)
 {
-    lua_close(luaState);
+    api::luaDispatcher.Reset(); // NOTE: collected along with luaState
+
+    capture::Stop();
+    control::Stop();
+    usage::Stop();
+    macros::player.Stop();
+    plugins::UnloadPlugins();
+    remaps::Unload();
+    shared::Destroy();
+
+    for (auto device = 0u; device < devices::MaxDeviceCount; device++)
+    {
+        scripts::SetDeviceScript(static_cast<uint_fast8_t>(device), nullptr);
+    }
+
+    memory::CloseState(luaState);
     ::PostQuitMessage(0);
     return ::DefWindowProcW(_windowHandle, WM_DESTROY, wParam, lParam);
 }
 
+LRESULT DispatchKeyEvents(WPARAM wParam, LPARAM lParam)
+{
+    UNREFERENCED_PARAMETER(wParam);
+    UNREFERENCED_PARAMETER(lParam);
+    api::ResumeDispatcher();
+    return 0;
+}
+
+LRESULT DispatchCapturedInput(WPARAM wParam, LPARAM lParam)
+{
+    UNREFERENCED_PARAMETER(wParam);
+    UNREFERENCED_PARAMETER(lParam);
+    capture::DispatchQueue();
+    return 0;
+}
+
+LRESULT RunControlRequest(WPARAM wParam, LPARAM lParam)
+{
+    UNREFERENCED_PARAMETER(wParam);
+    UNREFERENCED_PARAMETER(lParam);
+    control::RunPendingRequest();
+    return 0;
+}
+
 LRESULT AppCommand(WPARAM wParam, LPARAM lParam)
 {
     return ::DefWindowProcW(_windowHandle, WM_APPCOMMAND, wParam, lParam);
@@ -1950,7 +7413,8 @@ void PrintRawKeyboardDebug(bool isMake, uint_fast16_t virtualKey, uint_fast16_t
     std::wcout << std::dec << L' ';
 }
 
-void ProcessRawKeyboardInput(const RAWKEYBOARD& keyboard)
+// Returns the key event's sequence number.
+uint32_t ProcessRawKeyboardInput(const RAWINPUTHEADER& header, const RAWKEYBOARD& keyboard, const int64_t timestamp)
 {
     const uint_fast16_t scancode = keyboard.MakeCode;
     const uint_fast16_t virtualKey = keyboard.VKey;
@@ -1963,21 +7427,70 @@ void ProcessRawKeyboardInput(const RAWKEYBOARD& keyboard)
     const auto e0 = 0 != (RI_KEY_E0 & keyboard.Flags);
     const auto e1 = 0 != (RI_KEY_E1 & keyboard.Flags);
 
-    if (0 == (RI_KEY_BREAK & keyboard.Flags)) // if (the key was made)
+    const auto device = devices::FindDeviceSlot(header.hDevice);
+    auto& keyboardDevice = devices::keyboardDevices[device];
+    devices::RecordScancodeDevice(scancode, device, 0 != (RI_KEY_BREAK & keyboard.Flags));
+
+    KeyEventRecord keyEvent = {};
+    keyEvent.timestamp = timestamp;
+    keyEvent.deviceHandle = reinterpret_cast<uint64_t>(header.hDevice);
+    keyEvent.extraInformation = static_cast<uint32_t>(keyboard.ExtraInformation);
+    keyEvent.virtualKey = static_cast<uint16_t>(virtualKey);
+    keyEvent.scancode = static_cast<uint16_t>(scancode);
+    keyEvent.e0 = e0;
+    keyEvent.e1 = e1;
+    keyEvent.device = static_cast<uint8_t>(device);
+    keyEvent.injected = (nullptr == header.hDevice); // SendInput() events don't come from a device
+    keyEvent.isBreak = (0 != (RI_KEY_BREAK & keyboard.Flags));
+
+    keyEvent.repeatCount = devices::CountRepeat(keyboardDevice.madeVirtualKeys, keyboardDevice.repeatCounts, virtualKey, 0 != keyEvent.isBreak);
+
+    stream::MergeRawInputEvent(keyEvent);
+    trace::SequenceScope sequenceScope(keyEvent.sequence);
+
+    // Key events sent by this process only update the key state, unless a script asked to see them.
+    const auto isSelfInjected = keyEvent.injected && selfInjection.signature == keyboard.ExtraInformation;
+    const auto isSkipped = isSelfInjected && !selfInjection.isVisible;
+
+    if (!isSelfInjected)
+    {
+        macros::Record(keyEvent);
+    }
+
+    using devices::KeyboardDevice;
+
+    if (!keyEvent.isBreak) // if (the key was made)
     {
-        PrintRawKeyboardDebug(true, virtualKey, scancode, e0, e1, keyboard.ExtraInformation);
+        if (control::isKeyLogging)
+        {
+            PrintRawKeyboardDebug(true, virtualKey, scancode, e0, e1, keyboard.ExtraInformation);
+        }
 
         MakeScancode(scancode);
         MakeVirtualKey(virtualKey);
+        Set(keyboardDevice.madeScancodes, scancode);
+        Set(keyboardDevice.madeVirtualKeys, virtualKey);
+        shared::Publish(keyEvent);
+
+        if (!isSelfInjected)
+        {
+            expansions::ProcessKeyMake(keyEvent);
+        }
+
+        if (isSkipped)
+        {
+            selfInjection.skippedRawInputEvents++;
+            return keyEvent.sequence;
+        }
 
         if (IsVirtualKeyMakeLatched(virtualKey))
         {
-            api::KeyCallbackHandler<api::CodeType::VirtualKey, api::vk::MakeLatches>(luaState, virtualKey, scancode, e0, e1, keyboard.ExtraInformation);
+            api::DispatchKeyCallbacks<api::CodeType::VirtualKey, api::vk::MakeLatches, &KeyboardDevice::latchedVirtualKeyMakes>(luaState, keyEvent);
         }
 
         if (IsScancodeMakeLatched(scancode))
         {
-            api::KeyCallbackHandler<api::CodeType::Scancode, api::sc::MakeLatches>(luaState, virtualKey, scancode, e0, e1, keyboard.ExtraInformation);
+            api::DispatchKeyCallbacks<api::CodeType::Scancode, api::sc::MakeLatches, &KeyboardDevice::latchedScancodeMakes>(luaState, keyEvent);
         }
     }
     else
@@ -1986,17 +7499,29 @@ void ProcessRawKeyboardInput(const RAWKEYBOARD& keyboard)
 
         BreakScancode(scancode);
         BreakVirtualKey(virtualKey);
+        Clear(keyboardDevice.madeScancodes, scancode);
+        Clear(keyboardDevice.madeVirtualKeys, virtualKey);
+        devices::ReleaseHookKey(scancode, e0);
+        shared::Publish(keyEvent);
+
+        if (isSkipped)
+        {
+            selfInjection.skippedRawInputEvents++;
+            return keyEvent.sequence;
+        }
 
         if (IsVirtualKeyBreakLatched(virtualKey))
         {
-            api::KeyCallbackHandler<api::CodeType::VirtualKey, api::vk::BreakLatches>(luaState, virtualKey, scancode, e0, e1, keyboard.ExtraInformation);
+            api::DispatchKeyCallbacks<api::CodeType::VirtualKey, api::vk::BreakLatches, &KeyboardDevice::latchedVirtualKeyBreaks>(luaState, keyEvent);
         }
 
         if (IsScancodeBreakLatched(scancode))
         {
-            api::KeyCallbackHandler<api::CodeType::Scancode, api::sc::BreakLatches>(luaState, virtualKey, scancode, e0, e1, keyboard.ExtraInformation);
+            api::DispatchKeyCallbacks<api::CodeType::Scancode, api::sc::BreakLatches, &KeyboardDevice::latchedScancodeBreaks>(luaState, keyEvent);
         }
     }
+
+    return keyEvent.sequence;
 }
 
 LRESULT Input(WPARAM wParam, LPARAM lParam)
@@ -2048,7 +7573,10 @@ LRESULT Input(WPARAM wParam, LPARAM lParam)
 
     if (RIM_TYPEKEYBOARD == type)
     {
-        ProcessRawKeyboardInput(input.data.keyboard);
+        const auto start = ReadTimestamp();
+        capture::RecordDelay(static_cast<uint32_t>(::GetMessageTime()));
+        const auto sequence = ProcessRawKeyboardInput(input.header, input.data.keyboard, start);
+        trace::Record(trace::Stage::RawInput, sequence, start, ReadTimestamp());
     }
     else
     {
@@ -2062,14 +7590,39 @@ LRESULT Input(WPARAM wParam, LPARAM lParam)
     return ::DefWindowProcW(_windowHandle, WM_INPUT, wParam, lParam);
 }
 
+void ChangeInputDevice(const WPARAM change, const HANDLE hDevice)
+{
+    if (GIDC_ARRIVAL == change)
+    {
+        (void)devices::FindDeviceSlot(hDevice);
+    }
+    else if (GIDC_REMOVAL == change)
+    {
+        devices::DetachDevice(hDevice);
+    }
+}
+
+LRESULT InputDeviceChange(WPARAM wParam, LPARAM lParam)
+{
+    ChangeInputDevice(wParam, reinterpret_cast<HANDLE>(lParam));
+
+    return ::DefWindowProcW(_windowHandle, WM_INPUT_DEVICE_CHANGE, wParam, lParam);
+}
+
 void EnableRawKeyboardInput(const bool value)
 {
+    if (capture::Forward(value ? capture::Command::EnableRawInput : capture::Command::DisableRawInput))
+    {
+        _isReadingRawKeyboard = value;
+        return;
+    }
+
     RAWINPUTDEVICE device;
 
     device.usUsagePage  = 0x01; // Generic Desktop
     device.usUsage      = 0x06; // Keyboard
-    device.dwFlags      = (value) ? (RIDEV_INPUTSINK | RIDEV_NOLEGACY) : RIDEV_REMOVE; // RIDEV_NOLEGACY prevents WM_KEYDOWN, WM_CHAR, etc. messages.
-    device.hwndTarget   = (0 != (RIDEV_REMOVE & device.dwFlags)) ? nullptr : _windowHandle;
+    device.dwFlags      = (value) ? (RIDEV_INPUTSINK | RIDEV_NOLEGACY | RIDEV_DEVNOTIFY) : RIDEV_REMOVE; // RIDEV_NOLEGACY prevents WM_KEYDOWN, WM_CHAR, etc. messages.
+    device.hwndTarget   = (0 != (RIDEV_REMOVE & device.dwFlags)) ? nullptr : (capture::IsRunning() ? capture::window : _windowHandle);
 
     {
         const auto regResult = ::RegisterRawInputDevices(
@@ -2086,6 +7639,412 @@ void EnableRawKeyboardInput(const bool value)
     _isReadingRawKeyboard = value;
 }
 
+// Input Capture
+//
+// The keyboard hook and raw input are taken on a thread of their own, at a raised priority, with a
+//  message loop that does nothing else; painting, control requests, the garbage collector, and every
+//  callback stay on the main thread. The capture thread decides, from the key maps, whether the hook
+//  consumes a key event; then queues the event for the main thread, which runs its callbacks as
+//  though it had come straight from the hook, or from raw input. Interception callbacks run a little
+//  after their key event has been filtered out, as they do in Lua dispatch mode.
+//
+// NOTE: The capture thread reads the key maps, and the scancode to device table, a word at a time
+//  while the main thread changes them; a binding change is seen by the next key event, or the one
+//  after that.
+namespace capture
+{
+    enum class InputKind : uint8_t { Hook, RawInput, DeviceChange };
+
+    struct CapturedInput
+    {
+        int64_t         timestamp;          // QPC; when the capture thread took the event
+        int64_t         queued;             // QPC; when it queued it
+        uint32_t        time;               // the system's time stamp; KBDLLHOOKSTRUCT::time, or the message time
+        uint32_t        captureSequence;    // what the capture thread's spans are charged to; see trace::NewCaptureSequence()
+        InputKind       kind;
+        HookKind        hookKind;
+        bool            isConsumed;         // what the hook did with the event
+        bool            e0;
+        bool            injected;
+        uint16_t        virtualKey;
+        uint16_t        scancode;
+        uint32_t        extraInformation;
+        WPARAM          change;             // GIDC_ARRIVAL or GIDC_REMOVAL
+        RAWINPUTHEADER  header;
+        RAWKEYBOARD     keyboard;
+    };
+
+    const uint32_t QueueLength = 512u;
+    const uint32_t QueueMask = QueueLength - 1u;
+
+    // Single producer (the capture thread), single consumer (the main thread).
+    array<CapturedInput, QueueLength> queue;
+    std::atomic<uint32_t> queueHead(0u); // written by the main thread
+    std::atomic<uint32_t> queueTail(0u); // written by the capture thread
+
+    const wchar_t WindowClassName[] = L"UBERKEY_CAPTURE";
+
+    std::thread thread;
+    std::atomic<HWND> targetWindow(nullptr);    // the main window, once it's made
+    HANDLE mmcssTask = nullptr;
+
+    // Capture thread only.
+    void Push(const CapturedInput& input)
+    {
+        const auto tail = queueTail.load(std::memory_order_relaxed);
+        const auto next = (tail + 1u) & QueueMask;
+        if (next == queueHead.load())
+        {
+            droppedCount++;
+            return;
+        }
+
+        queue[tail] = input;
+        queueTail.store(next);
+
+        // NOTE: Either this sees the main thread has emptied the queue, or the main thread sees the
+        //  new tail before it stops draining; both are sequentially consistent.
+        if (queueHead.load() == tail) // if (the queue was empty) wake up the main thread
+        {
+            ::PostMessageW(targetWindow.load(), CapturedInputMessage, 0, 0);
+        }
+    }
+
+    template<api::CodeType useCode, KeyMap devices::KeyboardDevice::* keyMap>
+    inline bool IsIntercepted(const uint_fast16_t virtualKey, const uint_fast16_t scancode)
+    {
+        const auto code = (useCode == api::CodeType::VirtualKey) ? virtualKey : scancode;
+        const auto device = devices::CorrelateHookEvent(scancode);
+
+        return IsSet(devices::AnyKeyboard().*keyMap, code) ||
+            (devices::AnyDevice != device && IsSet(devices::keyboardDevices[device].*keyMap, code));
+    }
+
+    // The hook's callbacks, while the capture thread is running. Returns true if the key event is
+    //  consumed; the same answer the main thread's dispatch would give.
+    template<HookKind kind>
+    bool CaptureHookEvent(uint_fast16_t virtualKey, uint_fast16_t scancode, bool e0, bool injected, uint_fast32_t extraInformation, uint_fast32_t time)
+    {
+        if (nullptr == luaState)
+        {
+            return false;
+        }
+
+        using devices::KeyboardDevice;
+
+        CapturedInput input = {};
+        input.timestamp = ReadTimestamp();
+        input.time = static_cast<uint32_t>(time);
+        input.captureSequence = trace::NewCaptureSequence();
+        input.kind = InputKind::Hook;
+        input.hookKind = kind;
+        input.e0 = e0;
+        input.injected = injected;
+        input.virtualKey = static_cast<uint16_t>(virtualKey);
+        input.scancode = static_cast<uint16_t>(scancode);
+        input.extraInformation = static_cast<uint32_t>(extraInformation);
+
+        switch (kind)
+        {
+        case HookKind::ScancodeMake:
+            input.isConsumed = IsIntercepted<api::CodeType::Scancode, &KeyboardDevice::interceptedScancodeMakes>(virtualKey, scancode);
+            break;
+        case HookKind::ScancodeBreak:
+            input.isConsumed = IsIntercepted<api::CodeType::Scancode, &KeyboardDevice::interceptedScancodeBreaks>(virtualKey, scancode);
+            break;
+        case HookKind::VirtualKeyMake:
+            input.isConsumed = IsIntercepted<api::CodeType::VirtualKey, &KeyboardDevice::interceptedVirtualKeyMakes>(virtualKey, scancode);
+            break;
+        case HookKind::VirtualKeyBreak:
+            input.isConsumed = IsIntercepted<api::CodeType::VirtualKey, &KeyboardDevice::interceptedVirtualKeyBreaks>(virtualKey, scancode);
+            break;
+        }
+
+        // The remap image's keys are sent now, while the hook still holds the key event.
+        if (input.isConsumed && (HookKind::VirtualKeyMake == kind || HookKind::VirtualKeyBreak == kind))
+        {
+            uberkey_key_event event = {};
+            event.timestamp = input.timestamp;
+            event.sequence = input.captureSequence;
+            event.virtual_key = input.virtualKey;
+            event.scancode = input.scancode;
+            event.e0 = e0;
+            event.injected = injected;
+            event.extra_information = input.extraInformation;
+            event.is_break = (HookKind::VirtualKeyBreak == kind);
+            remaps::CaptureKeyEvent(event);
+        }
+
+        input.queued = ReadTimestamp();
+        Push(input);
+        return input.isConsumed;
+    }
+
+    void CaptureRawInput(const LPARAM lParam)
+    {
+        RAWINPUT rawInput;
+        UINT size = sizeof(rawInput);
+        if (UINT(-1) == ::GetRawInputData(reinterpret_cast<HRAWINPUT>(lParam), RID_INPUT, &rawInput, &size, sizeof(RAWINPUTHEADER)) ||
+            RIM_TYPEKEYBOARD != rawInput.header.dwType) // NOTE: only keyboards are registered, so a keyboard's input always fits
+        {
+            return;
+        }
+
+        CapturedInput input = {};
+        input.timestamp = ReadTimestamp();
+        input.time = static_cast<uint32_t>(::GetMessageTime());
+        input.captureSequence = trace::NoSequence;
+        input.kind = InputKind::RawInput;
+        input.header = rawInput.header;
+        input.keyboard = rawInput.data.keyboard;
+
+        input.queued = ReadTimestamp();
+        Push(input);
+    }
+
+    void RunCommand(const Command command)
+    {
+        switch (command)
+        {
+        case Command::InstallHook:
+            hook::InstallLowLevelKeyboardHook();
+            break;
+        case Command::RemoveHook:
+            hook::DisableLowLevelKeyboardHook();
+            break;
+        case Command::EnableRawInput:
+            EnableRawKeyboardInput(true);
+            break;
+        case Command::DisableRawInput:
+            EnableRawKeyboardInput(false);
+            break;
+        case Command::Stop:
+            ::PostQuitMessage(0);
+            break;
+        }
+    }
+
+    LRESULT CALLBACK WindowProcedure(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+    {
+        try
+        {
+            switch (message)
+            {
+            case WM_INPUT:
+                CaptureRawInput(lParam);
+                break; // NOTE: DefWindowProc() cleans up after WM_INPUT
+            case WM_INPUT_DEVICE_CHANGE:
+                {
+                    CapturedInput input = {};
+                    input.timestamp = ReadTimestamp();
+                    input.kind = InputKind::DeviceChange;
+                    input.change = wParam;
+                    input.header.hDevice = reinterpret_cast<HANDLE>(lParam);
+                    Push(input);
+                }
+                return 0;
+            case CommandMessage:
+                RunCommand(static_cast<Command>(wParam));
+                return 0;
+            default:
+                break;
+            }
+        }
+        catch (const exception& e)
+        {
+            std::cout << "Input capture failed: " << e.what() << std::endl;
+        }
+
+        return ::DefWindowProcW(hWnd, message, wParam, lParam);
+    }
+
+    // MMCSS schedules the thread like a pro audio thread; without it (i.e. the service is stopped), the
+    //  thread just gets a higher priority.
+    void RaisePriority()
+    {
+        using AvSetMmThreadCharacteristicsW_t = HANDLE (WINAPI*)(LPCWSTR taskName, LPDWORD taskIndex);
+        using AvSetMmThreadPriority_t = BOOL (WINAPI*)(HANDLE avrtHandle, int priority);
+        const int AvrtPriorityHigh = 1; // AVRT_PRIORITY_HIGH
+
+        const auto hAvrt = ::LoadLibraryExW(L"avrt.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
+        if (nullptr != hAvrt)
+        {
+            const auto AvSetMmThreadCharacteristicsW = reinterpret_cast<AvSetMmThreadCharacteristicsW_t>(::GetProcAddress(hAvrt, "AvSetMmThreadCharacteristicsW"));
+            const auto AvSetMmThreadPriority = reinterpret_cast<AvSetMmThreadPriority_t>(::GetProcAddress(hAvrt, "AvSetMmThreadPriority"));
+
+            DWORD taskIndex = 0u;
+            mmcssTask = (nullptr != AvSetMmThreadCharacteristicsW) ? AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex) : nullptr;
+            if (nullptr != mmcssTask && nullptr != AvSetMmThreadPriority)
+            {
+                (void)AvSetMmThreadPriority(mmcssTask, AvrtPriorityHigh);
+                return; // NOTE: avrt.dll stays loaded, for as long as the thread is registered
+            }
+        }
+
+        std::wcout << L"MMCSS isn't available; raising the input thread's priority instead." << std::endl;
+        ::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    }
+
+    void Run(const HANDLE readyEvent)
+    {
+        RaisePriority();
+        trace::NameThread("input capture");
+
+        WNDCLASSEXW wc = {};
+        wc.cbSize = sizeof(wc);
+        wc.lpfnWndProc = &WindowProcedure;
+        wc.hInstance = ::GetModuleHandleW(nullptr);
+        wc.lpszClassName = WindowClassName;
+        ::RegisterClassExW(&wc);
+
+        threadId = ::GetCurrentThreadId();
+        window = ::CreateWindowExW(0, WindowClassName, L"UberKey Input", 0, 0, 0, 0, 0, HWND_MESSAGE, nullptr, wc.hInstance, nullptr);
+        ::SetEvent(readyEvent);
+        if (nullptr == window)
+        {
+            return;
+        }
+
+        MSG msg;
+        while (::GetMessageW(&msg, nullptr, 0, 0) > 0)
+        {
+            ::DispatchMessageW(&msg);
+        }
+
+        hook::DisableLowLevelKeyboardHook();
+        if (_isReadingRawKeyboard)
+        {
+            try
+            {
+                EnableRawKeyboardInput(false);
+            }
+            catch (const exception&)
+            {
+            }
+        }
+
+        ::DestroyWindow(window);
+    }
+
+    // Starts the capture thread, and waits until it can take commands. Call it before the hook, or raw
+    //  input, are set up.
+    void Start()
+    {
+        const auto readyEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        thread = std::thread(&Run, readyEvent);
+        ::WaitForSingleObject(readyEvent, INFINITE);
+        ::CloseHandle(readyEvent);
+
+        if (nullptr == window)
+        {
+            std::wcout << L"Failed to start the input thread; capturing input on the main thread." << std::endl;
+            thread.join();
+        }
+    }
+
+    // Captured events are held until the main window is there to dispatch them.
+    void SetTarget(const HWND hWnd)
+    {
+        targetWindow.store(hWnd);
+        ::PostMessageW(hWnd, CapturedInputMessage, 0, 0);
+    }
+
+    // Main thread only.
+    void Stop()
+    {
+        if (!thread.joinable())
+        {
+            return;
+        }
+
+        ::PostMessageW(window, CommandMessage, static_cast<WPARAM>(Command::Stop), 0);
+        thread.join();
+
+        window = nullptr;
+        threadId = 0u;
+        targetWindow.store(nullptr);
+    }
+
+    // The capture thread's spans, and the wait in the queue, once the key event has its sequence number.
+    //  The capture span links the capture sequence number to it.
+    void TraceCapture(const trace::Stage stage, const uint32_t sequence, const CapturedInput& input, const int64_t dispatched)
+    {
+        const trace::Span span = { input.timestamp, input.queued, sequence, threadId, input.captureSequence, stage };
+        trace::Record(span);
+        trace::Record(trace::Stage::Queue, sequence, input.queued, dispatched);
+    }
+
+    template<api::CodeType useCode, const char* const CallbackTablename, KeyMap devices::KeyboardDevice::* keyMap>
+    void DispatchHookEvent(const CapturedInput& input, const bool isBreak, const int64_t dispatched)
+    {
+        const auto keyEvent = api::MakeHookKeyEvent(input.virtualKey, input.scancode, input.e0, input.injected, input.extraInformation, isBreak, input.time, input.timestamp);
+        TraceCapture(trace::Stage::Hook, keyEvent.sequence, input, dispatched);
+        (void)api::DispatchKeyCallbacks<useCode, CallbackTablename, keyMap>(luaState, keyEvent);
+        api::CompleteHookEvent(keyEvent, input.isConsumed); // NOTE: what the hook did; the key maps may have changed since
+    }
+
+    void Dispatch(const CapturedInput& input)
+    {
+        using devices::KeyboardDevice;
+        namespace sc = api::sc;
+        namespace vk = api::vk;
+
+        if (InputKind::DeviceChange == input.kind)
+        {
+            ChangeInputDevice(input.change, input.header.hDevice);
+            return;
+        }
+
+        RecordDelay(input.time);
+        static const auto Frequency = macros::TicksPerSecond();
+        const auto dispatched = ReadTimestamp();
+        queueDelays.Add((dispatched - input.timestamp) * 1000000 / Frequency);
+
+        if (InputKind::RawInput == input.kind)
+        {
+            const auto sequence = ProcessRawKeyboardInput(input.header, input.keyboard, input.timestamp);
+            TraceCapture(trace::Stage::RawInput, sequence, input, dispatched);
+            return;
+        }
+
+        if (nullptr == luaState)
+        {
+            return;
+        }
+
+        switch (input.hookKind)
+        {
+        case HookKind::ScancodeMake:
+            DispatchHookEvent<api::CodeType::Scancode, sc::MakeInterceptions, &KeyboardDevice::interceptedScancodeMakes>(input, false, dispatched);
+            break;
+        case HookKind::ScancodeBreak:
+            DispatchHookEvent<api::CodeType::Scancode, sc::BreakInterceptions, &KeyboardDevice::interceptedScancodeBreaks>(input, true, dispatched);
+            break;
+        case HookKind::VirtualKeyMake:
+            DispatchHookEvent<api::CodeType::VirtualKey, vk::MakeInterceptions, &KeyboardDevice::interceptedVirtualKeyMakes>(input, false, dispatched);
+            break;
+        case HookKind::VirtualKeyBreak:
+            DispatchHookEvent<api::CodeType::VirtualKey, vk::BreakInterceptions, &KeyboardDevice::interceptedVirtualKeyBreaks>(input, true, dispatched);
+            break;
+        }
+    }
+
+    // Main thread only. Dispatches everything queued, including what's queued meanwhile.
+    void DispatchQueue()
+    {
+        auto head = queueHead.load(std::memory_order_relaxed);
+        for (auto tail = queueTail.load(); head != tail; tail = queueTail.load())
+        {
+            while (head != tail)
+            {
+                Dispatch(queue[head]);
+                head = (head + 1u) & QueueMask;
+                queueHead.store(head); // the slot may be reused
+            }
+        }
+    }
+} // namespace capture
+
 LRESULT CALLBACK WindowProcedure(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
     try
@@ -2137,6 +8096,12 @@ bool TryHandlePlatformEvent(bool& isQuitting, int& exitCode)
         return true;
     }
 
+    if (nullptr == msg.hwnd && BindingChangeMessage == msg.message) // if (a thread message; there's no window to dispatch it to)
+    {
+        api::ApplyBindingChanges();
+        return true;
+    }
+
     //::TranslateMessage(&msg); // Doesn't make sense if you don't care about legacy keyboard input.
     ::DispatchMessageW(&msg);
     return true;
@@ -2146,6 +8111,21 @@ int WindowsEventLoop()
 {
     for (;;) // -ever
     {
+        if (IsBackgroundProcessingPending())
+        {
+            MSG msg;
+            if (!::PeekMessageW(&msg, nullptr, 0, 0, PM_NOREMOVE)) // if (the message queue is empty)
+            {
+                BackgroundApplicationProcessing();
+                continue;
+            }
+
+            if (collector::idle.IsOverDebt(luaState)) // if (too busy to wait for the queue to empty)
+            {
+                (void)collector::idle.RunSlice(luaState, true);
+            }
+        }
+
         // Check for pending OS events:
         bool isQuitting;
         int exitCode;
@@ -2236,12 +8216,15 @@ void CreateMessageMap()
     messageMap[WM_DESTROY] = &Destroy;
     messageMap[WM_APPCOMMAND] = &AppCommand;
     messageMap[WM_INPUT] = &Input;
+    messageMap[WM_INPUT_DEVICE_CHANGE] = &InputDeviceChange;
+    messageMap[DispatchKeyEventsMessage] = &DispatchKeyEvents;
+    messageMap[ControlRequestMessage] = &RunControlRequest;
+    messageMap[CapturedInputMessage] = &DispatchCapturedInput;
 }
 
 int APIENTRY wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
 {
     UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
 
     //volatile bool pausing = true;
     //while (pausing) { Sleep(1000); }
@@ -2258,13 +8241,26 @@ int APIENTRY wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmd
         {
             CreateMessageMap();
 
+            // -capture_thread takes input on a thread of its own; by default it's taken on the main thread,
+            //  where the interception callbacks run while the hook holds the key event.
+            const auto isCaptureThread = (nullptr != lpCmdLine && nullptr != ::wcsstr(lpCmdLine, L"-capture_thread"));
+            if (isCaptureThread)
+            {
+                capture::Start();
+            }
+
             Sizeui windowClientSize;
             windowClientSize.width = 300;
             windowClientSize.height = 200;
 
             CreateApplicationWindow(L"Uber Key", windowClientSize, hInstance, nCmdShow);
 
+            if (capture::IsRunning())
+            {
+                capture::SetTarget(_windowHandle);
+            }
             EnableRawKeyboardInput(true);
+            control::Start(_windowHandle);
 
             std::cout << "Entering event loop..." << std::endl;
 
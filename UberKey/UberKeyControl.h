@@ -0,0 +1,71 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// The control protocol.
+//
+// A running UberKey serves one control client at a time on a named pipe. The client writes a request;
+//  a header followed by its payload. UberKey answers each request with a response header, followed by
+//  a UTF-8 text payload; a message on failure, or the command's output. Requests are run one at a
+//  time, on the thread that dispatches key events, between key events.
+//
+// NOTE: This header is C, and only uses fixed size types; keep it that way. Commands may be added;
+//  anything else that changes needs a bump of UBERKEY_CONTROL_VERSION.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UBERKEY_CONTROL_PIPE_NAME   L"\\\\.\\pipe\\UberKey.Control"
+#define UBERKEY_CONTROL_VERSION     1u
+#define UBERKEY_CONTROL_MAX_PAYLOAD 65536u
+
+typedef enum uberkey_control_command
+{
+    UBERKEY_CONTROL_LOAD_SCRIPT = 1,        // payload: a script file name, from the program's directory
+    UBERKEY_CONTROL_SET_BINDING = 2,        // payload: uberkey_control_binding
+    UBERKEY_CONTROL_DUMP_COUNTERS = 3,      // no payload; answers with "name value" lines
+    UBERKEY_CONTROL_SET_KEY_LOGGING = 4,    // payload: uint32_t; non-zero to log key events to the console
+    UBERKEY_CONTROL_EVALUATE = 5,           // payload: Lua source; answers with the results, tab separated
+    UBERKEY_CONTROL_EXPORT_TRACE = 6        // payload: a file name, in the program's directory; writes the latency trace
+} uberkey_control_command;
+
+typedef enum uberkey_control_status
+{
+    UBERKEY_CONTROL_OK = 0,
+    UBERKEY_CONTROL_BAD_REQUEST = 1,        // unknown command, wrong version, or a malformed payload
+    UBERKEY_CONTROL_FAILED = 2,             // the command ran, and failed
+    UBERKEY_CONTROL_STOPPING = 3            // UberKey is exiting
+} uberkey_control_status;
+
+typedef struct uberkey_control_request
+{
+    uint16_t version;   // UBERKEY_CONTROL_VERSION
+    uint16_t command;   // uberkey_control_command
+    uint32_t length;    // of the payload that follows; at most UBERKEY_CONTROL_MAX_PAYLOAD
+} uberkey_control_request;
+
+typedef struct uberkey_control_response
+{
+    uint32_t status;    // uberkey_control_status
+    uint32_t length;    // of the text that follows
+} uberkey_control_response;
+
+// Disables a binding, or enables it again. The kind is an uberkey_binding_kind (see UberKeyPlugin.h),
+//  and the device is a device slot, or zero for any device. A disabled binding keeps its Lua callback
+//  and native handlers, but its key is no longer latched or intercepted; binding the key again
+//  enables it.
+typedef struct uberkey_control_binding
+{
+    uint32_t kind;
+    uint32_t code;
+    uint32_t device;
+    uint32_t is_enabled;
+} uberkey_control_binding;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,99 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// The native plugin ABI.
+//
+// A plugin is a DLL in the "plugins" directory beside UberKey.exe, or a .so in the one beside
+//  uberkey-linux. The host loads each one at start up, before running UberKey.lua, and calls its
+//  uberkey_plugin_load() export with the host's function table. The plugin binds handlers to keys through that table, just like the Lua binding functions;
+//  handlers are called from the key dispatch, with the key event itself, and never enter Lua.
+//
+// NOTE: This header is C, and only uses fixed size types; keep it that way. Anything added must go
+//  on the end of a struct, along with a bump of UBERKEY_PLUGIN_ABI_VERSION.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UBERKEY_PLUGIN_ABI_VERSION 1u
+
+#if defined(_WIN32)
+#define UBERKEY_CALL __cdecl
+#define UBERKEY_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define UBERKEY_CALL
+#define UBERKEY_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+// Same layout as keyboard.ffi.event; see the README.
+typedef struct uberkey_key_event
+{
+    int64_t  timestamp;
+    uint64_t device_handle;
+    uint32_t sequence;
+    uint32_t extra_information;
+    uint16_t virtual_key;
+    uint16_t scancode;
+    uint16_t repeat_count;
+    uint8_t  e0;
+    uint8_t  e1;
+    uint8_t  device;
+    uint8_t  injected;
+    uint8_t  is_break;
+    uint8_t  sources;
+    uint8_t  is_consumed;
+    uint8_t  reserved[3];
+} uberkey_key_event;
+
+// The kinds of binding; one for each of the keyboard.listen_for_* and keyboard.intercept_* functions.
+typedef enum uberkey_binding_kind
+{
+    UBERKEY_LISTEN_FOR_SCANCODE_MAKE = 0,
+    UBERKEY_LISTEN_FOR_SCANCODE_BREAK = 1,
+    UBERKEY_LISTEN_FOR_VIRTUAL_KEY_MAKE = 2,
+    UBERKEY_LISTEN_FOR_VIRTUAL_KEY_BREAK = 3,
+    UBERKEY_INTERCEPT_SCANCODE_MAKE = 4,
+    UBERKEY_INTERCEPT_SCANCODE_BREAK = 5,
+    UBERKEY_INTERCEPT_VIRTUAL_KEY_MAKE = 6,
+    UBERKEY_INTERCEPT_VIRTUAL_KEY_BREAK = 7
+} uberkey_binding_kind;
+
+// Called on UberKey's main thread, as the key is dispatched; with -capture_thread, after the hook has
+//  returned. Must return quickly; without the capture thread, an intercepting handler holds up the
+//  system's keyboard input while it runs.
+typedef void (UBERKEY_CALL *uberkey_key_handler)(const uberkey_key_event* event, void* context);
+
+typedef struct uberkey_host
+{
+    uint32_t abi_version; // UBERKEY_PLUGIN_ABI_VERSION of the host
+
+    // Binds a handler to a key; the device is a device slot, or zero for any device. Handlers bound to
+    //  the same key run in order, lowest first; a Lua callback for the key runs at order zero, after
+    //  the handlers with a negative order. A device script's callback runs on the script's own thread,
+    //  so it's only queued at order zero. Returns zero on success.
+    // NOTE: Only call from uberkey_plugin_load(), or from a handler.
+    int32_t (UBERKEY_CALL *bind)(uint32_t kind, uint32_t code, uint32_t device, int32_t order, uberkey_key_handler handler, void* context);
+
+    // Removes a handler bound with the same arguments. Returns zero on success.
+    int32_t (UBERKEY_CALL *unbind)(uint32_t kind, uint32_t code, uint32_t device, uberkey_key_handler handler, void* context);
+
+    // Writes a line to UberKey's console.
+    void (UBERKEY_CALL *log)(const char* message);
+} uberkey_host;
+
+// Plugin exports.
+//  uberkey_plugin_load() returns zero on success; otherwise the plugin is unloaded again. The host
+//  table stays valid until uberkey_plugin_unload() returns.
+typedef int32_t (UBERKEY_CALL *uberkey_plugin_load_function)(const uberkey_host* host);
+typedef void (UBERKEY_CALL *uberkey_plugin_unload_function)(void);
+
+#define UBERKEY_PLUGIN_LOAD_NAME "uberkey_plugin_load"
+#define UBERKEY_PLUGIN_UNLOAD_NAME "uberkey_plugin_unload"
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
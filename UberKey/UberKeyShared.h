@@ -0,0 +1,179 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// The key state UberKey publishes to other processes.
+//
+// UberKey keeps a named shared memory segment up to date with the keys that are made, the keys being
+//  intercepted, and the last key event's sequence number. The segment is written with a seqlock: the
+//  writer makes the sequence odd, writes the state, and makes it even again; a reader copies the
+//  state out, and keeps its copy if the sequence was even and unchanged across the copy. The sequence
+//  is a std::atomic, with release and acquire ordering around the copies. Readers never block the
+//  writer, or each other.
+//
+// NOTE: Readers only need this header. Anything added to uberkey_key_state must go on the end, along
+//  with a bump of UBERKEY_SHARED_VERSION.
+
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#define UBERKEY_SHARED_NAME     L"Local\\UberKey.KeyState"
+#define UBERKEY_SHARED_MAGIC    0x534b4b55u // "UKKS"
+#define UBERKEY_SHARED_VERSION  1u
+
+// Key maps are 256 bits; bit (code % 32) of word (code / 32).
+struct uberkey_key_state
+{
+    uint32_t event_sequence;    // keyboard.ffi.event's sequence number for the last key event
+    uint32_t reserved;
+    int64_t  event_timestamp;   // QueryPerformanceCounter() ticks of the last key event
+    uint32_t made_scancodes[8];
+    uint32_t made_virtual_keys[8];
+    uint32_t intercepted_scancode_makes[8];
+    uint32_t intercepted_scancode_breaks[8];
+    uint32_t intercepted_virtual_key_makes[8];
+    uint32_t intercepted_virtual_key_breaks[8];
+};
+
+struct uberkey_shared_segment
+{
+    uint32_t                magic;
+    uint32_t                version;
+    std::atomic<uint32_t>   sequence;   // odd while the state is being written
+    uint32_t                writer_process_id;
+    uberkey_key_state       state;      // only copied with uberkey_write_state() and uberkey_try_read_state()
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "std::atomic<uint32_t> must be a plain 32-bit word");
+static_assert(0u == sizeof(uberkey_key_state) % sizeof(uint32_t), "uberkey_key_state must be whole 32-bit words");
+
+inline bool uberkey_is_set(const uint32_t (&keyMap)[8], const unsigned int code)
+{
+    return 0u != (keyMap[(code & 0xffu) / 32u] & (1u << (code % 32u)));
+}
+
+// The state is copied a word at a time, with relaxed atomics, so a read racing a write is never a data
+//  race; it's the sequence, and the fences around it, that tell a reader whether its copy is whole.
+const size_t uberkey_key_state_words = sizeof(uberkey_key_state) / sizeof(uint32_t);
+
+// Writer side; used by UberKey. There's only ever the one writer.
+inline void uberkey_write_state(uberkey_shared_segment& segment, const uberkey_key_state& state)
+{
+    const auto sequence = segment.sequence.load(std::memory_order_relaxed);
+    segment.sequence.store(sequence + 1u, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release); // the odd sequence is seen before any of the state
+
+    const auto pFrom = reinterpret_cast<const uint32_t*>(&state);
+    const auto pTo = reinterpret_cast<std::atomic<uint32_t>*>(&segment.state);
+    for (size_t i = 0u; i < uberkey_key_state_words; i++)
+    {
+        pTo[i].store(pFrom[i], std::memory_order_relaxed);
+    }
+
+    segment.sequence.store(sequence + 2u, std::memory_order_release); // all of the state is seen before the even sequence
+}
+
+// Reader side. Returns false, and leaves a torn copy, if the state was written during the copy.
+inline bool uberkey_try_read_state(const uberkey_shared_segment& segment, uberkey_key_state& state)
+{
+    const auto before = segment.sequence.load(std::memory_order_acquire);
+    if (0u != (before & 1u)) // if (being written)
+    {
+        return false;
+    }
+
+    const auto pFrom = reinterpret_cast<const std::atomic<uint32_t>*>(&segment.state);
+    const auto pTo = reinterpret_cast<uint32_t*>(&state);
+    for (size_t i = 0u; i < uberkey_key_state_words; i++)
+    {
+        pTo[i] = pFrom[i].load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire); // the state is read before the sequence is again
+    return before == segment.sequence.load(std::memory_order_relaxed);
+}
+
+// A small reader for other processes.
+class UberKeySharedReader final
+{
+public:
+    UberKeySharedReader()
+        : _mapping(nullptr)
+        , _pSegment(nullptr)
+        , _retryCount(0u)
+    {
+    }
+
+    ~UberKeySharedReader()
+    {
+        Close();
+    }
+
+    // Returns false if UberKey isn't running, or publishes a different version of the state.
+    bool Open()
+    {
+        Close();
+
+        _mapping = ::OpenFileMappingW(FILE_MAP_READ, FALSE, UBERKEY_SHARED_NAME);
+        if (nullptr == _mapping)
+        {
+            return false;
+        }
+
+        _pSegment = static_cast<const uberkey_shared_segment*>(::MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, sizeof(uberkey_shared_segment)));
+        if (nullptr == _pSegment || UBERKEY_SHARED_MAGIC != _pSegment->magic || UBERKEY_SHARED_VERSION != _pSegment->version)
+        {
+            Close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void Close()
+    {
+        if (nullptr != _pSegment)
+        {
+            ::UnmapViewOfFile(_pSegment);
+            _pSegment = nullptr;
+        }
+        if (nullptr != _mapping)
+        {
+            ::CloseHandle(_mapping);
+            _mapping = nullptr;
+        }
+    }
+
+    // Copies a consistent snapshot of the state. Returns false if the writer kept it busy for every try.
+    bool Read(uberkey_key_state& state, unsigned int maxTries = 1000u)
+    {
+        for (unsigned int i = 0u; i < maxTries; i++)
+        {
+            if (uberkey_try_read_state(*_pSegment, state))
+            {
+                return true;
+            }
+
+            _retryCount++;
+            ::YieldProcessor();
+        }
+
+        return false;
+    }
+
+    bool isOpen() const { return nullptr != _pSegment; }
+    uint32_t writerProcessId() const { return _pSegment->writer_process_id; }
+    uint64_t retryCount() const { return _retryCount; }
+
+private:
+    HANDLE                          _mapping;
+    const uberkey_shared_segment*   _pSegment;
+    uint64_t                        _retryCount;
+
+    UberKeySharedReader(const UberKeySharedReader&) = delete;
+    UberKeySharedReader& operator =(const UberKeySharedReader&) = delete;
+};
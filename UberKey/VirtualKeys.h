@@ -0,0 +1,253 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// Microsoft's symbolic virtual key names; the Lua vk table, and the key names of binding files.
+// NOTE: Only standard C++; RemapCompiler includes it too.
+
+#pragma once
+
+#include <cstddef>
+
+struct VirtualKeyMeta
+{
+    const char* name;
+    const char* info;
+    const char** altNames;
+
+    VirtualKeyMeta(const char* name, const char* info, const char* altNames[])
+        : name(name), info(info), altNames(altNames)
+    {
+    }
+};
+
+const char* altNames0x15[] = { "hangul", "hangeul", nullptr };
+const char* altNames0x19[] = { "hanja", nullptr };
+const char* altNames0x92[] = { "oem_nec_equal", nullptr };
+const size_t altNameCount = ((sizeof(altNames0x15) + sizeof(altNames0x19) + sizeof(altNames0x92)) / sizeof(char*)) - 3;
+
+static const VirtualKeyMeta virtualKeys[256] =
+{
+    { "", "", nullptr }, // 0x00
+    { "lbutton", "", nullptr }, // 0x01
+    { "rbutton", "", nullptr }, // 0x02
+    { "cancel", "", nullptr }, // 0x03
+    { "mbutton", "not contiguous with l & rbutton", nullptr }, // 0x04
+    { "xbutton1", "not contiguous with l & rbutton", nullptr }, // 0x05
+    { "xbutton2", "not contiguous with l & rbutton", nullptr }, // 0x06
+    { "", "unassigned", nullptr }, // 0x07
+    { "back", "", nullptr }, // 0x08
+    { "tab", "", nullptr }, // 0x09
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, // 0x0a - 0x0b
+    { "clear", "", nullptr }, // 0x0c
+    { "return", "", nullptr }, // 0x0d
+    { "", "", nullptr }, { "", "", nullptr }, // 0x0e - 0x0f
+    { "shift", "", nullptr }, // 0x10
+    { "control", "", nullptr }, // 0x11
+    { "menu", "", nullptr }, // 0x12
+    { "pause", "", nullptr }, // 0x13
+    { "capital", "", nullptr }, // 0x14
+    { "kana", "Japanese and Korean versions are different", altNames0x15 }, // 0x15
+    { "", "", nullptr }, // 0x16
+    { "junja", "", nullptr }, // 0x17
+    { "final", "", nullptr }, // 0x18
+    { "kanji", "Japanese and Korean versions are different", altNames0x19 }, // 0x19
+    { "", "", nullptr }, // 0x1a
+    { "escape", "", nullptr }, // 0x1b
+    { "convert", "", nullptr }, // 0x1c
+    { "nonconvert", "", nullptr }, // 0x1d
+    { "accept", "", nullptr }, // 0x1e
+    { "modechange", "", nullptr }, // 0x1f
+    { "space", "", nullptr }, // 0x20
+    { "prior", "", nullptr }, // 0x21
+    { "next", "", nullptr }, // 0x22
+    { "end", "", nullptr }, // 0x23
+    { "home", "", nullptr }, // 0x24
+    { "left", "", nullptr }, // 0x25
+    { "up", "", nullptr }, // 0x26
+    { "right", "", nullptr }, // 0x27
+    { "down", "", nullptr }, // 0x28
+    { "select", "", nullptr }, // 0x29
+    { "print", "", nullptr }, // 0x2a
+    { "execute", "", nullptr }, // 0x2b
+    { "snapshot", "", nullptr }, // 0x2c
+    { "insert", "", nullptr }, // 0x2d
+    { "delete", "", nullptr }, // 0x2e
+    { "help", "", nullptr }, // 0x2f
+    { "_0", "same as ASCII '0'", nullptr }, // 0x30
+    { "_1", "same as ASCII '1'", nullptr }, // 0x31
+    { "_2", "same as ASCII '2'", nullptr }, // 0x32
+    { "_3", "same as ASCII '3'", nullptr }, // 0x33
+    { "_4", "same as ASCII '4'", nullptr }, // 0x34
+    { "_5", "same as ASCII '5'", nullptr }, // 0x35
+    { "_6", "same as ASCII '6'", nullptr }, // 0x36
+    { "_7", "same as ASCII '7'", nullptr }, // 0x37
+    { "_8", "same as ASCII '8'", nullptr }, // 0x38
+    { "_9", "same as ASCII '9'", nullptr }, // 0x39
+    { "", "", nullptr }, { "", "", nullptr }, { "", "", nullptr }, // 0x3a - 0x3f
+    { "", "", nullptr }, { "", "", nullptr }, { "", "", nullptr },
+    { "", "unassigned", nullptr }, // 0x40
+    { "a", "same as ASCII 'A'", nullptr }, // 0x41
+    { "b", "same as ASCII 'B'", nullptr }, // 0x42
+    { "c", "same as ASCII 'C'", nullptr }, // 0x43
+    { "d", "same as ASCII 'D'", nullptr }, // 0x44
+    { "e", "same as ASCII 'E'", nullptr }, // 0x45
+    { "f", "same as ASCII 'F'", nullptr }, // 0x46
+    { "g", "same as ASCII 'G'", nullptr }, // 0x47
+    { "h", "same as ASCII 'H'", nullptr }, // 0x48
+    { "i", "same as ASCII 'I'", nullptr }, // 0x49
+    { "j", "same as ASCII 'J'", nullptr }, // 0x4a
+    { "k", "same as ASCII 'K'", nullptr }, // 0x4b
+    { "l", "same as ASCII 'L'", nullptr }, // 0x4c
+    { "m", "same as ASCII 'M'", nullptr }, // 0x4d
+    { "n", "same as ASCII 'N'", nullptr }, // 0x4e
+    { "o", "same as ASCII 'O'", nullptr }, // 0x4f
+    { "p", "same as ASCII 'P'", nullptr }, // 0x50
+    { "q", "same as ASCII 'Q'", nullptr }, // 0x51
+    { "r", "same as ASCII 'R'", nullptr }, // 0x52
+    { "s", "same as ASCII 'S'", nullptr }, // 0x53
+    { "t", "same as ASCII 'T'", nullptr }, // 0x54
+    { "u", "same as ASCII 'U'", nullptr }, // 0x55
+    { "v", "same as ASCII 'V'", nullptr }, // 0x56
+    { "w", "same as ASCII 'W'", nullptr }, // 0x57
+    { "x", "same as ASCII 'X'", nullptr }, // 0x58
+    { "y", "same as ASCII 'Y'", nullptr }, // 0x59
+    { "z", "same as ASCII 'Z'", nullptr }, // 0x5a
+    { "lwin", "", nullptr }, // 0x5b
+    { "rwin", "", nullptr }, // 0x5c
+    { "apps", "", nullptr }, // 0x5d
+    { "", "reserved", nullptr }, // 0x5e
+    { "sleep", "", nullptr }, // 0x5f
+    { "numpad0", "", nullptr }, // 0x60
+    { "numpad1", "", nullptr }, // 0x61
+    { "numpad2", "", nullptr }, // 0x62
+    { "numpad3", "", nullptr }, // 0x63
+    { "numpad4", "", nullptr }, // 0x64
+    { "numpad5", "", nullptr }, // 0x65
+    { "numpad6", "", nullptr }, // 0x66
+    { "numpad7", "", nullptr }, // 0x67
+    { "numpad8", "", nullptr }, // 0x68
+    { "numpad9", "", nullptr }, // 0x69
+    { "multiply", "", nullptr }, // 0x6a
+    { "add", "", nullptr }, // 0x6b
+    { "separator", "", nullptr }, // 0x6c
+    { "subtract", "", nullptr }, // 0x6d
+    { "decimal", "", nullptr }, // 0x6e
+    { "divide", "", nullptr }, // 0x6f
+    { "f1", "", nullptr }, // 0x70
+    { "f2", "", nullptr }, // 0x71
+    { "f3", "", nullptr }, // 0x72
+    { "f4", "", nullptr }, // 0x73
+    { "f5", "", nullptr }, // 0x74
+    { "f6", "", nullptr }, // 0x75
+    { "f7", "", nullptr }, // 0x76
+    { "f8", "", nullptr }, // 0x77
+    { "f9", "", nullptr }, // 0x78
+    { "f10", "", nullptr }, // 0x79
+    { "f11", "", nullptr }, // 0x7a
+    { "f12", "", nullptr }, // 0x7b
+    { "f13", "", nullptr }, // 0x7c
+    { "f14", "", nullptr }, // 0x7d
+    { "f15", "", nullptr }, // 0x7e
+    { "f16", "", nullptr }, // 0x7f
+    { "f17", "", nullptr }, // 0x80
+    { "f18", "", nullptr }, // 0x81
+    { "f19", "", nullptr }, // 0x82
+    { "f20", "", nullptr }, // 0x83
+    { "f21", "", nullptr }, // 0x84
+    { "f22", "", nullptr }, // 0x85
+    { "f23", "", nullptr }, // 0x86
+    { "f24", "", nullptr }, // 0x87
+    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, // 0x88 - 0x8f
+    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
+    { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
+    { "numlock", "", nullptr }, // 0x90
+    { "scroll", "", nullptr }, // 0x91
+    { "oem_fj_jisho", "Fujitsu/OASYS 'dictionary' key; NEC PC-9800 '=' key on numpad", altNames0x92 }, // 0x92
+    { "oem_fj_masshou", "Fujitsu/OASYS 'unregister word' key", nullptr }, // 0x93
+    { "oem_fj_touroku", "Fujitsu/OASYS 'register word' key", nullptr }, // 0x94
+    { "oem_fj_loya", "Fujitsu/OASYS 'left oyayubi' key", nullptr }, // 0x95
+    { "oem_fj_roya", "Fujitsu/OASYS 'right oyayubi' key", nullptr }, // 0x96
+    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, // 0x97 - 0x9f
+    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
+    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr },
+    { "lshift", "left Shift; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa0
+    { "rshift", "right Shift; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa1
+    { "lcontrol", "left Ctrl; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa2
+    { "rcontrol", "right Ctrl; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa3
+    { "lmenu", "left Alt; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa4
+    { "rmenu", "right Alt; Used only as parameters to GetAsyncKeyState() and GetKeyState(). No other API or message will distinguish left and right keys in this way.", nullptr }, // 0xa5
+    { "browser_back", "", nullptr }, // 0xa6
+    { "browser_forward", "", nullptr }, // 0xa7
+    { "browser_refresh", "", nullptr }, // 0xa8
+    { "browser_stop", "", nullptr }, // 0xa9
+    { "browser_search", "", nullptr }, // 0xaa
+    { "browser_favorites", "", nullptr }, // 0xab
+    { "browser_home", "", nullptr }, // 0xac
+    { "volume_mute", "", nullptr }, // 0xad
+    { "volume_down", "", nullptr }, // 0xae
+    { "volume_up", "", nullptr }, // 0xaf
+    { "media_next_track", "", nullptr }, // 0xb0
+    { "media_prev_track", "", nullptr }, // 0xb1
+    { "media_stop", "", nullptr }, // 0xb2
+    { "media_play_pause", "", nullptr }, // 0xb3
+    { "launch_mail", "", nullptr }, // 0xb4
+    { "launch_media_select", "", nullptr }, // 0xb5
+    { "launch_app1", "", nullptr }, // 0xb6
+    { "launch_app2", "", nullptr }, // 0xb7
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, // 0xb8 - 0xb9
+    { "oem_1", "';:' for us", nullptr }, // 0xba
+    { "oem_plus", "'+' any country", nullptr }, // 0xbb
+    { "oem_comma", "',' any country", nullptr }, // 0xbc
+    { "oem_minus", "'-' any country", nullptr }, // 0xbd
+    { "oem_period", "'.' any country", nullptr }, // 0xbe
+    { "oem_2", "'/?' for us", nullptr }, // 0xbf
+    { "oem_3", "'`~' for us", nullptr }, // 0xc0
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr }, // 0xc1 - 0xd7
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
+    { "", "reserved", nullptr }, { "", "reserved", nullptr }, { "", "reserved", nullptr },
+    { "", "reserved", nullptr }, { "", "reserved", nullptr },
+    { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, { "", "unassigned", nullptr }, // 0xd8 - 0xda
+    { "oem_4", "'[{' for us", nullptr }, // 0xdb
+    { "oem_5", "'\\|' for us", nullptr }, // 0xdc
+    { "oem_6", "']}' for us", nullptr }, // 0xdd
+    { "oem_7", "''\"' for us", nullptr }, // 0xde
+    { "oem_8", "", nullptr }, // 0xdf
+    { "", "reserved", nullptr }, // 0xe0
+    { "oem_ax", "Various extended or enhanced keyboards; 'ax' key on japanese ax kbd", nullptr }, // 0xe1
+    { "oem_102", "Various extended or enhanced keyboards; \"<>\" or \"\\|\" on rt 102-key kbd.", nullptr }, // 0xe2
+    { "ico_help", "Various extended or enhanced keyboards; help key on ico", nullptr }, // 0xe3
+    { "ico_00", "Various extended or enhanced keyboards; 00 key on ico", nullptr }, // 0xe4
+    { "processkey", "", nullptr }, // 0xe5
+    { "ico_clear", "", nullptr }, // 0xe6
+    { "packet", "", nullptr }, // 0xe7
+    { "", "unassigned", nullptr }, // 0xe8
+    { "oem_reset", "Nokia/Ericsson", nullptr }, // 0xe9
+    { "oem_jump", "Nokia/Ericsson", nullptr }, // 0xea
+    { "oem_pa1", "Nokia/Ericsson", nullptr }, // 0xeb
+    { "oem_pa2", "Nokia/Ericsson", nullptr }, // 0xec
+    { "oem_pa3", "Nokia/Ericsson", nullptr }, // 0xed
+    { "oem_wsctrl", "Nokia/Ericsson", nullptr }, // 0xee
+    { "oem_cusel", "Nokia/Ericsson", nullptr }, // 0xef
+    { "oem_attn", "Nokia/Ericsson", nullptr }, // 0xf0
+    { "oem_finish", "Nokia/Ericsson", nullptr }, // 0xf1
+    { "oem_copy", "Nokia/Ericsson", nullptr }, // 0xf2
+    { "oem_auto", "Nokia/Ericsson", nullptr }, // 0xf3
+    { "oem_enlw", "Nokia/Ericsson", nullptr }, // 0xf4
+    { "oem_backtab", "Nokia/Ericsson", nullptr }, // 0xf5
+    { "attn", "", nullptr }, // 0xf6
+    { "crsel", "", nullptr }, // 0xf7
+    { "exsel", "", nullptr }, // 0xf8
+    { "ereof", "", nullptr }, // 0xf9
+    { "play", "", nullptr }, // 0xfa
+    { "zoom", "", nullptr }, // 0xfb
+    { "noname", "", nullptr }, // 0xfc
+    { "pa1", "", nullptr }, // 0xfd
+    { "oem_clear", "", nullptr }, // 0xfe
+    { "", "reserved", nullptr }  // 0xff
+};
+
+const auto virtualKeyCount = sizeof(virtualKeys) / sizeof(virtualKeys[0]);
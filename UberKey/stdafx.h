@@ -17,6 +17,13 @@
 #include <unordered_map>
 #include <string>
 #include <sstream>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cwctype>
+#include <atomic>
+#include <algorithm>
 
 // Lua Related
 #include <lua.hpp>
@@ -0,0 +1,246 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// Sends a control request to a running UberKey, and prints the answer.
+//
+//  UberKeyCtl load <file name>                     runs a script file from UberKey's directory
+//  UberKeyCtl enable <kind> <code> [device]        enables a binding again
+//  UberKeyCtl disable <kind> <code> [device]       stops a binding latching or intercepting its key
+//  UberKeyCtl counters                             prints UberKey's statistics
+//  UberKeyCtl log on|off                           switches the console's key event log
+//  UberKeyCtl eval <Lua source>                    runs a chunk in the main script's state
+//  UberKeyCtl trace <file name>                    writes the latency trace, in Chrome's format, to UberKey's directory
+//
+// The kinds are named after the keyboard functions that make them; e.g. intercept_virtual_key_make.
+
+#include <windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "UberKeyControl.h"
+
+namespace
+{
+    // In the order of uberkey_binding_kind.
+    const wchar_t* const BindingKindNames[] =
+    {
+        L"listen_for_scancode_make",
+        L"listen_for_scancode_break",
+        L"listen_for_virtual_key_make",
+        L"listen_for_virtual_key_break",
+        L"intercept_scancode_make",
+        L"intercept_scancode_break",
+        L"intercept_virtual_key_make",
+        L"intercept_virtual_key_break",
+    };
+
+    const uint32_t BindingKindCount = sizeof(BindingKindNames) / sizeof(BindingKindNames[0]);
+
+    int Usage()
+    {
+        std::wcout << L"usage: UberKeyCtl load <file name>" << std::endl;
+        std::wcout << L"       UberKeyCtl enable|disable <kind> <code> [device]" << std::endl;
+        std::wcout << L"       UberKeyCtl counters" << std::endl;
+        std::wcout << L"       UberKeyCtl log on|off" << std::endl;
+        std::wcout << L"       UberKeyCtl eval <Lua source>" << std::endl;
+        std::wcout << L"       UberKeyCtl trace <file name>" << std::endl;
+        std::wcout << L"kinds:";
+        for (const auto name : BindingKindNames)
+        {
+            std::wcout << L' ' << name;
+        }
+        std::wcout << std::endl;
+        return 1;
+    }
+
+    std::string Utf16ToUtf8(const wchar_t* const str)
+    {
+        const auto count = ::WideCharToMultiByte(CP_UTF8, 0, str, -1, nullptr, 0, nullptr, nullptr);
+        if (count <= 1)
+        {
+            return std::string();
+        }
+
+        std::string result(count, '\0');
+        ::WideCharToMultiByte(CP_UTF8, 0, str, -1, &result[0], count, nullptr, nullptr);
+        result.resize(count - 1); // drop the terminator
+
+        return result;
+    }
+
+    bool ReadAll(HANDLE pipe, void* buffer, DWORD size)
+    {
+        auto pBytes = static_cast<uint8_t*>(buffer);
+        while (0u != size)
+        {
+            DWORD count = 0u;
+            if (!::ReadFile(pipe, pBytes, size, &count, nullptr) || 0u == count)
+            {
+                return false;
+            }
+            pBytes += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    bool WriteAll(HANDLE pipe, const void* buffer, DWORD size)
+    {
+        auto pBytes = static_cast<const uint8_t*>(buffer);
+        while (0u != size)
+        {
+            DWORD count = 0u;
+            if (!::WriteFile(pipe, pBytes, size, &count, nullptr) || 0u == count)
+            {
+                return false;
+            }
+            pBytes += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    HANDLE OpenControlPipe()
+    {
+        for (;;)
+        {
+            const auto pipe = ::CreateFileW(UBERKEY_CONTROL_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+            if (INVALID_HANDLE_VALUE != pipe || ERROR_PIPE_BUSY != ::GetLastError())
+            {
+                return pipe;
+            }
+
+            if (!::WaitNamedPipeW(UBERKEY_CONTROL_PIPE_NAME, 5000)) // if (another client kept it busy)
+            {
+                return INVALID_HANDLE_VALUE;
+            }
+        }
+    }
+
+    // Returns the response status, or -1 if UberKey couldn't be reached.
+    int SendRequest(const uint16_t command, const void* payload, const uint32_t length)
+    {
+        const auto pipe = OpenControlPipe();
+        if (INVALID_HANDLE_VALUE == pipe)
+        {
+            std::wcout << L"UberKey isn't running, or isn't answering." << std::endl;
+            return -1;
+        }
+
+        const uberkey_control_request request = { UBERKEY_CONTROL_VERSION, command, length };
+        uberkey_control_response response = {};
+        std::string reply;
+
+        auto isSent = WriteAll(pipe, &request, sizeof(request)) && (0u == length || WriteAll(pipe, payload, length));
+        isSent = isSent && ReadAll(pipe, &response, sizeof(response));
+        if (isSent && 0u != response.length)
+        {
+            reply.resize(response.length);
+            isSent = ReadAll(pipe, &reply[0], response.length);
+        }
+        ::CloseHandle(pipe);
+
+        if (!isSent)
+        {
+            std::wcout << L"The connection to UberKey was lost." << std::endl;
+            return -1;
+        }
+
+        if (!reply.empty())
+        {
+            std::cout << reply;
+            if ('\n' != reply.back())
+            {
+                std::cout << std::endl;
+            }
+        }
+        return static_cast<int>(response.status);
+    }
+
+    int SetBinding(const int argc, wchar_t* argv[], const bool isEnabled)
+    {
+        if (argc < 4)
+        {
+            return Usage();
+        }
+
+        uberkey_control_binding binding = {};
+        binding.kind = BindingKindCount;
+        for (auto i = 0u; i < BindingKindCount; i++)
+        {
+            if (0 == ::wcscmp(argv[2], BindingKindNames[i]))
+            {
+                binding.kind = i;
+            }
+        }
+        if (BindingKindCount == binding.kind)
+        {
+            return Usage();
+        }
+
+        binding.code = ::wcstoul(argv[3], nullptr, 0);
+        binding.device = (argc > 4) ? ::wcstoul(argv[4], nullptr, 0) : 0u;
+        binding.is_enabled = isEnabled ? 1u : 0u;
+
+        return SendRequest(UBERKEY_CONTROL_SET_BINDING, &binding, sizeof(binding));
+    }
+} // namespace
+
+int wmain(int argc, wchar_t* argv[])
+{
+    if (argc < 2)
+    {
+        return Usage();
+    }
+
+    const std::wstring command = argv[1];
+
+    if (L"load" == command && 3 == argc)
+    {
+        const auto fileName = Utf16ToUtf8(argv[2]);
+        return SendRequest(UBERKEY_CONTROL_LOAD_SCRIPT, fileName.data(), static_cast<uint32_t>(fileName.size()));
+    }
+    if (L"enable" == command || L"disable" == command)
+    {
+        return SetBinding(argc, argv, L"enable" == command);
+    }
+    if (L"counters" == command && 2 == argc)
+    {
+        return SendRequest(UBERKEY_CONTROL_DUMP_COUNTERS, nullptr, 0u);
+    }
+    if (L"log" == command && 3 == argc)
+    {
+        const uint32_t isEnabled = (0 == ::wcscmp(argv[2], L"on")) ? 1u : 0u;
+        return SendRequest(UBERKEY_CONTROL_SET_KEY_LOGGING, &isEnabled, sizeof(isEnabled));
+    }
+    if (L"trace" == command && 3 == argc)
+    {
+        const auto fileName = Utf16ToUtf8(argv[2]);
+        return SendRequest(UBERKEY_CONTROL_EXPORT_TRACE, fileName.data(), static_cast<uint32_t>(fileName.size()));
+    }
+    if (L"eval" == command && argc >= 3)
+    {
+        // NOTE: the rest of the arguments are joined back up, so quoting is optional
+        std::wstring source = argv[2];
+        for (auto i = 3; i < argc; i++)
+        {
+            source += L' ';
+            source += argv[i];
+        }
+
+        const auto chunk = Utf16ToUtf8(source.c_str());
+        if (chunk.size() > UBERKEY_CONTROL_MAX_PAYLOAD)
+        {
+            std::wcout << L"The Lua source is too long." << std::endl;
+            return 1;
+        }
+        return SendRequest(UBERKEY_CONTROL_EVALUATE, chunk.data(), static_cast<uint32_t>(chunk.size()));
+    }
+
+    return Usage();
+}
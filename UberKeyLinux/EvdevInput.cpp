@@ -0,0 +1,429 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "EvdevInput.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace
+{
+    struct KeycodeKey
+    {
+        uint16_t keycode;
+        uint8_t  scancode;
+        uint8_t  prefix;        // 0xe0, 0xe1, or zero
+        uint8_t  virtualKey;
+    };
+
+    // The PC keyboard keys; set 1 scancodes, and the virtual keys of a US layout. Keycodes 1 through 88
+    //  are the scancodes themselves.
+    const KeycodeKey KeycodeKeys[] =
+    {
+        { KEY_ESC, 0x01, 0, 0x1b },             { KEY_1, 0x02, 0, '1' },                { KEY_2, 0x03, 0, '2' },
+        { KEY_3, 0x04, 0, '3' },                { KEY_4, 0x05, 0, '4' },                { KEY_5, 0x06, 0, '5' },
+        { KEY_6, 0x07, 0, '6' },                { KEY_7, 0x08, 0, '7' },                { KEY_8, 0x09, 0, '8' },
+        { KEY_9, 0x0a, 0, '9' },                { KEY_0, 0x0b, 0, '0' },                { KEY_MINUS, 0x0c, 0, 0xbd },
+        { KEY_EQUAL, 0x0d, 0, 0xbb },           { KEY_BACKSPACE, 0x0e, 0, 0x08 },       { KEY_TAB, 0x0f, 0, 0x09 },
+        { KEY_Q, 0x10, 0, 'Q' },                { KEY_W, 0x11, 0, 'W' },                { KEY_E, 0x12, 0, 'E' },
+        { KEY_R, 0x13, 0, 'R' },                { KEY_T, 0x14, 0, 'T' },                { KEY_Y, 0x15, 0, 'Y' },
+        { KEY_U, 0x16, 0, 'U' },                { KEY_I, 0x17, 0, 'I' },                { KEY_O, 0x18, 0, 'O' },
+        { KEY_P, 0x19, 0, 'P' },                { KEY_LEFTBRACE, 0x1a, 0, 0xdb },       { KEY_RIGHTBRACE, 0x1b, 0, 0xdd },
+        { KEY_ENTER, 0x1c, 0, 0x0d },           { KEY_LEFTCTRL, 0x1d, 0, 0xa2 },        { KEY_A, 0x1e, 0, 'A' },
+        { KEY_S, 0x1f, 0, 'S' },                { KEY_D, 0x20, 0, 'D' },                { KEY_F, 0x21, 0, 'F' },
+        { KEY_G, 0x22, 0, 'G' },                { KEY_H, 0x23, 0, 'H' },                { KEY_J, 0x24, 0, 'J' },
+        { KEY_K, 0x25, 0, 'K' },                { KEY_L, 0x26, 0, 'L' },                { KEY_SEMICOLON, 0x27, 0, 0xba },
+        { KEY_APOSTROPHE, 0x28, 0, 0xde },      { KEY_GRAVE, 0x29, 0, 0xc0 },           { KEY_LEFTSHIFT, 0x2a, 0, 0xa0 },
+        { KEY_BACKSLASH, 0x2b, 0, 0xdc },       { KEY_Z, 0x2c, 0, 'Z' },                { KEY_X, 0x2d, 0, 'X' },
+        { KEY_C, 0x2e, 0, 'C' },                { KEY_V, 0x2f, 0, 'V' },                { KEY_B, 0x30, 0, 'B' },
+        { KEY_N, 0x31, 0, 'N' },                { KEY_M, 0x32, 0, 'M' },                { KEY_COMMA, 0x33, 0, 0xbc },
+        { KEY_DOT, 0x34, 0, 0xbe },             { KEY_SLASH, 0x35, 0, 0xbf },           { KEY_RIGHTSHIFT, 0x36, 0, 0xa1 },
+        { KEY_KPASTERISK, 0x37, 0, 0x6a },      { KEY_LEFTALT, 0x38, 0, 0xa4 },         { KEY_SPACE, 0x39, 0, 0x20 },
+        { KEY_CAPSLOCK, 0x3a, 0, 0x14 },        { KEY_F1, 0x3b, 0, 0x70 },              { KEY_F2, 0x3c, 0, 0x71 },
+        { KEY_F3, 0x3d, 0, 0x72 },              { KEY_F4, 0x3e, 0, 0x73 },              { KEY_F5, 0x3f, 0, 0x74 },
+        { KEY_F6, 0x40, 0, 0x75 },              { KEY_F7, 0x41, 0, 0x76 },              { KEY_F8, 0x42, 0, 0x77 },
+        { KEY_F9, 0x43, 0, 0x78 },              { KEY_F10, 0x44, 0, 0x79 },             { KEY_NUMLOCK, 0x45, 0, 0x90 },
+        { KEY_SCROLLLOCK, 0x46, 0, 0x91 },      { KEY_KP7, 0x47, 0, 0x67 },             { KEY_KP8, 0x48, 0, 0x68 },
+        { KEY_KP9, 0x49, 0, 0x69 },             { KEY_KPMINUS, 0x4a, 0, 0x6d },         { KEY_KP4, 0x4b, 0, 0x64 },
+        { KEY_KP5, 0x4c, 0, 0x65 },             { KEY_KP6, 0x4d, 0, 0x66 },             { KEY_KPPLUS, 0x4e, 0, 0x6b },
+        { KEY_KP1, 0x4f, 0, 0x61 },             { KEY_KP2, 0x50, 0, 0x62 },             { KEY_KP3, 0x51, 0, 0x63 },
+        { KEY_KP0, 0x52, 0, 0x60 },             { KEY_KPDOT, 0x53, 0, 0x6e },           { KEY_102ND, 0x56, 0, 0xe2 },
+        { KEY_F11, 0x57, 0, 0x7a },             { KEY_F12, 0x58, 0, 0x7b },             { KEY_KPENTER, 0x1c, 0xe0, 0x0d },
+        { KEY_RIGHTCTRL, 0x1d, 0xe0, 0xa3 },    { KEY_KPSLASH, 0x35, 0xe0, 0x6f },      { KEY_SYSRQ, 0x37, 0xe0, 0x2c },
+        { KEY_RIGHTALT, 0x38, 0xe0, 0xa5 },     { KEY_HOME, 0x47, 0xe0, 0x24 },         { KEY_UP, 0x48, 0xe0, 0x26 },
+        { KEY_PAGEUP, 0x49, 0xe0, 0x21 },       { KEY_LEFT, 0x4b, 0xe0, 0x25 },         { KEY_RIGHT, 0x4d, 0xe0, 0x27 },
+        { KEY_END, 0x4f, 0xe0, 0x23 },          { KEY_DOWN, 0x50, 0xe0, 0x28 },         { KEY_PAGEDOWN, 0x51, 0xe0, 0x22 },
+        { KEY_INSERT, 0x52, 0xe0, 0x2d },       { KEY_DELETE, 0x53, 0xe0, 0x2e },       { KEY_MUTE, 0x20, 0xe0, 0xad },
+        { KEY_VOLUMEDOWN, 0x2e, 0xe0, 0xae },   { KEY_VOLUMEUP, 0x30, 0xe0, 0xaf },     { KEY_PAUSE, 0x1d, 0xe1, 0x13 },
+        { KEY_LEFTMETA, 0x5b, 0xe0, 0x5b },     { KEY_RIGHTMETA, 0x5c, 0xe0, 0x5c },    { KEY_COMPOSE, 0x5d, 0xe0, 0x5d },
+        { KEY_SLEEP, 0x5f, 0xe0, 0x5f },        { KEY_NEXTSONG, 0x19, 0xe0, 0xb0 },     { KEY_PLAYPAUSE, 0x22, 0xe0, 0xb3 },
+        { KEY_PREVIOUSSONG, 0x10, 0xe0, 0xb1 }, { KEY_STOPCD, 0x24, 0xe0, 0xb2 },       { KEY_F13, 0x64, 0, 0x7c },
+        { KEY_F14, 0x65, 0, 0x7d },             { KEY_F15, 0x66, 0, 0x7e },             { KEY_F16, 0x67, 0, 0x7f },
+        { KEY_F17, 0x68, 0, 0x80 },             { KEY_F18, 0x69, 0, 0x81 },             { KEY_F19, 0x6a, 0, 0x82 },
+        { KEY_F20, 0x6b, 0, 0x83 },             { KEY_F21, 0x6c, 0, 0x84 },             { KEY_F22, 0x6d, 0, 0x85 },
+        { KEY_F23, 0x6e, 0, 0x86 },             { KEY_F24, 0x76, 0, 0x87 },
+    };
+
+    const uint32_t KeycodeIndexSize = 256u;
+
+    struct KeycodeIndex
+    {
+        const KeycodeKey* byKeycode[KeycodeIndexSize];
+        uint16_t byVirtualKey[256];
+        uint16_t byScancode[2][128];    // [e0][scancode]
+
+        KeycodeIndex()
+        {
+            ::memset(this, 0, sizeof(*this));
+
+            for (const auto& key : KeycodeKeys)
+            {
+                byKeycode[key.keycode] = &key;
+                if (0u == byVirtualKey[key.virtualKey])
+                {
+                    byVirtualKey[key.virtualKey] = key.keycode;
+                }
+                if (0xe1u != key.prefix)
+                {
+                    byScancode[(0xe0u == key.prefix) ? 1 : 0][key.scancode] = key.keycode;
+                }
+            }
+
+            // VK_SHIFT, VK_CONTROL, and VK_MENU send their left hand keys.
+            byVirtualKey[0x10] = KEY_LEFTSHIFT;
+            byVirtualKey[0x11] = KEY_LEFTCTRL;
+            byVirtualKey[0x12] = KEY_LEFTALT;
+        }
+    };
+
+    const KeycodeIndex& Index()
+    {
+        static const KeycodeIndex index;
+        return index;
+    }
+
+    int64_t Microseconds(const input_event& event)
+    {
+        return static_cast<int64_t>(event.input_event_sec) * 1000000 + event.input_event_usec;
+    }
+} // namespace
+
+bool LinuxKeycodeToKey(uint16_t keycode, uberkey_key_event& event)
+{
+    const auto pKey = (keycode < KeycodeIndexSize) ? Index().byKeycode[keycode] : nullptr;
+    if (nullptr == pKey)
+    {
+        return false;
+    }
+
+    event.virtual_key = pKey->virtualKey;
+    event.scancode = pKey->scancode;
+    event.e0 = (0xe0u == pKey->prefix) ? 1u : 0u;
+    event.e1 = (0xe1u == pKey->prefix) ? 1u : 0u;
+    return true;
+}
+
+uint16_t VirtualKeyToLinuxKeycode(uint_fast16_t virtualKey)
+{
+    return (virtualKey < 256u) ? Index().byVirtualKey[virtualKey] : 0u;
+}
+
+uint16_t ScancodeToLinuxKeycode(uint_fast16_t scancode, bool isE0, bool isE1)
+{
+    if (isE1)
+    {
+        return (0x1du == scancode) ? KEY_PAUSE : 0u;
+    }
+    return (scancode < 128u) ? Index().byScancode[isE0 ? 1 : 0][scancode] : 0u;
+}
+
+EvdevReader::EvdevReader()
+    : _epoll(::epoll_create1(EPOLL_CLOEXEC))
+    , _openCount(0u)
+    , _sequence(0u)
+    , _droppedCount(0u)
+{
+}
+
+EvdevReader::~EvdevReader()
+{
+    for (auto& source : _sources)
+    {
+        Close(source);
+    }
+    if (-1 != _epoll)
+    {
+        ::close(_epoll);
+    }
+}
+
+bool EvdevReader::Add(int fd, uint8_t device)
+{
+    if (-1 == _epoll)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // NOTE: Sources are indexed from their epoll events, so the vector must not move once reading starts.
+    _sources.emplace_back();
+    auto& source = _sources.back();
+    ::memset(&source, 0, sizeof(source));
+    source.fd = fd;
+    source.device = device;
+
+    epoll_event pollEvent = {};
+    pollEvent.events = EPOLLIN;
+    pollEvent.data.u32 = static_cast<uint32_t>(_sources.size() - 1u);
+    source.isPolled = (0 == ::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &pollEvent));
+    if (!source.isPolled && EPERM != errno) // if (it isn't just a regular file)
+    {
+        const auto error = errno;
+        ::close(fd);
+        _sources.pop_back();
+        errno = error;
+        return false;
+    }
+
+    _openCount++;
+    return true;
+}
+
+bool EvdevReader::Read(int timeoutMilliseconds, uberkey_key_handler handler, void* context)
+{
+    for (auto& source : _sources)
+    {
+        if (-1 != source.fd && !source.isPolled)
+        {
+            if (!ReadSource(source, handler, context))
+            {
+                Close(source);
+            }
+            return 0u != _openCount;
+        }
+    }
+
+    epoll_event pollEvents[16];
+    const auto count = ::epoll_wait(_epoll, pollEvents, sizeof(pollEvents) / sizeof(pollEvents[0]), timeoutMilliseconds);
+    if (-1 == count)
+    {
+        return EINTR == errno;
+    }
+
+    for (auto i = 0; i < count; i++)
+    {
+        auto& source = _sources[pollEvents[i].data.u32];
+        if (-1 != source.fd && !ReadSource(source, handler, context))
+        {
+            Close(source);
+        }
+    }
+
+    return 0u != _openCount;
+}
+
+bool EvdevReader::ReadSource(Source& source, uberkey_key_handler handler, void* context)
+{
+    const auto pBytes = reinterpret_cast<uint8_t*>(source.buffer);
+    const auto readCount = ::read(source.fd, pBytes + source.fill, sizeof(source.buffer) - source.fill);
+    if (readCount <= 0)
+    {
+        return readCount < 0 && (EAGAIN == errno || EINTR == errno);
+    }
+
+    const auto size = source.fill + static_cast<uint32_t>(readCount);
+    const auto eventCount = size / static_cast<uint32_t>(sizeof(input_event));
+
+    for (auto i = 0u; i < eventCount; i++)
+    {
+        const auto& inputEvent = source.buffer[i];
+
+        // The kernel drops events when its buffer overflows; the rest of that report can't be trusted.
+        if (EV_SYN == inputEvent.type)
+        {
+            if (SYN_DROPPED == inputEvent.code)
+            {
+                source.isDropping = true;
+                _droppedCount++;
+            }
+            else if (SYN_REPORT == inputEvent.code)
+            {
+                source.isDropping = false;
+            }
+            continue;
+        }
+        if (EV_KEY != inputEvent.type || source.isDropping || inputEvent.code >= KEY_CNT)
+        {
+            continue;
+        }
+
+        uberkey_key_event event = {};
+        if (!LinuxKeycodeToKey(inputEvent.code, event))
+        {
+            continue;
+        }
+
+        auto& repeatCount = source.repeatCounts[inputEvent.code];
+        repeatCount = (2 == inputEvent.value) ? repeatCount + 1u : 0u;
+
+        event.timestamp = Microseconds(inputEvent);
+        event.sequence = ++_sequence;
+        event.repeat_count = repeatCount;
+        event.device = source.device;
+        event.is_break = (0 == inputEvent.value) ? 1u : 0u;
+        event.sources = 2u; // like raw input; straight from the device
+
+        handler(&event, context);
+    }
+
+    // Keep a partly read event for the next read.
+    source.fill = size % static_cast<uint32_t>(sizeof(input_event));
+    ::memmove(pBytes, pBytes + eventCount * sizeof(input_event), source.fill);
+
+    return true;
+}
+
+void EvdevReader::Close(Source& source)
+{
+    if (-1 == source.fd)
+    {
+        return;
+    }
+
+    if (source.isPolled)
+    {
+        ::epoll_ctl(_epoll, EPOLL_CTL_DEL, source.fd, nullptr);
+    }
+    ::close(source.fd);
+    source.fd = -1;
+    _openCount--;
+}
+
+UinputSink::UinputSink()
+    : _fd(-1)
+    , _isDevice(false)
+    , _count(0u)
+    , _sentCount(0u)
+    , _error(0)
+{
+}
+
+UinputSink::~UinputSink()
+{
+    Flush();
+    if (-1 != _fd)
+    {
+        if (_isDevice)
+        {
+            ::ioctl(_fd, UI_DEV_DESTROY);
+        }
+        ::close(_fd);
+    }
+}
+
+bool UinputSink::CreateKeyboard(const char* name)
+{
+    const auto fd = ::open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (-1 == fd)
+    {
+        return false;
+    }
+
+    auto isCreated = (0 == ::ioctl(fd, UI_SET_EVBIT, EV_KEY)) && (0 == ::ioctl(fd, UI_SET_EVBIT, EV_SYN));
+    for (const auto& key : KeycodeKeys)
+    {
+        isCreated = isCreated && (0 == ::ioctl(fd, UI_SET_KEYBIT, key.keycode));
+    }
+
+    uinput_setup setup = {};
+    setup.id.bustype = BUS_VIRTUAL;
+    ::strncpy(setup.name, name, UINPUT_MAX_NAME_SIZE - 1);
+    isCreated = isCreated && (0 == ::ioctl(fd, UI_DEV_SETUP, &setup)) && (0 == ::ioctl(fd, UI_DEV_CREATE));
+
+    if (!isCreated)
+    {
+        const auto error = errno;
+        ::close(fd);
+        errno = error;
+        return false;
+    }
+
+    Attach(fd);
+    _isDevice = true;
+    return true;
+}
+
+void UinputSink::Attach(int fd)
+{
+    _fd = fd;
+    _isDevice = false;
+}
+
+bool UinputSink::Key(uint16_t keycode, int32_t value)
+{
+    auto isWritten = true;
+    if (_count + 2u > BatchSize)
+    {
+        isWritten = Write();
+    }
+
+    Append(EV_KEY, keycode, value);
+    Append(EV_SYN, SYN_REPORT, 0);
+    _sentCount++;
+    return isWritten;
+}
+
+bool UinputSink::Flush()
+{
+    (void)Write();
+
+    if (0 != _error)
+    {
+        errno = _error;
+        _error = 0;
+        return false;
+    }
+    return true;
+}
+
+// Writes the buffered events; or, with no descriptor, drops them. Keeps the first failure for Flush().
+bool UinputSink::Write()
+{
+    if (0u == _count)
+    {
+        return true;
+    }
+
+    const auto size = _count * sizeof(input_event);
+    _count = 0u;
+    if (-1 == _fd)
+    {
+        return true;
+    }
+
+    const auto written = ::write(_fd, _buffer, size);
+    if (static_cast<ssize_t>(size) == written)
+    {
+        return true;
+    }
+
+    if (0 == _error)
+    {
+        _error = (-1 == written) ? errno : EIO; // NOTE: a short write leaves errno alone
+    }
+    return false;
+}
+
+void UinputSink::Append(uint16_t type, uint16_t code, int32_t value)
+{
+    auto& event = _buffer[_count++];
+    ::memset(&event, 0, sizeof(event)); // uinput stamps the time itself
+    event.type = type;
+    event.code = code;
+    event.value = value;
+}
@@ -0,0 +1,118 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <linux/input.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "UberKeyPlugin.h"
+
+// Linux input: evdev key events in, uinput key events out.
+//
+// Linux keycodes are translated into the same virtual keys and scancodes the Windows side dispatches
+//  (a US layout); the key events are uberkey_key_event, as native plugins get them. Any descriptor
+//  carrying struct input_event will do as an input or an output; a device node, a pipe, or a file
+//  with a recorded stream in it.
+// NOTE: Linux only; nothing here is built on Windows.
+
+// Fills in the virtual key, scancode, e0, and e1 of a Linux keycode. Returns false for keycodes with
+//  no virtual key.
+bool LinuxKeycodeToKey(uint16_t keycode, uberkey_key_event& event);
+
+// Returns the Linux keycode of a virtual key, or of a scancode; zero for none.
+uint16_t VirtualKeyToLinuxKeycode(uint_fast16_t virtualKey);
+uint16_t ScancodeToLinuxKeycode(uint_fast16_t scancode, bool isE0, bool isE1);
+
+// Reads key events from any number of descriptors, with epoll, in batches. Nothing is allocated per
+//  event.
+class EvdevReader final
+{
+public:
+    EvdevReader();
+    ~EvdevReader();
+
+    // Adds a descriptor, and takes it over; the device is the slot put in its key events. Regular
+    //  files can't be polled, so they're read straight through, ahead of everything else. Returns
+    //  false, with errno set, on failure.
+    bool Add(int fd, uint8_t device);
+
+    // Waits up to the timeout for input, and hands each key event read to the handler. Returns false
+    //  when every descriptor has ended, or on an error.
+    bool Read(int timeoutMilliseconds, uberkey_key_handler handler, void* context);
+
+    size_t openCount() const { return _openCount; }
+    uint64_t droppedCount() const { return _droppedCount; } // times the kernel's event buffer overflowed
+
+private:
+    static const uint32_t BatchSize = 64u;
+
+    struct Source
+    {
+        int         fd;
+        bool        isPolled;
+        bool        isDropping;                         // after SYN_DROPPED, until the next SYN_REPORT
+        uint8_t     device;
+        uint32_t    fill;                               // bytes of a partly read event in the buffer
+        input_event buffer[BatchSize];
+        uint16_t    repeatCounts[KEY_CNT];
+    };
+
+    int                 _epoll;
+    std::vector<Source> _sources;
+    size_t              _openCount;
+    uint32_t            _sequence;
+    uint64_t            _droppedCount;
+
+    // Returns false when the source has ended.
+    bool ReadSource(Source& source, uberkey_key_handler handler, void* context);
+    void Close(Source& source);
+
+    EvdevReader(const EvdevReader&) = delete;
+    EvdevReader& operator =(const EvdevReader&) = delete;
+};
+
+// Writes key events in uinput's format; to a virtual keyboard made with /dev/uinput, or to any
+//  descriptor. Events are buffered until Flush(), so each batch is one write(). With neither, the keys
+//  are only counted.
+class UinputSink final
+{
+public:
+    UinputSink();
+    ~UinputSink();
+
+    // Makes a virtual keyboard that can send every key. Returns false, with errno set, on failure.
+    bool CreateKeyboard(const char* name);
+
+    // Writes to the descriptor instead, and takes it over.
+    void Attach(int fd);
+
+    // Values are zero for a break, one for a make, and two for an autorepeat. Each key is followed by a
+    //  SYN_REPORT. Returns false if the full buffer couldn't be written first; the key is still buffered.
+    bool Key(uint16_t keycode, int32_t value);
+
+    // Returns false, with errno set, if this or any write since the last Flush() failed.
+    bool Flush();
+
+    bool isOpen() const { return -1 != _fd; }
+    uint64_t sentCount() const { return _sentCount; }
+
+private:
+    static const uint32_t BatchSize = 128u;
+
+    int         _fd;
+    bool        _isDevice;
+    uint32_t    _count;
+    uint64_t    _sentCount;
+    int         _error;     // errno of a failed write not yet reported by Flush()
+    input_event _buffer[BatchSize];
+
+    void Append(uint16_t type, uint16_t code, int32_t value);
+    bool Write();
+
+    UinputSink(const UinputSink&) = delete;
+    UinputSink& operator =(const UinputSink&) = delete;
+};
@@ -0,0 +1,489 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// UberKey's remap images on Linux.
+//
+//  uberkey-linux [-image <file>] [-output <file> | -uinput] [-grab] [-realtime] <input>...
+//
+// Reads key events from each input; an evdev device node, or a file or pipe with a recorded stream
+//  of struct input_event. Keys the image binds are run through its actions, just as UberKey does on
+//  Windows; every other key is sent on untouched. The keys are sent to a file, or to a virtual
+//  keyboard made with uinput. With -grab, the devices' own key events go nowhere else. With
+//  -realtime, the events are read with SCHED_FIFO, ahead of everything but the kernel's own threads.
+// Native plugins are the .so files in the "plugins" directory beside uberkey-linux; see UberKeyPlugin.h.
+//  The image's actions take the place of the Lua callback, at order zero.
+//
+// Build it with:
+//  g++ -std=c++11 -O2 -IUberKey UberKeyLinux/*.cpp UberKey/RemapImage.cpp UberKey/NativeHandlers.cpp -ldl -o uberkey-linux
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "EvdevInput.h"
+#include "NativeHandlers.h"
+#include "RemapImage.h"
+
+namespace
+{
+    volatile sig_atomic_t isStopping = 0;
+
+    void Stop(int)
+    {
+        isStopping = 1;
+    }
+
+    int Usage()
+    {
+        std::cout << "usage: uberkey-linux [-image <file>] [-output <file> | -uinput] [-grab] [-realtime] <input>..." << std::endl;
+        return 1;
+    }
+
+    int64_t Nanoseconds()
+    {
+        timespec now;
+        ::clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+
+    // A remap image, mapped read-only.
+    class MappedImage final
+    {
+    public:
+        MappedImage()
+            : _pView(nullptr)
+            , _size(0u)
+        {
+        }
+
+        ~MappedImage()
+        {
+            image.Close();
+            if (nullptr != _pView)
+            {
+                ::munmap(_pView, _size);
+            }
+        }
+
+        bool Open(const char* fileName)
+        {
+            const auto fd = ::open(fileName, O_RDONLY | O_CLOEXEC);
+            struct stat status;
+            if (-1 == fd || 0 != ::fstat(fd, &status) || 0 == status.st_size)
+            {
+                std::cout << "Can't read the remap image " << fileName << ": " << ::strerror(errno) << std::endl;
+                if (-1 != fd)
+                {
+                    ::close(fd);
+                }
+                return false;
+            }
+
+            _size = static_cast<size_t>(status.st_size);
+            _pView = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (MAP_FAILED == _pView)
+            {
+                _pView = nullptr;
+                std::cout << "Failed to map the remap image: " << ::strerror(errno) << std::endl;
+                return false;
+            }
+
+            const auto pError = image.Open(_pView, _size);
+            if (nullptr != pError)
+            {
+                std::cout << "The remap image can't be used; " << pError << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        RemapImage image;
+
+    private:
+        void*  _pView;
+        size_t _size;
+
+        MappedImage(const MappedImage&) = delete;
+        MappedImage& operator =(const MappedImage&) = delete;
+    };
+
+    // Sends the image's keys, and the keys it passes through, to the sink. NOTE: a failed write is kept
+    //  by the sink, and reported by the main loop's next Flush().
+    class SinkOutput final : public RemapOutput
+    {
+    public:
+        SinkOutput(UinputSink& sink, const uberkey_key_event& event)
+            : _sink(sink)
+            , _event(event)
+        {
+        }
+
+        void PassThrough() override
+        {
+            const auto keycode = ScancodeToLinuxKeycode(_event.scancode, 0u != _event.e0, 0u != _event.e1);
+            if (0u != keycode)
+            {
+                (void)_sink.Key(keycode, Value(0u != _event.is_break));
+            }
+        }
+
+        void Send(const uint_fast16_t virtualKey, const bool isBreak) override
+        {
+            const auto keycode = VirtualKeyToLinuxKeycode(virtualKey);
+            if (0u != keycode)
+            {
+                (void)_sink.Key(keycode, Value(isBreak));
+            }
+        }
+
+        void Send(const RemapKeyStep* pSteps, const uint32_t count) override
+        {
+            for (auto i = 0u; i < count; i++)
+            {
+                const auto keycode = VirtualKeyToLinuxKeycode(pSteps[i].virtualKey);
+                if (0u != keycode)
+                {
+                    (void)_sink.Key(keycode, (0u != pSteps[i].isBreak) ? 0 : 1);
+                }
+            }
+        }
+
+    private:
+        UinputSink&              _sink;
+        const uberkey_key_event& _event;
+
+        // The kernel ignores a make of a key that's already made, so autorepeats are sent as such.
+        int32_t Value(const bool isBreak) const
+        {
+            return isBreak ? 0 : ((0u != _event.repeat_count) ? 2 : 1);
+        }
+
+        SinkOutput(const SinkOutput&) = delete;
+        SinkOutput& operator =(const SinkOutput&) = delete;
+    };
+
+    struct Host
+    {
+        MappedImage      image;
+        RemapDispatcher  dispatcher;
+        UinputSink       sink;
+        uint64_t         eventCount;
+
+        Host()
+            : dispatcher(image.image)
+            , eventCount(0u)
+        {
+        }
+    };
+
+    // Runs the key event through the image, or passes it on untouched.
+    void RunImage(Host& host, const uberkey_key_event& event, SinkOutput& output)
+    {
+        if (!host.image.image.isOpen() || !host.image.image.IsBound(event.virtual_key))
+        {
+            output.PassThrough();
+        }
+        else if (0u != event.is_break)
+        {
+            host.dispatcher.Break(event.virtual_key, output);
+        }
+        else
+        {
+            host.dispatcher.Make(event.virtual_key, output);
+        }
+    }
+
+    // Native Plugins
+
+    NativeHandlerTable nativeHandlers;
+
+    int32_t UBERKEY_CALL Bind(uint32_t kind, uint32_t code, uint32_t device, int32_t order, uberkey_key_handler handler, void* context)
+    {
+        if (kind > UBERKEY_INTERCEPT_VIRTUAL_KEY_BREAK || code >= 256u || device >= 256u || nullptr == handler)
+        {
+            return -1;
+        }
+
+        const NativeHandler nativeHandler = { order, handler, context };
+        nativeHandlers.Bind(kind, device, code, nativeHandler);
+        return 0;
+    }
+
+    int32_t UBERKEY_CALL Unbind(uint32_t kind, uint32_t code, uint32_t device, uberkey_key_handler handler, void* context)
+    {
+        return nativeHandlers.Unbind(kind, device, code, handler, context) ? 0 : -1;
+    }
+
+    void UBERKEY_CALL Log(const char* message)
+    {
+        std::cout << message << std::endl;
+    }
+
+    const uberkey_host PluginHost = { UBERKEY_PLUGIN_ABI_VERSION, &Bind, &Unbind, &Log };
+
+    struct Plugin
+    {
+        void*                           module;
+        uberkey_plugin_unload_function  unload;
+    };
+
+    std::vector<Plugin> loadedPlugins;
+
+    void LoadPlugins()
+    {
+        char path[PATH_MAX];
+        const auto length = ::readlink("/proc/self/exe", path, sizeof(path) - 1u);
+        if (length <= 0)
+        {
+            return;
+        }
+        path[length] = '\0';
+
+        auto directory = std::string(path);
+        directory.erase(directory.rfind('/') + 1u);
+        directory += "plugins/";
+
+        const auto pDirectory = ::opendir(directory.c_str());
+        if (nullptr == pDirectory)
+        {
+            return; // no plugins
+        }
+
+        while (const auto pEntry = ::readdir(pDirectory))
+        {
+            const std::string name = pEntry->d_name;
+            if (name.size() <= 3u || 0 != name.compare(name.size() - 3u, 3u, ".so"))
+            {
+                continue;
+            }
+
+            const auto module = ::dlopen((directory + name).c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (nullptr == module)
+            {
+                std::cout << "Failed to load plugin: " << ::dlerror() << std::endl;
+                continue;
+            }
+
+            const auto load = reinterpret_cast<uberkey_plugin_load_function>(::dlsym(module, UBERKEY_PLUGIN_LOAD_NAME));
+            const auto unload = reinterpret_cast<uberkey_plugin_unload_function>(::dlsym(module, UBERKEY_PLUGIN_UNLOAD_NAME));
+            if (nullptr == load || 0 != load(&PluginHost))
+            {
+                std::cout << "Plugin failed to initialize: " << name << std::endl;
+                ::dlclose(module);
+                continue;
+            }
+
+            std::cout << "Loaded plugin: " << name << std::endl;
+
+            const Plugin plugin = { module, unload };
+            loadedPlugins.push_back(plugin);
+        }
+
+        ::closedir(pDirectory);
+    }
+
+    void UnloadPlugins()
+    {
+        nativeHandlers.Clear();
+
+        for (auto it = loadedPlugins.rbegin(); it != loadedPlugins.rend(); ++it)
+        {
+            if (nullptr != it->unload)
+            {
+                it->unload();
+            }
+            ::dlclose(it->module);
+        }
+        loadedPlugins.clear();
+    }
+
+    // The handlers bound to a key event; listening and intercepting, by scancode and by virtual key, on
+    //  any device and on the event's device. Held until they've all run.
+    struct BoundHandlers
+    {
+        NativeHandlerList lists[8];
+        bool              isIntercepted;
+
+        explicit BoundHandlers(const uberkey_key_event& event)
+            : isIntercepted(false)
+        {
+            const auto breakOffset = (0u != event.is_break) ? 1u : 0u;
+            auto i = 0u;
+            for (auto kind = static_cast<uint32_t>(UBERKEY_LISTEN_FOR_SCANCODE_MAKE); kind <= UBERKEY_INTERCEPT_VIRTUAL_KEY_BREAK; kind += 2u)
+            {
+                const auto isVirtualKey = (UBERKEY_LISTEN_FOR_VIRTUAL_KEY_MAKE == kind || UBERKEY_INTERCEPT_VIRTUAL_KEY_MAKE == kind);
+                const auto code = isVirtualKey ? event.virtual_key : event.scancode;
+                lists[i] = nativeHandlers.Find(kind + breakOffset, 0u, code);
+                lists[i + 1u] = (0u != event.device) ? nativeHandlers.Find(kind + breakOffset, event.device, code) : nullptr;
+                if (kind >= UBERKEY_INTERCEPT_SCANCODE_MAKE && (lists[i] || lists[i + 1u]))
+                {
+                    isIntercepted = true;
+                }
+                i += 2u;
+            }
+        }
+
+        void Run(const uberkey_key_event& event, const bool isBeforeScript) const
+        {
+            for (const auto& list : lists)
+            {
+                NativeHandlerTable::Run(list, event, isBeforeScript);
+            }
+        }
+    };
+
+    void HandleKey(const uberkey_key_event* event, void* context)
+    {
+        auto& host = *static_cast<Host*>(context);
+        SinkOutput output(host.sink, *event);
+
+        host.eventCount++;
+        if (!nativeHandlers.empty())
+        {
+            const BoundHandlers handlers(*event);
+            handlers.Run(*event, true);
+            if (!handlers.isIntercepted)
+            {
+                RunImage(host, *event, output);
+            }
+            handlers.Run(*event, false);
+        }
+        else
+        {
+            RunImage(host, *event, output);
+        }
+    }
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Host host;
+    EvdevReader reader;
+    auto isGrabbing = false;
+    uint8_t device = 0u;
+
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string argument = argv[i];
+        if ("-image" == argument && i + 1 < argc)
+        {
+            if (!host.image.Open(argv[++i]))
+            {
+                return 1;
+            }
+        }
+        else if ("-output" == argument && i + 1 < argc && !host.sink.isOpen())
+        {
+            const auto fd = ::open(argv[++i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (-1 == fd)
+            {
+                std::cout << "Can't write " << argv[i] << ": " << ::strerror(errno) << std::endl;
+                return 1;
+            }
+            host.sink.Attach(fd);
+        }
+        else if ("-uinput" == argument && !host.sink.isOpen())
+        {
+            if (!host.sink.CreateKeyboard("UberKey"))
+            {
+                std::cout << "Can't make a uinput keyboard: " << ::strerror(errno) << std::endl;
+                return 1;
+            }
+        }
+        else if ("-grab" == argument)
+        {
+            isGrabbing = true;
+        }
+        else if ("-realtime" == argument)
+        {
+            // Below the kernel's interrupt threads, which run at 50.
+            sched_param parameters = {};
+            parameters.sched_priority = 40;
+            if (0 != ::sched_setscheduler(0, SCHED_FIFO, &parameters))
+            {
+                std::cout << "Can't use SCHED_FIFO: " << ::strerror(errno) << std::endl;
+            }
+        }
+        else if ('-' == argument[0])
+        {
+            return Usage();
+        }
+        else
+        {
+            const auto fd = ::open(argv[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (-1 == fd)
+            {
+                std::cout << "Can't read " << argv[i] << ": " << ::strerror(errno) << std::endl;
+                return 1;
+            }
+            if (isGrabbing && 0 != ::ioctl(fd, EVIOCGRAB, 1)) // if (it isn't a device, or another program has it)
+            {
+                std::cout << "Can't grab " << argv[i] << ": " << ::strerror(errno) << std::endl;
+                ::close(fd);
+                return 1;
+            }
+            if (!reader.Add(fd, ++device))
+            {
+                std::cout << "Can't poll " << argv[i] << ": " << ::strerror(errno) << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    if (0u == reader.openCount())
+    {
+        return Usage();
+    }
+
+    LoadPlugins();
+
+    struct sigaction action = {};
+    action.sa_handler = &Stop;
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+
+    const auto start = Nanoseconds();
+    auto isSending = true;
+    while (0 == isStopping && reader.Read(250, &HandleKey, &host))
+    {
+        if (!host.sink.Flush())
+        {
+            std::cout << "Failed to send keys: " << ::strerror(errno) << std::endl;
+            isSending = false;
+            break;
+        }
+    }
+    if (isSending && !host.sink.Flush())
+    {
+        std::cout << "Failed to send keys: " << ::strerror(errno) << std::endl;
+    }
+    const auto elapsed = Nanoseconds() - start;
+
+    UnloadPlugins();
+
+    std::cout << host.eventCount << " key events read, " << host.sink.sentCount() << " sent, "
+        << reader.droppedCount() << " overflows; " << (elapsed / 1000000) << " ms";
+    if (0u != host.eventCount)
+    {
+        std::cout << ", " << (elapsed / static_cast<int64_t>(host.eventCount)) << " ns per key event";
+    }
+    std::cout << std::endl;
+
+    return 0;
+}
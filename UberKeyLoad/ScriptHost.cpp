@@ -0,0 +1,551 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "ScriptHost.h"
+
+#if !defined(UBERKEY_NO_LUA)
+#include <stdexcept>
+
+#include "IdleCollector.h"
+#include "KeyDispatch.h"
+#include "VirtualKeys.h"
+#endif
+
+#if defined(UBERKEY_NO_LUA)
+
+struct ScriptState
+{
+};
+
+struct ScriptBindings
+{
+};
+
+ScriptHost::ScriptHost()
+    : _L(nullptr)
+    , _stats()
+    , _mode(CollectorMode::Automatic)
+{
+}
+
+ScriptHost::~ScriptHost()
+{
+}
+
+bool ScriptHost::Load(const char*)
+{
+    _lastError = "built without Lua";
+    return false;
+}
+
+bool ScriptHost::Dispatch(const uberkey_key_event&)
+{
+    return false;
+}
+
+bool ScriptHost::SetDispatchMode(const DispatchMode mode)
+{
+    if (DispatchMode::Native == mode)
+    {
+        return true;
+    }
+
+    _lastError = "built without Lua";
+    return false;
+}
+
+void ScriptHost::ResumeDispatcher()
+{
+}
+
+void ScriptHost::SetCollectorMode(const CollectorMode mode)
+{
+    _mode = mode;
+}
+
+bool ScriptHost::HasIdleWork() const
+{
+    return false;
+}
+
+bool ScriptHost::IsOverDebt() const
+{
+    return false;
+}
+
+int64_t ScriptHost::RunSlice(bool)
+{
+    return 0;
+}
+
+size_t ScriptHost::memoryInUse() const
+{
+    return 0u;
+}
+
+#else
+
+// Device slot zero holds the bindings to any device, as UberKey's does.
+struct ScriptState
+{
+    KeyMap                      boundKeys[256][dispatch::BindingKindCount]; // by device slot, and binding kind
+    KeyMap                      madeVirtualKeys;
+    KeyMap                      madeScancodes;
+    IdleCollector               collector;
+    ScriptHost::DispatchMode    dispatchMode;
+    dispatch::LuaDispatcher     dispatcher;
+    uberkey_key_event           currentEvent; // where the Lua dispatcher copies each key event
+
+    ScriptState()
+        : dispatchMode(ScriptHost::DispatchMode::Native)
+        , currentEvent()
+    {
+        Clear(boundKeys);
+        Clear(madeVirtualKeys);
+        Clear(madeScancodes);
+    }
+};
+
+// The Lua functions; each has the host as its first upvalue.
+struct ScriptBindings
+{
+    static ScriptHost& Host(lua_State* L)
+    {
+        return *static_cast<ScriptHost*>(lua_touserdata(L, lua_upvalueindex(1)));
+    }
+
+    static uint_fast16_t CheckCode(lua_State* L, const int argumentIndex, const char* const Typename)
+    {
+        const auto code = luaL_checkinteger(L, argumentIndex);
+        if (code < 0 || code > 0xffff)
+        {
+            luaL_error(L, "%s (%p) is out of range", Typename, code);
+        }
+        return static_cast<uint_fast16_t>(code);
+    }
+
+    static uint_fast8_t CheckDevice(lua_State* L, const int argumentIndex)
+    {
+        if (lua_isnoneornil(L, argumentIndex))
+        {
+            return dispatch::AnyDevice;
+        }
+
+        const auto device = luaL_checkinteger(L, argumentIndex);
+        if (device < 0 || device > 0xff)
+        {
+            luaL_error(L, "device (%d) is out of range", static_cast<int>(device));
+        }
+        return static_cast<uint_fast8_t>(device);
+    }
+
+    // upvalue 2 is the binding kind.
+    static int SetKeyCallback(lua_State* L)
+    {
+        auto& host = Host(L);
+        const auto kind = static_cast<uint32_t>(lua_tointeger(L, lua_upvalueindex(2)));
+        const auto Typename = dispatch::IsVirtualKeyKind(kind) ? dispatch::vk::Typename : dispatch::sc::Typename;
+
+        // Argument checking
+        if (lua_gettop(L) < 2) // if (there are less than 2 Lua arguments passed to this function)
+        {
+            luaL_error(L, "not enough arguments; ([integer] %s, [function] callback, [[device]])", Typename);
+        }
+
+        const auto code = CheckCode(L, 1, Typename);
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        const auto device = CheckDevice(L, 3);
+        lua_settop(L, 2);
+
+        Set(host._state->boundKeys[device][kind], code);
+
+        dispatch::StoreKeyCallback(L, dispatch::CallbackTableNames[kind], dispatch::CallbackIndex(device, code)); // callbacks[index] = argv[2]; pop callback
+        return 0;
+    }
+
+    static int ClearKeyCallback(lua_State* L)
+    {
+        auto& host = Host(L);
+        const auto kind = static_cast<uint32_t>(lua_tointeger(L, lua_upvalueindex(2)));
+        const auto Typename = dispatch::IsVirtualKeyKind(kind) ? dispatch::vk::Typename : dispatch::sc::Typename;
+
+        // Argument checking
+        if (lua_gettop(L) < 1) // if (no arguments passed to this function)
+        {
+            luaL_error(L, "not enough arguments; ([integer] %s, [[device]])", Typename);
+        }
+
+        const auto code = CheckCode(L, 1, Typename);
+        const auto device = CheckDevice(L, 2);
+        lua_settop(L, 0);
+
+        lua_pushnil(L);
+        dispatch::StoreKeyCallback(L, dispatch::CallbackTableNames[kind], dispatch::CallbackIndex(device, code)); // callbacks[index] = nil; pop nil
+
+        Clear(host._state->boundKeys[device][kind], code);
+        return 0;
+    }
+
+    // Takes the same arguments as UberKey's send functions; only counts the keys.
+    static int SendKey(lua_State* L)
+    {
+        (void)luaL_checkinteger(L, 1);
+        Host(L)._stats.sentKeyCount++;
+        return 0;
+    }
+
+    static int SendKeys(lua_State* L)
+    {
+        const auto argc = lua_gettop(L);
+        for (auto argi = 1; argi <= argc; argi++)
+        {
+            (void)luaL_checkinteger(L, argi);
+        }
+        Host(L)._stats.sentKeyCount += static_cast<uint64_t>(argc);
+        return 0;
+    }
+
+    static int SendText(lua_State* L)
+    {
+        size_t length = 0u;
+        (void)luaL_checklstring(L, 1, &length);
+        Host(L)._stats.sentKeyCount += 2u * length; // a make and a break for each character
+        return 0;
+    }
+
+    // keyboard.set_dispatch_mode("native" | "lua")
+    static int SetDispatchMode(lua_State* L)
+    {
+        auto& host = Host(L);
+        const std::string mode = luaL_checkstring(L, 1);
+
+        if ("native" != mode && "lua" != mode)
+        {
+            return luaL_error(L, "unrecognized dispatch mode \"%s\"; expected \"native\" or \"lua\"", mode.c_str());
+        }
+        if (!host.SetDispatchMode(("lua" == mode) ? ScriptHost::DispatchMode::Lua : ScriptHost::DispatchMode::Native))
+        {
+            return luaL_error(L, "%s", host._lastError.c_str());
+        }
+        return 0;
+    }
+
+    static int DoNothing(lua_State*)
+    {
+        return 0;
+    }
+
+    static int Print(lua_State*)
+    {
+        return 0;
+    }
+
+    // The key state tables; upvalue 2 is nonzero for the scancodes.
+    static int KeyStateIndex(lua_State* L)
+    {
+        auto& host = Host(L);
+        const auto isScancode = 0 != lua_tointeger(L, lua_upvalueindex(2));
+        const auto code = CheckCode(L, 2, isScancode ? dispatch::sc::Typename : dispatch::vk::Typename);
+        lua_pushboolean(L, IsSet(isScancode ? host._state->madeScancodes : host._state->madeVirtualKeys, code));
+        return 1;
+    }
+
+    static int KeyStateLength(lua_State* L)
+    {
+        lua_pushinteger(L, sizeof(KeyMap) * 8u);
+        return 1;
+    }
+
+    static int KeyStateSetIndex(lua_State* L)
+    {
+        luaL_error(L, "%s table is not user writable", lua_tointeger(L, lua_upvalueindex(2)) ? dispatch::sc::Typename : dispatch::vk::Typename);
+        return 0;
+    }
+
+    static void PushClosure(lua_State* L, ScriptHost& host, const lua_CFunction function, const lua_Integer value)
+    {
+        lua_pushlightuserdata(L, &host);
+        lua_pushinteger(L, value);
+        lua_pushcclosure(L, function, 2);
+    }
+
+    static void CreateKeyStateTable(lua_State* L, ScriptHost& host, const char* const name, const bool isScancode)
+    {
+        lua_newtable(L); // the proxy
+        lua_createtable(L, 0, 3); // its metatable
+        PushClosure(L, host, &KeyStateIndex, isScancode ? 1 : 0);
+        lua_setfield(L, -2, "__index");
+        PushClosure(L, host, &KeyStateLength, isScancode ? 1 : 0);
+        lua_setfield(L, -2, "__len");
+        PushClosure(L, host, &KeyStateSetIndex, isScancode ? 1 : 0);
+        lua_setfield(L, -2, "__newindex");
+        lua_setmetatable(L, -2);
+        lua_setglobal(L, name);
+    }
+
+    static void Register(lua_State* L, ScriptHost& host)
+    {
+        static const char* const BindingNames[8] =
+        {
+            "scancode_make", "scancode_break", "virtual_key_make", "virtual_key_break",
+            "scancode_make", "scancode_break", "virtual_key_make", "virtual_key_break",
+        };
+
+        static const struct
+        {
+            const char*     name;
+            lua_CFunction   function;
+        } Functions[] =
+        {
+            { "send_virtual_key_make", &SendKey },
+            { "send_virtual_key_break", &SendKey },
+            { "send_scancode_make", &SendKey },
+            { "send_scancode_break", &SendKey },
+            { "send_keys", &SendKeys },
+            { "send_text", &SendText },
+            { "set_dispatch_mode", &SetDispatchMode },
+            { "hook", &DoNothing },
+            { "unhook", &DoNothing },
+        };
+
+        dispatch::CreateCallbackTables(L);
+
+        lua_newtable(L); // keyboard
+        for (auto kind = 0u; kind < dispatch::BindingKindCount; kind++)
+        {
+            const std::string prefix = dispatch::IsInterceptionKind(kind) ? "intercept_" : "listen_for_";
+            const std::string stopPrefix = dispatch::IsInterceptionKind(kind) ? "stop_intercepting_" : "stop_listening_for_";
+
+            PushClosure(L, host, &SetKeyCallback, kind);
+            lua_setfield(L, -2, (prefix + BindingNames[kind]).c_str());
+            PushClosure(L, host, &ClearKeyCallback, kind);
+            lua_setfield(L, -2, (stopPrefix + BindingNames[kind]).c_str());
+        }
+        for (const auto& function : Functions)
+        {
+            PushClosure(L, host, function.function, 0);
+            lua_setfield(L, -2, function.name);
+        }
+
+        lua_createtable(L, virtualKeyCount, 0); // virtual key descriptions
+        for (auto i = 0u; i < virtualKeyCount; i++)
+        {
+            lua_pushstring(L, virtualKeys[i].info);
+            lua_rawseti(L, -2, static_cast<int>(i));
+        }
+        lua_setfield(L, -2, "virtual_key_descriptions");
+        lua_setglobal(L, "keyboard");
+
+        lua_createtable(L, virtualKeyCount, virtualKeyCount + altNameCount); // vk; by name, and by code
+        for (auto i = 0u; i < virtualKeyCount; i++)
+        {
+            const auto& key = virtualKeys[i];
+            if ('\0' == key.name[0]) // if (unassigned or reserved)
+            {
+                continue;
+            }
+
+            lua_pushinteger(L, i);
+            lua_setfield(L, -2, key.name);
+            lua_pushstring(L, key.name);
+            lua_rawseti(L, -2, static_cast<int>(i));
+            for (auto pAlt = key.altNames; nullptr != pAlt && nullptr != *pAlt; pAlt++)
+            {
+                lua_pushinteger(L, i);
+                lua_setfield(L, -2, *pAlt);
+            }
+        }
+        lua_setglobal(L, "vk");
+
+        CreateKeyStateTable(L, host, "virtual_keys", false);
+        CreateKeyStateTable(L, host, "scancodes", true);
+    }
+};
+
+ScriptHost::ScriptHost()
+    : _L(nullptr)
+    , _state(new ScriptState())
+    , _stats()
+    , _mode(CollectorMode::Automatic)
+{
+}
+
+ScriptHost::~ScriptHost()
+{
+    if (nullptr != _L)
+    {
+        lua_close(_L);
+    }
+}
+
+bool ScriptHost::Load(const char* fileName)
+{
+    const auto L = luaL_newstate();
+    if (nullptr == L)
+    {
+        _lastError = "failed to create a Lua state";
+        return false;
+    }
+
+    luaL_openlibs(L);
+    ScriptBindings::Register(L, *this);
+
+    _L = L; // NOTE: the script may set the dispatch mode as it runs
+    if (0 != luaL_loadfile(L, fileName) || 0 != lua_pcall(L, 0, 0, 0))
+    {
+        _lastError = lua_tostring(L, -1);
+        _state->dispatcher.Reset();
+        _state->dispatchMode = DispatchMode::Native;
+        _L = nullptr;
+        lua_close(L);
+        return false;
+    }
+
+    // NOTE: a script's output would swamp the report
+    lua_pushcfunction(L, &ScriptBindings::Print);
+    lua_setglobal(L, "print");
+
+    SetCollectorMode(_mode);
+    return true;
+}
+
+bool ScriptHost::Dispatch(const uberkey_key_event& event)
+{
+    const auto isBreak = 0u != event.is_break;
+    auto& state = *_state;
+
+    if (isBreak)
+    {
+        Clear(state.madeVirtualKeys, event.virtual_key);
+        Clear(state.madeScancodes, event.scancode);
+    }
+    else
+    {
+        Set(state.madeVirtualKeys, event.virtual_key);
+        Set(state.madeScancodes, event.scancode);
+    }
+
+    if (nullptr == _L)
+    {
+        return false;
+    }
+
+    auto isConsumed = false;
+    for (const auto kind : dispatch::DispatchOrder(isBreak))
+    {
+        const auto Tablename = dispatch::CallbackTableNames[kind];
+        const auto code = dispatch::IsVirtualKeyKind(kind) ? event.virtual_key : event.scancode;
+
+        // NOTE: keys with nothing bound never enter Lua
+        const auto isDispatched = dispatch::DispatchKeyCallbacks(state.boundKeys[dispatch::AnyDevice][kind], state.boundKeys[event.device][kind], event.device, code, [&](const uint_fast8_t, const lua_Integer callbackIndex)
+        {
+            if (DispatchMode::Lua == state.dispatchMode)
+            {
+                if (state.dispatcher.isFull()) // dispatch what's there now
+                {
+                    ResumeDispatcher();
+                }
+                (void)state.dispatcher.Queue(kind, callbackIndex, event); // NOTE: callbacks here can't queue more
+                _stats.queuedCount++;
+                return;
+            }
+
+            if (!dispatch::PushKeyCallback(_L, Tablename, callbackIndex))
+            {
+                return;
+            }
+
+            _stats.callbackCount++;
+            const auto argumentCount = dispatch::PushKeyCallbackArguments(_L, event, LUA_NOREF);
+            if (0 != lua_pcall(_L, argumentCount, 0, 0))
+            {
+                _stats.errorCount++;
+                _lastError = lua_tostring(_L, -1);
+                lua_pop(_L, 1);
+            }
+        });
+
+        isConsumed = isConsumed || (isDispatched && dispatch::IsInterceptionKind(kind));
+    }
+
+    if (isConsumed)
+    {
+        _stats.consumedCount++;
+    }
+    return isConsumed;
+}
+
+bool ScriptHost::SetDispatchMode(const DispatchMode mode)
+{
+    auto& state = *_state;
+
+    if (DispatchMode::Lua == mode && !state.dispatcher.isCreated())
+    {
+        if (nullptr == _L)
+        {
+            _lastError = "no script is loaded";
+            return false;
+        }
+
+        try
+        {
+            state.dispatcher.Create(_L, &state.currentEvent);
+        }
+        catch (const std::exception& e)
+        {
+            _lastError = e.what();
+            return false;
+        }
+    }
+
+    ResumeDispatcher(); // finish off any queued events first
+    state.dispatchMode = mode;
+    return true;
+}
+
+void ScriptHost::ResumeDispatcher()
+{
+    _state->dispatcher.Resume([this](const std::string& message)
+    {
+        _stats.errorCount++;
+        _lastError = message;
+    });
+}
+
+void ScriptHost::SetCollectorMode(const CollectorMode mode)
+{
+    _mode = mode;
+    if (nullptr == _L)
+    {
+        return;
+    }
+
+    _state->collector.SetMode(_L, (CollectorMode::Idle == _mode) ? IdleCollector::Mode::Idle : IdleCollector::Mode::Automatic);
+}
+
+bool ScriptHost::HasIdleWork() const
+{
+    return nullptr != _L && _state->collector.HasIdleWork(_L);
+}
+
+bool ScriptHost::IsOverDebt() const
+{
+    return nullptr != _L && _state->collector.IsOverDebt(_L);
+}
+
+int64_t ScriptHost::RunSlice(const bool isBusy)
+{
+    auto& collector = _state->collector;
+    (void)collector.RunSlice(_L, isBusy);
+
+    _stats.sliceCount = collector.stats().sliceCount;
+    _stats.cycleCount = collector.stats().cycleCount;
+    return collector.stats().lastPause;
+}
+
+size_t ScriptHost::memoryInUse() const
+{
+    return (nullptr != _L) ? (static_cast<size_t>(lua_gc(_L, LUA_GCCOUNT, 0)) * 1024u + static_cast<size_t>(lua_gc(_L, LUA_GCCOUNTB, 0))) : 0u;
+}
+
+#endif
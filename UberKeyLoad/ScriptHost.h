@@ -0,0 +1,84 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "UberKeyPlugin.h"
+
+struct lua_State;
+struct ScriptState;
+
+// Runs an UberKey.lua style script outside of UberKey, for load testing.
+//
+// The script gets the keyboard binding functions, with UberKey's arguments and callback tables; the
+//  vk table, and the virtual_keys and scancodes key state tables. The send functions only count the
+//  keys they would send, and hook() and unhook() do nothing. Key events go through UberKey's own
+//  dispatch core (KeyDispatch.h), and its idle collector (IdleCollector.h); an event with an
+//  interception bound is consumed. Keys with nothing bound never enter Lua. The callbacks run as each
+//  key event is dispatched, or, in Lua dispatch mode, from UberKey's Lua dispatcher, a batch at a time.
+// NOTE: Only standard C++; it's built on Linux too. Built with UBERKEY_NO_LUA, there's no Lua, and
+//  Load() always fails.
+
+struct ScriptStats
+{
+    uint64_t    callbackCount;
+    uint64_t    queuedCount;        // callbacks queued for the Lua dispatcher
+    uint64_t    errorCount;
+    uint64_t    consumedCount;      // key events an interception was bound to
+    uint64_t    sentKeyCount;       // keys the script sent
+    uint64_t    sliceCount;         // idle collector slices
+    uint64_t    cycleCount;         // idle collector cycles completed
+};
+
+class ScriptHost final
+{
+public:
+    enum class CollectorMode { Automatic, Idle };
+    enum class DispatchMode { Native, Lua };
+
+    ScriptHost();
+    ~ScriptHost();
+
+    // Returns false, with the reason in lastError(), if the script can't be loaded or fails to run.
+    bool Load(const char* fileName);
+
+    // Runs the callbacks bound to the key event, or queues them in Lua dispatch mode. Returns true if an
+    //  interception consumed it.
+    bool Dispatch(const uberkey_key_event& event);
+
+    // Lua mode is keyboard.set_dispatch_mode("lua"); the callbacks are queued for the Lua dispatcher,
+    //  and run by ResumeDispatcher(), once per batch. Returns false, with the reason in lastError(), if
+    //  the dispatcher can't be made. Call after Load().
+    bool SetDispatchMode(DispatchMode mode);
+    void ResumeDispatcher();
+
+    // Idle mode stops Lua's collector; it's then run in slices, between key events, as UberKey's idle
+    //  collector does. The settings are the same as keyboard.set_gc_mode("idle", ...).
+    void SetCollectorMode(CollectorMode mode);
+    bool HasIdleWork() const;
+    bool IsOverDebt() const;
+    int64_t RunSlice(bool isBusy = false); // returns the pause, in nanoseconds
+
+    size_t memoryInUse() const; // bytes
+    const ScriptStats& stats() const { return _stats; }
+    const std::string& lastError() const { return _lastError; }
+
+    bool isLoaded() const { return nullptr != _L; }
+
+private:
+    lua_State*                      _L;
+    std::unique_ptr<ScriptState>    _state; // the key maps and the collector
+    ScriptStats                     _stats;
+    std::string                     _lastError;
+    CollectorMode                   _mode;
+
+    friend struct ScriptBindings;
+
+    ScriptHost(const ScriptHost&) = delete;
+    ScriptHost& operator =(const ScriptHost&) = delete;
+};
@@ -0,0 +1,393 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#include "TypistModels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+namespace
+{
+    const int64_t NanosecondsPerMillisecond = 1000000;
+
+    // The keyboard's typematic; Windows' defaults.
+    const int64_t RepeatDelay = 500 * NanosecondsPerMillisecond;
+    const int64_t RepeatPeriod = 33 * NanosecondsPerMillisecond;
+
+    const uint8_t VkBack = 0x08;
+    const uint8_t VkTab = 0x09;
+    const uint8_t VkSpace = 0x20;
+    const uint8_t VkLWin = 0x5b;
+    const uint8_t VkF1 = 0x70;
+    const uint8_t VkLShift = 0xa0;
+    const uint8_t VkLControl = 0xa2;
+    const uint8_t VkLMenu = 0xa4;
+    const uint8_t VkOemComma = 0xbc;
+    const uint8_t VkOemPeriod = 0xbe;
+    const uint8_t VkOem7 = 0xde; // the apostrophe
+
+    struct KeyScancode
+    {
+        uint8_t virtualKey;
+        uint8_t scancode;
+        uint8_t e0;
+    };
+
+    // Set 1 scancodes of the keys the models type.
+    const KeyScancode KeyScancodes[] =
+    {
+        { VkBack, 0x0e, 0 }, { VkTab, 0x0f, 0 }, { 0x0d, 0x1c, 0 }, { VkSpace, 0x39, 0 },
+        { '1', 0x02, 0 }, { '2', 0x03, 0 }, { '3', 0x04, 0 }, { '4', 0x05, 0 }, { '5', 0x06, 0 },
+        { '6', 0x07, 0 }, { '7', 0x08, 0 }, { '8', 0x09, 0 }, { '9', 0x0a, 0 }, { '0', 0x0b, 0 },
+        { 'Q', 0x10, 0 }, { 'W', 0x11, 0 }, { 'E', 0x12, 0 }, { 'R', 0x13, 0 }, { 'T', 0x14, 0 },
+        { 'Y', 0x15, 0 }, { 'U', 0x16, 0 }, { 'I', 0x17, 0 }, { 'O', 0x18, 0 }, { 'P', 0x19, 0 },
+        { 'A', 0x1e, 0 }, { 'S', 0x1f, 0 }, { 'D', 0x20, 0 }, { 'F', 0x21, 0 }, { 'G', 0x22, 0 },
+        { 'H', 0x23, 0 }, { 'J', 0x24, 0 }, { 'K', 0x25, 0 }, { 'L', 0x26, 0 }, { 'Z', 0x2c, 0 },
+        { 'X', 0x2d, 0 }, { 'C', 0x2e, 0 }, { 'V', 0x2f, 0 }, { 'B', 0x30, 0 }, { 'N', 0x31, 0 },
+        { 'M', 0x32, 0 }, { VkOemComma, 0x33, 0 }, { VkOemPeriod, 0x34, 0 }, { VkOem7, 0x28, 0 },
+        { VkLShift, 0x2a, 0 }, { VkLControl, 0x1d, 0 }, { VkLMenu, 0x38, 0 }, { VkLWin, 0x5b, 1 },
+        { VkF1, 0x3b, 0 }, { VkF1 + 1, 0x3c, 0 }, { VkF1 + 2, 0x3d, 0 }, { VkF1 + 3, 0x3e, 0 },
+        { VkF1 + 4, 0x3f, 0 }, { VkF1 + 5, 0x40, 0 }, { VkF1 + 6, 0x41, 0 }, { VkF1 + 7, 0x42, 0 },
+        { VkF1 + 8, 0x43, 0 }, { VkF1 + 9, 0x44, 0 }, { VkF1 + 10, 0x57, 0 }, { VkF1 + 11, 0x58, 0 },
+    };
+
+    struct ScancodeIndex
+    {
+        KeyScancode byVirtualKey[256];
+
+        ScancodeIndex()
+        {
+            ::memset(byVirtualKey, 0, sizeof(byVirtualKey));
+            for (const auto& key : KeyScancodes)
+            {
+                byVirtualKey[key.virtualKey] = key;
+            }
+        }
+    };
+
+    const ScancodeIndex scancodeIndex;
+
+    // The text model's alphabet; a character's symbol is its index.
+    const char Alphabet[] = "abcdefghijklmnopqrstuvwxyz ,.'";
+    const uint32_t SymbolCount = sizeof(Alphabet) - 1u;
+    const uint32_t SpaceSymbol = 26u;
+    const uint32_t PeriodSymbol = 28u;
+    const uint32_t SentenceStart = 0x100u; // flags the state after a period and a space
+
+    // The chain is trained on this.
+    const char Corpus[] =
+        "the quick brown fox jumps over the lazy dog. a keyboard is a typewriter style device which uses an "
+        "arrangement of buttons or keys to act as levers or electronic switches. following the decline of punch "
+        "cards and paper tape, interaction via teleprinter style keyboards became the main input method for "
+        "computers. keyboard keys typically have characters engraved or printed on them, and each press of a key "
+        "typically corresponds to a single written symbol. however, producing some symbols may require pressing "
+        "and holding several keys simultaneously or in sequence. while most keyboard keys produce letters, "
+        "numbers or signs, other keys or simultaneous key presses can produce actions or execute computer "
+        "commands. it's the software that decides what a key means, and that's where the remapping happens. "
+        "when you type a sentence there is a rhythm to it; common pairs of letters come quickly, and the hands "
+        "roll from one key onto the next before the first is released. there are pauses between words, and "
+        "longer ones while the writer thinks about what should come next.";
+
+    uint32_t SymbolOf(const char ch)
+    {
+        const auto p = ::strchr(Alphabet, ch);
+        return (nullptr != p && '\0' != ch) ? static_cast<uint32_t>(p - Alphabet) : SpaceSymbol;
+    }
+
+    uint8_t VirtualKeyOf(const uint32_t symbol)
+    {
+        static const uint8_t Punctuation[] = { VkSpace, VkOemComma, VkOemPeriod, VkOem7 };
+        return (symbol < 26u) ? static_cast<uint8_t>('A' + symbol) : Punctuation[symbol - 26u];
+    }
+
+    // Cumulative counts of each pair of symbols in the corpus.
+    struct LetterPairs
+    {
+        uint32_t cumulative[SymbolCount][SymbolCount];
+
+        LetterPairs()
+        {
+            uint32_t counts[SymbolCount][SymbolCount];
+            for (auto& row : counts)
+            {
+                std::fill(std::begin(row), std::end(row), 0u);
+                row[SpaceSymbol] = 1u; // every symbol can end a word
+            }
+
+            for (auto i = 1u; i + 1u < sizeof(Corpus); i++)
+            {
+                counts[SymbolOf(Corpus[i - 1u])][SymbolOf(Corpus[i])]++;
+            }
+
+            for (auto from = 0u; from < SymbolCount; from++)
+            {
+                auto total = 0u;
+                for (auto to = 0u; to < SymbolCount; to++)
+                {
+                    total += counts[from][to];
+                    cumulative[from][to] = total;
+                }
+            }
+        }
+    };
+
+    const LetterPairs letterPairs;
+} // namespace
+
+bool ParseTypistModel(const char* name, TypistModel& model)
+{
+    static const struct
+    {
+        const char*     name;
+        TypistModel     model;
+    } Models[] =
+    {
+        { "text", TypistModel::Text },
+        { "gaming", TypistModel::Gaming },
+        { "holds", TypistModel::Holds },
+        { "chords", TypistModel::Chords },
+    };
+
+    for (const auto& entry : Models)
+    {
+        if (0 == ::strcmp(entry.name, name))
+        {
+            model = entry.model;
+            return true;
+        }
+    }
+    return false;
+}
+
+Typist::Typist(TypistModel model, uint8_t device, uint64_t seed)
+    : _model(model)
+    , _device(device)
+    , _random(seed)
+    , _clock(0)
+    , _order(0u)
+    , _state(SpaceSymbol | SentenceStart)
+{
+    std::fill(std::begin(_releases), std::end(_releases), INT64_MIN);
+}
+
+uberkey_key_event Typist::Next()
+{
+    // A gesture's events all come at, or after, its start; so once the earliest planned event is
+    //  before the next gesture's start, nothing planned later can come ahead of it.
+    while (_pending.empty() || _pending.front().time >= _clock)
+    {
+        Plan();
+    }
+
+    std::pop_heap(_pending.begin(), _pending.end(), std::greater<Pending>());
+    const auto event = _pending.back().event;
+    _pending.pop_back();
+    return event;
+}
+
+void Typist::Plan()
+{
+    switch (_model)
+    {
+    case TypistModel::Text:
+        PlanText();
+        break;
+    case TypistModel::Gaming:
+        PlanGaming();
+        break;
+    case TypistModel::Holds:
+        PlanHold();
+        break;
+    case TypistModel::Chords:
+        PlanChord();
+        break;
+    }
+}
+
+// One character; about 85 words a minute, with a pause now and then after a word.
+void Typist::PlanText()
+{
+    const auto last = _state & 0xffu;
+    const auto row = letterPairs.cumulative[last];
+    const auto pick = static_cast<uint32_t>(_random() % row[SymbolCount - 1u]);
+    const auto symbol = static_cast<uint32_t>(std::upper_bound(row, row + SymbolCount, pick) - row);
+
+    if (symbol < 26u && Chance(0.02)) // if (a typo) hit a neighbouring letter, and take it back
+    {
+        Press(static_cast<uint8_t>('A' + (symbol + 1u) % 26u), _clock, Uniform(60, 110), false);
+        _clock += Uniform(150, 300);
+        Press(VkBack, _clock, Uniform(60, 100), false);
+        _clock += Uniform(200, 400);
+    }
+
+    const auto virtualKey = VirtualKeyOf(symbol);
+    const auto hold = Uniform(60, 120);
+    if (symbol < 26u && 0u != (SentenceStart & _state)) // if (a capital)
+    {
+        const auto lead = Uniform(40, 90);
+        Press(VkLShift, _clock, lead + hold + Uniform(10, 40), false);
+        Press(virtualKey, _clock + lead, hold, false);
+        _clock += lead;
+    }
+    else
+    {
+        Press(virtualKey, _clock, hold, false);
+    }
+
+    std::lognormal_distribution<double> gap(std::log(140.0), 0.35);
+    _clock += std::max<int64_t>(static_cast<int64_t>(gap(_random) * NanosecondsPerMillisecond), 30 * NanosecondsPerMillisecond);
+    if (SpaceSymbol == symbol && Chance(0.05)) // if (thinking)
+    {
+        _clock += Uniform(300, 1500);
+    }
+
+    if (SpaceSymbol == symbol && PeriodSymbol == last)
+    {
+        _state = symbol | SentenceStart;
+    }
+    else if (SpaceSymbol != symbol || 0u == (SentenceStart & _state))
+    {
+        _state = symbol;
+    }
+}
+
+// Movement held down, sometimes diagonally or sprinting, with the ability keys tapped meanwhile.
+void Typist::PlanGaming()
+{
+    static const uint8_t MovementKeys[] = { 'W', 'W', 'W', 'A', 'S', 'D' };
+    static const uint8_t AbilityKeys[] = { 'Q', 'E', 'R', 'F', '1', '2', '3', '4', VkSpace };
+
+    const auto start = _clock;
+    const auto hold = Uniform(150, 1500);
+
+    const auto movement = MovementKeys[_random() % sizeof(MovementKeys)];
+    Press(movement, start, hold, true);
+    if (Chance(0.25)) // if (diagonal)
+    {
+        const uint8_t sideways = Chance(0.5) ? 'A' : 'D';
+        if (sideways != movement)
+        {
+            Press(sideways, start + Uniform(10, 60), hold - Uniform(60, 120), true);
+        }
+    }
+    if (Chance(0.3)) // if (sprinting)
+    {
+        Press(VkLShift, start, hold + Uniform(10, 50), false);
+    }
+
+    auto tap = start;
+    for (auto taps = _random() % 5u; taps > 0u; taps--)
+    {
+        tap += Uniform(70, 150);
+        Press(AbilityKeys[_random() % sizeof(AbilityKeys)], tap, Uniform(25, 60), false);
+    }
+
+    _clock = std::max(start + hold, tap) + Uniform(100, 200);
+}
+
+// A letter held for seconds; it autorepeats at the typematic rate.
+void Typist::PlanHold()
+{
+    const auto hold = Uniform(1000, 8000);
+    Press(static_cast<uint8_t>('A' + _random() % 26u), _clock, hold, true);
+    _clock += hold + Uniform(200, 800);
+}
+
+// Modifiers made one after another, a key tapped, and the modifiers let go in reverse.
+void Typist::PlanChord()
+{
+    static const uint8_t Keys[] = { 'A', 'C', 'F', 'N', 'O', 'S', 'T', 'V', 'W', 'X', 'Z', '1', '2', VkTab, VkF1 + 3, VkF1 + 4 };
+
+    uint8_t modifiers[3];
+    auto modifierCount = 0u;
+    const auto kind = _random() % 10u;
+    if (kind < 8u)
+    {
+        modifiers[modifierCount++] = VkLControl;
+    }
+    if (kind >= 6u && kind < 8u)
+    {
+        modifiers[modifierCount++] = VkLShift;
+    }
+    if (8u == kind)
+    {
+        modifiers[modifierCount++] = VkLMenu;
+    }
+    if (9u == kind)
+    {
+        modifiers[modifierCount++] = VkLWin;
+    }
+
+    auto time = _clock;
+    int64_t makes[3];
+    for (auto i = 0u; i < modifierCount; i++)
+    {
+        makes[i] = time;
+        time += Uniform(15, 40);
+    }
+
+    const auto hold = Uniform(60, 110);
+    Press(Keys[_random() % sizeof(Keys)], time, hold, false);
+    time += hold;
+
+    for (auto i = modifierCount; i-- > 0u;)
+    {
+        time += Uniform(10, 30);
+        Press(modifiers[i], makes[i], time - makes[i], false);
+    }
+
+    _clock = time + Uniform(300, 1200);
+}
+
+void Typist::Press(const uint8_t virtualKey, int64_t make, const int64_t hold, const bool isRepeating)
+{
+    // A key can't be pressed again before it's let go; e.g. the double letters of the text model.
+    make = std::max(make, _releases[virtualKey] + NanosecondsPerMillisecond);
+    _releases[virtualKey] = make + hold;
+
+    Add(virtualKey, make, false, 0u);
+
+    if (isRepeating)
+    {
+        uint16_t repeatCount = 0u;
+        for (auto repeat = make + RepeatDelay; repeat < make + hold; repeat += RepeatPeriod)
+        {
+            Add(virtualKey, repeat, false, ++repeatCount);
+        }
+    }
+
+    Add(virtualKey, make + hold, true, 0u);
+}
+
+void Typist::Add(const uint8_t virtualKey, const int64_t time, const bool isBreak, const uint16_t repeatCount)
+{
+    const auto& key = scancodeIndex.byVirtualKey[virtualKey];
+
+    Pending pending = {};
+    pending.time = time;
+    pending.order = _order++;
+    pending.event.timestamp = time;
+    pending.event.device_handle = _device;
+    pending.event.virtual_key = virtualKey;
+    pending.event.scancode = key.scancode;
+    pending.event.e0 = key.e0;
+    pending.event.repeat_count = repeatCount;
+    pending.event.device = _device;
+    pending.event.is_break = isBreak ? 1u : 0u;
+    pending.event.sources = 2u; // as raw input
+
+    _pending.push_back(pending);
+    std::push_heap(_pending.begin(), _pending.end(), std::greater<Pending>());
+}
+
+int64_t Typist::Uniform(const int64_t low, const int64_t high)
+{
+    return (low + static_cast<int64_t>(_random() % static_cast<uint64_t>(high - low + 1))) * NanosecondsPerMillisecond;
+}
+
+bool Typist::Chance(const double probability)
+{
+    return std::uniform_real_distribution<double>(0.0, 1.0)(_random) < probability;
+}
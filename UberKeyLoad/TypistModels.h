@@ -0,0 +1,74 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "UberKeyPlugin.h"
+
+// Synthetic typists, for load testing.
+//
+// Each model makes the makes, autorepeats, and breaks a person (and a keyboard's typematic) would,
+//  on a timeline of its own; the key events are uberkey_key_event, as native plugins get them, with
+//  the timestamp in nanoseconds of model time. Keys are those of a US layout, with the virtual keys
+//  the low-level hook reports (e.g. VK_LSHIFT, rather than VK_SHIFT).
+// NOTE: Only standard C++; it's built on Linux too.
+
+enum class TypistModel : uint8_t
+{
+    Text,       // prose, from a Markov chain of letter pairs; with rollover, capitals, and typos
+    Gaming,     // movement keys held down, with bursts of taps on the ability keys
+    Holds,      // one key at a time, held for seconds, autorepeating
+    Chords,     // modifier combinations; e.g. control+shift+t
+};
+
+// The names are text, gaming, holds, and chords. Returns false for any other name.
+bool ParseTypistModel(const char* name, TypistModel& model);
+
+class Typist final
+{
+public:
+    Typist(TypistModel model, uint8_t device, uint64_t seed);
+
+    // The next key event, in timestamp order.
+    uberkey_key_event Next();
+
+private:
+    struct Pending
+    {
+        int64_t             time;
+        uint64_t            order;      // keeps events of the same time in the order they were planned
+        uberkey_key_event   event;
+
+        bool operator >(const Pending& other) const
+        {
+            return (time != other.time) ? time > other.time : order > other.order;
+        }
+    };
+
+    TypistModel             _model;
+    uint8_t                 _device;
+    std::mt19937_64         _random;
+    std::vector<Pending>    _pending;   // a min-heap
+    int64_t                 _clock;     // when the next gesture starts; no planned event is earlier
+    uint64_t                _order;
+    uint32_t                _state;     // the text model's last character
+    int64_t                 _releases[256]; // when each key was last let go
+
+    void Plan();
+    void PlanText();
+    void PlanGaming();
+    void PlanHold();
+    void PlanChord();
+
+    // Plans a key's make, its autorepeats when asked for, and its break.
+    void Press(uint8_t virtualKey, int64_t make, int64_t hold, bool isRepeating);
+    void Add(uint8_t virtualKey, int64_t time, bool isBreak, uint16_t repeatCount);
+
+    int64_t Uniform(int64_t low, int64_t high); // milliseconds; returns nanoseconds
+    bool Chance(double probability);
+};
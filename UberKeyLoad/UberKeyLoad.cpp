@@ -0,0 +1,717 @@
+//  Copyright (c) 2016 Christopher Gassib. All rights reserved.
+//
+
+// Load tests UberKey's key dispatch with synthetic typists.
+//
+//  UberKeyLoad [-model <name>[,<name>...]] [-devices <n>] [-rate <events per second>] [-seconds <n>]
+//              [-report <seconds>] [-image <remap image>] [-script <file>] [-gc auto|idle] [-seed <n>]
+//              [-dispatch native|lua] [-batch <n>] [-threads shared|device]
+//
+// Each device has a typist of its own (see TypistModels.h); the models are given to the devices in
+//  turn, and the devices' key events are merged in order. Every key event goes through the script's
+//  callbacks, then, unless an interception consumed it, the remap image; the same dispatch UberKey
+//  runs. With -rate, key events are due at a steady rate, and each one's latency is from when it was
+//  due until its dispatch finished; so a stall counts against every event held up behind it. With no
+//  rate, key events are dispatched back to back, and the latency is each one's own dispatch time.
+//
+// -dispatch lua runs the script's callbacks from UberKey's Lua dispatcher, as
+//  keyboard.set_dispatch_mode("lua") does; so the two modes can be compared on the same key events. The
+//  dispatcher is resumed whenever the run is ahead of schedule, and after at most -batch key events
+//  (64 by default), as UberKey's event loop resumes it once it gets to a batch. A key event that queued a
+//  callback finishes with its batch.
+//
+// -threads device gives each device a thread, a script, and a remap dispatcher of its own, as device
+//  scripts have in UberKey, and each device's typist feeds its thread alone; -rate is then each
+//  device's. It runs with 1, 2, 4, and so on up to -devices devices, for -seconds each, and reports the
+//  key events per second of all the devices together at each count; so how dispatch scales across cores.
+//
+// Every report gives the key events per second, latency percentiles, the Lua heap's size and growth,
+//  and the idle collector's pauses (with -gc idle); soak runs are just long ones.
+//
+// Build it with:
+//  g++ -std=c++11 -O2 -pthread -IUberKey UberKeyLoad/*.cpp UberKey/RemapImage.cpp UberKey/KeyDispatch.cpp UberKey/IdleCollector.cpp
+//      $(pkg-config --cflags --libs luajit) -o uberkey-load
+//  or, with no Lua, with -DUBERKEY_NO_LUA instead of LuaJIT's flags, and without KeyDispatch.cpp and IdleCollector.cpp.
+// NOTE: Only standard C++; it's built on Linux too.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RemapImage.h"
+#include "ScriptHost.h"
+#include "TypistModels.h"
+
+namespace
+{
+    volatile std::sig_atomic_t isStopping = 0;
+
+    void Stop(int)
+    {
+        isStopping = 1;
+    }
+
+    int Usage()
+    {
+        std::cout << "usage: UberKeyLoad [-model <name>[,<name>...]] [-devices <n>] [-rate <events per second>] [-seconds <n>]" << std::endl
+            << "                   [-report <seconds>] [-image <remap image>] [-script <file>] [-gc auto|idle] [-seed <n>]" << std::endl
+            << "                   [-dispatch native|lua] [-batch <n>] [-threads shared|device]" << std::endl
+            << "  models: text, gaming, holds, chords" << std::endl;
+        return 1;
+    }
+
+    inline int64_t Nanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Nanosecond durations in log-linear buckets; eight to each power of two, so within 12.5%.
+    class Histogram final
+    {
+    public:
+        Histogram()
+            : _counts(BucketCount, 0u)
+            , _count(0u)
+            , _max(0)
+        {
+        }
+
+        void Add(const int64_t value)
+        {
+            const auto v = static_cast<uint64_t>(std::max<int64_t>(value, 0));
+            _counts[Bucket(v)]++;
+            _count++;
+            _max = std::max(_max, static_cast<int64_t>(v));
+        }
+
+        void Add(const Histogram& other)
+        {
+            for (auto i = 0u; i < BucketCount; i++)
+            {
+                _counts[i] += other._counts[i];
+            }
+            _count += other._count;
+            _max = std::max(_max, other._max);
+        }
+
+        void Clear()
+        {
+            std::fill(_counts.begin(), _counts.end(), 0u);
+            _count = 0u;
+            _max = 0;
+        }
+
+        // The upper bound of the bucket the percentile falls in.
+        int64_t Percentile(const double percentile) const
+        {
+            const auto rank = static_cast<uint64_t>(percentile / 100.0 * _count);
+            auto seen = 0ull;
+            for (auto i = 0u; i < BucketCount; i++)
+            {
+                seen += _counts[i];
+                if (seen > rank)
+                {
+                    return std::min(UpperBound(i), _max);
+                }
+            }
+            return _max;
+        }
+
+        uint64_t count() const { return _count; }
+        int64_t max() const { return _max; }
+
+    private:
+        static const uint32_t SubBucketBits = 3u;
+        static const uint32_t SubBucketCount = 1u << SubBucketBits;
+        static const uint32_t BucketCount = (64u - SubBucketBits + 1u) * SubBucketCount;
+
+        std::vector<uint64_t>   _counts;
+        uint64_t                _count;
+        int64_t                 _max;
+
+        static uint32_t Bucket(const uint64_t v)
+        {
+            if (v < SubBucketCount)
+            {
+                return static_cast<uint32_t>(v);
+            }
+
+            auto exponent = 63u;
+            while (0u == (v & (1ull << exponent)))
+            {
+                exponent--;
+            }
+            const auto subBucket = static_cast<uint32_t>(v >> (exponent - SubBucketBits)) & (SubBucketCount - 1u);
+            return (exponent - SubBucketBits + 1u) * SubBucketCount + subBucket;
+        }
+
+        static int64_t UpperBound(const uint32_t bucket)
+        {
+            if (bucket < SubBucketCount)
+            {
+                return bucket;
+            }
+
+            const auto exponent = bucket / SubBucketCount + SubBucketBits - 1u;
+            const auto subBucket = bucket % SubBucketCount;
+            return static_cast<int64_t>(((SubBucketCount + subBucket + 1ull) << (exponent - SubBucketBits)) - 1ull);
+        }
+    };
+
+    // Counts the keys a remap image sends.
+    class CountingOutput final : public RemapOutput
+    {
+    public:
+        CountingOutput()
+            : passedCount(0u)
+            , sentCount(0u)
+        {
+        }
+
+        void PassThrough() override
+        {
+            passedCount++;
+        }
+
+        void Send(const uint_fast16_t, const bool) override
+        {
+            sentCount++;
+        }
+
+        void Send(const RemapKeyStep*, const uint32_t count) override
+        {
+            sentCount += count;
+        }
+
+        uint64_t passedCount;
+        uint64_t sentCount;
+    };
+
+    // The typists, with their key events merged in timestamp order.
+    class Typists final
+    {
+    public:
+        Typists(const std::vector<TypistModel>& models, const uint32_t deviceCount, const uint64_t seed)
+        {
+            for (auto i = 0u; i < deviceCount; i++)
+            {
+                _typists.emplace_back(new Typist(models[i % models.size()], static_cast<uint8_t>(i + 1u), seed + i));
+                _next.push_back(_typists.back()->Next());
+            }
+        }
+
+        uberkey_key_event Next()
+        {
+            auto earliest = 0u;
+            for (auto i = 1u; i < _next.size(); i++)
+            {
+                if (_next[i].timestamp < _next[earliest].timestamp)
+                {
+                    earliest = i;
+                }
+            }
+
+            const auto event = _next[earliest];
+            _next[earliest] = _typists[earliest]->Next();
+            return event;
+        }
+
+    private:
+        std::vector<std::unique_ptr<Typist>>    _typists;
+        std::vector<uberkey_key_event>          _next;
+    };
+
+    std::string Microseconds(const int64_t nanoseconds)
+    {
+        std::stringstream s;
+        s << std::fixed << std::setprecision(1) << (nanoseconds / 1000.0);
+        return s.str();
+    }
+
+    struct Totals
+    {
+        uint64_t    eventCount;
+        Histogram   latencies;
+        Histogram   pauses;
+    };
+
+    void Report(const char* label, const double seconds, const Totals& totals, const ScriptHost& script, const size_t startMemory)
+    {
+        const auto memory = script.memoryInUse();
+        const auto growth = static_cast<int64_t>(memory) - static_cast<int64_t>(startMemory);
+
+        std::cout << label << std::fixed << std::setprecision(0) << (totals.eventCount / seconds) << " key events/s"
+            << "; latency us p50 " << Microseconds(totals.latencies.Percentile(50.0))
+            << " p99 " << Microseconds(totals.latencies.Percentile(99.0))
+            << " p99.9 " << Microseconds(totals.latencies.Percentile(99.9))
+            << " max " << Microseconds(totals.latencies.max());
+        if (script.isLoaded())
+        {
+            std::cout << "; Lua " << (memory / 1024u) << " KB (" << ((growth >= 0) ? "+" : "") << (growth / 1024) << ")";
+        }
+        if (0u != totals.pauses.count())
+        {
+            std::cout << "; gc " << totals.pauses.count() << " slices, us p99 " << Microseconds(totals.pauses.Percentile(99.0))
+                << " max " << Microseconds(totals.pauses.max());
+        }
+        std::cout << std::endl;
+    }
+
+    // Runs key events through a script's callbacks, then, unless an interception consumed them, the
+    //  remap image; and times them. Waiting for a paced key event is idle time, for the collector and
+    //  the Lua dispatcher, as in UberKey's event loop. One to a thread.
+    class EventLoop final
+    {
+    public:
+        EventLoop(ScriptHost& script, const RemapImage& image, const double period, const uint32_t batchSize, const int64_t start)
+            : interval()
+            , _script(script)
+            , _image(image)
+            , _dispatcher(image)
+            , _period(period)
+            , _batchSize(batchSize)
+            , _start(start)
+            , _now(start)
+        {
+            _queuedDue.reserve(batchSize);
+        }
+
+        // Runs the i'th key event of the run.
+        void Run(const uint64_t i, const uberkey_key_event& event)
+        {
+            // When paced, the key event is due on the schedule, whether or not the last one was late.
+            auto due = _now;
+            if (0.0 != _period)
+            {
+                due = _start + static_cast<int64_t>(i * _period);
+                while (_now < due)
+                {
+                    if (!_queuedDue.empty()) // if (ahead of schedule) finish the batch
+                    {
+                        ResumeDispatcher();
+                    }
+                    else if (_script.HasIdleWork())
+                    {
+                        interval.pauses.Add(_script.RunSlice());
+                    }
+                    else if (due - _now > 2000000) // if (the wait is long) let go of the processor
+                    {
+                        std::this_thread::sleep_for(std::chrono::nanoseconds(due - _now - 1000000));
+                    }
+                    _now = Nanoseconds();
+                }
+            }
+            else if (_script.HasIdleWork() && 0u == (i % 1024u)) // unpaced, idle time is only had now and then
+            {
+                interval.pauses.Add(_script.RunSlice());
+                due = _now = Nanoseconds();
+            }
+
+            if (_script.IsOverDebt()) // if (the collector has fallen behind) it runs, busy or not
+            {
+                interval.pauses.Add(_script.RunSlice(true));
+            }
+
+            const auto queuedCount = _script.stats().queuedCount;
+            if (!_script.Dispatch(event))
+            {
+                if (!_image.isOpen() || !_image.IsBound(event.virtual_key))
+                {
+                    output.PassThrough();
+                }
+                else if (0u != event.is_break)
+                {
+                    _dispatcher.Break(event.virtual_key, output);
+                }
+                else
+                {
+                    _dispatcher.Make(event.virtual_key, output);
+                }
+            }
+
+            _now = Nanoseconds();
+            interval.eventCount++;
+            if (queuedCount != _script.stats().queuedCount) // if (a callback is waiting on the dispatcher)
+            {
+                _queuedDue.push_back(due);
+                if (_queuedDue.size() >= _batchSize)
+                {
+                    ResumeDispatcher();
+                }
+            }
+            else
+            {
+                interval.latencies.Add(_now - due);
+            }
+        }
+
+        // Runs what's still queued for the Lua dispatcher.
+        void Finish()
+        {
+            ResumeDispatcher();
+        }
+
+        int64_t now() const { return _now; }
+
+        Totals          interval;
+        CountingOutput  output;
+
+    private:
+        ScriptHost&             _script;
+        const RemapImage&       _image;
+        RemapDispatcher         _dispatcher;
+        const double            _period;
+        const uint32_t          _batchSize;
+        const int64_t           _start;
+        int64_t                 _now;
+        std::vector<int64_t>    _queuedDue; // the due times of the key events waiting on the Lua dispatcher
+
+        void ResumeDispatcher()
+        {
+            _script.ResumeDispatcher();
+            _now = Nanoseconds();
+            for (const auto queued : _queuedDue)
+            {
+                interval.latencies.Add(_now - queued);
+            }
+            _queuedDue.clear();
+        }
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator =(const EventLoop&) = delete;
+    };
+
+    struct ScriptSettings
+    {
+        std::string                 fileName;
+        ScriptHost::CollectorMode   collectorMode;
+        ScriptHost::DispatchMode    dispatchMode;
+    };
+
+    bool LoadScript(ScriptHost& script, const ScriptSettings& settings)
+    {
+        script.SetCollectorMode(settings.collectorMode);
+        if (!settings.fileName.empty() && !script.Load(settings.fileName.c_str()))
+        {
+            std::cout << "Can't run " << settings.fileName << ": " << script.lastError() << std::endl;
+            return false;
+        }
+        if (ScriptHost::DispatchMode::Lua == settings.dispatchMode && !script.SetDispatchMode(settings.dispatchMode))
+        {
+            std::cout << "Can't use Lua dispatch: " << script.lastError() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // A device with a thread of its own.
+    struct DeviceThread
+    {
+        ScriptHost                  script;
+        std::unique_ptr<Typist>     typist;
+        std::unique_ptr<EventLoop>  loop;
+        std::thread                 thread;
+    };
+
+    // Runs each device on its own thread for the given time; returns false if a script can't be loaded.
+    bool RunDeviceThreads(const std::vector<TypistModel>& models, const uint32_t deviceCount, const uint64_t seed, const ScriptSettings& settings,
+        const RemapImage& image, const double period, const uint32_t batchSize, const double seconds)
+    {
+        std::vector<std::unique_ptr<DeviceThread>> devices;
+        for (auto i = 0u; i < deviceCount; i++)
+        {
+            devices.emplace_back(new DeviceThread());
+            auto& device = *devices.back();
+            if (!LoadScript(device.script, settings))
+            {
+                return false;
+            }
+            device.typist.reset(new Typist(models[i % models.size()], static_cast<uint8_t>(i + 1u), seed + i));
+        }
+
+        // NOTE: the threads start together, once they're all made
+        std::atomic<bool> isStarted(false);
+        const auto start = Nanoseconds() + 10000000;
+        const auto end = start + static_cast<int64_t>(seconds * 1e9);
+        for (auto& pDevice : devices)
+        {
+            auto& device = *pDevice;
+            device.loop.reset(new EventLoop(device.script, image, period, batchSize, start));
+            device.thread = std::thread([&device, &isStarted, end]()
+            {
+                while (!isStarted.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+
+                auto& loop = *device.loop;
+                for (uint64_t i = 0u; 0 == isStopping && loop.now() < end; i++)
+                {
+                    loop.Run(i, device.typist->Next());
+                }
+                loop.Finish();
+            });
+        }
+
+        while (Nanoseconds() < start)
+        {
+            std::this_thread::yield();
+        }
+        isStarted.store(true, std::memory_order_release);
+
+        Totals total = {};
+        uint64_t callbackCount = 0u;
+        uint64_t errorCount = 0u;
+        auto last = start;
+        for (auto& pDevice : devices)
+        {
+            pDevice->thread.join();
+            total.eventCount += pDevice->loop->interval.eventCount;
+            total.latencies.Add(pDevice->loop->interval.latencies);
+            total.pauses.Add(pDevice->loop->interval.pauses);
+            last = std::max(last, pDevice->loop->now());
+
+            const auto& stats = pDevice->script.stats();
+            callbackCount += stats.callbackCount + stats.queuedCount;
+            errorCount += stats.errorCount;
+        }
+
+        const auto elapsed = (last - start) / 1e9;
+        std::cout << std::setw(4) << deviceCount << " devices: " << std::fixed << std::setprecision(0) << (total.eventCount / elapsed) << " key events/s ("
+            << (total.eventCount / elapsed / deviceCount) << " a device)"
+            << "; latency us p50 " << Microseconds(total.latencies.Percentile(50.0))
+            << " p99 " << Microseconds(total.latencies.Percentile(99.0))
+            << " p99.9 " << Microseconds(total.latencies.Percentile(99.9))
+            << " max " << Microseconds(total.latencies.max());
+        if (!settings.fileName.empty())
+        {
+            std::cout << "; " << callbackCount << " callbacks, " << errorCount << " errors";
+        }
+        std::cout << std::endl;
+        return true;
+    }
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::vector<TypistModel> models;
+    uint32_t deviceCount = 1u;
+    double rate = 0.0;
+    double seconds = 10.0;
+    double reportSeconds = 1.0;
+    uint64_t seed = 1u;
+    uint32_t batchSize = 64u;
+    auto isThreadPerDevice = false;
+    ScriptSettings settings = { std::string(), ScriptHost::CollectorMode::Automatic, ScriptHost::DispatchMode::Native };
+    std::vector<uint32_t> imageBuffer; // NOTE: uint32_t, since images must be 4 byte aligned
+    RemapImage image;
+    ScriptHost script;
+
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string argument = argv[i];
+        if (i + 1 >= argc)
+        {
+            return Usage();
+        }
+
+        const std::string value = argv[++i];
+        if ("-model" == argument)
+        {
+            std::stringstream names(value);
+            std::string name;
+            while (std::getline(names, name, ','))
+            {
+                TypistModel model;
+                if (!ParseTypistModel(name.c_str(), model))
+                {
+                    return Usage();
+                }
+                models.push_back(model);
+            }
+        }
+        else if ("-devices" == argument)
+        {
+            const auto n = std::atoi(value.c_str());
+            if (n < 1 || n > 255)
+            {
+                std::cout << "There can be 1 to 255 devices" << std::endl;
+                return 1;
+            }
+            deviceCount = static_cast<uint32_t>(n);
+        }
+        else if ("-rate" == argument)
+        {
+            rate = std::atof(value.c_str());
+        }
+        else if ("-seconds" == argument)
+        {
+            seconds = std::atof(value.c_str());
+        }
+        else if ("-report" == argument)
+        {
+            reportSeconds = std::max(std::atof(value.c_str()), 0.1);
+        }
+        else if ("-seed" == argument)
+        {
+            seed = std::strtoull(value.c_str(), nullptr, 0);
+        }
+        else if ("-image" == argument)
+        {
+            std::ifstream file(value, std::ios::binary);
+            const std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            if (!file.good() && !file.eof())
+            {
+                std::cout << "Can't read the remap image " << value << std::endl;
+                return 1;
+            }
+
+            imageBuffer.resize((bytes.size() + 3u) / 4u);
+            ::memcpy(imageBuffer.data(), bytes.data(), bytes.size());
+            const auto pError = image.Open(imageBuffer.data(), bytes.size());
+            if (nullptr != pError)
+            {
+                std::cout << "The remap image can't be used; " << pError << std::endl;
+                return 1;
+            }
+        }
+        else if ("-script" == argument)
+        {
+            settings.fileName = value;
+        }
+        else if ("-dispatch" == argument && ("native" == value || "lua" == value))
+        {
+            settings.dispatchMode = ("lua" == value) ? ScriptHost::DispatchMode::Lua : ScriptHost::DispatchMode::Native;
+        }
+        else if ("-threads" == argument && ("shared" == value || "device" == value))
+        {
+            isThreadPerDevice = ("device" == value);
+        }
+        else if ("-batch" == argument)
+        {
+            const auto n = std::atoi(value.c_str());
+            if (n < 1)
+            {
+                std::cout << "A batch is at least 1 key event" << std::endl;
+                return 1;
+            }
+            batchSize = static_cast<uint32_t>(n);
+        }
+        else if ("-gc" == argument && ("auto" == value || "idle" == value))
+        {
+            settings.collectorMode = ("idle" == value) ? ScriptHost::CollectorMode::Idle : ScriptHost::CollectorMode::Automatic;
+        }
+        else
+        {
+            return Usage();
+        }
+    }
+
+    if (models.empty())
+    {
+        models.push_back(TypistModel::Text);
+    }
+
+    std::signal(SIGINT, &Stop);
+    std::signal(SIGTERM, &Stop);
+
+    const auto period = (rate > 0.0) ? 1e9 / rate : 0.0;
+
+    if (isThreadPerDevice)
+    {
+        for (auto count = 1u; 0 == isStopping; count = std::min(count * 2u, deviceCount))
+        {
+            if (!RunDeviceThreads(models, count, seed, settings, image, period, batchSize, seconds))
+            {
+                return 1;
+            }
+            if (count == deviceCount)
+            {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    if (!LoadScript(script, settings))
+    {
+        return 1;
+    }
+
+    Typists typists(models, deviceCount, seed);
+    const auto startMemory = script.memoryInUse();
+
+    Totals total = {};
+
+    const auto start = Nanoseconds();
+    const auto end = start + static_cast<int64_t>(seconds * 1e9);
+    const auto reportPeriod = static_cast<int64_t>(reportSeconds * 1e9);
+    auto nextReport = start + reportPeriod;
+    auto lastReport = start;
+
+    EventLoop loop(script, image, period, batchSize, start);
+    auto& interval = loop.interval;
+    const auto& output = loop.output;
+
+    for (uint64_t i = 0u; 0 == isStopping && loop.now() < end; i++)
+    {
+        loop.Run(i, typists.Next());
+
+        const auto now = loop.now();
+        if (now >= nextReport)
+        {
+            std::stringstream label;
+            label << std::setw(6) << ((now - start) / 1000000000) << " s: ";
+            Report(label.str().c_str(), (now - lastReport) / 1e9, interval, script, startMemory);
+
+            total.eventCount += interval.eventCount;
+            total.latencies.Add(interval.latencies);
+            total.pauses.Add(interval.pauses);
+            interval.eventCount = 0u;
+            interval.latencies.Clear();
+            interval.pauses.Clear();
+
+            lastReport = now;
+            nextReport += reportPeriod;
+        }
+    }
+
+    loop.Finish();
+
+    total.eventCount += interval.eventCount;
+    total.latencies.Add(interval.latencies);
+    total.pauses.Add(interval.pauses);
+
+    Report(" total: ", (loop.now() - start) / 1e9, total, script, startMemory);
+
+    const auto& stats = script.stats();
+    std::cout << total.eventCount << " key events; " << output.passedCount << " passed through, " << output.sentCount << " sent by the remap image";
+    if (script.isLoaded())
+    {
+        std::cout << "; " << ((ScriptHost::DispatchMode::Lua == settings.dispatchMode) ? "lua" : "native") << " dispatch, "
+            << (stats.callbackCount + stats.queuedCount) << " callbacks, " << stats.consumedCount << " consumed, " << stats.sentKeyCount << " keys sent, "
+            << stats.errorCount << " errors";
+        if (0u != stats.errorCount)
+        {
+            std::cout << " (last: " << script.lastError() << ")";
+        }
+        if (0u != stats.sliceCount)
+        {
+            std::cout << "; " << stats.cycleCount << " idle collector cycles";
+        }
+    }
+    std::cout << std::endl;
+
+    return (0u != stats.errorCount) ? 1 : 0;
+}